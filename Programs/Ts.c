@@ -13,7 +13,8 @@
 	   <turn-over scale for the duty cycle of galaxies, in units of halo mass> <Soft band X-ray luminosity>]
 
   The last optional argument is the z' redshift output from which to reload intermediate
-  evolution files in ../Boxes/Ts_evolution/
+  evolution files in ../Boxes/Ts_evolution/.  Without it, an interrupted run resumes from its
+  last checkpoint (see TS_CHECKPOINT_INTERVAL in HEAT_PARAMS.H) when called again.
 
   Memory usage (in floats)~ (<NUMBER OF FILTER STEPS> + 3) x HII_DIM^3
 
@@ -106,14 +107,362 @@ void destroy_21cmMC_arrays() {
 #define MAX_TK (float) 5e4 
 
 
+/*
+  Checkpointing (see TS_CHECKPOINT_INTERVAL).  A checkpoint holds the state at the start of a z'
+  step: the Tk and x_e boxes, the z' step counters, the running means carried between steps,
+  and the global evolution file written so far.  It is keyed on everything the evolution depends
+  on, including a checksum of the density box, and only resumed from if the key matches.  The
+  source populations of SOURCES.H are functions, so they enter the key through their values at
+  the two ends of the z' range of the run.
+  It is written to a temporary file and renamed, so a crash while writing leaves the previous
+  checkpoint intact.
+*/
+#define TS_CHECKPOINT_KEY_LEN (int) 48
+#define TS_CHECKPOINT_VERSION (double) (2)
+typedef struct{
+  double key[TS_CHECKPOINT_KEY_LEN];
+  float zp, prev_zp, dzp;
+  int counter, zp_ct, COMPUTE_Ts;
+  double x_e_ave, Tk_ave, PS_ION_EFF;
+  long global_evol_len; // length of the global evolution file
+} Ts_checkpoint;
+
+void set_checkpoint_key(Ts_checkpoint *state, float REDSHIFT, double delta_checksum, sources src){
+  double z_src[2] = {REDSHIFT, Z_HEAT_MAX};
+  int k = 0, i;
+
+  memset(state->key, 0, sizeof(state->key));
+  state->key[k++] = TS_CHECKPOINT_VERSION;
+  state->key[k++] = REDSHIFT; state->key[k++] = HII_DIM; state->key[k++] = BOX_LEN;
+  state->key[k++] = delta_checksum;
+  state->key[k++] = HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY;
+  state->key[k++] = X_LUMINOSITY; state->key[k++] = X_RAY_SPEC_INDEX;
+  state->key[k++] = F_STAR10; state->key[k++] = ALPHA_STAR; state->key[k++] = F_ESC10;
+  state->key[k++] = ALPHA_ESC; state->key[k++] = M_TURN; state->key[k++] = T_AST;
+  state->key[k++] = M_MIN; state->key[k++] = HII_EFF_FACTOR; state->key[k++] = Pop;
+  state->key[k++] = NUM_FILTER_STEPS_FOR_Ts; state->key[k++] = ZPRIME_STEP_FACTOR;
+  state->key[k++] = Z_HEAT_MAX; state->key[k++] = R_XLy_MAX;
+  state->key[k++] = FREQ_INT_FIXED_NODES; state->key[k++] = USE_NU_TAU_ONE_TABLE;
+  state->key[k++] = DELNL0_STREAMING;
+  state->key[k++] = XION_at_Z_HEAT_MAX; state->key[k++] = TK_at_Z_HEAT_MAX;
+  state->key[k++] = USE_GENERAL_SOURCES;
+  if (USE_GENERAL_SOURCES){
+    for (i=0; i<2; i++){
+      state->key[k++] = src.fesc(z_src[i], 1e10); state->key[k++] = src.Nion(z_src[i], 1e10);
+      state->key[k++] = src.fstar(z_src[i], 1e10); state->key[k++] = src.fx(z_src[i], 1e10);
+      state->key[k++] = src.minMass(z_src[i]); state->key[k++] = src.fPopIII(z_src[i]);
+    }
+  }
+}
+
+void checkpoint_filename(char *filename, float REDSHIFT){
+  if (HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY)
+    sprintf(filename, "../Boxes/Ts_evolution/Ts_checkpoint_z%06.2f_L_X%.1e_alphaX%.1f_f_star10_%06.4f_alpha_star%06.4f_f_esc10_%06.4f_alpha_esc%06.4f_Mturn%.1e_t_star%06.4f_Pop%i_%i_%.0fMpc", REDSHIFT, X_LUMINOSITY, X_RAY_SPEC_INDEX, F_STAR10, ALPHA_STAR, F_ESC10, ALPHA_ESC, M_TURN, T_AST, Pop, HII_DIM, BOX_LEN);
+  else
+    sprintf(filename, "../Boxes/Ts_evolution/Ts_checkpoint_z%06.2f_L_X%.1e_alphaX%.1f_Mmin%.1e_zetaIon%.2f_Pop%i_%i_%.0fMpc", REDSHIFT, X_LUMINOSITY, X_RAY_SPEC_INDEX, M_MIN, HII_EFF_FACTOR, Pop, HII_DIM, BOX_LEN);
+}
+
+int write_checkpoint(char *filename, Ts_checkpoint *state, float *Tk_box, float *x_e_box,
+		     FILE *GLOBAL_EVOL, char *global_evol_filename){
+  char tmpname[600], *evol = NULL;
+  FILE *F, *EVOL;
+  int status = -1;
+
+  // copy of the global evolution file so far
+  fflush(GLOBAL_EVOL);
+  if (!(EVOL = fopen(global_evol_filename, "rb")))
+    return -1;
+  fseek(EVOL, 0, SEEK_END);
+  state->global_evol_len = ftell(EVOL);
+  rewind(EVOL);
+  evol = (char *) malloc(state->global_evol_len + 1);
+  if (!evol || (fread(evol, 1, state->global_evol_len, EVOL) != state->global_evol_len)){
+    fclose(EVOL); free(evol);
+    return -1;
+  }
+  fclose(EVOL);
+
+  sprintf(tmpname, "%s.tmp", filename);
+  if (!(F = fopen(tmpname, "wb"))){
+    free(evol);
+    return -1;
+  }
+  if ( (fwrite(state, sizeof(Ts_checkpoint), 1, F) == 1) &&
+       (fwrite(evol, 1, state->global_evol_len, F) == state->global_evol_len) &&
+       (mod_fwrite(Tk_box, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F) == 1) &&
+       (mod_fwrite(x_e_box, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F) == 1) &&
+       (fflush(F) == 0) && (fsync(fileno(F)) == 0) )
+    status = 0;
+  if (fclose(F) || (status < 0) || rename(tmpname, filename)){
+    remove(tmpname);
+    status = -1;
+  }
+  free(evol);
+  return status;
+}
+
+/*
+  On success, state holds the checkpointed state and the global evolution file is restored to
+  its contents at the checkpoint (it is truncated first, as it may be open for appending).
+*/
+int read_checkpoint(char *filename, Ts_checkpoint *state, float *Tk_box, float *x_e_box,
+		    FILE *GLOBAL_EVOL){
+  Ts_checkpoint saved;
+  char *evol = NULL;
+  FILE *F;
+  int status = -1;
+
+  if (!(F = fopen(filename, "rb")))
+    return -1;
+  if ( (fread(&saved, sizeof(Ts_checkpoint), 1, F) != 1) || memcmp(saved.key, state->key, sizeof(state->key)) ||
+       (saved.global_evol_len < 0) || !(evol = (char *) malloc(saved.global_evol_len + 1)) ){
+    fclose(F);
+    return -1;
+  }
+  if ( (fread(evol, 1, saved.global_evol_len, F) == saved.global_evol_len) &&
+       (mod_fread(Tk_box, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F) == 1) &&
+       (mod_fread(x_e_box, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F) == 1) &&
+       (fflush(GLOBAL_EVOL) == 0) && (ftruncate(fileno(GLOBAL_EVOL), 0) == 0) &&
+       (fseek(GLOBAL_EVOL, 0, SEEK_SET) == 0) &&
+       (fwrite(evol, 1, saved.global_evol_len, GLOBAL_EVOL) == saved.global_evol_len) ){
+    *state = saved;
+    fflush(GLOBAL_EVOL);
+    status = 0;
+  }
+  fclose(F);
+  free(evol);
+  return status;
+}
+
+
+/*
+  With DELNL0_STREAMING only the unfiltered box, delNL0[0], is stored.  At every z' step, each
+  filter shell in turn is filtered from the k-space box DELNL0_K_BOX into DELNL0_R_BOX, and its
+  contribution to the z'' integrals of evolveInt is added to those of every cell, ZPP_SUMS[4][box_ct]
+  (see add_zpp_shell()).  The cells are then evolved from their summed integrals.
+  x_e is the same for every shell, so the bracket of each cell in the frequency integral tables
+  is searched for once per z' step and kept in ZPP_M_XHII_LOW (one byte per cell); its weight is
+  recomputed from x_e in each shell.
+*/
+fftwf_complex *DELNL0_K_BOX = NULL, *DELNL0_WORK_BOX = NULL;
+fftwf_plan DELNL0_PLAN = NULL;
+float *DELNL0_R_BOX = NULL;
+double *ZPP_SUMS[4] = {NULL, NULL, NULL, NULL};
+unsigned char *ZPP_M_XHII_LOW = NULL;
+
+void free_delNL0(float **delNL0){
+  int R_ct;
+  for (R_ct=0; R_ct<NUM_FILTER_STEPS_FOR_Ts; R_ct++)
+    free(delNL0[R_ct]);
+
+  for (R_ct=0; R_ct<4; R_ct++){
+    free(ZPP_SUMS[R_ct]);
+    ZPP_SUMS[R_ct] = NULL;
+  }
+  free(ZPP_M_XHII_LOW);
+  ZPP_M_XHII_LOW = NULL;
+  free(DELNL0_R_BOX);
+  DELNL0_R_BOX = NULL;
+  if (DELNL0_PLAN){
+    fftwf_destroy_plan(DELNL0_PLAN);
+    DELNL0_PLAN = NULL;
+  }
+  fftwf_free(DELNL0_K_BOX); fftwf_free(DELNL0_WORK_BOX);
+  DELNL0_K_BOX = DELNL0_WORK_BOX = NULL;
+}
+
+/* DELNL0_STREAMING: filters the density box on the scale of shell R_ct into DELNL0_R_BOX, as delNL0[R_ct] */
+void filter_delNL0_R(int R_ct, float growth_factor_z){
+  int i, j, k;
+  float delNL0_val;
+
+  memcpy(DELNL0_WORK_BOX, DELNL0_K_BOX, sizeof(fftwf_complex)*HII_KSPACE_NUM_PIXELS);
+  if (R_ct > 0){ // don't filter on cell size
+    HII_filter(DELNL0_WORK_BOX, HEAT_FILTER, R_values[R_ct]);
+  }
+  fftwf_execute(DELNL0_PLAN);
+
+#pragma omp parallel for shared(DELNL0_WORK_BOX, DELNL0_R_BOX, growth_factor_z) private(i, j, k, delNL0_val)
+  for (i=0; i<HII_DIM; i++){
+    for (j=0; j<HII_DIM; j++){
+      for (k=0; k<HII_DIM; k++){
+	delNL0_val = *((float *) DELNL0_WORK_BOX + HII_R_FFT_INDEX(i,j,k));
+	if (delNL0_val < -1){ // correct for alliasing in the filtering step
+	  delNL0_val = -1+FRACT_FLOAT_ERR;
+	}
+	// and linearly extrapolate to z=0
+	DELNL0_R_BOX[HII_R_INDEX(i,j,k)] = delNL0_val / growth_factor_z;
+      }
+    }
+  }
+}
+
+/* the ionized fraction xHII_call clamped to the x_int_XHII table, as elec_interp.c does */
+float freq_int_clamp(float xHII_call){
+  if (xHII_call > x_int_XHII[x_int_NXHII-1]*0.999) {
+    xHII_call = x_int_XHII[x_int_NXHII-1]*0.999;
+  } else if (xHII_call < x_int_XHII[0]) {
+    xHII_call = 1.001*x_int_XHII[0];
+  }
+  return xHII_call;
+}
+
+/* the linear interpolation weight of x_int_XHII[m_xHII_low+1], for the bracket m_xHII_low of xHII_call */
+double freq_int_weight_of(float xHII_call, int m_xHII_low){
+  xHII_call = freq_int_clamp(xHII_call);
+  return (xHII_call - x_int_XHII[m_xHII_low]) / (double) (x_int_XHII[m_xHII_low+1] - x_int_XHII[m_xHII_low]);
+}
+
+/*
+  The bracket of the ionized fraction xHII_call in x_int_XHII, i.e. x_int_XHII[m_xHII_low] and
+  x_int_XHII[m_xHII_low+1] (after clamping xHII_call to the table), and the linear interpolation
+  weight of its upper element.  Returns m_xHII_low.
+*/
+int freq_int_bracket(float xHII_call, double *weight){
+  int m_xHII_low;
+
+  m_xHII_low = locate_xHII_index(freq_int_clamp(xHII_call));
+  *weight = freq_int_weight_of(xHII_call, m_xHII_low);
+  return m_xHII_low;
+}
+
+/* the frequency integral table tbl of shell R_ct, interpolated with the bracket from freq_int_bracket() */
+double interp_freq_int(double tbl[][NUM_FILTER_STEPS_FOR_Ts], int R_ct, int m_xHII_low, double weight){
+  return (1-weight)*tbl[m_xHII_low][R_ct] + weight*tbl[m_xHII_low+1][R_ct];
+}
+
+/* the same for all of the filter shells at once, into freq_int[]; both rows of tbl are contiguous in R_ct */
+void interp_freq_int_rows(double tbl[][NUM_FILTER_STEPS_FOR_Ts], int m_xHII_low, double weight, double freq_int[]){
+  double *tbl_low = tbl[m_xHII_low], *tbl_high = tbl[m_xHII_low+1];
+  double weight_low = 1-weight;
+  int R_ct;
+
+#pragma omp simd
+  for (R_ct=0; R_ct<NUM_FILTER_STEPS_FOR_Ts; R_ct++)
+    freq_int[R_ct] = weight_low*tbl_low[R_ct] + weight*tbl_high[R_ct];
+}
+
+
+/*
+  Normalizes the collapsed fraction of the filter shell R_ct, at z''=zpp, so that its mean over the
+  box is the Sheth-Torman collapse fraction (ST_over_PS[R_ct] and ST_over_PS_Lya[R_ct]).
+*/
+void normalize_fcoll_R(float **delNL0, int R_ct, float zpp, int arr_num){
+  fcoll_box fb;
+  double fcoll_R;
+  float Splined_Fcollzpp_X_mean, Splined_Fcollzpp_Lya_mean;
+
+  init_fcoll_box(&fb, delNL0[R_ct], 0);
+
+  if (HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY) { // New in v1.4
+    fb.growth = dicke(zpp);
+    set_fcoll_sfr(&fb, FcollLow_zpp_spline[R_ct], Overdense_high_table, Fcollz_SFR_high_table[arr_num + R_ct],
+		  second_derivs_Fcoll_zpp[R_ct], NSFR_high, 0.99*Deltac);
+    fcoll_R = mean_fcoll_box(&fb);
+  }
+  else if (!(sigma_atR[R_ct] < sigma_Tmin[R_ct])){ // as in sigmaparam_FgtrM_bias()
+    fprintf(stderr, "normalize_fcoll_R: Biased region is smaller than halo!\nResult is bogus.\n");
+    fcoll_R = 0;
+  }
+  else {
+    // sigmaparam_FgtrM_bias(zpp, sigma_Tmin[R_ct], delNL0, sigma_atR[R_ct]) of every cell
+    set_fcoll_erfc(&fb, Deltac/dicke(zpp),
+		   1.0/(sqrt(2)*sqrt(sigma_Tmin[R_ct]*sigma_Tmin[R_ct] - sigma_atR[R_ct]*sigma_atR[R_ct])));
+    fcoll_R = mean_fcoll_box(&fb);
+  }
+
+  if (HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY) {// New in v1.4
+    FgtrM_st_SFR_X_z(zpp,&(Splined_Fcollzpp_X_mean));
+    FgtrM_st_SFR_Lya_z(zpp,&(Splined_Fcollzpp_Lya_mean));
+    ST_over_PS[R_ct] = Splined_Fcollzpp_X_mean / fcoll_R; 
+    ST_over_PS_Lya[R_ct] = Splined_Fcollzpp_Lya_mean / fcoll_R;
+  }
+  else {
+    ST_over_PS[R_ct] = FgtrM_st(zpp, M_MIN) / fcoll_R;
+  }
+
+  if (DEBUG_ON){
+    if (HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY) {
+      printf("zpp = %le M_MIN = %le fcoll_R = %le\n", zpp, M_MIN, fcoll_R);
+      printf("ST/PS=%g, mean_ST=%g, mean_ps=%g\n, ratios of mean=%g\n", ST_over_PS[R_ct], 
+	     Splined_Fcollzpp_X_mean,
+	     FgtrM(zpp, M_MIN),
+	     Splined_Fcollzpp_X_mean/FgtrM(zpp, M_MIN)
+	     );
+    }
+    else {
+      printf("ST/PS=%g, mean_ST=%g, mean_ps=%g\n, ratios of mean=%g\n", ST_over_PS[R_ct], 
+	     FgtrM_st(zpp, M_MIN), 
+	     FgtrM(zpp, M_MIN),
+	     FgtrM_st(zpp, M_MIN)/FgtrM(zpp, M_MIN)
+	     );
+    }
+  }
+}
+
+/*
+  DELNL0_STREAMING: sums the z'' integrals of every cell into ZPP_SUMS, one filter shell at a time.
+  As the collapsed fraction of a shell is normalized with its filtered box, this is also done here.
+*/
+void sum_zpp_shells(float zp, float growth_factor_z, float **delNL0, float *x_e_box, int COMPUTE_Ts,
+		    int arr_num, double freq_int_heat_tbl[][NUM_FILTER_STEPS_FOR_Ts],
+		    double freq_int_ion_tbl[][NUM_FILTER_STEPS_FOR_Ts], double freq_int_lya_tbl[][NUM_FILTER_STEPS_FOR_Ts]){
+  unsigned long long box_ct;
+  int R_ct, m_xHII_low;
+  float zpp, prev_zpp;
+  double zpp_sums[4], freq_int_heat, freq_int_ion, freq_int_lya, freq_int_weight;
+
+#pragma omp parallel for shared(ZPP_SUMS) private(box_ct)
+  for (box_ct=0; box_ct<HII_TOT_NUM_PIXELS; box_ct++)
+    ZPP_SUMS[0][box_ct] = ZPP_SUMS[1][box_ct] = ZPP_SUMS[2][box_ct] = ZPP_SUMS[3][box_ct] = 0;
+  if (NO_LIGHT)
+    return;
+
+#pragma omp parallel for shared(x_e_box, ZPP_M_XHII_LOW) private(box_ct)
+  for (box_ct=0; box_ct<HII_TOT_NUM_PIXELS; box_ct++)
+    ZPP_M_XHII_LOW[box_ct] = locate_xHII_index(freq_int_clamp(x_e_box[box_ct]));
+
+  for (R_ct=0; R_ct<NUM_FILTER_STEPS_FOR_Ts; R_ct++){
+    if (R_ct > 0){
+      filter_delNL0_R(R_ct, growth_factor_z);
+      delNL0[R_ct] = DELNL0_R_BOX;
+    }
+
+    // as in the loop over the shells in main
+    prev_zpp = (R_ct == 0) ? zp : zpp_edge[R_ct-1];
+    zpp = (zpp_edge[R_ct]+prev_zpp)*0.5;
+    normalize_fcoll_R(delNL0, R_ct, zpp, arr_num);
+
+#pragma omp parallel for shared(delNL0, x_e_box, ZPP_M_XHII_LOW, ZPP_SUMS, freq_int_heat_tbl, freq_int_ion_tbl, freq_int_lya_tbl, R_ct, COMPUTE_Ts, zp, arr_num) private(box_ct, m_xHII_low, freq_int_weight, freq_int_heat, freq_int_ion, freq_int_lya, zpp_sums)
+    for (box_ct=0; box_ct<HII_TOT_NUM_PIXELS; box_ct++){
+      m_xHII_low = ZPP_M_XHII_LOW[box_ct];
+      freq_int_weight = freq_int_weight_of(x_e_box[box_ct], m_xHII_low);
+      freq_int_heat = interp_freq_int(freq_int_heat_tbl, R_ct, m_xHII_low, freq_int_weight);
+      freq_int_ion = interp_freq_int(freq_int_ion_tbl, R_ct, m_xHII_low, freq_int_weight);
+      freq_int_lya = COMPUTE_Ts ? interp_freq_int(freq_int_lya_tbl, R_ct, m_xHII_low, freq_int_weight) : 0;
+
+      zpp_sums[0] = ZPP_SUMS[0][box_ct]; zpp_sums[1] = ZPP_SUMS[1][box_ct];
+      zpp_sums[2] = ZPP_SUMS[2][box_ct]; zpp_sums[3] = ZPP_SUMS[3][box_ct];
+      add_zpp_shell(zp, R_ct, delNL0[R_ct][box_ct], freq_int_heat, freq_int_ion, freq_int_lya,
+		    COMPUTE_Ts, arr_num, zpp_sums);
+      ZPP_SUMS[0][box_ct] = zpp_sums[0]; ZPP_SUMS[1][box_ct] = zpp_sums[1];
+      ZPP_SUMS[2][box_ct] = zpp_sums[2]; ZPP_SUMS[3][box_ct] = zpp_sums[3];
+    }
+
+    if (R_ct > 0)
+      delNL0[R_ct] = NULL;
+  }
+}
+
+
 int main(int argc, char ** argv){
   fftwf_complex *box, *unfiltered_box;
   fftwf_plan plan;
-  unsigned long long ct, sample_ct;
+  unsigned long long ct;
   int R_ct,i,j,k, COMPUTE_Ts, x_e_ct;
   float REDSHIFT, growth_factor_z, R, R_factor, zp, mu_for_Ts, filling_factor_of_HI_zp;
   int ithread;
-  float *Tk_box, *x_e_box, *Ts, J_star_Lya, dzp, prev_zp, zpp, prev_zpp, prev_R;
+  float *Tk_box, *x_e_box, *Ts, J_star_Lya, dzp, prev_zp, zpp, prev_zpp;
   FILE *F, *GLOBAL_EVOL, *OUT;
   char filename[500];
   float dz, zeta_ion_eff, Tk_BC, xe_BC, nu, zprev, zcurr, curr_delNL0[NUM_FILTER_STEPS_FOR_Ts];
@@ -121,20 +470,24 @@ int main(int argc, char ** argv){
     Xion_ave;
 double freq_int_heat_tbl[x_int_NXHII][NUM_FILTER_STEPS_FOR_Ts], freq_int_ion_tbl[x_int_NXHII][NUM_FILTER_STEPS_FOR_Ts], freq_int_lya_tbl[x_int_NXHII][NUM_FILTER_STEPS_FOR_Ts];
   int goodSteps,badSteps;
-  int m_xHII_low, m_xHII_high, n_ct, zp_ct;
-double freq_int_heat[NUM_FILTER_STEPS_FOR_Ts], freq_int_ion[NUM_FILTER_STEPS_FOR_Ts], freq_int_lya[NUM_FILTER_STEPS_FOR_Ts];
- double nuprime, fcoll_R, fcoll_R_Lya, Ts_ave;
- float *delNL0[NUM_FILTER_STEPS_FOR_Ts], xHII_call, curr_xalpha;
+  int m_xHII_low, n_ct, zp_ct;
+double freq_int_heat[NUM_FILTER_STEPS_FOR_Ts], freq_int_ion[NUM_FILTER_STEPS_FOR_Ts], freq_int_lya[NUM_FILTER_STEPS_FOR_Ts], freq_int_weight;
+ double nuprime, Ts_ave;
+ float *delNL0[NUM_FILTER_STEPS_FOR_Ts], curr_xalpha, delNL0_val;
+ double cell_zpp_sums[4];
  float z, Jalpha, TK, TS, xe, deltax;
  time_t start_time, curr_time;
- double J_alpha_threads[NUMCORES], xalpha_threads[NUMCORES], Xheat_threads[NUMCORES],
-   Xion_threads[NUMCORES], lower_int_limit;
- float Splined_Fcollzp_mean, Splined_Fcollzpp_X_mean,ION_EFF_FACTOR,fcoll, fcollLya,Splined_Fcollzpp_Lya_mean; // New in v1.4
+ double lower_int_limit[NUM_FILTER_STEPS_FOR_Ts], freq_int_xe[x_int_NXHII], cell_totals[4];
+ row_sums cell_sums;
+ float Splined_Fcollzp_mean,ION_EFF_FACTOR; // New in v1.4
  float zp_table; //New in v1.4
  int counter,arr_num; // New in v1.4
  double Luminosity_conversion_factor;
  int RESTART = 0;
 double Tback;
+ Ts_checkpoint checkpoint;
+ char checkpoint_file[500], global_evol_filename[500];
+ double delta_checksum = 0;
  /**********  BEGIN INITIALIZATION   **************************************/
  //New in v1.4
  if (SHARP_CUTOFF) {
@@ -323,6 +676,7 @@ if(USE_GENERAL_SOURCES) M_MIN = src.minMass(REDSHIFT) * 50.0; //Multipied by 50
    else
      GLOBAL_EVOL = fopen(filename, "w");
  }
+ strcpy(global_evol_filename, filename);
  if (!GLOBAL_EVOL){
    fprintf(stderr, "Unable to open global evolution file at %s\nAborting...\n",
 	   filename);
@@ -380,6 +734,7 @@ if(USE_GENERAL_SOURCES) M_MIN = src.minMass(REDSHIFT) * 50.0; //Multipied by 50
 	  destruct_heat();
 	  return -1;
 	}
+	delta_checksum += *((float *)unfiltered_box + HII_R_FFT_INDEX(i,j,k));
       }
     }
   }
@@ -403,6 +758,8 @@ if(USE_GENERAL_SOURCES) M_MIN = src.minMass(REDSHIFT) * 50.0; //Multipied by 50
 
 
   /*** Create the z=0 non-linear density fields smoothed on scale R to be used in computing fcoll ***/
+  for (R_ct=0; R_ct<NUM_FILTER_STEPS_FOR_Ts; R_ct++)
+    delNL0[R_ct] = NULL;
   R = L_FACTOR*BOX_LEN/(float)HII_DIM;
   R_factor = pow(R_XLy_MAX/R, 1/(float)NUM_FILTER_STEPS_FOR_Ts);
   //  R_factor = pow(E, log(HII_DIM)/(float)NUM_FILTER_STEPS_FOR_Ts);
@@ -413,12 +770,15 @@ if(USE_GENERAL_SOURCES) M_MIN = src.minMass(REDSHIFT) * 50.0; //Multipied by 50
 	    (double)clock()/CLOCKS_PER_SEC/60.0);
     fprintf(LOG, "Processing scale R= %06.2fMpc, time=%06.2f min\n", R, 
 	    (double)clock()/CLOCKS_PER_SEC/60.0);
-    if (! (delNL0[R_ct] = (float *) malloc(sizeof(float)*HII_TOT_NUM_PIXELS))){
+    if (DELNL0_STREAMING && (R_ct > 0)){ // filtered at every z' step instead
+      R *= R_factor;
+      continue;
+    }
+    if (!(delNL0[R_ct] = (float *) malloc(sizeof(float)*HII_TOT_NUM_PIXELS))){
       fprintf(stderr, "Error in memory allocation\nAborting...\n");
       fprintf(LOG, "Error in memory allocation\nAborting...\n");
       fclose(LOG); fclose(GLOBAL_EVOL);fftwf_free(box);  fftwf_free(unfiltered_box);
-      for(ct=0; ct<R_ct; ct++)
-	free(delNL0[ct]);
+      free_delNL0(delNL0);
       destruct_heat();
       return -1;
     }
@@ -437,12 +797,13 @@ if(USE_GENERAL_SOURCES) M_MIN = src.minMass(REDSHIFT) * 50.0; //Multipied by 50
     for (i=0; i<HII_DIM; i++){
       for (j=0; j<HII_DIM; j++){
 	for (k=0; k<HII_DIM; k++){
-	  delNL0[R_ct][HII_R_INDEX(i,j,k)] = *((float *) box + HII_R_FFT_INDEX(i,j,k));
-	  if (delNL0[R_ct][HII_R_INDEX(i,j,k)] < -1){ // correct for alliasing in the filtering step
-	    delNL0[R_ct][HII_R_INDEX(i,j,k)] = -1+FRACT_FLOAT_ERR;
+	  delNL0_val = *((float *) box + HII_R_FFT_INDEX(i,j,k));
+	  if (delNL0_val < -1){ // correct for alliasing in the filtering step
+	    delNL0_val = -1+FRACT_FLOAT_ERR;
 	  }
 	  // and linearly extrapolate to z=0
-	  delNL0[R_ct][HII_R_INDEX(i,j,k)] /= growth_factor_z; 
+	  delNL0_val /= growth_factor_z; 
+	  delNL0[R_ct][HII_R_INDEX(i,j,k)] = delNL0_val;
 	}
       }
     }
@@ -450,18 +811,35 @@ if(USE_GENERAL_SOURCES) M_MIN = src.minMass(REDSHIFT) * 50.0; //Multipied by 50
     R *= R_factor;
   } //end for loop through the filter scales R
   
-  fftwf_destroy_plan(plan);
-  fftwf_cleanup();
-  fftwf_free(box); fftwf_free(unfiltered_box);// we don't need this anymore
+  if (DELNL0_STREAMING){ // keep the k-space box and the plan, for filtering at every z' step
+    DELNL0_K_BOX = unfiltered_box;
+    DELNL0_WORK_BOX = box;
+    DELNL0_PLAN = plan;
+    for (R_ct=0; R_ct<4; R_ct++)
+      ZPP_SUMS[R_ct] = (double *) malloc(sizeof(double)*HII_TOT_NUM_PIXELS);
+    ZPP_M_XHII_LOW = (unsigned char *) malloc(sizeof(unsigned char)*HII_TOT_NUM_PIXELS);
+    DELNL0_R_BOX = (float *) malloc(sizeof(float)*HII_TOT_NUM_PIXELS);
+    if (!ZPP_SUMS[0] || !ZPP_SUMS[1] || !ZPP_SUMS[2] || !ZPP_SUMS[3] || !ZPP_M_XHII_LOW || !DELNL0_R_BOX){
+      fprintf(stderr, "Error in memory allocation\nAborting...\n");
+      fprintf(LOG, "Error in memory allocation\nAborting...\n");
+      fclose(LOG); fclose(GLOBAL_EVOL);
+      free_delNL0(delNL0);
+      destruct_heat();
+      return -1;
+    }
+  }
+  else{
+    fftwf_destroy_plan(plan);
+    fftwf_cleanup();
+    fftwf_free(box); fftwf_free(unfiltered_box);// we don't need this anymore
+  }
 
   // now lets allocate memory for our kinetic temperature and residual neutral fraction boxes
   if (!(Tk_box = (float *) malloc(sizeof(float)*HII_TOT_NUM_PIXELS))){
     fprintf(stderr, "Error in memory allocation for Tk box\nAborting...\n");
     fprintf(LOG, "Error in memory allocation for Tk box\nAborting...\n");
     fclose(LOG);fclose(GLOBAL_EVOL);
-    for (R_ct=0; R_ct<NUM_FILTER_STEPS_FOR_Ts; R_ct++){
-      free(delNL0[R_ct]);
-    }
+    free_delNL0(delNL0);
     destruct_heat();
     return -1;
   }
@@ -469,9 +847,7 @@ if(USE_GENERAL_SOURCES) M_MIN = src.minMass(REDSHIFT) * 50.0; //Multipied by 50
     fprintf(stderr, "Error in memory allocation for xe box\nAborting...\n");
     fprintf(LOG, "Error in memory allocation for xe box\nAborting...\n");
     fclose(LOG);  free(Tk_box);fclose(GLOBAL_EVOL);
-    for (R_ct=0; R_ct<NUM_FILTER_STEPS_FOR_Ts; R_ct++){
-      free(delNL0[R_ct]);
-    }
+    free_delNL0(delNL0);
     destruct_heat();
     return -1;
   }
@@ -481,9 +857,16 @@ if(USE_GENERAL_SOURCES) M_MIN = src.minMass(REDSHIFT) * 50.0; //Multipied by 50
     fprintf(stderr, "Error in memory allocation for Ts box\nAborting...\n");
     fprintf(LOG, "Error in memory allocation for Ts box\nAborting...\n");
     fclose(LOG);  fclose(GLOBAL_EVOL);free(Tk_box); free(x_e_box);
-    for (R_ct=0; R_ct<NUM_FILTER_STEPS_FOR_Ts; R_ct++){
-      free(delNL0[R_ct]);
-    }
+    free_delNL0(delNL0);
+    destruct_heat();
+    return -1;
+  }
+
+  // the global averages accumulated in the loop through the box (J_alpha, x_alpha, and the X-ray heating and ionization rates)
+  if (init_row_sums(&cell_sums, 4) < 0){
+    fprintf(LOG, "Error in memory allocation for the box sums\nAborting...\n");
+    fclose(LOG);  fclose(GLOBAL_EVOL);free(Tk_box); free(x_e_box); free(Ts);
+    free_delNL0(delNL0);
     destruct_heat();
     return -1;
   }
@@ -513,9 +896,7 @@ if(USE_GENERAL_SOURCES) M_MIN = src.minMass(REDSHIFT) * 50.0; //Multipied by 50
       fprintf(stderr, "Ts.c: WARNING: Unable to open input file %s\nAborting\n", filename);
       fprintf(LOG, "Ts.c: WARNING: Unable to open input file %s\nAborting\n", filename);
       fclose(LOG); fclose(GLOBAL_EVOL); free(Tk_box); free(x_e_box); free(Ts);
-      for (R_ct=0; R_ct<NUM_FILTER_STEPS_FOR_Ts; R_ct++){
-	free(delNL0[R_ct]);
-      }
+      free_delNL0(delNL0);
       destruct_heat();
       return -1;
     }
@@ -524,9 +905,7 @@ if(USE_GENERAL_SOURCES) M_MIN = src.minMass(REDSHIFT) * 50.0; //Multipied by 50
 	fprintf(stderr, "Ts.c: Write error occured while reading Tk box.\nAborting\n");
 	fprintf(LOG, "Ts.c: Write error occured while reading Tk box.\nAborting\n");
 	fclose(LOG);  free(Tk_box); free(x_e_box); free(Ts);
-	for (R_ct=0; R_ct<NUM_FILTER_STEPS_FOR_Ts; R_ct++){
-	  free(delNL0[R_ct]);
-	}
+	free_delNL0(delNL0);
 	destruct_heat();
       }
       fclose(F);
@@ -545,9 +924,7 @@ if(USE_GENERAL_SOURCES) M_MIN = src.minMass(REDSHIFT) * 50.0; //Multipied by 50
       fprintf(stderr, "Ts.c: WARNING: Unable to open output file %s\nAborting\n", filename);
       fprintf(LOG, "Ts.c: WARNING: Unable to open output file %s\nAborting\n", filename);
       fclose(LOG);  free(Tk_box); free(x_e_box); free(Ts);
-      for (R_ct=0; R_ct<NUM_FILTER_STEPS_FOR_Ts; R_ct++){
-	free(delNL0[R_ct]);
-      }
+      free_delNL0(delNL0);
       destruct_heat();
     }
     else{
@@ -555,18 +932,13 @@ if(USE_GENERAL_SOURCES) M_MIN = src.minMass(REDSHIFT) * 50.0; //Multipied by 50
 	fprintf(stderr, "Ts.c: Write error occured while reading xe box.\n");
 	fprintf(LOG, "Ts.c: Write error occured while reading xe box.\n");
 	fclose(LOG);  free(Tk_box); free(x_e_box); free(Ts);
-	for (R_ct=0; R_ct<NUM_FILTER_STEPS_FOR_Ts; R_ct++){
-	  free(delNL0[R_ct]);
-	}
+	free_delNL0(delNL0);
 	destruct_heat();
       }
       fclose(F);
     }
-    Tk_ave = x_e_ave = 0;
-    for (box_ct=0; box_ct<HII_TOT_NUM_PIXELS; box_ct++){
-      Tk_ave += Tk_box[box_ct];
-      x_e_ave += x_e_box[box_ct];
-    }
+    Tk_ave = box_sum(Tk_box, 0);
+    x_e_ave = box_sum(x_e_box, 0);
     Tk_ave /= (double) HII_TOT_NUM_PIXELS;
 
 
@@ -601,22 +973,22 @@ if(USE_GENERAL_SOURCES) M_MIN = src.minMass(REDSHIFT) * 50.0; //Multipied by 50
   dzp = zp - prev_zp;
   zp_ct=0;
   COMPUTE_Ts = 0;
+
+  // tabulate the filter shells at each of the z' steps
+  if (init_zpp_shell_table(zp, REDSHIFT) < 0){
+    fprintf(stderr, "Ts.c: WARNING: Unable to set up the z'' shell table, will compute the shells at each step\n");
+    fprintf(LOG, "Ts.c: WARNING: Unable to set up the z'' shell table, will compute the shells at each step\n");
+  }
+
   /* New in v1.4: set up interpolation table for computing f_coll(z,delta) */
   if (HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY) {
     init_21cmMC_arrays();
 	
 	// Find the highest and lowest redshfit to initialise interpolation of the mean collapse fraction for the global reionization.
     determine_zpp_min = REDSHIFT*0.999;
+    set_zpp_shells(0, zp);
     for (R_ct=0; R_ct<NUM_FILTER_STEPS_FOR_Ts; R_ct++){
-        if (R_ct==0){
-            prev_zpp = zp;
-            prev_R = 0; 
-        }    
-        else{
-            prev_zpp = zpp_edge[R_ct-1];
-            prev_R = R_values[R_ct-1];
-        }    
-        zpp_edge[R_ct] = prev_zpp - (R_values[R_ct] - prev_R)*CMperMPC / drdz(prev_zpp); // cell size
+        prev_zpp = (R_ct==0) ? zp : zpp_edge[R_ct-1];
         zpp = (zpp_edge[R_ct]+prev_zpp)*0.5; // average redshift value of shell: z'' + 0.5 * dz''
     }    
     determine_zpp_max = zpp*1.001;
@@ -643,16 +1015,9 @@ if(USE_GENERAL_SOURCES) M_MIN = src.minMass(REDSHIFT) * 50.0; //Multipied by 50
     zp_table = zp;
 	counter = 0;
     for (i=0; i<Nsteps_zp; i++) {
+      set_zpp_shells(i, zp_table);
       for (R_ct=0; R_ct<NUM_FILTER_STEPS_FOR_Ts; R_ct++){
-          if (R_ct==0){
-              prev_zpp = zp_table;
-              prev_R = 0; 
-          }    
-          else{
-              prev_zpp = zpp_edge[R_ct-1];
-              prev_R = R_values[R_ct-1];
-          }    
-          zpp_edge[R_ct] = prev_zpp - (R_values[R_ct] - prev_R)*CMperMPC / drdz(prev_zpp); // cell size
+          prev_zpp = (R_ct==0) ? zp_table : zpp_edge[R_ct-1];
           zpp = (zpp_edge[R_ct]+prev_zpp)*0.5; // average redshift value of shell: z'' + 0.5 * dz''
 		  redshift_interp_table[counter] = zpp;
 		  counter += 1;
@@ -673,7 +1038,33 @@ if(USE_GENERAL_SOURCES) M_MIN = src.minMass(REDSHIFT) * 50.0; //Multipied by 50
 	
   }
   
+  // tabulate the tau=1 frequencies (or read them from the cache)
+  if (USE_NU_TAU_ONE_TABLE && (init_nu_tau_one_table() < 0)){
+    fprintf(stderr, "Ts.c: WARNING: Unable to set up the nu_tau_one table, will solve for it at each step\n");
+    fprintf(LOG, "Ts.c: WARNING: Unable to set up the nu_tau_one table, will solve for it at each step\n");
+  }
+
   counter = 0;
+
+  // resume from the checkpoint of an interrupted run, if there is one
+  if ((TS_CHECKPOINT_INTERVAL > 0) && !RESTART){
+    set_checkpoint_key(&checkpoint, REDSHIFT, delta_checksum, src);
+    checkpoint_filename(checkpoint_file, REDSHIFT);
+    if (read_checkpoint(checkpoint_file, &checkpoint, Tk_box, x_e_box, GLOBAL_EVOL) == 0){
+      zp = checkpoint.zp;
+      prev_zp = checkpoint.prev_zp;
+      dzp = checkpoint.dzp;
+      counter = checkpoint.counter;
+      zp_ct = checkpoint.zp_ct;
+      COMPUTE_Ts = checkpoint.COMPUTE_Ts;
+      x_e_ave = checkpoint.x_e_ave;
+      Tk_ave = checkpoint.Tk_ave;
+      PS_ION_EFF = checkpoint.PS_ION_EFF;
+      fprintf(stderr, "Resuming from the checkpoint %s at z'=%f, step %i. <Tk> = %f. <xe> = %e\n", checkpoint_file, zp, counter, Tk_ave, x_e_ave);
+      fprintf(LOG, "Resuming from the checkpoint %s at z'=%f, step %i. <Tk> = %f. <xe> = %e\n", checkpoint_file, zp, counter, Tk_ave, x_e_ave);
+    }
+  }
+
   while (zp > REDSHIFT){
       Tback = T_background(0, 0, zp);
 
@@ -737,117 +1128,18 @@ if(USE_GENERAL_SOURCES) M_MIN = src.minMass(REDSHIFT) * 50.0; //Multipied by 50
     fprintf(stderr, "Initializing look-up tables. Time=%06.2f min\n", (double)clock()/CLOCKS_PER_SEC/60.0);
     fprintf(LOG, "Initializing look-up tables. Time=%06.2f min\n", (double)clock()/CLOCKS_PER_SEC/60.0);
     time(&start_time);
+    set_zpp_shells(counter, zp);
     for (R_ct=0; R_ct<NUM_FILTER_STEPS_FOR_Ts; R_ct++){
-      if (R_ct==0){
-	prev_zpp = zp;
-	prev_R = 0;
-      }
-      else{
-	prev_zpp = zpp_edge[R_ct-1];
-	prev_R = R_values[R_ct-1];
-      }
-	
-      zpp_edge[R_ct] = prev_zpp - (R_values[R_ct] - prev_R)*CMperMPC / drdz(prev_zpp); // cell size
-
+      prev_zpp = (R_ct==0) ? zp : zpp_edge[R_ct-1];
       zpp = (zpp_edge[R_ct]+prev_zpp)*0.5; // average redshift value of shell: z'' + 0.5 * dz''
 	  //if (zpp - redshift_interp_table[arr_num+R_ct] > 1e-3) printf("zpp = %.4f, zpp_array = %.4f\n", zpp, redshift_interp_table[arr_num+R_ct]);
       if(SHARP_CUTOFF) sigma_Tmin[R_ct] =  sigma_z0(M_MIN); // In v1.4 sigma_Tmin doesn't nedd to be an array, just a constant.
       // let's now normalize the total collapse fraction so that the mean is the
-      // Sheth-Torman collapse fraction
-      fcoll_R = 0;
-      fcoll_R_Lya;
-      sample_ct=0;
-      for (box_ct=0; box_ct<HII_TOT_NUM_PIXELS; box_ct+=(HII_TOT_NUM_PIXELS/1e5+1)){
-	sample_ct++;
-	// New in v1.4
-
-	if (HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY) {
-	  growth_zpp = dicke(zpp);
-      //---------- interpolation for fcoll starts ----------
-      if (delNL0[R_ct][box_ct]*growth_zpp < 1.5){
-        if (delNL0[R_ct][box_ct]*growth_zpp < -1.) {
-		  fcoll = 0;
-      fcollLya = 0;
-        }    
-        else {
-          fcoll = gsl_spline_eval(FcollLow_zpp_spline[R_ct], log10(delNL0[R_ct][box_ct]*growth_zpp+1.), FcollLow_zpp_spline_acc[R_ct]);
-          fcollLya = gsl_spline_eval(FcollLowLya_zpp_spline[R_ct], log10(delNL0[R_ct][box_ct]*growth_zpp+1.), FcollLowLya_zpp_spline_acc[R_ct]);
-          fcoll = pow(10., fcoll);
-        }    
-      }    
-      else {
-        if (delNL0[R_ct][box_ct]*growth_zpp < 0.99*Deltac) {
-          // Usage of 0.99*Deltac arises due to the fact that close to the critical density, the collapsed fraction becomes a little unstable
-          // However, such densities should always be collapsed, so just set f_coll to unity. 
-          // Additionally, the fraction of points in this regime relative to the entire simulation volume is extremely small.
-		  //New
-          splint(Overdense_high_table-1,Fcollz_SFR_high_table[arr_num + R_ct]-1,second_derivs_Fcoll_zpp[R_ct]-1,NSFR_high,delNL0[R_ct][box_ct]*growth_zpp,&(fcoll));
-          splint(Overdense_high_table-1,FcollzLya_SFR_high_table[arr_num + R_ct]-1,second_derivs_FcollLya_zpp[R_ct]-1,NSFR_high,delNL0[R_ct][box_ct]*growth_zpp,&(fcollLya));
-        }    
-        else {
-		  fcoll = 1.;
-      fcollLya = 1.;
-        }    
-      }    
-      Splined_Fcoll = fcoll;
-      Splined_Fcoll_Lya = fcollLya;
-      //---------- interpolation for fcoll is done ----------
-	  fcoll_R += Splined_Fcoll;
-    fcoll_R_Lya += Splined_Fcoll_Lya;
-	} 
-	else {
-	  fcoll_R += sigmaparam_FgtrM_bias(zpp, sigma_Tmin[R_ct], 
-					 delNL0[R_ct][box_ct], sigma_atR[R_ct]);
-    }
-	  }
+      // Sheth-Torman collapse fraction (with DELNL0_STREAMING, once the shell is filtered below)
+      if (!DELNL0_STREAMING)
+	normalize_fcoll_R(delNL0, R_ct, zpp, arr_num);
 
-      fcoll_R /= (double) sample_ct;
-
-	  if (HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY) {// New in v1.4
-	    FgtrM_st_SFR_X_z(zpp,&(Splined_Fcollzpp_X_mean));
-      FgtrM_st_SFR_Lya_z(zpp,&(Splined_Fcollzpp_Lya_mean));
-	    ST_over_PS[R_ct] = Splined_Fcollzpp_X_mean / fcoll_R; 
-      ST_over_PS_Lya[R_ct] = Splined_Fcollzpp_Lya_mean / fcoll_R;
-	  }
-	  else {
-        ST_over_PS[R_ct] = FgtrM_st(zpp, M_MIN) / fcoll_R;
-	  }
-
-      if (DEBUG_ON){
-	    if (HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY) {
-        printf("zpp = %le M_MIN = %le fcoll_R = %le\n", zpp, M_MIN, fcoll_R);
-      printf("ST/PS=%g, mean_ST=%g, mean_ps=%g\n, ratios of mean=%g\n", ST_over_PS[R_ct], 
-		 Splined_Fcollzpp_X_mean,
-        
-	     FgtrM(zpp, M_MIN),
-	     Splined_Fcollzpp_X_mean/FgtrM(zpp, M_MIN)
-	     );
-		}
-		else {
-      printf("ST/PS=%g, mean_ST=%g, mean_ps=%g\n, ratios of mean=%g\n", ST_over_PS[R_ct], 
-	     FgtrM_st(zpp, M_MIN), 
-	     FgtrM(zpp, M_MIN),
-	     FgtrM_st(zpp, M_MIN)/FgtrM(zpp, M_MIN)
-	     );
-		}
-      }
-
-      lower_int_limit = FMAX(nu_tau_one(zp, zpp, x_e_ave, filling_factor_of_HI_zp), NU_X_THRESH);
-
-
-/***************  PARALLELIZED LOOP ******************************************************************/
-      // set up frequency integral table for later interpolation for the cell's x_e value
-#pragma omp parallel shared(freq_int_heat_tbl, freq_int_ion_tbl, COMPUTE_Ts, freq_int_lya_tbl, zp, R_ct, x_e_ave, x_int_XHII, x_int_Energy, x_int_fheat, x_int_n_Lya, x_int_nion_HI, x_int_nion_HeI, x_int_nion_HeII, lower_int_limit) private(x_e_ct)
-{
-#pragma omp for
-  for (x_e_ct = 0; x_e_ct < x_int_NXHII; x_e_ct++){
-    freq_int_heat_tbl[x_e_ct][R_ct] = integrate_over_nu(zp, x_int_XHII[x_e_ct], lower_int_limit, 0);
-    freq_int_ion_tbl[x_e_ct][R_ct] = integrate_over_nu(zp, x_int_XHII[x_e_ct], lower_int_limit, 1);
-    if (COMPUTE_Ts)
-      freq_int_lya_tbl[x_e_ct][R_ct] = integrate_over_nu(zp, x_int_XHII[x_e_ct], lower_int_limit, 2);
-  }
-} // end omp declaration
-/***************  END PARALLELIZED LOOP ******************************************************************/
+      lower_int_limit[R_ct] = FMAX(nu_tau_one_lookup(zp, zpp, R_ct, x_e_ave, filling_factor_of_HI_zp), NU_X_THRESH);
 
       // and create the sum over Lya transitions from direct Lyn flux
       sum_lyn[R_ct] = 0;
@@ -861,15 +1153,45 @@ if(USE_GENERAL_SOURCES) M_MIN = src.minMass(REDSHIFT) * 50.0; //Multipied by 50
 	/*else*/ sum_lyn[R_ct] += frecycle(n_ct) * spectral_emissivity(nuprime, 0, Pop, src.fPopIII(zpp));
       }
     } // end loop over R_ct filter steps
+
+/***************  PARALLELIZED LOOP ******************************************************************/
+    // set up frequency integral table for later interpolation for the cell's x_e value
+    if (FREQ_INT_FIXED_NODES > 0){
+#pragma omp parallel for shared(freq_int_heat_tbl, freq_int_ion_tbl, COMPUTE_Ts, freq_int_lya_tbl, zp, lower_int_limit) private(R_ct, x_e_ct, freq_int_xe) schedule(dynamic)
+      for (R_ct=0; R_ct<NUM_FILTER_STEPS_FOR_Ts; R_ct++){
+	integrate_over_nu_fixed(zp, lower_int_limit[R_ct], 0, freq_int_xe);
+	for (x_e_ct = 0; x_e_ct < x_int_NXHII; x_e_ct++)
+	  freq_int_heat_tbl[x_e_ct][R_ct] = freq_int_xe[x_e_ct];
+	integrate_over_nu_fixed(zp, lower_int_limit[R_ct], 1, freq_int_xe);
+	for (x_e_ct = 0; x_e_ct < x_int_NXHII; x_e_ct++)
+	  freq_int_ion_tbl[x_e_ct][R_ct] = freq_int_xe[x_e_ct];
+	if (COMPUTE_Ts){
+	  integrate_over_nu_fixed(zp, lower_int_limit[R_ct], 2, freq_int_xe);
+	  for (x_e_ct = 0; x_e_ct < x_int_NXHII; x_e_ct++)
+	    freq_int_lya_tbl[x_e_ct][R_ct] = freq_int_xe[x_e_ct];
+	}
+      }
+    }
+    else{
+      // all of the (x_e, R) entries as one loop, so that every thread has work
+#pragma omp parallel for shared(freq_int_heat_tbl, freq_int_ion_tbl, COMPUTE_Ts, freq_int_lya_tbl, zp, lower_int_limit) private(ct, R_ct, x_e_ct) schedule(dynamic)
+      for (ct = 0; ct < x_int_NXHII*NUM_FILTER_STEPS_FOR_Ts; ct++){
+	x_e_ct = ct % x_int_NXHII;
+	R_ct = ct / x_int_NXHII;
+	freq_int_heat_tbl[x_e_ct][R_ct] = integrate_over_nu(zp, x_int_XHII[x_e_ct], lower_int_limit[R_ct], 0);
+	freq_int_ion_tbl[x_e_ct][R_ct] = integrate_over_nu(zp, x_int_XHII[x_e_ct], lower_int_limit[R_ct], 1);
+	if (COMPUTE_Ts)
+	  freq_int_lya_tbl[x_e_ct][R_ct] = integrate_over_nu(zp, x_int_XHII[x_e_ct], lower_int_limit[R_ct], 2);
+      }
+    }
+/***************  END PARALLELIZED LOOP ******************************************************************/
     time(&curr_time);
     fprintf(stderr, "Finishing initializing look-up tables.  It took %06.2f min on the main thread. Time elapsed (total for all threads)=%06.2f\n", difftime(curr_time, start_time)/60.0, (double)clock()/CLOCKS_PER_SEC/60.0);
     fprintf(LOG, "Finishing initializing look-up tables.  It took %06.2f min on the main thread. Total time elapsed (total for all threads)=%06.2f\n", difftime(curr_time, start_time)/60.0, (double)clock()/CLOCKS_PER_SEC/60.0);
     fflush(NULL);
 
     // scroll through each cell and update the temperature and residual ionization fraction
-    growth_factor_zp = dicke(zp);
-    dgrowth_factor_dzp = ddicke_dz(zp);
-    dt_dzp = dtdz(zp);
+    // (growth_factor_zp, dgrowth_factor_dzp and dt_dzp were set with the shells)
 	// New in v1.4
     // Conversion of the input bolometric luminosity to a ZETA_X, as used to be used in Ts.c
     // Conversion here means the code otherwise remains the same as the original Ts.c
@@ -897,17 +1219,23 @@ if(USE_GENERAL_SOURCES) M_MIN = src.minMass(REDSHIFT) * 50.0; //Multipied by 50
 
 
 
+    if (DELNL0_STREAMING){
+      fprintf(stderr, "Summing over the filter shells at z'=%f, time elapsed  (total for all threads)= %06.2f min\n", zp, (double)clock()/CLOCKS_PER_SEC/60.0);
+      fprintf(LOG, "Summing over the filter shells at z'=%f, time elapsed  (total for all threads)= %06.2f min\n", zp, (double)clock()/CLOCKS_PER_SEC/60.0);
+      sum_zpp_shells(zp, growth_factor_z, delNL0, x_e_box, COMPUTE_Ts, arr_num,
+		     freq_int_heat_tbl, freq_int_ion_tbl, freq_int_lya_tbl);
+    }
+
     /********  LOOP THROUGH BOX *************/
     fprintf(stderr, "Looping through box at z'=%f, time elapsed  (total for all threads)= %06.2f min\n", zp, (double)clock()/CLOCKS_PER_SEC/60.0);
     fprintf(LOG, "Looping through box at z'=%f, time elapsed  (total for all threads)= %06.2f min\n", zp, (double)clock()/CLOCKS_PER_SEC/60.0);
     fflush(NULL);
     time(&start_time);
-    for (ct=0; ct<NUMCORES; ct++)
-      J_alpha_threads[ct] = xalpha_threads[ct] = Xheat_threads[ct] = Xion_threads[ct] = 0;
+    zero_row_sums(&cell_sums);
     /***************  PARALLELIZED LOOP ******************************************************************/
-#pragma omp parallel shared(COMPUTE_Ts, Tk_box, x_e_box, x_e_ave, delNL0, freq_int_heat_tbl, freq_int_ion_tbl, freq_int_lya_tbl, zp, dzp, Ts, x_int_XHII, x_int_Energy, x_int_fheat, x_int_n_Lya, x_int_nion_HI, x_int_nion_HeI, x_int_nion_HeII, growth_factor_zp, dgrowth_factor_dzp, NO_LIGHT, zpp_edge, sigma_atR, sigma_Tmin, ST_over_PS, ST_over_PS_Lya, sum_lyn, const_zp_prefactor, M_MIN_at_z, M_MIN_at_zp, dt_dzp, J_alpha_threads, xalpha_threads, Xheat_threads, Xion_threads) private(box_ct, ans, xHII_call, R_ct, curr_delNL0, m_xHII_low, m_xHII_high, freq_int_heat, freq_int_ion, freq_int_lya, dansdz, J_alpha_tot, curr_xalpha)
+#pragma omp parallel shared(COMPUTE_Ts, Tk_box, x_e_box, x_e_ave, delNL0, ZPP_SUMS, freq_int_heat_tbl, freq_int_ion_tbl, freq_int_lya_tbl, zp, dzp, Ts, x_int_XHII, x_int_Energy, x_int_fheat, x_int_n_Lya, x_int_nion_HI, x_int_nion_HeI, x_int_nion_HeII, growth_factor_zp, dgrowth_factor_dzp, NO_LIGHT, zpp_edge, sigma_atR, sigma_Tmin, ST_over_PS, ST_over_PS_Lya, sum_lyn, const_zp_prefactor, M_MIN_at_z, M_MIN_at_zp, dt_dzp, cell_sums) private(box_ct, ans, R_ct, curr_delNL0, cell_zpp_sums, m_xHII_low, freq_int_weight, freq_int_heat, freq_int_ion, freq_int_lya, dansdz, J_alpha_tot, curr_xalpha)
     {
-#pragma omp for
+#pragma omp for schedule(static, HII_DIM) // whole rows per thread, for cell_sums
       
     for (box_ct=0; box_ct<HII_TOT_NUM_PIXELS; box_ct++){
       if (!COMPUTE_Ts && (Tk_box[box_ct] > MAX_TK)) //just leave it alone and go to next value
@@ -926,47 +1254,27 @@ if(USE_GENERAL_SOURCES) M_MIN = src.minMass(REDSHIFT) * 50.0; //Multipied by 50
       }
       */
 
-      xHII_call = x_e_box[box_ct];
-
-      // Check if ionized fraction is within boundaries; if not, adjust to be within
-      if (xHII_call > x_int_XHII[x_int_NXHII-1]*0.999) {
-	xHII_call = x_int_XHII[x_int_NXHII-1]*0.999;
-      } else if (xHII_call < x_int_XHII[0]) {
-	xHII_call = 1.001*x_int_XHII[0];
+      if (DELNL0_STREAMING){ // the z'' integrals were summed by sum_zpp_shells()
+	curr_delNL0[0] = delNL0[0][box_ct];
+	cell_zpp_sums[0] = ZPP_SUMS[0][box_ct]; cell_zpp_sums[1] = ZPP_SUMS[1][box_ct];
+	cell_zpp_sums[2] = ZPP_SUMS[2][box_ct]; cell_zpp_sums[3] = ZPP_SUMS[3][box_ct];
+	evolve_zpp_sums(zp, curr_delNL0[0], cell_zpp_sums, COMPUTE_Ts, ans, dansdz);
       }
-      //interpolate to correct nu integral value based on the cell's ionization state
-      for (R_ct=0; R_ct<NUM_FILTER_STEPS_FOR_Ts; R_ct++){
-	curr_delNL0[R_ct] = delNL0[R_ct][box_ct];
-	m_xHII_low = locate_xHII_index(xHII_call);
-	m_xHII_high = m_xHII_low + 1;
-
-	// heat
-	freq_int_heat[R_ct] = (freq_int_heat_tbl[m_xHII_high][R_ct] - 
-			       freq_int_heat_tbl[m_xHII_low][R_ct]) / 
-	                  (x_int_XHII[m_xHII_high] - x_int_XHII[m_xHII_low]);
-	freq_int_heat[R_ct] *= (xHII_call - x_int_XHII[m_xHII_low]);
-	freq_int_heat[R_ct] += freq_int_heat_tbl[m_xHII_low][R_ct];
-
-	// ionization
-	freq_int_ion[R_ct] = (freq_int_ion_tbl[m_xHII_high][R_ct] - 
-			       freq_int_ion_tbl[m_xHII_low][R_ct]) / 
-	                  (x_int_XHII[m_xHII_high] - x_int_XHII[m_xHII_low]);
-	freq_int_ion[R_ct] *= (xHII_call - x_int_XHII[m_xHII_low]);
-	freq_int_ion[R_ct] += freq_int_ion_tbl[m_xHII_low][R_ct];
-
-	// lya
-	if (COMPUTE_Ts){
-	  freq_int_lya[R_ct] = (freq_int_lya_tbl[m_xHII_high][R_ct] - 
-				 freq_int_lya_tbl[m_xHII_low][R_ct]) / 
-	    (x_int_XHII[m_xHII_high] - x_int_XHII[m_xHII_low]);
-	  freq_int_lya[R_ct] *= (xHII_call - x_int_XHII[m_xHII_low]);
-	  freq_int_lya[R_ct] += freq_int_lya_tbl[m_xHII_low][R_ct];
-	}
+      else{
+        for (R_ct=0; R_ct<NUM_FILTER_STEPS_FOR_Ts; R_ct++)
+	  curr_delNL0[R_ct] = delNL0[R_ct][box_ct];
+
+        // interpolate to the nu integrals of the cell's ionization state, which is the same for all of the shells
+        m_xHII_low = freq_int_bracket(x_e_box[box_ct], &freq_int_weight);
+        interp_freq_int_rows(freq_int_heat_tbl, m_xHII_low, freq_int_weight, freq_int_heat);
+        interp_freq_int_rows(freq_int_ion_tbl, m_xHII_low, freq_int_weight, freq_int_ion);
+        if (COMPUTE_Ts)
+  	interp_freq_int_rows(freq_int_lya_tbl, m_xHII_low, freq_int_weight, freq_int_lya);
+
+        /********  finally compute the redshift derivatives *************/
+        evolveInt(zp, curr_delNL0, freq_int_heat, freq_int_ion, freq_int_lya,
+  	  	COMPUTE_Ts, ans, dansdz, arr_num);//, M_TURN,ALPHA_STAR,F_STAR10,T_AST);
       }
-
-      /********  finally compute the redshift derivatives *************/
-      evolveInt(zp, curr_delNL0, freq_int_heat, freq_int_ion, freq_int_lya,
-	  	COMPUTE_Ts, ans, dansdz, arr_num);//, M_TURN,ALPHA_STAR,F_STAR10,T_AST);
  
       //update quantities
       x_e_box[box_ct] += dansdz[0] * dzp; // remember dzp is negative
@@ -987,10 +1295,10 @@ if(USE_GENERAL_SOURCES) M_MIN = src.minMass(REDSHIFT) * 50.0; //Multipied by 50
 	J_alpha_tot = dansdz[2]; //not really d/dz, but the lya flux
 	Ts[box_ct] = get_Ts(zp, curr_delNL0[0]*growth_factor_zp,
 			    Tk_box[box_ct], x_e_box[box_ct], J_alpha_tot, &curr_xalpha);
-	J_alpha_threads[omp_get_thread_num()] += J_alpha_tot;
-	xalpha_threads[omp_get_thread_num()] += curr_xalpha;
-	Xheat_threads[omp_get_thread_num()] += dansdz[3];
-	Xion_threads[omp_get_thread_num()] += dansdz[4];
+	ROW_SUM_ADD(&cell_sums, box_ct, 0, J_alpha_tot);
+	ROW_SUM_ADD(&cell_sums, box_ct, 1, curr_xalpha);
+	ROW_SUM_ADD(&cell_sums, box_ct, 2, dansdz[3]);
+	ROW_SUM_ADD(&cell_sums, box_ct, 3, dansdz[4]);
       }
     }
 
@@ -1004,19 +1312,14 @@ if(USE_GENERAL_SOURCES) M_MIN = src.minMass(REDSHIFT) * 50.0; //Multipied by 50
     fflush(NULL);
 
     // compute new average values
-    x_e_ave = 0; Tk_ave = 0; Ts_ave = 0; J_alpha_ave = 0; xalpha_ave = 0; Xheat_ave=0; Xion_ave=0;
-    for (box_ct=0; box_ct<HII_TOT_NUM_PIXELS; box_ct++){
-      x_e_ave += x_e_box[box_ct];
-      Tk_ave += Tk_box[box_ct];
-      if (COMPUTE_Ts)
-	Ts_ave += Ts[box_ct];
-    }
-    for (ct=0; ct<NUMCORES; ct++){
-      J_alpha_ave += J_alpha_threads[ct];
-      xalpha_ave += xalpha_threads[ct];
-      Xheat_ave += Xheat_threads[ct];
-      Xion_ave += Xion_threads[ct];
-    }
+    x_e_ave = box_sum(x_e_box, 0);
+    Tk_ave = box_sum(Tk_box, 0);
+    Ts_ave = COMPUTE_Ts ? box_sum(Ts, 0) : 0;
+    total_row_sums(&cell_sums, cell_totals);
+    J_alpha_ave = cell_totals[0];
+    xalpha_ave = cell_totals[1];
+    Xheat_ave = cell_totals[2];
+    Xion_ave = cell_totals[3];
     Ts_ave /= (double)HII_TOT_NUM_PIXELS;
     x_e_ave /= (double)HII_TOT_NUM_PIXELS;
     Tk_ave /= (double)HII_TOT_NUM_PIXELS;
@@ -1103,19 +1406,39 @@ if(USE_GENERAL_SOURCES) M_MIN = src.minMass(REDSHIFT) * 50.0; //Multipied by 50
     zp = ((1+prev_zp) / ZPRIME_STEP_FACTOR - 1);
     dzp = zp - prev_zp;
 	counter += 1;
+
+    // checkpoint the state for the next step
+    if ((TS_CHECKPOINT_INTERVAL > 0) && !RESTART && (counter % TS_CHECKPOINT_INTERVAL == 0) && (zp > REDSHIFT)){
+      checkpoint.zp = zp;
+      checkpoint.prev_zp = prev_zp;
+      checkpoint.dzp = dzp;
+      checkpoint.counter = counter;
+      checkpoint.zp_ct = zp_ct;
+      checkpoint.COMPUTE_Ts = COMPUTE_Ts;
+      checkpoint.x_e_ave = x_e_ave;
+      checkpoint.Tk_ave = Tk_ave;
+      checkpoint.PS_ION_EFF = PS_ION_EFF;
+      if (write_checkpoint(checkpoint_file, &checkpoint, Tk_box, x_e_box, GLOBAL_EVOL, global_evol_filename) < 0){
+	fprintf(stderr, "Ts.c: WARNING: Unable to write the checkpoint %s\n", checkpoint_file);
+	fprintf(LOG, "Ts.c: WARNING: Unable to write the checkpoint %s\n", checkpoint_file);
+      }
+    }
   } // end main integral loop over z'
 
+  // the run is complete, so the checkpoint is no longer needed
+  if ((TS_CHECKPOINT_INTERVAL > 0) && !RESTART)
+    remove(checkpoint_file);
+
 
 
   //deallocate
   fclose(LOG); fclose(GLOBAL_EVOL); free(Tk_box); free(x_e_box); free(Ts);
+  free_row_sums(&cell_sums);
   if (HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY) {
   	destroy_21cmMC_arrays();
 	free_interpolation();
   }
-  for (R_ct=0; R_ct<NUM_FILTER_STEPS_FOR_Ts; R_ct++){
-    free(delNL0[R_ct]);
-  }
+  free_delNL0(delNL0);
   destruct_heat();
   return 0;
 }
@@ -2,6 +2,9 @@
 #include "../Parameter_files/ANAL_PARAMS.H"
 #include "../Parameter_files/HEAT_PARAMS.H"
 #include "../Parameter_files/SOURCES.H"
+#include "rsd_helper_progs.c"
+#include "power_spec_helper_progs.c"
+#include "reduction_helper_progs.c"
 
 
 /*
@@ -15,39 +18,173 @@
   to NUMCORES in INIT_PARAMS.H
 */
 
+/* summary statistics of the brightness temperature box, filled by fill_delta_T */
+typedef struct{
+  double ave, min, max; // delta_T before the velocity correction (ave is the box sum)
+  double ave_Ts, min_Ts, max_Ts; // spin temperature (ave_Ts is the box sum)
+  double ave_v, max_v, max_dvdx; // delta_T after the (non sub-cell) velocity correction
+  unsigned long long nonlin_ct; // number of voxels exceeding MAX_DVDR
+} delta_T_stats;
+
+
+/*
+  Function FILL_DELTA_T is the fused brightness temperature kernel.  In a single threaded sweep over
+  the unpadded boxes it computes const_factor*x_HI*(1+delta), applies the spin temperature factor
+  (if USE_TS_IN_21CM) and, if T_USE_VELOCITIES, the velocity gradient correction from the FFT padded
+  box <v>, which must already hold the line-of-sight velocity gradient.  All of the summary statistics
+  are accumulated at the same time, and returned in <stats>: the extrema with OpenMP reductions, and
+  the sums per skewer, added up in a fixed order (see reduction_helper_progs.c) so that they do not
+  depend on the number of threads.  Returns -1 if the memory for the skewer sums can not be allocated.
+
+  The sweep is over line-of-sight skewers, which are contiguous in all of the boxes (including <v>).
+  With SUBCELL_RSD the box is left ready for subcell_RSD_remap(), otherwise it is final.
+*/
+int fill_delta_T(float *delta_T, float *xH, float *deltax, float *Ts, float *v, float REDSHIFT, float H,
+		  float T_rad, float const_factor, int num_th, delta_T_stats *stats){
+  unsigned long long skewer, r_ct, v_ct;
+  int k;
+  float pixel_delta_T, pixel_Ts, gradient_component;
+  double dvdx, max_v_deriv, max_dvdx, thread_max_v, thread_max_dvdx;
+  double ave, min, max, ave_Ts, min_Ts, max_Ts, ave_v, max_v, totals[3];
+  unsigned long long nonlin_ct;
+  row_sums skewer_sums; // ave, ave_Ts and ave_v of every skewer
+
+  if (init_row_sums(&skewer_sums, 3) < 0)
+    return -1;
+  max = -1e3;
+  min = 1e3;
+  max_Ts = 0;
+  min_Ts = 1e5;
+  max_v = -1;
+  max_dvdx = 0;
+  nonlin_ct = 0;
+  max_v_deriv = fabs(MAX_DVDR*H);
+
+#pragma omp parallel shared(delta_T, xH, deltax, Ts, v, REDSHIFT, H, T_rad, const_factor, max_v_deriv, max_v, max_dvdx, skewer_sums) private(skewer, r_ct, v_ct, k, pixel_delta_T, pixel_Ts, gradient_component, dvdx, thread_max_v, thread_max_dvdx, ave, ave_Ts, ave_v) num_threads(num_th)
+{
+  thread_max_v = -1;
+  thread_max_dvdx = 0;
+
+#pragma omp for reduction(+:nonlin_ct) reduction(min:min,min_Ts) reduction(max:max,max_Ts)
+  for (skewer=0; skewer<HII_D*HII_D; skewer++){
+    r_ct = skewer*HII_D; // == HII_R_INDEX(i,j,0)
+    v_ct = skewer*2llu*(HII_MID+1llu); // == HII_R_FFT_INDEX(i,j,0)
+    ave = ave_Ts = ave_v = 0;
+
+    for (k=0; k<HII_DIM; k++){
+      pixel_delta_T = const_factor*xH[r_ct+k]*(1+deltax[r_ct+k]);
+
+      if (USE_TS_IN_21CM){
+	pixel_Ts = Ts[r_ct+k];
+	if(SUBCELL_RSD) {
+	  // Converting the prefactors into the optical depth, tau. Factor of 1000 is the conversion of spin temperature from K to mK
+	  pixel_delta_T *= (1. + REDSHIFT)/(1000.*pixel_Ts);
+	}
+	else {
+	  pixel_delta_T *= (1 - T_rad / pixel_Ts);
+	}
+
+	ave_Ts += pixel_Ts;
+	if (min_Ts > pixel_Ts) { min_Ts = pixel_Ts;}
+	if (max_Ts < pixel_Ts) { max_Ts = pixel_Ts;}
+      }
+
+      if (max < pixel_delta_T){ max = pixel_delta_T;}
+      if (min > pixel_delta_T){ min = pixel_delta_T;}
+      ave += pixel_delta_T;
+
+      if (T_USE_VELOCITIES){
+	if (SUBCELL_RSD){
+	  gradient_component = fabs(v[v_ct+k]/H + 1.0);
+
+	  if (USE_TS_IN_21CM){
+	    // Calculate the brightness temperature, using the optical depth
+	    if(gradient_component < FRACT_FLOAT_ERR) {
+	      // Gradient component goes to zero, optical depth diverges. But, since we take exp(-tau), this goes to zero and (1 - exp(-tau)) goes to unity.
+	      // Again, factors of 1000. are conversions from K to mK
+	      pixel_delta_T = 1000.*(pixel_Ts - T_rad)/(1. + REDSHIFT);
+	    }
+	    else {
+	      pixel_delta_T = (1. - exp(- pixel_delta_T/gradient_component ))*1000.*(pixel_Ts - T_rad)/(1. + REDSHIFT);
+	    }
+	  }
+	  else{
+	    // Ts >> T_rad limit of the above, in which (1 - exp(-tau)) -> tau
+	    if (gradient_component < FRACT_FLOAT_ERR) gradient_component = FRACT_FLOAT_ERR;
+	    pixel_delta_T /= gradient_component;
+	  }
+	}
+	else{
+	  dvdx = v[v_ct+k];
+
+	  // set maximum allowed gradient for this linear approximation
+	  if (fabs(dvdx) > max_v_deriv){
+	    if (dvdx < 0) dvdx = -max_v_deriv;
+	    else dvdx = max_v_deriv;
+	    nonlin_ct++;
+	  }
+
+	  pixel_delta_T /= (dvdx/H + 1.0);
+
+	  if (thread_max_v < pixel_delta_T){
+	    thread_max_v = pixel_delta_T;
+	    thread_max_dvdx = dvdx;
+	  }
+	  ave_v += pixel_delta_T;
+	}
+      }
+
+      delta_T[r_ct+k] = pixel_delta_T;
+    }
+    skewer_sums.rows[skewer].s[0] = ave;
+    skewer_sums.rows[skewer].s[1] = ave_Ts;
+    skewer_sums.rows[skewer].s[2] = ave_v;
+  }
+
+  // the maximum and its velocity gradient are merged as a pair
+#pragma omp critical
+  {
+    if (max_v < thread_max_v){
+      max_v = thread_max_v;
+      max_dvdx = thread_max_dvdx;
+    }
+  }
+}
+
+  total_row_sums(&skewer_sums, totals);
+  free_row_sums(&skewer_sums);
+  stats->ave = totals[0]; stats->min = min; stats->max = max;
+  stats->ave_Ts = totals[1]; stats->min_Ts = min_Ts; stats->max_Ts = max_Ts;
+  stats->ave_v = totals[2]; stats->max_v = max_v; stats->max_dvdx = max_dvdx;
+  stats->nonlin_ct = nonlin_ct;
+  return 0;
+}
+
+
 int main(int argc, char ** argv){
   fftwf_complex *deldel_T;
   fftwf_plan plan;
   char filename[1000], psoutputdir[1000], *token;
-  float *deltax, REDSHIFT, growth_factor, dDdt, pixel_x_HI, pixel_deltax, *delta_T, *v, H, dummy;
+  float *deltax, REDSHIFT, growth_factor, dDdt, *delta_T, *v, H, dummy;
   FILE *F, *LOG;
-  int i,j,k, n_x, n_y, n_z, NUM_BINS, curr_Pop, arg_offset,num_th;
-  double dvdx, ave, *p_box, *k_ave, max_v_deriv;
-  unsigned long long ct, *in_bin_ct, nonlin_ct, temp_ct;
-  float nf, max, maxi, maxj, maxk, maxdvdx, min, mini, minj, mink, mindvdx;
-  float k_x, k_y, k_z, k_mag, k_sq, k_floor, k_ceil, k_max, k_first_bin_ceil, k_factor;
-  float *xH, const_factor, *Ts, T_rad, pixel_Ts_factor, curr_alphaX, curr_MminX;
-  double ave_Ts, min_Ts, max_Ts, temp, curr_zetaX;
-  int ii;
-  
-  float d1_low, d1_high, d2_low, d2_high, gradient_component, min_gradient_component, subcell_width, x_val1, x_val2, subcell_displacement;
-  float RSD_pos_new, RSD_pos_new_boundary_low,RSD_pos_new_boundary_high, fraction_within, fraction_outside, cell_distance;
-
-  float *x_pos_offset, *x_pos, *delta_T_RSD_LOS;
-  
-  x_pos = calloc(N_RSD_STEPS,sizeof(float));
-  x_pos_offset = calloc(N_RSD_STEPS,sizeof(float));
-  delta_T_RSD_LOS = calloc(HII_DIM,sizeof(float));
+  int i,j,k, n_x, n_y, n_z, curr_Pop, arg_offset,num_th;
+  double ave;
+  unsigned long long ct;
+  float nf;
+  float k_x, k_y, k_z;
+  float *xH, const_factor, *Ts, T_rad, curr_alphaX, curr_MminX;
+  double curr_zetaX;
+  delta_T_stats stats;
+  ps_bins k_bins, k_perp_bins, k_par_bins;
+  ps_estimator ps;
+  int perp_ct, par_ct;
   
   int HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY = 0;
 
 
   /************  BEGIN INITIALIZATION ****************************/
   if (SHARP_CUTOFF) HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY = 1;
-  max = -1e3;
-  min = 1e3;
-  ave = 0;
-  nonlin_ct=0;
+  Ts = NULL;
 
   // check arguments
   if (argc < 3){
@@ -70,6 +207,7 @@ int main(int argc, char ** argv){
     return -1;
   }
   fftwf_plan_with_nthreads(num_th);    
+  omp_set_num_threads(num_th);
 
   // open LOG file
   REDSHIFT = atof(argv[1+arg_offset]);
@@ -121,7 +259,7 @@ int main(int argc, char ** argv){
   fclose(F);
  
   // allocate memory for deltax box and read it in
-  deltax = (float *) malloc(sizeof(float)*HII_TOT_FFT_NUM_PIXELS);
+  deltax = (float *) malloc(sizeof(float)*HII_TOT_NUM_PIXELS);
   if (!deltax){
     fprintf(stderr, "delta_T: Error allocating memory for deltax box\nAborting...\n");
     fprintf(LOG, "delta_T: Error allocating memory for deltax box\nAborting...\n");
@@ -137,17 +275,12 @@ int main(int argc, char ** argv){
   }
   fprintf(stderr, "Reading in deltax box\n");
   fprintf(LOG, "Reading in deltax box\n");
-  for (i=0; i<HII_DIM; i++){
-    for (j=0; j<HII_DIM; j++){
-      for (k=0; k<HII_DIM; k++){
-	if (fread((float *)deltax + HII_R_FFT_INDEX(i,j,k), sizeof(float), 1, F)!=1){
-	  fprintf(stderr, "delta_T: Read error occured while reading deltax box.\n");
-	  fprintf(LOG, "delta_T: Read error occured while reading deltax box.\n");
-	  fclose(F); free(xH); free(deltax);
-	  fclose(LOG); fftwf_cleanup_threads(); return -1;
-	}
-      }
-    }
+  // the density is only used by the brightness temperature kernel, so it is kept unpadded
+  if (mod_fread(deltax, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
+    fprintf(stderr, "delta_T: Read error occured while reading deltax box.\n");
+    fprintf(LOG, "delta_T: Read error occured while reading deltax box.\n");
+    fclose(F); free(xH); free(deltax);
+    fclose(LOG); fftwf_cleanup_threads(); return -1;
   }
   fclose(F);
 
@@ -183,15 +316,14 @@ int main(int argc, char ** argv){
       free(xH); free(deltax); free(delta_T); free(v);
       fclose(LOG); fftwf_cleanup_threads(); return -1;
     }
+    // the velocity box is FFT padded, but each line-of-sight skewer is contiguous
     for (i=0; i<HII_DIM; i++){
       for (j=0; j<HII_DIM; j++){
-	for (k=0; k<HII_DIM; k++){
-	  if (fread((float *)v + HII_R_FFT_INDEX(i,j,k), sizeof(float), 1, F)!=1){
-	    fprintf(stderr, "delta_T: Read error occured while reading velocity box.\n");
-	    fprintf(LOG, "delta_T: Read error occured while reading velocity box.\n");
-	    fclose(F); free(xH); free(deltax); free(delta_T); free(v);
-	    fclose(LOG); fftwf_cleanup_threads(); return -1;
-	  }
+	if (fread((float *)v + HII_R_FFT_INDEX(i,j,0), sizeof(float), HII_DIM, F)!=HII_DIM){
+	  fprintf(stderr, "delta_T: Read error occured while reading velocity box.\n");
+	  fprintf(LOG, "delta_T: Read error occured while reading velocity box.\n");
+	  fclose(F); free(xH); free(deltax); free(delta_T); free(v);
+	  fclose(LOG); fftwf_cleanup_threads(); return -1;
 	}
       }
     }
@@ -223,69 +355,71 @@ int main(int argc, char ** argv){
 
   /************  END INITIALIZATION ****************************/
 
-  // ok, lets fill the delta_T box; which will be the same size as the bubble box
-  ave_Ts = max_Ts = 0;
-  min_Ts = 1e5;
-  temp=0;
-  temp_ct=0;
-  for (i=0; i<HII_DIM; i++){
-    for (j=0; j<HII_DIM; j++){
-      for (k=0; k<HII_DIM; k++){
-
-	pixel_deltax = deltax[HII_R_FFT_INDEX(i,j,k)];
-	pixel_x_HI = xH[HII_R_INDEX(i,j,k)];
+  // check if we need to correct for velocities
+  if (T_USE_VELOCITIES){
+    // let's take the derivative in k-space
+    plan = fftwf_plan_dft_r2c_3d(HII_DIM, HII_DIM, HII_DIM, (float *)v, (fftwf_complex *)v, FFTW_ESTIMATE);
+    fftwf_execute(plan);
+    fftwf_destroy_plan(plan);
+    fftwf_cleanup();
+#pragma omp parallel shared(v) private(n_x, n_y, n_z, k_x, k_y, k_z) num_threads(num_th)
+{
+#pragma omp for
+    for (n_x=0; n_x<HII_DIM; n_x++){
+      if (n_x>HII_MIDDLE)
+	k_x =(n_x-HII_DIM) * DELTA_K;  // wrap around for FFT convention
+      else
+	k_x = n_x * DELTA_K;
 
-	if (pixel_x_HI > TINY){
-	  temp = pixel_deltax;
-	  temp_ct++;
-	}
+      for (n_y=0; n_y<HII_DIM; n_y++){
+	if (n_y>HII_MIDDLE)
+	  k_y =(n_y-HII_DIM) * DELTA_K;
+	else
+	  k_y = n_y * DELTA_K;
 
-	delta_T[HII_R_INDEX(i,j,k)] = const_factor*pixel_x_HI*(1+pixel_deltax);
+	for (n_z=0; n_z<=HII_MIDDLE; n_z++){ 
+	  k_z = n_z * DELTA_K;
 
-	if (USE_TS_IN_21CM){
-      if(SUBCELL_RSD) {
-          // Converting the prefactors into the optical depth, tau. Factor of 1000 is the conversion of spin temperature from K to mK
-          delta_T[HII_R_INDEX(i,j,k)] *= (1. + REDSHIFT)/(1000.*Ts[HII_R_INDEX(i,j,k)]);
-      }
-      else {
-      
-          pixel_Ts_factor = (1 - T_rad / Ts[HII_R_INDEX(i,j,k)]);
-          delta_T[HII_R_INDEX(i,j,k)] *= pixel_Ts_factor;
-      }
-      
-      ave_Ts += Ts[HII_R_INDEX(i,j,k)];
-	  if (min_Ts > Ts[HII_R_INDEX(i,j,k)]) { min_Ts = Ts[HII_R_INDEX(i,j,k)];}
-	  if (max_Ts < Ts[HII_R_INDEX(i,j,k)]) { max_Ts = Ts[HII_R_INDEX(i,j,k)];}
+	  // take partial deriavative along the line of sight
+	  switch(VELOCITY_COMPONENT){
+	  case 1:
+	    *((fftwf_complex *) v + HII_C_INDEX(n_x,n_y,n_z)) *= k_x*I/(float)HII_TOT_NUM_PIXELS;
+	    break;
+	  case 3:
+	    *((fftwf_complex *) v + HII_C_INDEX(n_x,n_y,n_z)) *= k_z*I/(float)HII_TOT_NUM_PIXELS;
+	    break;
+	  default:
+	    *((fftwf_complex *) v + HII_C_INDEX(n_x,n_y,n_z)) *= k_y*I/(float)HII_TOT_NUM_PIXELS;
+	  }
 	}
-
-	if (max < delta_T[HII_R_INDEX(i,j,k)]){ max = delta_T[HII_R_INDEX(i,j,k)];}
-	if (min > delta_T[HII_R_INDEX(i,j,k)]){ min = delta_T[HII_R_INDEX(i,j,k)];}
-	ave += delta_T[HII_R_INDEX(i,j,k)];
       }
     }
+}
+    plan = fftwf_plan_dft_c2r_3d(HII_DIM, HII_DIM, HII_DIM, (fftwf_complex *)v, (float *)v, FFTW_ESTIMATE);
+    fftwf_execute(plan);
+    fftwf_destroy_plan(plan);
+    fftwf_cleanup();
   }
-  ave /= (float)HII_TOT_NUM_PIXELS;
-  fprintf(stderr, "Without velocities, max is %e, min is %e, ave is %e\n", max, min, ave);
-  fprintf(LOG, "Without velocities, max is %e, min is %e, ave is %e\n", max, min, ave);
 
-  if (USE_TS_IN_21CM){
-    ave_Ts /= (double) HII_TOT_NUM_PIXELS;
-    fprintf(stderr, "Ts, min = %e, max = %e, ave = %e\n", min_Ts, max_Ts, ave_Ts);
-    fprintf(stderr, "corresponding to (1-trad/Ts of), min = %e, max = %e, ave = %e\n", 1-T_rad/min_Ts, 1-T_rad/max_Ts, 1-T_rad/ave_Ts);
-  }
-
-  x_val1 = 0.;
-  x_val2 = 1.;
-   
-  subcell_width = (BOX_LEN/(float)HII_DIM)/(float)N_RSD_STEPS;
-   
-  float max_cell_distance;
-   
-  max_cell_distance = 0.;
-  
+  // ok, lets fill the delta_T box; which will be the same size as the bubble box.
+  // a single sweep computes the brightness temperature, the spin temperature and
+  // velocity gradient corrections and all of the summary statistics
+  if (fill_delta_T(delta_T, xH, deltax, Ts, v, REDSHIFT, H, T_rad, const_factor, num_th, &stats) < 0){
+    fprintf(LOG, "delta_T.c: Error allocating memory for the box sums\nAborting...\n");
+    free(xH); free(deltax); free(delta_T); free(v); free(Ts);
+    fclose(LOG); fftwf_cleanup_threads(); return -1;
+  }
 
+  ave = stats.ave/(double)HII_TOT_NUM_PIXELS;
+  fprintf(stderr, "Without velocities, max is %e, min is %e, ave is %e\n", stats.max, stats.min, ave);
+  fprintf(LOG, "Without velocities, max is %e, min is %e, ave is %e\n", stats.max, stats.min, ave);
+
+  if (USE_TS_IN_21CM){
+    stats.ave_Ts /= (double) HII_TOT_NUM_PIXELS;
+    fprintf(stderr, "Ts, min = %e, max = %e, ave = %e\n", stats.min_Ts, stats.max_Ts, stats.ave_Ts);
+    fprintf(stderr, "corresponding to (1-trad/Ts of), min = %e, max = %e, ave = %e\n", 1-T_rad/stats.min_Ts, 1-T_rad/stats.max_Ts, 1-T_rad/stats.ave_Ts);
+  }
 
-    // check if we need to correct for velocities
   if (!T_USE_VELOCITIES){ //  we can stop here and print
     sprintf(filename, "../Boxes/delta_T_z%06.2f_nf%f_useTs%i_%i_%.0fMpc", REDSHIFT, nf, USE_TS_IN_21CM, HII_DIM, BOX_LEN);
     F = fopen(filename, "wb");
@@ -296,327 +430,40 @@ int main(int argc, char ** argv){
     fclose(F);
   }
   else{
-    max = -1;
-    min = 1e3;
-    ave = 0;
- 
-
-  // let's take the derivative in k-space
-  plan = fftwf_plan_dft_r2c_3d(HII_DIM, HII_DIM, HII_DIM, (float *)v, (fftwf_complex *)v, FFTW_ESTIMATE);
-  fftwf_execute(plan);
-  fftwf_destroy_plan(plan);
-  fftwf_cleanup();
-  for (n_x=0; n_x<HII_DIM; n_x++){
-    if (n_x>HII_MIDDLE)
-      k_x =(n_x-HII_DIM) * DELTA_K;  // wrap around for FFT convention
-    else
-      k_x = n_x * DELTA_K;
-
-    for (n_y=0; n_y<HII_DIM; n_y++){
-      if (n_y>HII_MIDDLE)
-	k_y =(n_y-HII_DIM) * DELTA_K;
-      else
-	k_y = n_y * DELTA_K;
-
-      for (n_z=0; n_z<=HII_MIDDLE; n_z++){ 
-	k_z = n_z * DELTA_K;
-
-	// take partial deriavative along the line of sight
-	switch(VELOCITY_COMPONENT){
-	case 1:
-	  *((fftwf_complex *) v + HII_C_INDEX(n_x,n_y,n_z)) *= k_x*I/(float)HII_TOT_NUM_PIXELS;
-	  break;
-	case 3:
-	  *((fftwf_complex *) v + HII_C_INDEX(n_x,n_y,n_z)) *= k_z*I/(float)HII_TOT_NUM_PIXELS;
-	  break;
-	default:
-	  *((fftwf_complex *) v + HII_C_INDEX(n_x,n_y,n_z)) *= k_y*I/(float)HII_TOT_NUM_PIXELS;
-	}
+    if(SUBCELL_RSD) {
+      // Note to convert the velocity v, to a displacement in redshift space, convert from s -> r + (1+z)*v/H(z)
+      // To convert the velocity within the array v to km/s, it is a*dD/dt*delta. Where the scale factor a comes from the continuity equation
+      // The array v as defined in 21cmFAST is (ik/k^2)*dD/dt*delta, as it is defined as a comoving quantity (scale factor is implicit).
+      // However, the conversion between real and redshift space also picks up a scale factor, therefore the scale factors drop out and therefore
+      // the displacement of the sub-cells is purely determined from the array, v and the Hubble factor: v/H.
+      // The re-gridding is done independently for each line-of-sight skewer (see rsd_helper_progs.c)
+      if (subcell_RSD_remap(delta_T, xH, v, H, num_th, &ave) < 0){
+	fprintf(LOG, "delta_T.c: Error allocating memory for the sub-cell RSD buffers\nAborting...\n");
+	free(xH); free(deltax); free(delta_T); free(v); free(Ts);
+	fclose(LOG); fftwf_cleanup_threads(); return -1;
       }
     }
-  }
-  plan = fftwf_plan_dft_c2r_3d(HII_DIM, HII_DIM, HII_DIM, (fftwf_complex *)v, (float *)v, FFTW_ESTIMATE);
-  fftwf_execute(plan);
-  fftwf_destroy_plan(plan);
-  fftwf_cleanup();
-
-  if(SUBCELL_RSD) {
-        
-        // now add the velocity correction to the delta_T maps
-   min_gradient_component = 1.0;
-   
-   for (i=0; i<HII_DIM; i++){
-       for (j=0; j<HII_DIM; j++){
-           for (k=0; k<HII_DIM; k++){
-               
-               gradient_component = fabs(v[HII_R_FFT_INDEX(i,j,k)]/H + 1.0);
-               
-               // Calculate the brightness temperature, using the optical depth
-               if(gradient_component < FRACT_FLOAT_ERR) {
-                   // Gradient component goes to zero, optical depth diverges. But, since we take exp(-tau), this goes to zero and (1 - exp(-tau)) goes to unity.
-                   // Again, factors of 1000. are conversions from K to mK
-                   delta_T[HII_R_INDEX(i,j,k)] = 1000.*(Ts[HII_R_INDEX(i,j,k)] - T_rad)/(1. + REDSHIFT);
-               }
-               else {
-   			  delta_T[HII_R_INDEX(i,j,k)] = (1. - exp(- delta_T[HII_R_INDEX(i,j,k)]/gradient_component ))*1000.*(Ts[HII_R_INDEX(i,j,k)] - T_rad)/(1. + REDSHIFT);
-               }
-           }
-       }
-   }
-  
-   // normalised units of cell length. 0 equals beginning of cell, 1 equals end of cell
-   // These are the sub-cell central positions (x_pos_offset), and the corresponding normalised value (x_pos) between 0 and 1
-   for(ii=0;ii<N_RSD_STEPS;ii++) {
-       x_pos_offset[ii] = subcell_width*(float)ii + subcell_width/2.;
-       x_pos[ii] = x_pos_offset[ii]/( BOX_LEN/(float)HII_DIM );
-   }
-   // Note to convert the velocity v, to a displacement in redshift space, convert from s -> r + (1+z)*v/H(z)
-   // To convert the velocity within the array v to km/s, it is a*dD/dt*delta. Where the scale factor a comes from the continuity equation
-   // The array v as defined in 21cmFAST is (ik/k^2)*dD/dt*delta, as it is defined as a comoving quantity (scale factor is implicit).
-   // However, the conversion between real and redshift space also picks up a scale factor, therefore the scale factors drop out and therefore
-   // the displacement of the sub-cells is purely determined from the array, v and the Hubble factor: v/H.
-     
-     for (i=0; i<HII_DIM; i++){
-         for (j=0; j<HII_DIM; j++){
-             
-             // Generate the optical-depth for the specific line-of-sight with R.S.D
-             for(k=0;k<HII_DIM;k++) {
-                 delta_T_RSD_LOS[k] = 0.0;
-             }
-             
-             for (k=0; k<HII_DIM; k++){
-                 
-                 if((fabs(delta_T[HII_R_INDEX(i,j,k)]) >= FRACT_FLOAT_ERR) && (xH[HII_R_INDEX(i,j,k)] >= FRACT_FLOAT_ERR)) {
-
-                     if(k==0) {
-                         d1_low = v[HII_R_FFT_INDEX(i,j,HII_DIM-1)]/H;
-                         d2_low = v[HII_R_FFT_INDEX(i,j,k)]/H;
-                     }
-                     else {
-                         d1_low = v[HII_R_FFT_INDEX(i,j,k-1)]/H;
-                         d2_low = v[HII_R_FFT_INDEX(i,j,k)]/H;
-                     }
-                     // Displacements (converted from velocity) for the original cell centres straddling half of the sub-cells (cell after)
-                     if(k==(HII_DIM-1)) {
-                         d1_high = v[HII_R_FFT_INDEX(i,j,k)]/H;
-                         d2_high = v[HII_R_FFT_INDEX(i,j,0)]/H;
-                     }
-                     else {
-                         d1_high = v[HII_R_FFT_INDEX(i,j,k)]/H;
-                         d2_high = v[HII_R_FFT_INDEX(i,j,k+1)]/H;
-                     }
-                    
-                     for(ii=0;ii<N_RSD_STEPS;ii++) {
-                         
-                         // linearly interpolate the displacements to determine the corresponding displacements of the sub-cells
-                         // Checking of 0.5 is for determining if we are left or right of the mid-point of the original cell (for the linear interpolation of the displacement)
-                         // to use the appropriate cell
-                         
-                         if(x_pos[ii] <= 0.5) {
-                             subcell_displacement = d1_low + ( (x_pos[ii] + 0.5 ) - x_val1)*( d2_low - d1_low )/( x_val2 - x_val1 );
-                         }
-                         else {
-                             subcell_displacement = d1_high + ( (x_pos[ii] - 0.5 ) - x_val1)*( d2_high - d1_high )/( x_val2 - x_val1 );
-                         }
-                         
-                         // The new centre of the sub-cell post R.S.D displacement. Normalised to units of cell width for determining it's displacement
-                         RSD_pos_new = (x_pos_offset[ii] + subcell_displacement)/( BOX_LEN/(float)HII_DIM );
-                         // The sub-cell boundaries of the sub-cell, for determining the fractional contribution of the sub-cell to neighbouring cells when
-                         // the sub-cell straddles two cell positions
-                         RSD_pos_new_boundary_low = RSD_pos_new - (subcell_width/2.)/( BOX_LEN/(float)HII_DIM );
-                         RSD_pos_new_boundary_high = RSD_pos_new + (subcell_width/2.)/( BOX_LEN/(float)HII_DIM );
-                         
-                         if(RSD_pos_new_boundary_low >= 0.0 && RSD_pos_new_boundary_high < 1.0) {
-                             // sub-cell has remained in the original cell (just add it back to the original cell)
-                             
-                             delta_T_RSD_LOS[k] += delta_T[HII_R_INDEX(i,j,k)]/(float)N_RSD_STEPS;
-                         }
-                         else if(RSD_pos_new_boundary_low < 0.0 && RSD_pos_new_boundary_high < 0.0) {
-                             // sub-cell has moved completely into a new cell (toward the observer)
-                             
-                             // determine how far the sub-cell has moved in units of original cell boundary
-                             cell_distance = ceil(fabs(RSD_pos_new_boundary_low))-1.;
-                             
-                             // Determine the location of the sub-cell relative to the original cell binning
-                             if(fabs(RSD_pos_new_boundary_high) > cell_distance) {
-                                 // sub-cell is entirely contained within the new cell (just add it to the new cell)
-                                // check if the new cell position is at the edge of the box. If so, periodic boundary conditions
-                                 if(k<((int)cell_distance+1)) {
-                                     delta_T_RSD_LOS[k-((int)cell_distance+1) + HII_DIM] += delta_T[HII_R_INDEX(i,j,k)]/(float)N_RSD_STEPS;
-                                 }
-                                 else {
-                                     delta_T_RSD_LOS[k-((int)cell_distance+1)] += delta_T[HII_R_INDEX(i,j,k)]/(float)N_RSD_STEPS;
-                                 }
-                             }
-                             else {
-                                 // sub-cell is partially contained within the cell
-                                 
-                                 // Determine the fraction of the sub-cell which is in either of the two original cells
-                                 fraction_outside = (fabs(RSD_pos_new_boundary_low) - cell_distance)/(subcell_width/( BOX_LEN/(float)HII_DIM ));
-                                 fraction_within = 1. - fraction_outside;
-                                 
-                                 // Check if the first part of the sub-cell is at the box edge
-                                 if(k<(((int)cell_distance))) {
-                                     delta_T_RSD_LOS[k-((int)cell_distance) + HII_DIM] += fraction_within*delta_T[HII_R_INDEX(i,j,k)]/(float)N_RSD_STEPS;
-                                 }
-                                 else {
-                                     delta_T_RSD_LOS[k-((int)cell_distance)] += fraction_within*delta_T[HII_R_INDEX(i,j,k)]/(float)N_RSD_STEPS;
-                                 }
-                                 // Check if the second part of the sub-cell is at the box edge
-                                 if(k<(((int)cell_distance + 1))) {
-                                     delta_T_RSD_LOS[k-((int)cell_distance+1) + HII_DIM] += fraction_outside*delta_T[HII_R_INDEX(i,j,k)]/(float)N_RSD_STEPS;
-                                 }
-                                 else {
-                                     delta_T_RSD_LOS[k-((int)cell_distance+1)] += fraction_outside*delta_T[HII_R_INDEX(i,j,k)]/(float)N_RSD_STEPS;
-                                 }
-                             }
-                         }
-                        else if(RSD_pos_new_boundary_low < 0.0 && (RSD_pos_new_boundary_high > 0.0 && RSD_pos_new_boundary_high < 1.0)) {
-                             // sub-cell has moved partially into a new cell (toward the observer)
-                             
-                             // Determine the fraction of the sub-cell which is in either of the two original cells
-                             fraction_within = RSD_pos_new_boundary_high/(subcell_width/( BOX_LEN/(float)HII_DIM ));
-                             fraction_outside = 1. - fraction_within;
-                             
-                             // Check the periodic boundaries conditions and move the fraction of each sub-cell to the appropriate new cell
-                             if(k==0) {
-                                 delta_T_RSD_LOS[HII_DIM-1] += fraction_outside*delta_T[HII_R_INDEX(i,j,k)]/(float)N_RSD_STEPS;
-                                 delta_T_RSD_LOS[k] += fraction_within*delta_T[HII_R_INDEX(i,j,k)]/(float)N_RSD_STEPS;
-                             }
-                             else {
-                                 delta_T_RSD_LOS[k-1] += fraction_outside*delta_T[HII_R_INDEX(i,j,k)]/(float)N_RSD_STEPS;
-                                 delta_T_RSD_LOS[k] += fraction_within*delta_T[HII_R_INDEX(i,j,k)]/(float)N_RSD_STEPS;
-                             }
-                         }
-                         else if((RSD_pos_new_boundary_low >= 0.0 && RSD_pos_new_boundary_low < 1.0) && (RSD_pos_new_boundary_high >= 1.0)) {
-                             // sub-cell has moved partially into a new cell (away from the observer)
-                             
-                             // Determine the fraction of the sub-cell which is in either of the two original cells
-                             fraction_outside = (RSD_pos_new_boundary_high - 1.)/(subcell_width/( BOX_LEN/(float)HII_DIM ));
-                             fraction_within = 1. - fraction_outside;
-                             
-                             // Check the periodic boundaries conditions and move the fraction of each sub-cell to the appropriate new cell
-                             if(k==(HII_DIM-1)) {
-                                 delta_T_RSD_LOS[k] += fraction_within*delta_T[HII_R_INDEX(i,j,k)]/(float)N_RSD_STEPS;
-                                 delta_T_RSD_LOS[0] += fraction_outside*delta_T[HII_R_INDEX(i,j,k)]/(float)N_RSD_STEPS;
-                             }
-                             else {
-                                 delta_T_RSD_LOS[k] += fraction_within*delta_T[HII_R_INDEX(i,j,k)]/(float)N_RSD_STEPS;
-                                 delta_T_RSD_LOS[k+1] += fraction_outside*delta_T[HII_R_INDEX(i,j,k)]/(float)N_RSD_STEPS;
-                             }
-                         }
-                        else {
-                             // sub-cell has moved completely into a new cell (away from the observer)
-                             
-                             // determine how far the sub-cell has moved in units of original cell boundary
-                             cell_distance = floor(fabs(RSD_pos_new_boundary_high));
-                             
-                             if(RSD_pos_new_boundary_low >= cell_distance) {
-                                 // sub-cell is entirely contained within the new cell (just add it to the new cell)
-                                 
-                                 // check if the new cell position is at the edge of the box. If so, periodic boundary conditions
-                                 if(k>(HII_DIM - 1 - (int)cell_distance)) {
-                                     delta_T_RSD_LOS[k+(int)cell_distance - HII_DIM] += delta_T[HII_R_INDEX(i,j,k)]/(float)N_RSD_STEPS;
-                                 }
-                                 else {
-                                     delta_T_RSD_LOS[k+(int)cell_distance] += delta_T[HII_R_INDEX(i,j,k)]/(float)N_RSD_STEPS;
-                                 }
-                             }
-                             else {
-                                 // sub-cell is partially contained within the cell
-                                 
-                                 // Determine the fraction of the sub-cell which is in either of the two original cells
-                                 fraction_outside = (RSD_pos_new_boundary_high - cell_distance)/(subcell_width/( BOX_LEN/(float)HII_DIM ));
-                                 fraction_within = 1. - fraction_outside;
-                                 
-                                 // Check if the first part of the sub-cell is at the box edge
-                                 if(k>(HII_DIM - 1 - ((int)cell_distance-1))) {
-                                     delta_T_RSD_LOS[k+(int)cell_distance-1 - HII_DIM] += fraction_within*delta_T[HII_R_INDEX(i,j,k)]/(float)N_RSD_STEPS;
-                                 }
-                                 else {
-                                     delta_T_RSD_LOS[k+(int)cell_distance-1] += fraction_within*delta_T[HII_R_INDEX(i,j,k)]/(float)N_RSD_STEPS;
-                                 }
-                                 // Check if the second part of the sub-cell is at the box edge
-                                 if(k>(HII_DIM - 1 - ((int)cell_distance))) {
-                                     delta_T_RSD_LOS[k+(int)cell_distance - HII_DIM] += fraction_outside*delta_T[HII_R_INDEX(i,j,k)]/(float)N_RSD_STEPS;
-                                 }
-                                 else {
-                                     delta_T_RSD_LOS[k+(int)cell_distance] += fraction_outside*delta_T[HII_R_INDEX(i,j,k)]/(float)N_RSD_STEPS;
-                                 }
-                            }
-                         }
-                     }
-                 }
-             }
-             
-             for(k=0;k<HII_DIM;k++) {
-                 delta_T[HII_R_INDEX(i,j,k)] = delta_T_RSD_LOS[k];
-                 
-                 ave += delta_T_RSD_LOS[k];
-             }
-         }
-     }
-    }
     else {
-          
-      // now add the velocity correction to the delta_T maps
-      max_v_deriv = fabs(MAX_DVDR*H);
-      for (i=0; i<HII_DIM; i++){
-          for (j=0; j<HII_DIM; j++){
-              for (k=0; k<HII_DIM; k++){
-
-                  dvdx = v[HII_R_FFT_INDEX(i,j,k)];
-
-                  // set maximum allowed gradient for this linear approximation
-                  if (fabs(dvdx) > max_v_deriv){
-                      if (dvdx < 0) dvdx = -max_v_deriv;
-                      else dvdx = max_v_deriv;
-                      nonlin_ct++;
-                  }
-
-                  delta_T[HII_R_INDEX(i,j,k)] /= (dvdx/H + 1.0);
-
-                  if (max < delta_T[HII_R_INDEX(i,j,k)]){
-                      maxi = i;
-                      maxj = j;
-                      maxk = k;
-                      maxdvdx = dvdx;
-                      max = delta_T[HII_R_INDEX(i,j,k)];
-                  }
-                  if (min > delta_T[HII_R_INDEX(i,j,k)]){
-                      mini = i;
-                      minj = j;
-                      mink = k;
-                      mindvdx = dvdx;
-                      min = delta_T[HII_R_INDEX(i,j,k)];
-                  }
-
-                  ave += delta_T[HII_R_INDEX(i,j,k)];
-              }
-          }
-      }
+      ave = stats.ave_v;
     }
-      
-     ave /= (HII_TOT_NUM_PIXELS+0.0);
-      
-      if(!SUBCELL_RSD) {
-          fprintf(LOG, "With velocities:\nMax is %e\t dvdx is %e, ave is %e\n", max, maxdvdx, ave);
-          fprintf(stderr, "With velocities:\nMax is %e\t dvdx is %e, ave is %e\n", max, maxdvdx, ave);
-          fprintf(LOG, "%llu out of %llu voxels (fraction=%e) exceeded max allowed velocity gradient\n", nonlin_ct, HII_TOT_NUM_PIXELS, nonlin_ct/(double)HII_TOT_NUM_PIXELS);
-          fprintf(stderr, "%llu out of %llu voxels (fraction=%e) exceeded max allowed velocity gradient\n", nonlin_ct, HII_TOT_NUM_PIXELS, nonlin_ct/(double)HII_TOT_NUM_PIXELS);
-      }
-      
+    ave /= (HII_TOT_NUM_PIXELS+0.0);
 
-  
-  // now write out the delta_T box with velocity correction
-  sprintf(filename, "../Boxes/delta_T_v%i_z%06.2f_nf%f_useTs%i_%i_%.0fMpc", VELOCITY_COMPONENT, REDSHIFT, nf, USE_TS_IN_21CM, HII_DIM, BOX_LEN);
-  F = fopen(filename, "wb");
-  fprintf(stderr, "Writting output delta_T box: %s\n", filename);
-  if (mod_fwrite(delta_T, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
-    fprintf(stderr, "delta_T: Write error occured while writting delta_T box.\n");
+    if(!SUBCELL_RSD) {
+      fprintf(LOG, "With velocities:\nMax is %e\t dvdx is %e, ave is %e\n", stats.max_v, stats.max_dvdx, ave);
+      fprintf(stderr, "With velocities:\nMax is %e\t dvdx is %e, ave is %e\n", stats.max_v, stats.max_dvdx, ave);
+      fprintf(LOG, "%llu out of %llu voxels (fraction=%e) exceeded max allowed velocity gradient\n", stats.nonlin_ct, HII_TOT_NUM_PIXELS, stats.nonlin_ct/(double)HII_TOT_NUM_PIXELS);
+      fprintf(stderr, "%llu out of %llu voxels (fraction=%e) exceeded max allowed velocity gradient\n", stats.nonlin_ct, HII_TOT_NUM_PIXELS, stats.nonlin_ct/(double)HII_TOT_NUM_PIXELS);
+    }
+
+    // now write out the delta_T box with velocity correction
+    sprintf(filename, "../Boxes/delta_T_v%i_z%06.2f_nf%f_useTs%i_%i_%.0fMpc", VELOCITY_COMPONENT, REDSHIFT, nf, USE_TS_IN_21CM, HII_DIM, BOX_LEN);
+    F = fopen(filename, "wb");
+    fprintf(stderr, "Writting output delta_T box: %s\n", filename);
+    if (mod_fwrite(delta_T, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
+      fprintf(stderr, "delta_T: Write error occured while writting delta_T box.\n");
+    }
+    fclose(F);
   }
-  fclose(F);
-}
 
 // deallocate what we aren't using anymore 
  free(xH); free(deltax); free(v); if (USE_TS_IN_21CM){ free(Ts);}
@@ -626,43 +473,35 @@ int main(int argc, char ** argv){
 
   /******  PRINT OUT THE POWERSPECTRUM  *********/
 
- k_factor = 1.5;
-  k_first_bin_ceil = DELTA_K;
-  k_max = DELTA_K*HII_DIM;
-  // initialize arrays
-  // ghetto counting (lookup how to do logs of arbitrary bases in c...)
-  NUM_BINS = 0;
-  k_floor = 0;
-  k_ceil = k_first_bin_ceil;
-  while (k_ceil < k_max){
-    NUM_BINS++;
-    k_floor=k_ceil;
-    k_ceil*=k_factor;
-  }
-
-  p_box =  (double *)malloc(sizeof(double)*NUM_BINS);
-  k_ave =  (double *)malloc(sizeof(double)*NUM_BINS);
-  in_bin_ct = (unsigned long long *)malloc(sizeof(unsigned long long)*NUM_BINS);
-  if (!p_box || !in_bin_ct || !k_ave){ // a bit sloppy, but whatever..
+  // initialize the estimator (see power_spec_helper_progs.c)
+  if ( (set_log_ps_bins(&k_bins, DELTA_K, 1.5, DELTA_K*HII_DIM) < 0) ||
+       (init_ps_estimator(&ps, k_bins, 3, 1.0/(2.0*PI*PI*VOLUME)) < 0) ||
+       (PRINT_CYLINDRICAL_T_POWER_SPEC &&
+	( (set_log_ps_bins(&k_perp_bins, DELTA_K, 1.5, DELTA_K*HII_DIM) < 0) ||
+	  (set_log_ps_bins(&k_par_bins, DELTA_K, 1.5, DELTA_K*HII_DIM) < 0) ||
+	  (add_cylindrical_ps_bins(&ps, k_perp_bins, k_par_bins) < 0) )) ||
+       (PRINT_MULTIPOLE_T_POWER_SPEC && (add_ps_multipoles(&ps) < 0)) ){
     fprintf(stderr, "delta_T.c: Error allocating memory.\nAborting...\n");
     fprintf(LOG, "delta_T.c: Error allocating memory.\nAborting...\n");
     free(delta_T); fclose(LOG);
     fftwf_cleanup_threads(); return -1;
   }
-  for (ct=0; ct<NUM_BINS; ct++){
-    p_box[ct] = k_ave[ct] = 0;
-    in_bin_ct[ct] = 0;
-  }
+  // note the 1/VOLUME factor, which turns this into a power density in k-space
+  // the line of sight of the cylindrical and multipole spectra is the velocity component used above
+  ps.los_axis = (VELOCITY_COMPONENT == 1) ? 0 : ((VELOCITY_COMPONENT == 3) ? 2 : 1);
 
   deldel_T = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*HII_KSPACE_NUM_PIXELS);
   if (!deldel_T){
     fprintf(stderr, "Unable to allocate memory for the deldel_T box!\n");
     fprintf(LOG, "Unable to allocate memory for the deldel_T box!\n");
-    free(delta_T); fclose(LOG); free(p_box); free(k_ave); free(in_bin_ct);
+    free(delta_T); fclose(LOG); free_ps_estimator(&ps);
     fftwf_cleanup_threads(); return -1;
   }
 
   // fill-up the real-space of the deldel box
+#pragma omp parallel shared(deldel_T, delta_T, ave) private(i, j, k)
+{
+#pragma omp for
   for (i=0; i<HII_DIM; i++){
     for (j=0; j<HII_DIM; j++){
       for (k=0; k<HII_DIM; k++){
@@ -674,6 +513,7 @@ int main(int argc, char ** argv){
       }
     }
   }
+}
 
   // transform to k-space
   plan = fftwf_plan_dft_r2c_3d(HII_DIM, HII_DIM, HII_DIM, (float *)deldel_T, (fftwf_complex *)deldel_T, FFTW_ESTIMATE);
@@ -682,45 +522,11 @@ int main(int argc, char ** argv){
   fftwf_cleanup();
 
   // now construct the power spectrum file
-  for (n_x=0; n_x<HII_DIM; n_x++){
-    if (n_x>HII_MIDDLE)
-      k_x =(n_x-HII_DIM) * DELTA_K;  // wrap around for FFT convention
-    else
-      k_x = n_x * DELTA_K;
-
-    for (n_y=0; n_y<HII_DIM; n_y++){
-      if (n_y>HII_MIDDLE)
-	k_y =(n_y-HII_DIM) * DELTA_K;
-      else
-	k_y = n_y * DELTA_K;
-
-      for (n_z=0; n_z<=HII_MIDDLE; n_z++){ 
-	k_z = n_z * DELTA_K;
-	
-	k_mag = sqrt(k_x*k_x + k_y*k_y + k_z*k_z);
-
-	// now go through the k bins and update
-	ct = 0;
-	k_floor = 0;
-	k_ceil = k_first_bin_ceil;
-	while (k_ceil < k_max){
-	  // check if we fal in this bin
-	  if ((k_mag>=k_floor) && (k_mag < k_ceil)){
-	    in_bin_ct[ct]++;
-	    p_box[ct] += pow(k_mag,3)*pow(cabs(deldel_T[HII_C_INDEX(n_x, n_y, n_z)]), 2)/(2.0*PI*PI*VOLUME);
-	    // note the 1/VOLUME factor, which turns this into a power density in k-space
-
-	    k_ave[ct] += k_mag;
-	    break;
-	  }
-
-	  ct++;
-	  k_floor=k_ceil;
-	  k_ceil*=k_factor;
-	}
-      }
-    }
-  } // end looping through k box
+  if (accumulate_power_spec(&ps, deldel_T, NULL, HII_DIM, 3, BOX_LEN) < 0){
+    fprintf(LOG, "delta_T.c: Error allocating memory for the power spectrum.\nAborting...\n");
+    free(delta_T); fclose(LOG); free_ps_estimator(&ps); fftwf_free(deldel_T);
+    fftwf_cleanup_threads(); return -1;
+  }
 
 
   if (DIMENSIONAL_T_POWER_SPEC)
@@ -741,13 +547,69 @@ int main(int argc, char ** argv){
   if (!F){
     fprintf(stderr, "delta_T.c: Couldn't open file %s for writting!\n", filename);
     fprintf(LOG, "delta_T.c: Couldn't open file %s for writting!\n", filename);
-    free(delta_T); fclose(LOG); free(p_box); free(k_ave); free(in_bin_ct); fftwf_free(deldel_T);
+    free(delta_T); fclose(LOG); free_ps_estimator(&ps); fftwf_free(deldel_T);
+    fftwf_cleanup_threads(); return -1;
   }
-  for (ct=1; ct<NUM_BINS; ct++){
-    if (in_bin_ct[ct]>0)
-      fprintf(F, "%e\t%e\t%e\n", k_ave[ct]/(in_bin_ct[ct]+0.0), p_box[ct]/(in_bin_ct[ct]+0.0), p_box[ct]/(in_bin_ct[ct]+0.0)/sqrt(in_bin_ct[ct]+0.0));
+  for (ct=1; ct<ps.k_bins.NUM_BINS; ct++){
+    if (ps.in_bin_ct[ct]>0)
+      fprintf(F, "%e\t%e\t%e\n", ps.k_ave[ct]/(ps.in_bin_ct[ct]+0.0), ps.p_box[ct]/(ps.in_bin_ct[ct]+0.0), ps.p_box[ct]/(ps.in_bin_ct[ct]+0.0)/sqrt(ps.in_bin_ct[ct]+0.0));
   }
-  fclose(F); free(p_box); free(k_ave); free(in_bin_ct); fftwf_free(deldel_T);
+  fclose(F);
+
+  // the 2D (k_perp, k_par) power spectrum
+  // columns: k_perp bin edges, k_par bin edges, power, number of modes
+  if (PRINT_CYLINDRICAL_T_POWER_SPEC){
+    sprintf(filename, "mkdir %s/Cylindrical", psoutputdir);
+    system(filename);
+    if (T_USE_VELOCITIES){
+      sprintf(filename, "%s/Cylindrical/ps_cyl_z%06.2f_nf%f_useTs%i_aveTb%06.2f_%i_%.0fMpc_v%i", psoutputdir, REDSHIFT, nf, USE_TS_IN_21CM, ave, HII_DIM, BOX_LEN, VELOCITY_COMPONENT);
+    }
+    else{
+      sprintf(filename, "%s/Cylindrical/ps_cyl_z%06.2f_nf%f_useTs%i_aveTb%06.2f_%i_%.0fMpc", psoutputdir, REDSHIFT, nf, USE_TS_IN_21CM, ave, HII_DIM, BOX_LEN);
+    }
+    if (!(F = fopen(filename, "w"))){
+      fprintf(stderr, "delta_T.c: Couldn't open file %s for writting!\n", filename);
+      fprintf(LOG, "delta_T.c: Couldn't open file %s for writting!\n", filename);
+    }
+    else{
+      for (perp_ct=0; perp_ct<ps.k_perp_bins.NUM_BINS; perp_ct++){
+	for (par_ct=0; par_ct<ps.k_par_bins.NUM_BINS; par_ct++){
+	  ct = perp_ct*ps.k_par_bins.NUM_BINS + par_ct;
+	  if (ps.in_cyl_ct[ct]>0)
+	    fprintf(F, "%e\t%e\t%e\t%e\t%e\t%llu\n", ps.k_perp_bins.k_edges[perp_ct], ps.k_perp_bins.k_edges[perp_ct+1],
+		    ps.k_par_bins.k_edges[par_ct], ps.k_par_bins.k_edges[par_ct+1], ps.p_cyl[ct]/(ps.in_cyl_ct[ct]+0.0), ps.in_cyl_ct[ct]);
+	}
+      }
+      fclose(F);
+    }
+  }
+
+  // the Legendre multipoles of the power spectrum
+  // columns: k, P0, P2, P4, number of modes
+  if (PRINT_MULTIPOLE_T_POWER_SPEC){
+    sprintf(filename, "mkdir %s/Multipoles", psoutputdir);
+    system(filename);
+    if (T_USE_VELOCITIES){
+      sprintf(filename, "%s/Multipoles/ps_ell_z%06.2f_nf%f_useTs%i_aveTb%06.2f_%i_%.0fMpc_v%i", psoutputdir, REDSHIFT, nf, USE_TS_IN_21CM, ave, HII_DIM, BOX_LEN, VELOCITY_COMPONENT);
+    }
+    else{
+      sprintf(filename, "%s/Multipoles/ps_ell_z%06.2f_nf%f_useTs%i_aveTb%06.2f_%i_%.0fMpc", psoutputdir, REDSHIFT, nf, USE_TS_IN_21CM, ave, HII_DIM, BOX_LEN);
+    }
+    if (!(F = fopen(filename, "w"))){
+      fprintf(stderr, "delta_T.c: Couldn't open file %s for writting!\n", filename);
+      fprintf(LOG, "delta_T.c: Couldn't open file %s for writting!\n", filename);
+    }
+    else{
+      for (ct=1; ct<ps.k_bins.NUM_BINS; ct++){
+	if (ps.in_bin_ct[ct]>0)
+	  fprintf(F, "%e\t%e\t%e\t%e\t%llu\n", ps.k_ave[ct]/(ps.in_bin_ct[ct]+0.0), ps.p_ell[ct]/(ps.in_bin_ct[ct]+0.0),
+		  ps.p_ell[ct+ps.k_bins.NUM_BINS]/(ps.in_bin_ct[ct]+0.0), ps.p_ell[ct+2*ps.k_bins.NUM_BINS]/(ps.in_bin_ct[ct]+0.0), ps.in_bin_ct[ct]);
+      }
+      fclose(F);
+    }
+  }
+
+  free_ps_estimator(&ps); fftwf_free(deldel_T);
 
   /****** END POWER SPECTRUM STUFF   ************/
 
@@ -1,89 +1,84 @@
 #include "../Parameter_files/INIT_PARAMS.H"
 #include "../Parameter_files/ANAL_PARAMS.H"
+#include "power_spec_helper_progs.c"
 
 /*
   USAGE: delta_ps <deltax filename> <output filename>
+     or: delta_ps -b <filename containing list of boxes> <output filename> [memory budget in GB]
 
   box is assumed to be of the HII dimension defined in ANAL_PARAM.H
+
+  In batch mode (-b), every line of the list file contains a box filename, optionally followed by
+  a chunk index N, in which case the N-th HII_DIM^3 box stored in that file is used (e.g. for stacked
+  lightcone boxes).  All boxes share one FFT plan and one set of buffers; as many boxes as fit in the
+  memory budget (default BATCH_MEM_BUDGET) are read-in and transformed concurrently, and the power
+  spectra of all of the boxes are written to a single table with the columns:
+  box number, k, power, error
+  The box numbers refer to the commented header lines at the top of the table.
 */
 
 #define FORMAT (int) 0 /* 0= unpadded binary box; 1= FFT padded binary box (outdated) */
-#define CONVERT_TO_DELTA (int) 0 /* 1= convert the field to a zero-mean delta; 
+#define CONVERT_TO_DELTA (int) 0 /* 1= convert the field to a zero-mean delta;
 		     be careful not to do this with fields which are already zero mean */
+#define BATCH_MEM_BUDGET (float) 4 /* default memory budget (in GB) for the box buffers in batch mode */
 
-int main(int argc, char ** argv){
-  char filename[100];
-  FILE *F;
-  float REDSHIFT;
-  int x,y,z, format;
-  fftwf_complex *deltax;
-  fftwf_plan plan;
-  float k_x, k_y, k_z, k_mag, k_floor, k_ceil, k_max, k_first_bin_ceil, k_factor;
-  int i,j,k, n_x, n_y, n_z, NUM_BINS;
-  double dvdx, ave, new_ave, *p_box, *k_ave;
-  unsigned long long ct, *in_bin_ct;
 
-  // check arguments
-  if (argc != 3){
-    fprintf(stderr, "USAGE: delta_ps <deltax filename> <output filename>\nAborting\n");
-    return -1;
-  }
-  // initialize and allocate thread info
-  if (fftwf_init_threads()==0){
-    fprintf(stderr, "init: ERROR: problem initializing fftwf threads\nAborting\n.");
-    return -1;
-  }
-  fftwf_plan_with_nthreads(NUMCORES); // use all processors for init
+/*
+  Reads the chunk_ct-th box from an open file into the (FFT padded) array deltax, optionally converts
+  it to a zero-mean delta, and transforms it to k-space using plan (executed on deltax).
+  Returns 0 on success, -1 on a read error.
+*/
+int box_to_k_space(FILE *F, unsigned long long chunk_ct, fftwf_complex *deltax, fftwf_plan plan, int verbose){
+  unsigned long long ct, skewer;
+  double ave, new_ave;
+  int i,j,k;
 
-  ave=0;
-  //allocate and read-in the density array
-  deltax = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*HII_KSPACE_NUM_PIXELS);
-  if (!deltax){
-    fprintf(stderr, "delta_T: Error allocating memory for deltax box\nAborting...\n");
-    fftwf_cleanup_threads(); return -1;
-  }
-  F = fopen(argv[1], "rb");
   switch (FORMAT){
     // FFT format
   case 1:
-    fprintf(stderr, "Reading in FFT padded deltax box\n");
-    if (mod_fread(deltax, sizeof(fftwf_complex)*HII_KSPACE_NUM_PIXELS, 1, F)!=1){
-      fftwf_free(deltax);
-      fprintf(stderr, "deltax_ps.c: unable to read-in file\nAborting\n");
-      fftwf_cleanup_threads(); return -1;
+    if (verbose) fprintf(stderr, "Reading in FFT padded deltax box\n");
+    if ( fseeko(F, (off_t)(chunk_ct*sizeof(fftwf_complex)*HII_KSPACE_NUM_PIXELS), SEEK_SET) ||
+	 (mod_fread(deltax, sizeof(fftwf_complex)*HII_KSPACE_NUM_PIXELS, 1, F)!=1) ){
+      fprintf(stderr, "deltax_ps.c: unable to read-in file\n");
+      return -1;
     }
     break;
 
     // unpaded format
   case 0:
-    fprintf(stderr, "Reading in unpadded box\n");
-    for (i=0; i<HII_DIM; i++){
-      for (j=0; j<HII_DIM; j++){
-	for (k=0; k<HII_DIM; k++){
-	  if (fread((float *)deltax + HII_R_FFT_INDEX(i,j,k), sizeof(float), 1, F)!=1){
-	    fprintf(stderr, "init.c: Read error occured!\n");
-	    fftwf_free(deltax);
-	    fftwf_cleanup_threads(); return -1;	    
-	  }
-      	  ave += *((float *)deltax + HII_R_FFT_INDEX(i,j,k));
-	}
+    if (verbose) fprintf(stderr, "Reading in unpadded box\n");
+    if (fseeko(F, (off_t)(chunk_ct*sizeof(float)*HII_TOT_NUM_PIXELS), SEEK_SET)){
+      fprintf(stderr, "delta_ps.c: Read error occured!\n");
+      return -1;
+    }
+    // read-in one line of sight at a time, straight into the padded array
+    for (skewer=0; skewer<HII_D*HII_D; skewer++){
+      if (fread((float *)deltax + skewer*2llu*(HII_MID+1llu), sizeof(float), HII_DIM, F)!=HII_DIM){
+	fprintf(stderr, "delta_ps.c: Read error occured!\n");
+	return -1;
       }
     }
-    ave /= (double)HII_TOT_NUM_PIXELS;
-    fprintf(stderr, "Average is %e\n", ave);
     break;
 
   default:
     fprintf(stderr, "Wrong format code\naborting...\n");
-    fftwf_free(deltax);
-    fftwf_cleanup_threads(); return -1;	    
+    return -1;
   }
-  fclose(F);
 
+  ave = 0;
+  for (i=0; i<HII_DIM; i++){
+    for (j=0; j<HII_DIM; j++){
+      for (k=0; k<HII_DIM; k++){
+	ave += *((float *)deltax + HII_R_FFT_INDEX(i,j,k));
+      }
+    }
+  }
+  ave /= (double)HII_TOT_NUM_PIXELS;
+  if (verbose) fprintf(stderr, "Average is %e\n", ave);
 
   if (CONVERT_TO_DELTA){
     new_ave = 0;
-    fprintf(stderr, "Now converting field to zero-mean delta\n");
+    if (verbose) fprintf(stderr, "Now converting field to zero-mean delta\n");
     for (i=0; i<HII_DIM; i++){
       for (j=0; j<HII_DIM; j++){
 	for (k=0; k<HII_DIM; k++){
@@ -94,106 +89,257 @@ int main(int argc, char ** argv){
       }
     }
     new_ave /= (double) HII_TOT_NUM_PIXELS;
-    fprintf(stderr, "The mean value of the field is now %e\n", new_ave);
+    if (verbose) fprintf(stderr, "The mean value of the field is now %e\n", new_ave);
   }
 
+  // do the FFTs
+  fftwf_execute_dft_r2c(plan, (float *)deltax, deltax);
+  for (ct=0; ct<HII_KSPACE_NUM_PIXELS; ct++){
+     deltax[ct] *= VOLUME/(HII_TOT_NUM_PIXELS+0.0);
+  }
 
+  return 0;
+}
 
-  // do the FFTs
-  plan = fftwf_plan_dft_r2c_3d(HII_DIM, HII_DIM, HII_DIM, (float *)deltax, (fftwf_complex *)deltax, FFTW_ESTIMATE);
-  fftwf_execute(plan);
+
+/*
+  Batch mode: power spectra of all of the boxes listed in the file list_filename,
+  written to a single table.
+*/
+int batch_delta_ps(char *list_filename, char *output_filename, float mem_budget){
+  char line[1000], box_filename[1000], **box_filenames;
+  FILE *F, *LIST, *BOX;
+  fftwf_complex **boxes;
+  fftwf_plan plan;
+  int NUM_BOXES, NUM_BUFFERS, box_ct, buffer_ct, num_read, error;
+  unsigned long long *chunks, ct;
+  ps_bins k_bins;
+  ps_estimator ps;
+
+  // read-in the list of boxes
+  if (!(LIST = fopen(list_filename, "r"))){
+    fprintf(stderr, "delta_ps.c: Unable to open box list %s\nAborting...\n", list_filename);
+    return -1;
+  }
+  NUM_BOXES = 0;
+  while (fgets(line, 1000, LIST)){
+    if (sscanf(line, "%999s", box_filename) == 1)
+      NUM_BOXES++;
+  }
+  if (NUM_BOXES == 0){
+    fprintf(stderr, "delta_ps.c: No boxes listed in %s\nAborting...\n", list_filename);
+    fclose(LIST); return -1;
+  }
+  box_filenames = (char **) malloc(sizeof(char *)*NUM_BOXES);
+  chunks = (unsigned long long *) malloc(sizeof(unsigned long long)*NUM_BOXES);
+  if (!box_filenames || !chunks){
+    fprintf(stderr, "delta_ps.c: Error allocating memory.\nAborting...\n");
+    free(box_filenames); free(chunks); fclose(LIST); return -1;
+  }
+  rewind(LIST);
+  box_ct = 0;
+  while ((box_ct < NUM_BOXES) && fgets(line, 1000, LIST)){
+    box_filenames[box_ct] = (char *) malloc(sizeof(char)*1000);
+    if (!box_filenames[box_ct]){
+      fprintf(stderr, "delta_ps.c: Error allocating memory.\nAborting...\n");
+      for (buffer_ct=0; buffer_ct<box_ct; buffer_ct++) free(box_filenames[buffer_ct]);
+      free(box_filenames); free(chunks); fclose(LIST); return -1;
+    }
+    num_read = sscanf(line, "%999s %llu", box_filenames[box_ct], &chunks[box_ct]);
+    if (num_read < 1){ // blank line
+      free(box_filenames[box_ct]);
+      continue;
+    }
+    if (num_read < 2)
+      chunks[box_ct] = 0;
+    box_ct++;
+  }
+  fclose(LIST);
+
+  // the number of boxes which are processed concurrently
+  NUM_BUFFERS = mem_budget*1073741824.0/(sizeof(fftwf_complex)*HII_KSPACE_NUM_PIXELS);
+  if (NUM_BUFFERS > NUMCORES) NUM_BUFFERS = NUMCORES;
+  if (NUM_BUFFERS > NUM_BOXES) NUM_BUFFERS = NUM_BOXES;
+  if (NUM_BUFFERS < 1) NUM_BUFFERS = 1;
+  fprintf(stderr, "Computing the power spectra of %i boxes, %i at a time\n", NUM_BOXES, NUM_BUFFERS);
+
+  // allocate the buffers and the estimator
+  error = 0;
+  boxes = (fftwf_complex **) calloc(NUM_BUFFERS, sizeof(fftwf_complex *));
+  if (!boxes) error = 1;
+  for (buffer_ct=0; !error && (buffer_ct<NUM_BUFFERS); buffer_ct++){
+    if (!(boxes[buffer_ct] = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*HII_KSPACE_NUM_PIXELS)))
+      error = 1;
+  }
+  if ( error ||
+       (set_log_ps_bins(&k_bins, DELTA_K, 1.4, DELTA_K*HII_DIM) < 0) ||
+       (init_ps_estimator(&ps, k_bins, 3, 1.0/(2.0*PI*PI*VOLUME)) < 0) ){
+    fprintf(stderr, "delta_ps.c: Error allocating memory.\nAborting...\n");
+    for (buffer_ct=0; boxes && (buffer_ct<NUM_BUFFERS); buffer_ct++) fftwf_free(boxes[buffer_ct]);
+    for (box_ct=0; box_ct<NUM_BOXES; box_ct++) free(box_filenames[box_ct]);
+    free(boxes); free(box_filenames); free(chunks); return -1;
+  }
+  // note the 1/VOLUME factor, which turns this into a power density in k-space
+
+  // one plan for all of the boxes; if several boxes are transformed concurrently, each gets one thread
+  if (NUM_BUFFERS > 1)
+    fftwf_plan_with_nthreads(1);
+  plan = fftwf_plan_dft_r2c_3d(HII_DIM, HII_DIM, HII_DIM, (float *)boxes[0], boxes[0], FFTW_ESTIMATE);
+
+  F = fopen(output_filename, "w");
+  if (!F){
+    fprintf(stderr, "delta_ps.c: Couldn't open file %s for writting!\n", output_filename);
+    error = 1;
+  }
+  else{
+    for (box_ct=0; box_ct<NUM_BOXES; box_ct++)
+      fprintf(F, "# %i\t%s\t%llu\n", box_ct, box_filenames[box_ct], chunks[box_ct]);
+  }
+
+  for (box_ct=0; !error && (box_ct<NUM_BOXES); box_ct+=NUM_BUFFERS){
+
+    // read-in and transform the next set of boxes concurrently
+#pragma omp parallel for shared(boxes, box_filenames, chunks, plan, box_ct, NUM_BUFFERS, NUM_BOXES) private(buffer_ct, BOX) reduction(+:error) num_threads(NUM_BUFFERS) schedule(dynamic)
+    for (buffer_ct=0; buffer_ct<NUM_BUFFERS; buffer_ct++){
+      if (box_ct+buffer_ct >= NUM_BOXES)
+	continue;
+      if (!(BOX = fopen(box_filenames[box_ct+buffer_ct], "rb"))){
+	fprintf(stderr, "delta_ps.c: Unable to open file %s\n", box_filenames[box_ct+buffer_ct]);
+	error++;
+	continue;
+      }
+      if (box_to_k_space(BOX, chunks[box_ct+buffer_ct], boxes[buffer_ct], plan, 0) != 0){
+	fprintf(stderr, "delta_ps.c: Unable to read-in box %llu of file %s\n", chunks[box_ct+buffer_ct], box_filenames[box_ct+buffer_ct]);
+	error++;
+      }
+      fclose(BOX);
+    }
+    if (error)
+      break;
+
+    // the binning itself is threaded, so go through the transformed boxes in order
+    for (buffer_ct=0; (buffer_ct<NUM_BUFFERS) && (box_ct+buffer_ct<NUM_BOXES); buffer_ct++){
+      reset_ps_estimator(&ps);
+      if (accumulate_power_spec(&ps, boxes[buffer_ct], NULL, HII_DIM, 3, BOX_LEN) < 0){
+	error++;
+	break;
+      }
+      for (ct=1; ct<ps.k_bins.NUM_BINS; ct++){
+	fprintf(F, "%i\t%e\t%e\t%e\n", box_ct+buffer_ct, ps.k_ave[ct]/(ps.in_bin_ct[ct]+0.0), ps.p_box[ct]/(ps.in_bin_ct[ct]+0.0), ps.p_box[ct]/(ps.in_bin_ct[ct]+0.0)/sqrt(ps.in_bin_ct[ct]+0.0));
+      }
+    }
+    if (error)
+      break;
+    fprintf(stderr, "Done with %i of %i boxes\n", (box_ct+NUM_BUFFERS < NUM_BOXES) ? box_ct+NUM_BUFFERS : NUM_BOXES, NUM_BOXES);
+  }
+
+  if (F) fclose(F);
   fftwf_destroy_plan(plan);
   fftwf_cleanup();
-  for (ct=0; ct<HII_KSPACE_NUM_PIXELS; ct++){
-     deltax[ct] *= VOLUME/(HII_TOT_NUM_PIXELS+0.0);
+  free_ps_estimator(&ps);
+  for (buffer_ct=0; buffer_ct<NUM_BUFFERS; buffer_ct++) fftwf_free(boxes[buffer_ct]);
+  for (box_ct=0; box_ct<NUM_BOXES; box_ct++) free(box_filenames[box_ct]);
+  free(boxes); free(box_filenames); free(chunks);
+
+  if (error){
+    fprintf(stderr, "delta_ps.c: Aborting...\n");
+    return -1;
   }
+  return 0;
+}
 
 
-  /******  PRINT OUT THE POWERSPECTRUM  *********/
+int main(int argc, char ** argv){
+  FILE *F;
+  fftwf_complex *deltax;
+  fftwf_plan plan;
+  unsigned long long ct;
+  float mem_budget;
+  int status, batch;
+  ps_bins k_bins;
+  ps_estimator ps;
 
-  k_factor = 1.4;
-  k_first_bin_ceil = DELTA_K;
-  k_max = DELTA_K*HII_DIM;
-  // initialize arrays
-   NUM_BINS = 0;
-  k_floor = 0;
-  k_ceil = k_first_bin_ceil;
-  while (k_ceil < k_max){
-    NUM_BINS++;
-    k_floor=k_ceil;
-    k_ceil*=k_factor;
-  }
-
-  p_box =  (double *)malloc(sizeof(double)*NUM_BINS);
-  k_ave =  (double *)malloc(sizeof(double)*NUM_BINS);
-  in_bin_ct = (unsigned long long *)malloc(sizeof(unsigned long long)*NUM_BINS);
-  if (!p_box || !in_bin_ct || !k_ave){ // a bit sloppy, but whatever..
-    fprintf(stderr, "delta_T.c: Error allocating memory.\nAborting...\n");
+  // check arguments
+  batch = (argc > 1) && !strcmp(argv[1], "-b");
+  if ( (!batch && (argc != 3)) || (batch && (argc != 4) && (argc != 5)) ){
+    fprintf(stderr, "USAGE: delta_ps <deltax filename> <output filename>\n");
+    fprintf(stderr, "   or: delta_ps -b <filename containing list of boxes> <output filename> [memory budget in GB]\nAborting\n");
+    return -1;
+  }
+  // initialize and allocate thread info
+  if (fftwf_init_threads()==0){
+    fprintf(stderr, "init: ERROR: problem initializing fftwf threads\nAborting\n.");
+    return -1;
+  }
+  fftwf_plan_with_nthreads(NUMCORES); // use all processors for init
+  omp_set_num_threads(NUMCORES);
+
+  // batch mode
+  if (batch){
+    mem_budget = BATCH_MEM_BUDGET;
+    if (argc == 5)
+      mem_budget = atof(argv[4]);
+    status = batch_delta_ps(argv[2], argv[3], mem_budget);
+    fftwf_cleanup_threads(); return status;
+  }
+
+  //allocate and read-in the density array
+  deltax = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*HII_KSPACE_NUM_PIXELS);
+  if (!deltax){
+    fprintf(stderr, "delta_T: Error allocating memory for deltax box\nAborting...\n");
+    fftwf_cleanup_threads(); return -1;
+  }
+  if (!(F = fopen(argv[1], "rb"))){
+    fprintf(stderr, "delta_ps.c: Unable to open file %s\nAborting...\n", argv[1]);
     fftwf_free(deltax);
     fftwf_cleanup_threads(); return -1;
   }
-  for (ct=0; ct<NUM_BINS; ct++){
-    p_box[ct] = k_ave[ct] = 0;
-    in_bin_ct[ct] = 0;
+  plan = fftwf_plan_dft_r2c_3d(HII_DIM, HII_DIM, HII_DIM, (float *)deltax, (fftwf_complex *)deltax, FFTW_ESTIMATE);
+  status = box_to_k_space(F, 0, deltax, plan, 1);
+  fclose(F);
+  fftwf_destroy_plan(plan);
+  fftwf_cleanup();
+  if (status != 0){
+    fprintf(stderr, "Aborting...\n");
+    fftwf_free(deltax);
+    fftwf_cleanup_threads(); return -1;
   }
 
 
+  /******  PRINT OUT THE POWERSPECTRUM  *********/
+
+  // initialize the estimator (see power_spec_helper_progs.c)
+  if ( (set_log_ps_bins(&k_bins, DELTA_K, 1.4, DELTA_K*HII_DIM) < 0) ||
+       (init_ps_estimator(&ps, k_bins, 3, 1.0/(2.0*PI*PI*VOLUME)) < 0) ){
+    fprintf(stderr, "delta_ps.c: Error allocating memory.\nAborting...\n");
+    fftwf_free(deltax);
+    fftwf_cleanup_threads(); return -1;
+  }
+  // note the 1/VOLUME factor, which turns this into a power density in k-space
+
   // now construct the power spectrum file
-  for (n_x=0; n_x<HII_DIM; n_x++){
-    if (n_x>HII_MIDDLE)
-      k_x =(n_x-HII_DIM) * DELTA_K;  // wrap around for FFT convention
-    else
-      k_x = n_x * DELTA_K;
-
-    for (n_y=0; n_y<HII_DIM; n_y++){
-      if (n_y>HII_MIDDLE)
-	k_y =(n_y-HII_DIM) * DELTA_K;
-      else
-	k_y = n_y * DELTA_K;
-
-      for (n_z=0; n_z<=HII_MIDDLE; n_z++){ 
-	k_z = n_z * DELTA_K;
-	
-	k_mag = sqrt(k_x*k_x + k_y*k_y + k_z*k_z);
-
-	// now go through the k bins and update
-	ct = 0;
-	k_floor = 0;
-	k_ceil = k_first_bin_ceil;
-	while (k_ceil < k_max){
-	  // check if we fal in this bin
-	  if ((k_mag>=k_floor) && (k_mag < k_ceil)){
-	    in_bin_ct[ct]++;
-	    p_box[ct] +=  pow(k_mag,3)*pow(cabs(deltax[HII_C_INDEX(n_x, n_y, n_z)]), 2) / (2.0*PI*PI*VOLUME);
-	    // note the 1/VOLUME factor, which turns this into a power density in k-space
-
-	    k_ave[ct] += k_mag;
-	    break;
-	  }
-
-	  ct++;
-	  k_floor=k_ceil;
-	  k_ceil*=k_factor;
-	}
-      }
-    }
-  } // end looping through k box
+  if (accumulate_power_spec(&ps, deltax, NULL, HII_DIM, 3, BOX_LEN) < 0){
+    fprintf(stderr, "delta_ps.c: Error allocating memory.\nAborting...\n");
+    fftwf_free(deltax); free_ps_estimator(&ps);
+    fftwf_cleanup_threads(); return -1;
+  }
   fftwf_free(deltax);
 
   // now lets print out the k bins
   F = fopen(argv[2], "w");
   if (!F){
-    fprintf(stderr, "delta_T.c: Couldn't open file %s for writting!\n", filename);
+    fprintf(stderr, "delta_ps.c: Couldn't open file %s for writting!\n", argv[2]);
+    free_ps_estimator(&ps);
     fftwf_cleanup_threads(); return -1;
   }
-  for (ct=1; ct<NUM_BINS; ct++){
-    fprintf(F, "%e\t%e\t%e\n", k_ave[ct]/(in_bin_ct[ct]+0.0), p_box[ct]/(in_bin_ct[ct]+0.0), p_box[ct]/(in_bin_ct[ct]+0.0)/sqrt(in_bin_ct[ct]+0.0));
+  for (ct=1; ct<ps.k_bins.NUM_BINS; ct++){
+    fprintf(F, "%e\t%e\t%e\n", ps.k_ave[ct]/(ps.in_bin_ct[ct]+0.0), ps.p_box[ct]/(ps.in_bin_ct[ct]+0.0), ps.p_box[ct]/(ps.in_bin_ct[ct]+0.0)/sqrt(ps.in_bin_ct[ct]+0.0));
   }
   fclose(F);
 
   /****** END POWER SPECTRUM STUFF   ************/
 
-  free(p_box); free(k_ave); free(in_bin_ct);
+  free_ps_estimator(&ps);
 
   fftwf_cleanup_threads(); return 0;
 }
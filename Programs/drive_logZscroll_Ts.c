@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/wait.h>
 
 #include "../Parameter_files/INIT_PARAMS.H"
@@ -21,7 +22,9 @@ int main(int argc, char ** argv){
   //float Z, M, M_MIN, nf;
   float M_MIN;
   float Z, M, nf;
-  char cmnd[1000];
+  float Z_halo;
+  char cmnd[1000], *halo_cmnd;
+  int num_halo_z;
   FILE *LOG;
   time_t start_time, curr_time;
   int status;
@@ -90,38 +93,53 @@ int main(int argc, char ** argv){
     Z = ((1+Z)*ZPRIME_STEP_FACTOR - 1);
   }
   Z = ((1+Z)/ ZPRIME_STEP_FACTOR - 1);
-  while (Z >= ZLOW){
-
-    //set the minimum source mass
-    //M_MIN = get_M_min_ion(Z);
 
-    if(USE_GENERAL_SOURCES)
-    {
-      sources src;
-      src = defaultSources();
-      M_MIN = src.minMass(Z);
-      printf("At z = %f, M_MIN = %e MSUN\n", Z, M_MIN);
+  // if USE_HALO_FIELD is turned on in ANAL_PARAMS.H, run the halo finder at every redshift,
+  // and then shift all of the halo lists at once (update_halo_pos reads the velocity fields only once)
+  if (USE_HALO_FIELD){
+    num_halo_z = 0;
+    for (Z_halo = Z; Z_halo >= ZLOW; Z_halo = ((1+Z_halo)/ZPRIME_STEP_FACTOR - 1))
+      num_halo_z++;
+    halo_cmnd = (char *) malloc(sizeof(char)*(100 + 20*num_halo_z));
+    if (!halo_cmnd){
+      fprintf(stderr, "drive_logZscroll_Ts: Error allocating memory for the update_halo_pos command\n Aborting...\n");
+      fclose(LOG);
+      return -1;
     }
+    strcpy(halo_cmnd, "./update_halo_pos");
 
-    // if USE_HALO_FIELD is turned on in ANAL_PARAMS.H, run the halo finder
-    if (USE_HALO_FIELD){
+    for (Z_halo = Z; Z_halo >= ZLOW; Z_halo = ((1+Z_halo)/ZPRIME_STEP_FACTOR - 1)){
       //  the following only depend on redshift, not ionization field
       // find halos
-      sprintf(cmnd, "./find_halos %.2f", Z);
+      sprintf(cmnd, "./find_halos %.2f", Z_halo);
       time(&curr_time);
       fprintf(stderr, "Now calling: %s, %g min have ellapsed\n", cmnd, difftime(curr_time, start_time)/60.0);
       fprintf(LOG, "Now calling: %s, %g min have ellapsed\n", cmnd, difftime(curr_time, start_time)/60.0);
       fflush(NULL);
       system(cmnd);
+      sprintf(halo_cmnd + strlen(halo_cmnd), " %.2f", Z_halo);
+    }
 
+    // shift halos accordig to their linear velocities
+    time(&curr_time);
+    fprintf(stderr, "Now calling: %s, %g min have ellapsed\n", halo_cmnd, -difftime(start_time, curr_time)/60.0);
+    fprintf(LOG, "Now calling: %s, %g min have ellapsed\n", halo_cmnd, -difftime(start_time, curr_time)/60.0);
+    fflush(NULL);
+    system(halo_cmnd);
+    free(halo_cmnd);
+  }
 
-      // shift halos accordig to their linear velocities
-      sprintf(cmnd, "./update_halo_pos %.2f", Z);
-      time(&curr_time);
-      fprintf(stderr, "Now calling: %s, %g min have ellapsed\n", cmnd, -difftime(start_time, curr_time)/60.0);
-      fprintf(LOG, "Now calling: %s, %g min have ellapsed\n", cmnd, -difftime(start_time, curr_time)/60.0);
-      fflush(NULL);
-      system(cmnd);
+  while (Z >= ZLOW){
+
+    //set the minimum source mass
+    //M_MIN = get_M_min_ion(Z);
+
+    if(USE_GENERAL_SOURCES)
+    {
+      sources src;
+      src = defaultSources();
+      M_MIN = src.minMass(Z);
+      printf("At z = %f, M_MIN = %e MSUN\n", Z, M_MIN);
     }
 
     // shift density field and update velocity field
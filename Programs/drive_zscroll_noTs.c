@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "../Parameter_files/INIT_PARAMS.H"
 #include "../Parameter_files/SOURCES.H"
@@ -24,7 +25,8 @@
 
 int main(int argc, char ** argv){
   float Z, M, M_MIN;
-  char cmnd[1000];
+  char cmnd[1000], *halo_cmnd;
+  int num_halo_z;
   FILE *LOG;
   time_t start_time, curr_time;
 
@@ -54,21 +56,21 @@ int main(int argc, char ** argv){
   fprintf(LOG, "Calling init to set up the initial conditions\n");
   system("./init"); // you only need this call once per realization
 
-  Z = ZSTART;
-  while (Z > (ZEND-0.0001)){
-    fprintf(stderr, "*************************************\n");
-
-    M_MIN = get_M_min_ion(Z);
-    if(USE_GENERAL_SOURCES)
-    {
-      sources src;
-      src = defaultSources();
-      M_MIN = src.minMass(Z);
-      printf("At z = %f, M_MIN = %e MSUN, M_ACT = %le\n", Z, M_MIN, minMassATC(Z));
+  // if USE_HALO_FIELD is turned on in ANAL_PARAMS.H, run the halo finder at every redshift,
+  // and then shift all of the halo lists at once (update_halo_pos reads the velocity fields only once)
+  if (USE_HALO_FIELD){
+    num_halo_z = 0;
+    for (Z = ZSTART; Z > (ZEND-0.0001); Z += ZSTEP)
+      num_halo_z++;
+    halo_cmnd = (char *) malloc(sizeof(char)*(100 + 20*num_halo_z));
+    if (!halo_cmnd){
+      fprintf(stderr, "drive_zscroll_noTs: Error allocating memory for the update_halo_pos command\n Aborting...\n");
+      fclose(LOG);
+      return -1;
     }
+    strcpy(halo_cmnd, "./update_halo_pos");
 
-    // if USE_HALO_FIELD is turned on in ANAL_PARAMS.H, run the halo finder
-    if (USE_HALO_FIELD){
+    for (Z = ZSTART; Z > (ZEND-0.0001); Z += ZSTEP){
       //  the following only depend on redshift, not ionization field
       // find halos
       sprintf(cmnd, "./find_halos %f", Z);
@@ -77,15 +79,29 @@ int main(int argc, char ** argv){
       fprintf(LOG, "Now calling: %s, %g min have ellapsed\n", cmnd, difftime(start_time, curr_time)/60.0);
       fflush(NULL);
       system(cmnd);
+      sprintf(halo_cmnd + strlen(halo_cmnd), " %f", Z);
+    }
 
+    // shift halos accordig to their linear velocities
+    time(&curr_time);
+    fprintf(stderr, "Now calling: %s, %g min have ellapsed\n", halo_cmnd, difftime(start_time, curr_time)/60.0);
+    fprintf(LOG, "Now calling: %s, %g min have ellapsed\n", halo_cmnd, difftime(start_time, curr_time)/60.0);
+    fflush(NULL);
+    system(halo_cmnd);
+    free(halo_cmnd);
+  }
 
-      // shift halos accordig to their linear velocities
-      sprintf(cmnd, "./update_halo_pos %f", Z);
-      time(&curr_time);
-      fprintf(stderr, "Now calling: %s, %g min have ellapsed\n", cmnd, difftime(start_time, curr_time)/60.0);
-      fprintf(LOG, "Now calling: %s, %g min have ellapsed\n", cmnd, difftime(start_time, curr_time)/60.0);
-      fflush(NULL);
-      system(cmnd);
+  Z = ZSTART;
+  while (Z > (ZEND-0.0001)){
+    fprintf(stderr, "*************************************\n");
+
+    M_MIN = get_M_min_ion(Z);
+    if(USE_GENERAL_SOURCES)
+    {
+      sources src;
+      src = defaultSources();
+      M_MIN = src.minMass(Z);
+      printf("At z = %f, M_MIN = %e MSUN, M_ACT = %le\n", Z, M_MIN, minMassATC(Z));
     }
 
     // shift density field and update velocity field
@@ -1,7 +1,12 @@
 /* Written by Steven Furlanetto */
 #include "stdio.h"
 #include "stdlib.h"
+#include "string.h"
 #include "math.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 // Below gives grid sizes for the interpolation arrays
 #ifndef _x_int_VARIABLES_DEFINED
 #define x_int_NXHII  14
@@ -9,8 +14,10 @@
 #define _x_int_VARIABLES_DEFINED
 #endif
 
-// Initialization; must be called once to 
-void initialize_interp_arrays();
+// Initialization; must be called once to set up the tables.  Returns 0, or -1 on an error.
+int initialize_interp_arrays();
+// Releases the tables
+void free_interp_arrays();
 
 // Primary functions to compute heating fractions and number of Lya photons or ionization produced,
 // Note that En is the energy of the *primary* photon, so the energy in the initial ionization is
@@ -25,6 +32,7 @@ float interp_nion_HeII(float En, float xHII_call);
 
 int locate_energy_index(float En);
 int locate_xHII_index(float xHII_call);
+static inline int energy_index_analytic(float En);
 
 
 // Functions to interpolate the energy deposition fractions of high-energy secondary electrons
@@ -40,33 +48,154 @@ int locate_xHII_index(float xHII_call);
 // So for example the fraction of energy in Lya photons is just (n_Lya*10.2)/(electron energy)
 
 // The interpolation arrays.  Note all are defined in global scope, but x_int_ prefix should
-// ensure no conflicts with other code
-float x_int_Energy[x_int_NENERGY];
-float x_int_XHII[x_int_NXHII];
-float x_int_fheat[x_int_NXHII][x_int_NENERGY];
-float x_int_n_Lya[x_int_NXHII][x_int_NENERGY];
-float x_int_nion_HI[x_int_NXHII][x_int_NENERGY];
-float x_int_nion_HeI[x_int_NXHII][x_int_NENERGY];
-float x_int_nion_HeII[x_int_NXHII][x_int_NENERGY];
-
-// Call once to read in data files and set up arrays for interpolation.
-// All data files should be in a local subdirectory "x_int_tables/"; if moved, change input_base
-// below to new location.
-void initialize_interp_arrays()
+// ensure no conflicts with other code.  They all point into one block of memory, which is
+// either the memory mapped binary table file (see below) or read from the text tables.
+float *x_int_Energy;
+float *x_int_XHII;
+float (*x_int_fheat)[x_int_NENERGY];
+float (*x_int_n_Lya)[x_int_NENERGY];
+float (*x_int_nion_HI)[x_int_NENERGY];
+float (*x_int_nion_HeI)[x_int_NENERGY];
+float (*x_int_nion_HeII)[x_int_NENERGY];
+
+// The text tables are in "x_int_tables/"; if moved, change X_INT_TABLE_DIR to the new location.
+// On the first run they are converted to the single binary file X_INT_BINARY_FILE, which later
+// runs memory map instead of parsing the 14 text files.  Its header is checked against the grid
+// sizes, and its contents against a checksum; if either does not match (or the file can not be
+// read) the text tables are read, and the binary file re-written.  Delete the binary file if the
+// text tables are changed.
+#define X_INT_TABLE_DIR "../External_tables/x_int_tables/"
+#define X_INT_BINARY_FILE X_INT_TABLE_DIR "x_int_tables.bin"
+#define X_INT_MAGIC "XINTTBL1"
+#define X_INT_NUM_FLOATS (x_int_NXHII + x_int_NENERGY + 5*x_int_NXHII*x_int_NENERGY)
+
+typedef struct{
+  char magic[8];
+  int NXHII, NENERGY;
+  unsigned long long checksum; // FNV-1a hash of the X_INT_NUM_FLOATS floats that follow the header
+} x_int_header;
+
+static float *x_int_block = NULL; // XHII, Energy, fheat, n_Lya, nion_HI, nion_HeI, nion_HeII
+static void *x_int_map = NULL;
+static size_t x_int_map_size = 0;
+
+// The energy grid is log-spaced with two step sizes, so its index is computed directly (see
+// locate_energy_index()); x_int_energy_analytic is set if the table was checked to match that
+// grid, otherwise the index is found by bisection.
+#define X_INT_E_LOW (double) (10.0)
+#define X_INT_E_BREAK (double) (1008.88)
+#define X_INT_N_BREAK (int) (233)
+#define X_INT_DLNE_LOW (double) (1.98026273e-2) // log(1.02)
+#define X_INT_DLNE_HIGH (double) (9.53101798e-2) // log(1.1)
+static int x_int_energy_analytic = 0;
+
+
+unsigned long long x_int_checksum(float *data){
+  unsigned long long hash = 14695981039346656037ULL;
+  unsigned char *bytes = (unsigned char *) data;
+  size_t i;
+
+  for (i=0; i<sizeof(float)*X_INT_NUM_FLOATS; i++){
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Points the x_int_ arrays into a block of X_INT_NUM_FLOATS floats
+void set_x_int_arrays(float *block){
+  x_int_XHII = block;
+  x_int_Energy = block + x_int_NXHII;
+  block += x_int_NXHII + x_int_NENERGY;
+  x_int_fheat = (float (*)[x_int_NENERGY]) block;
+  x_int_n_Lya = (float (*)[x_int_NENERGY]) (block + x_int_NXHII*x_int_NENERGY);
+  x_int_nion_HI = (float (*)[x_int_NENERGY]) (block + 2*x_int_NXHII*x_int_NENERGY);
+  x_int_nion_HeI = (float (*)[x_int_NENERGY]) (block + 3*x_int_NXHII*x_int_NENERGY);
+  x_int_nion_HeII = (float (*)[x_int_NENERGY]) (block + 4*x_int_NXHII*x_int_NENERGY);
+}
+
+// Memory maps X_INT_BINARY_FILE, if it is a valid table.  Returns 0, or -1 if it is not.
+int map_x_int_binary(){
+  struct stat st;
+  x_int_header *header;
+  void *map;
+  int fd;
+
+  if ((fd = open(X_INT_BINARY_FILE, O_RDONLY)) < 0)
+    return -1;
+  if (fstat(fd, &st) || (st.st_size != sizeof(x_int_header) + sizeof(float)*X_INT_NUM_FLOATS)){
+    close(fd);
+    return -1;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  header = (x_int_header *) map;
+  if (memcmp(header->magic, X_INT_MAGIC, 8) || (header->NXHII != x_int_NXHII) ||
+      (header->NENERGY != x_int_NENERGY) ||
+      (header->checksum != x_int_checksum((float *)((char *)map + sizeof(x_int_header))))){
+    fprintf(stderr, "elec_interp.c: %s does not match the expected tables, re-reading the text tables\n", X_INT_BINARY_FILE);
+    munmap(map, st.st_size);
+    return -1;
+  }
+
+  x_int_map = map;
+  x_int_map_size = st.st_size;
+  set_x_int_arrays((float *)((char *)map + sizeof(x_int_header)));
+  return 0;
+}
+
+// Writes the tables to X_INT_BINARY_FILE (through a temporary file, so that concurrent runs
+// never see a partial file).  Failing to write it is not an error, the text tables are just
+// read again on the next run.
+void write_x_int_binary(){
+  x_int_header header;
+  char tmpname[300];
+  FILE *F;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, X_INT_MAGIC, 8);
+  header.NXHII = x_int_NXHII;
+  header.NENERGY = x_int_NENERGY;
+  header.checksum = x_int_checksum(x_int_block);
+
+  sprintf(tmpname, "%s.%i.tmp", X_INT_BINARY_FILE, (int) getpid());
+  if (!(F = fopen(tmpname, "wb")))
+    return;
+  if ( (fwrite(&header, sizeof(header), 1, F) != 1) ||
+       (fwrite(x_int_block, sizeof(float), X_INT_NUM_FLOATS, F) != X_INT_NUM_FLOATS) ){
+    fclose(F);
+    remove(tmpname);
+    return;
+  }
+  if (fclose(F) || rename(tmpname, X_INT_BINARY_FILE))
+    remove(tmpname);
+}
+
+// Reads the text tables into x_int_block.  Returns 0, or -1 on an error.
+int read_x_int_text_tables()
 {
   FILE *input_file;
   char input_file_name[100];
-  char input_base[100] = "../External_tables/x_int_tables/";
+  char input_base[100] = X_INT_TABLE_DIR;
   char input_tail[100] = ".dat";
   char mode[10] = "r";
 
   float xHI,xHeI,xHeII,z,T;
   float trash;
-  char label[] = " ";
+  char label[100];
 
   int i;
   int n_ion;
 
+  if (!(x_int_block = (float *) malloc(sizeof(float)*X_INT_NUM_FLOATS))){
+    fprintf(stderr, "elec_interp.c: Error allocating memory for the tables\n");
+    return -1;
+  }
+  set_x_int_arrays(x_int_block);
+
   // Initialize array of ionized fractions
   x_int_XHII[0] = 1.0e-4;
   x_int_XHII[1] = 2.318e-4;
@@ -98,12 +227,12 @@ void initialize_interp_arrays()
 
     if (input_file == NULL) {
       fprintf(stderr, "Can't open input file %s!\n",input_file_name);
-      exit(1);
+      return -1;
     }
 
     // Read in first line
     for (i=1;i<=5;i++) {
-      fscanf(input_file,"%s", label);
+      fscanf(input_file,"%99s", label);
       //      printf("%s\n",label);
     }
     
@@ -112,22 +241,26 @@ void initialize_interp_arrays()
     
     // Read in column headings
     for (i=1;i<=11;i++) {
-      fscanf(input_file,"%s", label);
+      fscanf(input_file,"%99s", label);
       //      printf("%s\n",label);
     }
     
     // Read in data table
     for (i=0;i<x_int_NENERGY;i++) {
-      fscanf(input_file,"%g %g %g %g %g %g %g %g %g",
-	     &x_int_Energy[i],
-	     &trash,
-	     &x_int_fheat[n_ion][i],
-	     &trash,
-	     &x_int_n_Lya[n_ion][i],
-	     &x_int_nion_HI[n_ion][i],
-	     &x_int_nion_HeI[n_ion][i],
-	     &x_int_nion_HeII[n_ion][i],
-	     &trash);
+      if (fscanf(input_file,"%g %g %g %g %g %g %g %g %g",
+		 &x_int_Energy[i],
+		 &trash,
+		 &x_int_fheat[n_ion][i],
+		 &trash,
+		 &x_int_n_Lya[n_ion][i],
+		 &x_int_nion_HI[n_ion][i],
+		 &x_int_nion_HeI[n_ion][i],
+		 &x_int_nion_HeII[n_ion][i],
+		 &trash) != 9) {
+	fprintf(stderr, "Error reading line %i of the data in %s!\n", i, input_file_name);
+	fclose(input_file);
+	return -1;
+      }
       //      printf("%g\t%g\t%g\t%g\t%g\t%g\n", x_int_Energy[i], x_int_fheat[n_ion][i], 
       //      	     x_int_n_Lya[n_ion][i], x_int_nion_HI[n_ion][i], x_int_nion_HeI[n_ion][i], 
       //      	     x_int_nion_HeII[n_ion][i]);
@@ -136,18 +269,51 @@ void initialize_interp_arrays()
     fclose(input_file);
 
   }
-  return;
+  return 0;
 }
 
-// Function to compute fheat for an interacting electron, given energy En and IGM ionized fraction
-// xHII_call; note we assume xHeI=xHI and all the rest of the helium is in HeII (though that makes
-// almost no difference in practice).
-// Function returns the fraction of the this electron energy that is returned to heat, thus
-// it does NOT include the primary photo-ionization energy loss
-// Note that if En>highest element of array, it just uses that highest value.  Similarly, if 
-// xHII_call is less than or smaller than the limits of the ionized fraction array (10^-4 and 
-// 0.999), it just uses those values.
-float interp_fheat(float En, float xHII_call)
+// Call once to set up arrays for interpolation: memory maps the binary table file, or reads the
+// text tables and writes the binary file for the next time.  Returns 0, or -1 on an error.
+int initialize_interp_arrays()
+{
+  int n;
+
+  if (map_x_int_binary() < 0){
+    free_interp_arrays();
+    if (read_x_int_text_tables() < 0){
+      free_interp_arrays();
+      return -1;
+    }
+    write_x_int_binary();
+  }
+
+  // check that the energy grid is the one locate_energy_index() computes the index on
+  x_int_energy_analytic = 1;
+  for (n=0; n<x_int_NENERGY-1; n++){
+    if (energy_index_analytic(sqrt(x_int_Energy[n]*x_int_Energy[n+1])) != n)
+      break;
+  }
+  if (n < x_int_NENERGY-1){
+    fprintf(stderr, "elec_interp.c: WARNING: the energy grid of the tables is not the expected one at E=%g eV; using a bisection search on it\n", x_int_Energy[n]);
+    x_int_energy_analytic = 0;
+  }
+  return 0;
+}
+
+void free_interp_arrays()
+{
+  if (x_int_map){
+    munmap(x_int_map, x_int_map_size);
+    x_int_map = NULL;
+    x_int_map_size = 0;
+  }
+  free(x_int_block);
+  x_int_block = NULL;
+}
+
+// Bilinear interpolation of one of the tables (x_int_fheat etc.) at energy En and ionized fraction
+// xHII_call, common to all of the functions below.  Energies below the table return below_result.
+float interp_x_int_table(float (*table)[x_int_NENERGY], float En, float xHII_call, float below_result)
 {
   int n_low,n_high;
   int m_xHII_low,m_xHII_high;
@@ -160,7 +326,7 @@ float interp_fheat(float En, float xHII_call)
     // has anyway reached the asymptotic limit
     En = x_int_Energy[x_int_NENERGY-1]*0.999;
   } else if (En < x_int_Energy[0]) {
-    return 1.0;
+    return below_result;
   }
 
   // Check if ionized fraction is within boundaries; if not, adjust to be within
@@ -172,35 +338,43 @@ float interp_fheat(float En, float xHII_call)
 
   n_low = locate_energy_index(En);
   n_high = n_low + 1;
-  //  printf("nlow=%d %f\n",n_low,En);
-
+  
   m_xHII_low = locate_xHII_index(xHII_call);
   m_xHII_high = m_xHII_low + 1;
-  //    printf("%f %f %f\n",xHII_call,XHII[m_xHII_low],XHII[m_xHII_high]);
   
   // First linear interpolation in energy
-  elow_result = ((x_int_fheat[m_xHII_low][n_high]-x_int_fheat[m_xHII_low][n_low])/
+  elow_result = ((table[m_xHII_low][n_high]-table[m_xHII_low][n_low])/
 		 (x_int_Energy[n_high]-x_int_Energy[n_low]));
   elow_result *= (En - x_int_Energy[n_low]);
-  elow_result += x_int_fheat[m_xHII_low][n_low];
-  //  printf("elow= %f\n",elow_result);
+  elow_result += table[m_xHII_low][n_low];
   
   // Second linear interpolation in energy
-  ehigh_result = ((x_int_fheat[m_xHII_high][n_high]-x_int_fheat[m_xHII_high][n_low])/
+  ehigh_result = ((table[m_xHII_high][n_high]-table[m_xHII_high][n_low])/
 		  (x_int_Energy[n_high]-x_int_Energy[n_low]));
   ehigh_result *= (En - x_int_Energy[n_low]);
-  ehigh_result += x_int_fheat[m_xHII_high][n_low];
-  //  printf("ehigh= %f\n",ehigh_result);
+  ehigh_result += table[m_xHII_high][n_low];
   
   // Final interpolation over the ionized fraction
   final_result = (ehigh_result - elow_result)/(x_int_XHII[m_xHII_high] - x_int_XHII[m_xHII_low]);
   final_result *= (xHII_call - x_int_XHII[m_xHII_low]);
   final_result += elow_result;
-  //  printf("final= %f\n",final_result);
   
   return final_result;
 }
 
+// Function to compute fheat for an interacting electron, given energy En and IGM ionized fraction
+// xHII_call; note we assume xHeI=xHI and all the rest of the helium is in HeII (though that makes
+// almost no difference in practice).
+// Function returns the fraction of the this electron energy that is returned to heat, thus
+// it does NOT include the primary photo-ionization energy loss
+// Note that if En>highest element of array, it just uses that highest value.  Similarly, if 
+// xHII_call is less than or smaller than the limits of the ionized fraction array (10^-4 and 
+// 0.999), it just uses those values.
+float interp_fheat(float En, float xHII_call)
+{
+  return interp_x_int_table(x_int_fheat, En, xHII_call, 1.0);
+}
+
 // Function to compute nLya for an interacting electron, given energy En and IGM ionized fraction
 // xHII_call; note we assume xHeI=xHI and all the rest of the helium is in HeII (though that makes
 // almost no difference in practice).
@@ -211,52 +385,7 @@ float interp_fheat(float En, float xHII_call)
 // it just uses those values.
 float interp_n_Lya(float En, float xHII_call)
 {
-  int n_low,n_high;
-  int m_xHII_low,m_xHII_high;
-
-  float elow_result,ehigh_result,final_result;
-
-  // Check if En is inside interpolation boundaries
-  if (En > 0.999*x_int_Energy[x_int_NENERGY-1]) {
-    // If it is above the upper limit, we just assume that it is near the upper limit, which
-    // has anyway reached the asymptotic limit
-    En = x_int_Energy[x_int_NENERGY-1]*0.999;
-  } else if (En < x_int_Energy[0]) {
-    return 0.0;
-  }
-
-  // Check if ionized fraction is within boundaries; if not, adjust to be within
-  if (xHII_call > x_int_XHII[x_int_NXHII-1]*0.999) {
-    xHII_call = x_int_XHII[x_int_NXHII-1]*0.999;
-  } else if (xHII_call < x_int_XHII[0]) {
-    xHII_call = 1.001*x_int_XHII[0];
-  }
-
-  n_low = locate_energy_index(En);
-  n_high = n_low + 1;
-  
-  m_xHII_low = locate_xHII_index(xHII_call);
-  m_xHII_high = m_xHII_low + 1;
-  //    printf("%f %f %f\n",xHII_call,XHII[m_xHII_low],XHII[m_xHII_high]);
-  
-  // First linear interpolation in energy
-  elow_result = ((x_int_n_Lya[m_xHII_low][n_high]-x_int_n_Lya[m_xHII_low][n_low])/
-		 (x_int_Energy[n_high]-x_int_Energy[n_low]));
-  elow_result *= (En - x_int_Energy[n_low]);
-  elow_result += x_int_n_Lya[m_xHII_low][n_low];
-  
-  // Second linear interpolation in energy
-  ehigh_result = ((x_int_n_Lya[m_xHII_high][n_high]-x_int_n_Lya[m_xHII_high][n_low])/
-		  (x_int_Energy[n_high]-x_int_Energy[n_low]));
-  ehigh_result *= (En - x_int_Energy[n_low]);
-  ehigh_result += x_int_n_Lya[m_xHII_high][n_low];
-  
-  // Final interpolation over the ionized fraction
-  final_result = (ehigh_result - elow_result)/(x_int_XHII[m_xHII_high] - x_int_XHII[m_xHII_low]);
-  final_result *= (xHII_call - x_int_XHII[m_xHII_low]);
-  final_result += elow_result;
-  
-  return final_result;
+  return interp_x_int_table(x_int_n_Lya, En, xHII_call, 0.0);
 }
 
 // Function to compute nHI for an interacting electron, given energy En and IGM ionized fraction
@@ -269,52 +398,7 @@ float interp_n_Lya(float En, float xHII_call)
 // it just uses those values.
 float interp_nion_HI(float En, float xHII_call)
 {
-  int n_low,n_high;
-  int m_xHII_low,m_xHII_high;
-
-  float elow_result,ehigh_result,final_result;
-
-  // Check if En is inside interpolation boundaries
-  if (En > 0.999*x_int_Energy[x_int_NENERGY-1]) {
-    // If it is above the upper limit, we just assume that it is near the upper limit, which
-    // has anyway reached the asymptotic limit
-    En = x_int_Energy[x_int_NENERGY-1]*0.999;
-  } else if (En < x_int_Energy[0]) {
-    return 0.0;
-  }
-
-  // Check if ionized fraction is within boundaries; if not, adjust to be within
-  if (xHII_call > x_int_XHII[x_int_NXHII-1]*0.999) {
-    xHII_call = x_int_XHII[x_int_NXHII-1]*0.999;
-  } else if (xHII_call < x_int_XHII[0]) {
-    xHII_call = 1.001*x_int_XHII[0];
-  }
-
-  n_low = locate_energy_index(En);
-  n_high = n_low + 1;
-  
-  m_xHII_low = locate_xHII_index(xHII_call);
-  m_xHII_high = m_xHII_low + 1;
-  //    printf("%f %f %f\n",xHII_call,XHII[m_xHII_low],XHII[m_xHII_high]);
-  
-  // First linear interpolation in energy
-  elow_result = ((x_int_nion_HI[m_xHII_low][n_high]-x_int_nion_HI[m_xHII_low][n_low])/
-		 (x_int_Energy[n_high]-x_int_Energy[n_low]));
-  elow_result *= (En - x_int_Energy[n_low]);
-  elow_result += x_int_nion_HI[m_xHII_low][n_low];
-  
-  // Second linear interpolation in energy
-  ehigh_result = ((x_int_nion_HI[m_xHII_high][n_high]-x_int_nion_HI[m_xHII_high][n_low])/
-		  (x_int_Energy[n_high]-x_int_Energy[n_low]));
-  ehigh_result *= (En - x_int_Energy[n_low]);
-  ehigh_result += x_int_nion_HI[m_xHII_high][n_low];
-  
-  // Final interpolation over the ionized fraction
-  final_result = (ehigh_result - elow_result)/(x_int_XHII[m_xHII_high] - x_int_XHII[m_xHII_low]);
-  final_result *= (xHII_call - x_int_XHII[m_xHII_low]);
-  final_result += elow_result;
-  
-  return final_result;
+  return interp_x_int_table(x_int_nion_HI, En, xHII_call, 0.0);
 }
 
 // Function to compute nHeI for an interacting electron, given energy En and IGM ionized fraction
@@ -327,52 +411,7 @@ float interp_nion_HI(float En, float xHII_call)
 // it just uses those values.
 float interp_nion_HeI(float En, float xHII_call)
 {
-  int n_low,n_high;
-  int m_xHII_low,m_xHII_high;
-
-  float elow_result,ehigh_result,final_result;
-
-  // Check if En is inside interpolation boundaries
-  if (En > 0.999*x_int_Energy[x_int_NENERGY-1]) {
-    // If it is above the upper limit, we just assume that it is near the upper limit, which
-    // has anyway reached the asymptotic limit
-    En = x_int_Energy[x_int_NENERGY-1]*0.999;
-  } else if (En < x_int_Energy[0]) {
-    return 0.0;
-  }
-
-  // Check if ionized fraction is within boundaries; if not, adjust to be within
-  if (xHII_call > x_int_XHII[x_int_NXHII-1]*0.999) {
-    xHII_call = x_int_XHII[x_int_NXHII-1]*0.999;
-  } else if (xHII_call < x_int_XHII[0]) {
-    xHII_call = 1.001*x_int_XHII[0];
-  }
-
-  n_low = locate_energy_index(En);
-  n_high = n_low + 1;
-  
-  m_xHII_low = locate_xHII_index(xHII_call);
-  m_xHII_high = m_xHII_low + 1;
-  //    printf("%f %f %f\n",xHII_call,XHII[m_xHII_low],XHII[m_xHII_high]);
-  
-  // First linear interpolation in energy
-  elow_result = ((x_int_nion_HeI[m_xHII_low][n_high]-x_int_nion_HeI[m_xHII_low][n_low])/
-		 (x_int_Energy[n_high]-x_int_Energy[n_low]));
-  elow_result *= (En - x_int_Energy[n_low]);
-  elow_result += x_int_nion_HeI[m_xHII_low][n_low];
-  
-  // Second linear interpolation in energy
-  ehigh_result = ((x_int_nion_HeI[m_xHII_high][n_high]-x_int_nion_HeI[m_xHII_high][n_low])/
-		  (x_int_Energy[n_high]-x_int_Energy[n_low]));
-  ehigh_result *= (En - x_int_Energy[n_low]);
-  ehigh_result += x_int_nion_HeI[m_xHII_high][n_low];
-  
-  // Final interpolation over the ionized fraction
-  final_result = (ehigh_result - elow_result)/(x_int_XHII[m_xHII_high] - x_int_XHII[m_xHII_low]);
-  final_result *= (xHII_call - x_int_XHII[m_xHII_low]);
-  final_result += elow_result;
-  
-  return final_result;
+  return interp_x_int_table(x_int_nion_HeI, En, xHII_call, 0.0);
 }
 
 // Function to compute nHeII for an interacting electron, given energy En and IGM ionized fraction
@@ -385,81 +424,56 @@ float interp_nion_HeI(float En, float xHII_call)
 // it just uses those values.
 float interp_nion_HeII(float En, float xHII_call)
 {
-  int n_low,n_high;
-  int m_xHII_low,m_xHII_high;
-
-  float elow_result,ehigh_result,final_result;
-
-  // Check if En is inside interpolation boundaries
-  if (En > 0.999*x_int_Energy[x_int_NENERGY-1]) {
-    // If it is above the upper limit, we just assume that it is near the upper limit, which
-    // has anyway reached the asymptotic limit
-    En = x_int_Energy[x_int_NENERGY-1]*0.999;
-  } else if (En < x_int_Energy[0]) {
-    return 0.0;
-  }
-
-  // Check if ionized fraction is within boundaries; if not, adjust to be within
-  if (xHII_call > x_int_XHII[x_int_NXHII-1]*0.999) {
-    xHII_call = x_int_XHII[x_int_NXHII-1]*0.999;
-  } else if (xHII_call < x_int_XHII[0]) {
-    xHII_call = 1.001*x_int_XHII[0];
-  }
-
-  n_low = locate_energy_index(En);
-  n_high = n_low + 1;
-  
-  m_xHII_low = locate_xHII_index(xHII_call);
-  m_xHII_high = m_xHII_low + 1;
-  //    printf("%f %f %f\n",xHII_call,XHII[m_xHII_low],XHII[m_xHII_high]);
-  
-  // First linear interpolation in energy
-  elow_result = ((x_int_nion_HeII[m_xHII_low][n_high]-x_int_nion_HeII[m_xHII_low][n_low])/
-		 (x_int_Energy[n_high]-x_int_Energy[n_low]));
-  elow_result *= (En - x_int_Energy[n_low]);
-  elow_result += x_int_nion_HeII[m_xHII_low][n_low];
-  
-  // Second linear interpolation in energy
-  ehigh_result = ((x_int_nion_HeII[m_xHII_high][n_high]-x_int_nion_HeII[m_xHII_high][n_low])/
-		  (x_int_Energy[n_high]-x_int_Energy[n_low]));
-  ehigh_result *= (En - x_int_Energy[n_low]);
-  ehigh_result += x_int_nion_HeII[m_xHII_high][n_low];
-  
-  // Final interpolation over the ionized fraction
-  final_result = (ehigh_result - elow_result)/(x_int_XHII[m_xHII_high] - x_int_XHII[m_xHII_low]);
-  final_result *= (xHII_call - x_int_XHII[m_xHII_low]);
-  final_result += elow_result;
-  
-  return final_result;
+  return interp_x_int_table(x_int_nion_HeII, En, xHII_call, 0.0);
 }
 
 // Function to find bounding indices on the energy array, for an input energy En.
-// Note it is done exactly for speed, since all the energy arrays have the same structure.
-int locate_energy_index(float En) 
+// Note it is done exactly for speed, since all the energy arrays have the same structure: log-spaced
+// from 10 eV with one step up to 1008.88 eV and another above.  initialize_interp_arrays() checks
+// that the tables are on this grid; if they are not, the index is found by bisection.
+static inline int energy_index_analytic(float En)
 {
-  int n_low;
-
   // Find energy table location analytically!
-  if (En < 1008.88) {
-    n_low = (int)(log(En/10.0)/1.98026273e-2);
-  } else {
-    n_low = 232 + (int)(log(En/1008.88)/9.53101798e-2);
+  if (En < X_INT_E_BREAK) {
+    return (int)(log(En/X_INT_E_LOW)/X_INT_DLNE_LOW);
   }
+  return X_INT_N_BREAK + (int)(log(En/X_INT_E_BREAK)/X_INT_DLNE_HIGH);
+}
 
+int locate_energy_index(float En) 
+{
+  int n_low, n_high, n_mid;
+
+  if (x_int_energy_analytic)
+    return energy_index_analytic(En);
+
+  n_low = 0;
+  n_high = x_int_NENERGY - 1;
+  while (n_high - n_low > 1) {
+    n_mid = (n_low + n_high)/2;
+    if (En < x_int_Energy[n_mid])
+      n_high = n_mid;
+    else
+      n_low = n_mid;
+  }
   return n_low;
 }
 
 // Function to find bounding indices on the ionized fraction array, for an input fraction
-// xHII_call.  This is done by comparing to each element, since there are only 14 elements.
+// xHII_call, i.e. the last element that is <= xHII_call.  The ionized fractions are not evenly
+// spaced in either x or log(x), so this is a bisection (at most 4 comparisons for 14 elements).
 int locate_xHII_index(float xHII_call) 
 {
-  int m_xHII_low;
-
-  // Determine relevant ionized fractions to interpolate; do iteratively because few elements
-  m_xHII_low = x_int_NXHII - 1;
-  while (xHII_call < x_int_XHII[m_xHII_low]) {
-    m_xHII_low--;
+  int m_xHII_low, m_xHII_high, m_xHII_mid;
+
+  m_xHII_low = 0;
+  m_xHII_high = x_int_NXHII;
+  while (m_xHII_high - m_xHII_low > 1) {
+    m_xHII_mid = (m_xHII_low + m_xHII_high)/2;
+    if (xHII_call < x_int_XHII[m_xHII_mid])
+      m_xHII_high = m_xHII_mid;
+    else
+      m_xHII_low = m_xHII_mid;
   }
   return m_xHII_low;
 }
-
@@ -0,0 +1,165 @@
+#ifndef _FCOLL_HELPERS_
+#define _FCOLL_HELPERS_
+
+#include "../Parameter_files/INIT_PARAMS.H"
+#include "../Parameter_files/ANAL_PARAMS.H"
+#include "reduction_helper_progs.c"
+
+/*
+  Shared collapsed fraction normalization, used by Ts.c and find_HII_bubbles.c.
+
+  Both programs normalize the conditional collapsed fraction of a filtered density box so that its
+  mean over the box is the (Sheth-Tormen) mean collapsed fraction.  MEAN_FCOLL_BOX sweeps the whole
+  box once, in parallel over the rows of the box, and returns the exact mean (summed in the same
+  deterministic order as box_sum() in reduction_helper_progs.c).  Everything that only
+  depends on the redshift and the filter scale (growth factors, the erfc argument scaling) is set
+  once in the fcoll_box before the sweep, so the per-cell work is one interpolation or erfc.  Each
+  row is first copied to a contiguous buffer of overdensities.
+
+  The sweep is thread safe: the erfc is evaluated with erfcc() (which is what splined_erfc() in ps.c
+  returns, without its shared spline accelerator), and the splines without accelerators.
+
+  Usage:
+     fcoll_box fb;
+     init_fcoll_box(&fb, box, 0);
+     set_fcoll_erfc(&fb, Deltac/dicke(z), 1/(sqrt(2)*sigma));   or   set_fcoll_sfr(&fb, ...);
+     fb.fcoll = Fcoll;  // optional: also keep the collapsed fraction of every cell
+     f_coll = mean_fcoll_box(&fb);
+*/
+
+#define FCOLL_ERFC (int) 0 // erfc((erfc_delta_c - delta) * erfc_scale) for delta < erfc_delta_c, otherwise unity
+#define FCOLL_SFR (int) 1 // the splines of the halo mass dependent ionizing efficiency (New in v1.4)
+
+typedef struct{
+  float *box; // the filtered box, in the padded layout of an in-place FFT if padded
+  int padded;
+  float growth; // the box values times growth are the overdensities delta
+
+  int type; // FCOLL_ERFC or FCOLL_SFR
+  double erfc_delta_c, erfc_scale;
+  gsl_spline *sfr_low; // log10(fcoll) against log10(1+delta), for delta < 1.5
+  float *sfr_high_delta, *sfr_high_fcoll, *sfr_high_d2; // splint tables for 1.5 <= delta < sfr_delta_max
+  int sfr_high_n;
+  float sfr_delta_max; // the collapsed fraction is unity above this overdensity
+
+  float *fcoll; // if not NULL, the collapsed fraction of every cell is written here, in the layout of box
+} fcoll_box;
+
+
+/* Sets up fb for the float box <box> (padded for the in-place FFT layout), with unit growth and no output */
+void init_fcoll_box(fcoll_box *fb, float *box, int padded){
+  fb->box = box;
+  fb->padded = padded;
+  fb->growth = 1;
+  fb->type = FCOLL_ERFC;
+  fb->erfc_delta_c = Deltac;
+  fb->erfc_scale = 1;
+  fb->sfr_low = NULL;
+  fb->sfr_high_delta = fb->sfr_high_fcoll = fb->sfr_high_d2 = NULL;
+  fb->sfr_high_n = 0;
+  fb->sfr_delta_max = Deltac;
+  fb->fcoll = NULL;
+}
+
+void set_fcoll_erfc(fcoll_box *fb, double erfc_delta_c, double erfc_scale){
+  fb->type = FCOLL_ERFC;
+  fb->erfc_delta_c = erfc_delta_c;
+  fb->erfc_scale = erfc_scale;
+}
+
+/*
+  The sfr_high tables are the 0-offset arrays (splint is called with them minus one).  Above
+  sfr_delta_max the collapsed fraction is set to unity; Ts.c and FcollSpline_SFR() in ps.c use
+  0.99*Deltac, as close to the critical density the splined collapsed fraction becomes a little unstable.
+*/
+void set_fcoll_sfr(fcoll_box *fb, gsl_spline *sfr_low, float *sfr_high_delta, float *sfr_high_fcoll,
+		   float *sfr_high_d2, int sfr_high_n, float sfr_delta_max){
+  fb->type = FCOLL_SFR;
+  fb->sfr_low = sfr_low;
+  fb->sfr_high_delta = sfr_high_delta;
+  fb->sfr_high_fcoll = sfr_high_fcoll;
+  fb->sfr_high_d2 = sfr_high_d2;
+  fb->sfr_high_n = sfr_high_n;
+  fb->sfr_delta_max = sfr_delta_max;
+}
+
+
+/*
+  The collapsed fraction at overdensity delta from the FCOLL_SFR splines, as FcollSpline_SFR() in ps.c
+  with its cutoff at fb->sfr_delta_max.  The low density spline is evaluated without an accelerator,
+  so this can be called from several threads.
+*/
+float fcoll_sfr_value(fcoll_box *fb, float delta){
+  float fcoll;
+
+  if (delta < 1.5){
+    if (delta < -1.)
+      return 0;
+    fcoll = pow(10., gsl_spline_eval(fb->sfr_low, log10(delta+1.), NULL));
+  }
+  else if (delta < fb->sfr_delta_max){
+    splint(fb->sfr_high_delta-1, fb->sfr_high_fcoll-1, fb->sfr_high_d2-1, fb->sfr_high_n, delta, &fcoll);
+  }
+  else
+    return 1;
+
+  if (fcoll > 1.) fcoll = 1.;
+  return fcoll;
+}
+
+
+/*
+  Function MEAN_FCOLL_BOX returns the mean collapsed fraction of the box described by fb,
+  and writes the collapsed fraction of every cell to fb->fcoll if it is set.
+*/
+double mean_fcoll_box(fcoll_box *fb){
+  unsigned long long row, row_start;
+  double f_coll, row_sum, *row_total;
+  float row_delta[HII_DIM], row_fcoll[HII_DIM];
+  int k;
+
+  // the sums of the rows, added pairwise at the end (without the memory for them, the rows are summed serially)
+  row_total = (double *) malloc(sizeof(double)*HII_DIM*HII_DIM);
+  f_coll = 0;
+#pragma omp parallel for if(row_total) shared(fb, row_total, f_coll) private(row, row_start, row_sum, row_delta, row_fcoll, k)
+  for (row=0; row<(unsigned long long)HII_DIM*HII_DIM; row++){
+
+    // the overdensities of this row
+    row_start = fb->padded ? HII_R_FFT_INDEX(row/HII_DIM, row%HII_DIM, 0) : row*HII_DIM;
+    for (k=0; k<HII_DIM; k++)
+      row_delta[k] = fb->box[row_start+k] * fb->growth;
+
+    // and their collapsed fractions
+    row_sum = 0;
+    if (fb->type == FCOLL_ERFC){
+      for (k=0; k<HII_DIM; k++){
+	row_fcoll[k] = (row_delta[k] < fb->erfc_delta_c) ?
+	  erfcc((fb->erfc_delta_c - row_delta[k]) * fb->erfc_scale) : 1;
+	row_sum += row_fcoll[k];
+      }
+    }
+    else{
+      for (k=0; k<HII_DIM; k++){
+	row_fcoll[k] = fcoll_sfr_value(fb, row_delta[k]);
+	row_sum += row_fcoll[k];
+      }
+    }
+
+    if (fb->fcoll){
+      for (k=0; k<HII_DIM; k++)
+	fb->fcoll[row_start+k] = row_fcoll[k];
+    }
+    if (row_total)
+      row_total[row] = row_sum;
+    else
+      f_coll += row_sum;
+  }
+
+  if (row_total){
+    f_coll = pairwise_sum(row_total, (unsigned long long)HII_DIM*HII_DIM, 1);
+    free(row_total);
+  }
+  return f_coll / (double) HII_TOT_NUM_PIXELS;
+}
+
+#endif
@@ -5,53 +5,103 @@ Probably not so important to look in here
 ***********************************************************************/
 #include "../Parameter_files/INIT_PARAMS.H"
 #include "../Parameter_files/ANAL_PARAMS.H"
+#include "power_spec_helper_progs.c"
 
 
 void doFFT(float *R, fftwf_complex *Rf, long Nf, int dim);
 void doInverseFFT(fftwf_complex *Rf, float *R, long Nf, int dim);
+void destroyFFTPlans();
 void initialize(float **K,float **Pk, int **count, int flag);
 int knum(int i);
 void makePk(float *K, float *Pk, int *Count, fftwf_complex *Rf);
 
 
+/*
+  Plans are made once per (dimension, direction) and re-used with the new-array execute
+  functions; FFTW allows this for arrays with the same alignment as the ones planned with
+  (which is the case for arrays from fftwf_malloc), otherwise a one-off plan is made.
+  [dim==3][inverse]
+*/
+fftwf_plan FFT_PLANS[2][2] = {{NULL, NULL}, {NULL, NULL}};
+int FFT_PLAN_ALIGNMENT[2][2][2]; // alignment of the real and complex arrays of the plans
+
+
+fftwf_plan getFFTPlan(float *R, fftwf_complex *Rf, int dim, int inverse, int *one_off)
+{
+    int d = (dim == 3);
+    fftwf_plan p;
+
+    *one_off = 0;
+    if(FFT_PLANS[d][inverse] &&
+       (fftwf_alignment_of(R) == FFT_PLAN_ALIGNMENT[d][inverse][0]) &&
+       (fftwf_alignment_of((float *)Rf) == FFT_PLAN_ALIGNMENT[d][inverse][1]))
+	return FFT_PLANS[d][inverse];
+
+    if(!inverse)
+	p = (dim == 2) ? fftwf_plan_dft_r2c_2d(HII_DIM, HII_DIM, R, Rf, FFTW_ESTIMATE) :
+	    fftwf_plan_dft_r2c_3d(HII_DIM, HII_DIM, HII_DIM, R, Rf, FFTW_ESTIMATE);
+    else
+	p = (dim == 2) ? fftwf_plan_dft_c2r_2d(HII_DIM, HII_DIM, Rf, R, FFTW_ESTIMATE) :
+	    fftwf_plan_dft_c2r_3d(HII_DIM, HII_DIM, HII_DIM, Rf, R, FFTW_ESTIMATE);
+
+    if(FFT_PLANS[d][inverse]) // a differently aligned array, don't replace the cached plan
+	*one_off = 1;
+    else
+    {
+	FFT_PLANS[d][inverse] = p;
+	FFT_PLAN_ALIGNMENT[d][inverse][0] = fftwf_alignment_of(R);
+	FFT_PLAN_ALIGNMENT[d][inverse][1] = fftwf_alignment_of((float *)Rf);
+    }
+    return p;
+}
+
+
 /*Called to take Fourier transform of field*/
 void doFFT(float *R, fftwf_complex *Rf, long Nf, int dim)
 {
-    int i;
+    int i, one_off;
     float dvol = pow(BOX_LEN/HII_DIM,dim);
-    fftwf_plan p;
-    if(dim == 2)
-	p  = fftwf_plan_dft_r2c_2d(HII_DIM, HII_DIM, (float *)R, (fftwf_complex *)Rf, FFTW_ESTIMATE);
-    else
-	p  = fftwf_plan_dft_r2c_3d(HII_DIM, HII_DIM, HII_DIM, (float *)R, (fftwf_complex *)Rf, FFTW_ESTIMATE);
-    fftwf_execute(p);
+    fftwf_plan p = getFFTPlan(R, Rf, dim, 0, &one_off);
+
+    fftwf_execute_dft_r2c(p, R, Rf);
 
     for(i = 0; i<Nf; i++)
     {
 	Rf[i] *= dvol;  //d^3x differential
     }
 
-    fftwf_destroy_plan(p);
+    if(one_off)
+	fftwf_destroy_plan(p);
 }
 
 /* Calculates inverse fourier transform of real field R*/
 void doInverseFFT(fftwf_complex *Rf, float *R, long N, int dim)
 {
-    int i;
-    fftwf_plan p;
+    int i, one_off;
     float dvol = pow(BOX_LEN,dim);
+    fftwf_plan p = getFFTPlan(R, Rf, dim, 1, &one_off);
 
-    if(dim == 2)
-	p  = fftwf_plan_dft_c2r_2d(HII_DIM, HII_DIM, Rf, R, FFTW_ESTIMATE);
-    else 
-	p  = fftwf_plan_dft_c2r_3d(HII_DIM, HII_DIM, HII_DIM, Rf, R, FFTW_ESTIMATE);
-    fftwf_execute(p);
+    fftwf_execute_dft_c2r(p, Rf, R);
     for(i = 0; i<N; i++)
     {
 	R[i] /= dvol;
     }
 
-    fftwf_destroy_plan(p);
+    if(one_off)
+	fftwf_destroy_plan(p);
+}
+
+/* Frees the cached plans */
+void destroyFFTPlans()
+{
+    int d, inverse;
+    for(d = 0; d < 2; d++)
+	for(inverse = 0; inverse < 2; inverse++)
+	    if(FFT_PLANS[d][inverse])
+	    {
+		fftwf_destroy_plan(FFT_PLANS[d][inverse]);
+		FFT_PLANS[d][inverse] = NULL;
+	    }
 }
 
 
@@ -103,37 +153,30 @@ Makes power spectrum
 *******************************************************************/
 void makePk(float *K, float *Pk, int *Count, fftwf_complex *Rf)
 {
-    int i, k, l, a, n;
-    float m;
+    int n, NUM_BINS = HII_DIM*sqrt(2)/2. + 1;
     float dk = 2.*M_PI/BOX_LEN;
     float volume = pow(BOX_LEN, 2);
-
-    for(n = 0; n< HII_DIM*sqrt(2)/2.; n++)
-    {
-	Count[n] = 0.;
-	K[n] = 0.;
+    ps_bins k_bins;
+    ps_estimator ps;
+
+    // bin n is centered on n*dk, and every stored mode but the k==0 and nyquist
+    // columns has a conjugate twin (see power_spec_helper_progs.c)
+    if ( (set_linear_ps_bins(&k_bins, -0.5*dk, dk, NUM_BINS) < 0) ||
+	 (init_ps_estimator(&ps, k_bins, 0, 1.0) < 0) ){
+	fprintf(stderr, "makePk: Error allocating memory.\nAborting...\n");
+	exit(1);
+    }
+    ps.hermitian_weights = 1;
+    if (accumulate_power_spec(&ps, Rf, NULL, HII_DIM, 2, BOX_LEN) < 0){
+	fprintf(stderr, "makePk: Error allocating memory.\nAborting...\n");
+	exit(1);
     }
-  
-    for(i =  0; i< HII_DIM; i++)
-	    for(k =  0; k< HII_DIM/2 + 1; k++)
-	    {
-		a = 2;
-		if(k == 0 || k == HII_DIM/2 + 1)
-		    a = 1;
-		l = i*(HII_DIM/2 +1) + k;
-		m = sqrt(knum(i)*knum(i) + k*k);
-		n = (int) (m + .5);
-		K[n] += a*dk*m;
-      
-		Pk[n] += a*( crealf(Rf[l])*crealf(Rf[l]) + cimagf(Rf[l])*cimagf(Rf[l]) );
-
-		Count[n]+=a;
-	    }
 
-  
     for(n = 0; n< HII_DIM*sqrt(2)/2.; n++)
     {
-	K[n] /= Count[n];
-	Pk[n] /= (Count[n]*volume);
+	Count[n] = ps.in_bin_ct[n];
+	K[n] = ps.k_ave[n]/Count[n];
+	Pk[n] = ps.p_box[n]/(Count[n]*volume);
     }
+    free_ps_estimator(&ps);
 }
@@ -4,23 +4,25 @@
 #include "../Parameter_files/INIT_PARAMS.H"
 
 /*
-  Function FILTER filters the k-space box, <box>, using filter type
-  <filter_type> on a characteristic comoving scale <R> (in Mpc), where:
+  Function FILTER_BOX fills the k-space box, <box>, with the k-space box <src>, filtered
+  using filter type <filter_type> on a characteristic comoving scale <R> (in Mpc), where:
   0 = top-hat real space filter
   1 = top-hat k-space filter
   2 = gaussian
 
-  Relavant box parameters are taken from INIT_PARAMS.H
+  <box> and <src> may be the same array, in which case the box is filtered in place.
+  This way a pristine k-space box can be kept around, and each filtered field is obtained
+  in a single pass into a (reused) work buffer.
 
-  The function returns the filtered k field, <box>.
+  Relavant box parameters are taken from INIT_PARAMS.H
 */
 
-void filter(fftwf_complex *box, int filter_type, float R){
+void filter_box(fftwf_complex *box, fftwf_complex *src, int filter_type, float R){
   int n_x, n_z, n_y;
   float k_x, k_y, k_z, k_mag, kR;
 
   // loop through k-box
-#pragma omp parallel shared(box, filter_type, R) private(k_x, k_y, k_z, k_mag, kR, n_x, n_z, n_y)
+#pragma omp parallel shared(box, src, filter_type, R) private(k_x, k_y, k_z, k_mag, kR, n_x, n_z, n_y)
 {
 
 #pragma omp for 
@@ -40,20 +42,25 @@ void filter(fftwf_complex *box, int filter_type, float R){
 	kR = k_mag*R; // real space top-hat
 	if (filter_type == 0){ // real space top-hat
 	  if (kR > 1e-4){
-	    box[C_INDEX(n_x, n_y, n_z)] *= 3.0 * (sin(kR)/pow(kR, 3) - cos(kR)/pow(kR, 2));
+	    box[C_INDEX(n_x, n_y, n_z)] = src[C_INDEX(n_x, n_y, n_z)] * (3.0 * (sin(kR)/pow(kR, 3) - cos(kR)/pow(kR, 2)));
 	  }
+	  else
+	    box[C_INDEX(n_x, n_y, n_z)] = src[C_INDEX(n_x, n_y, n_z)];
 	}
 	else if (filter_type == 1){ // k-space top hat
 	  kR *= 0.413566994; // equates integrated volume to the real space top-hat (9pi/2)^(-1/3)
 	  if (kR > 1){
 	    box[C_INDEX(n_x, n_y, n_z)] = 0;
 	  }
+	  else
+	    box[C_INDEX(n_x, n_y, n_z)] = src[C_INDEX(n_x, n_y, n_z)];
 	}
 	else if (filter_type == 2){ // gaussian
 	  kR *= 0.643; // equates integrated volume to the real space top-hat
-	  box[C_INDEX(n_x, n_y, n_z)] *= pow(E, -kR*kR/2.0);
+	  box[C_INDEX(n_x, n_y, n_z)] = src[C_INDEX(n_x, n_y, n_z)] * pow(E, -kR*kR/2.0);
 	}
 	else{
+	  box[C_INDEX(n_x, n_y, n_z)] = src[C_INDEX(n_x, n_y, n_z)];
 	  if ( (n_x==0) && (n_y==0) && (n_z==0) )
 	    fprintf(stderr, "filter.c: Warning, filter type %i is undefined\nBox is unfiltered\n", filter_type);
 	}
@@ -65,4 +72,15 @@ void filter(fftwf_complex *box, int filter_type, float R){
   return;
 }
 
+
+/*
+  Function FILTER filters the k-space box, <box>, in place (see FILTER_BOX above).
+
+  The function returns the filtered k field, <box>.
+*/
+
+void filter(fftwf_complex *box, int filter_type, float R){
+  filter_box(box, box, filter_type, R);
+}
+
 #endif
@@ -1,6 +1,7 @@
 #include "bubble_helper_progs.c"
 #include "heating_helper_progs.c"
 #include "../Parameter_files/SOURCES.H"
+#include "halo_catalog_helper_progs.c"
 
 /*
   USAGE: find_HII_bubbles [-p <num of processors>] <redshift> [<previous redshift>]
@@ -174,17 +175,18 @@ int parse_arguments(int argc, char ** argv, int * num_th, int * arg_offset, floa
 int main(int argc, char ** argv){
   char filename[1000], error_message[1000];
   FILE *F = NULL, *pPipe = NULL;
-  float REDSHIFT, PREV_REDSHIFT, mass, R, xf, yf, zf, growth_factor, pixel_mass, cell_length_factor, massofscaleR;
+  float REDSHIFT, PREV_REDSHIFT, mass, R, growth_factor, pixel_mass, cell_length_factor, massofscaleR;
   float ave_N_min_cell, ION_EFF_FACTOR, M_MIN;
   int x,y,z, N_min_cell, LAST_FILTER_STEP, num_th, arg_offset, i,j,k;
   unsigned long long ct, ion_ct, sample_ct;
-  float f_coll_crit, pixel_volume,  density_over_mean, erfc_num, erfc_denom, erfc_denom_cell, res_xH, Splined_Fcoll;
+  float f_coll_crit, density_over_mean, erfc_denom, erfc_denom_cell, res_xH;
   // - RM
   float Splined_zeta;
   float *xH=NULL, TVIR_MIN, MFP, xHI_from_xrays, std_xrays, *z_re=NULL, *Gamma12=NULL, *mfp=NULL;
   fftwf_complex *M_coll_unfiltered=NULL, *M_coll_filtered=NULL, *deltax_unfiltered=NULL, *deltax_filtered=NULL, *xe_unfiltered=NULL, *xe_filtered=NULL;
   fftwf_complex *N_rec_unfiltered=NULL, *N_rec_filtered=NULL;
   fftwf_plan plan;
+  fcoll_box fcoll_norm;
   double global_xH, ave_xHI_xrays, ave_den, ST_over_PS, mean_f_coll_st, f_coll, ave_fcoll, dNrec;
   const gsl_rng_type * T=NULL;
   gsl_rng * r=NULL;
@@ -205,6 +207,9 @@ int main(int argc, char ** argv){
   src = defaultSources();
 
   int HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY = 0;
+  halo_catalog halo_cat = {0};
+  halo_record *halos = NULL;
+  long long num_read = 0, halo_ct;
   
   double aveR = 0;
   unsigned long long Rct = 0;
@@ -253,7 +258,6 @@ int main(int argc, char ** argv){
   fabs_dtdz = fabs(dtdz(REDSHIFT));
   t_ast = T_AST * t_hubble(REDSHIFT);
   growth_factor = dicke(REDSHIFT);
-  pixel_volume = pow(BOX_LEN/(float)HII_DIM, 3);
   pixel_mass = RtoM(L_FACTOR*BOX_LEN/(float)HII_DIM);
   // this parameter choice is sensitive to noise on the cell size, at least for the typical
   // cell sizes in RT simulations.  it probably doesn't matter for larger cell sizes.
@@ -391,11 +395,10 @@ int main(int argc, char ** argv){
 	  }
 	  xH[ct] = 1-xH[ct]; // convert from x_e to xH
 	  if (xH[ct]<0) xH[ct] = 0; //  should not happen....
-	  global_xH += xH[ct];
 	}
 	fclose(F);
 	F = NULL;
-	global_xH /= (double)HII_TOT_NUM_PIXELS;
+	global_xH = box_sum(xH, 0) / (double)HII_TOT_NUM_PIXELS;
       }
       else{
 	// find the neutral fraction
@@ -506,24 +509,36 @@ int main(int argc, char ** argv){
       
       // read in the halo list
       sprintf(filename, "../Output_files/Halo_lists/updated_halos_z%06.2f_%i_%.0fMpc", REDSHIFT, DIM, BOX_LEN);
-      F = fopen(filename, "r");
-      if (!F){
+      halos = (halo_record *) malloc(sizeof(halo_record)*HALO_CATALOG_CHUNK);
+      if (!halos || (open_halo_catalog_read(&halo_cat, filename) != 0)){
 	strcpy(error_message, "find_HII_bubbles.c: Unable to open halo list file: ");
 	strcat(error_message, filename);
 	strcat(error_message, "\nAborting...\n");
 	goto CLEANUP;
       }
       // now read in all halos above our threshold into the smoothed halo field
-      fscanf(F, "%e %f %f %f", &mass, &xf, &yf, &zf);
-      while (!feof(F) && (mass>=M_MIN)){
-	x = xf*HII_DIM;
-	y = yf*HII_DIM;
-	z = zf*HII_DIM;
-	*((float *)M_coll_unfiltered + HII_R_FFT_INDEX(x, y, z)) += mass;
-	fscanf(F, "%e %f %f %f", &mass, &xf, &yf, &zf);
+      // (the catalog is ordered by decreasing halo mass, so we can stop at the first halo below M_MIN)
+      mass = M_MIN;
+      while ((mass>=M_MIN) && ((num_read = read_halo_records(&halo_cat, halos, HALO_CATALOG_CHUNK)) > 0)){
+	for (halo_ct=0; halo_ct<num_read; halo_ct++){
+	  mass = halos[halo_ct].mass;
+	  if (mass < M_MIN)
+	    break;
+	  x = halos[halo_ct].x*HII_DIM;
+	  y = halos[halo_ct].y*HII_DIM;
+	  z = halos[halo_ct].z*HII_DIM;
+	  *((float *)M_coll_unfiltered + HII_R_FFT_INDEX(x, y, z)) += mass;
+	}
+      }
+      close_halo_catalog(&halo_cat);
+      free(halos);
+      halos = NULL;
+      if (num_read < 0){
+	strcpy(error_message, "find_HII_bubbles.c: Read error occured while reading halo list file: ");
+	strcat(error_message, filename);
+	strcat(error_message, "\nAborting...\n");
+	goto CLEANUP;
       }
-      fclose(F);
-	  F = NULL;
     } // end of the USE_HALO_FIELD option
 
     
@@ -652,6 +667,8 @@ int main(int argc, char ** argv){
       fftwf_free(deltax_filtered);
       fftwf_free(M_coll_unfiltered);
       fftwf_free(M_coll_filtered);
+      close_halo_catalog(&halo_cat);
+      free(halos);
       fftwf_cleanup_threads();
       free_ps();
       if (INHOMO_RECO) { free_MHR();}
@@ -783,61 +800,14 @@ int main(int argc, char ** argv){
     }*/
 	}
 
-	for (x=0; x<HII_DIM; x++){
-	  for (y=0; y<HII_DIM; y++){
-	    for (z=0; z<HII_DIM; z++){
-	      if (USE_HALO_FIELD){
-		Splined_Fcoll = *((float *)M_coll_filtered + HII_R_FFT_INDEX(x,y,z)) / (massofscaleR*density_over_mean);
-		Splined_Fcoll *= (4/3.0)*PI*pow(R,3) / pixel_volume;
-    // - RM
-    /*
-    if(USE_GENERAL_SOURCES)
-    {
-      Splined_zeta = *((float *)M_coll_filtered + HII_R_FFT_INDEX(x,y,z)) / (massofscaleR*density_over_mean);
-      Splined_zeta *= (4/3.0)*PI*pow(R,3) / pixel_volume;
-    }*/
-	      }
-	    
-	      else{
-          // - RM
-          /*
-      if(USE_GENERAL_SOURCES) {
-        density_over_mean = 1.0 + *((float *)deltax_filtered + HII_R_FFT_INDEX(x,y,z)); 
-        zetaSpline_SFR(density_over_mean - 1,&(Splined_zeta));
-      }*/
-		density_over_mean = 1.0 + *((float *)deltax_filtered + HII_R_FFT_INDEX(x,y,z));	    
-		if ( (density_over_mean - 1) < Deltac){ // we are not resolving collapsed structures
-		  if (HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY) { // New in v1.4
-			FcollSpline_SFR(density_over_mean - 1,&(Splined_Fcoll));
-      }
-		
-		  else{ // we can assume the classic constant ionizing luminosity to halo mass ratio
-		    erfc_num = (Deltac - (density_over_mean-1)) /  growth_factor;
-		    Splined_Fcoll = splined_erfc(erfc_num/erfc_denom);
-      }
-		  	}      
-		
-		else { // the entrire cell belongs to a collpased halo...  this is rare...
-		  Splined_Fcoll =  1.0;
-		}
-	      }
-
-	      // save the value of the collasped fraction into the Fcoll array
-	      Fcoll[HII_R_FFT_INDEX(x,y,z)] = Splined_Fcoll;
-	      f_coll += Splined_Fcoll;	  
-        // - RM
-        /*
-        if(USE_GENERAL_SOURCES)
-        {
-          Fcoll[HII_R_FFT_INDEX(x,y,z)] = Splined_Fcoll * Splined_zeta;
-          //if(x == 0 && y == 0 && z == 0) printf("Fcoll, zeta = %le %le\n", Splined_Fcoll, Splined_zeta);
-          f_coll += Splined_Fcoll;
-        }  */
-	    }
-	  }
-	} //  end loop through Fcoll box
-
-	f_coll /= (double) HII_TOT_NUM_PIXELS; // ave PS fcoll for this filter scale
+	// the collapsed fraction of every cell, and its mean (the ave PS fcoll for this filter scale)
+	init_fcoll_box(&fcoll_norm, (float *)deltax_filtered, 1);
+	if (HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY) // New in v1.4; FcollSpline_SFR() of Cosmo_c_files/ps.c, unity above 0.99*Deltac
+	  set_fcoll_sfr(&fcoll_norm, FcollLow_spline, Overdense_spline_SFR, Fcoll_spline_SFR, second_derivs_SFR, NSFR_high, 0.99*Deltac);
+	else // we can assume the classic constant ionizing luminosity to halo mass ratio
+	  set_fcoll_erfc(&fcoll_norm, Deltac, 1.0/(growth_factor*erfc_denom));
+	fcoll_norm.fcoll = Fcoll;
+	f_coll = mean_fcoll_box(&fcoll_norm);
 	ST_over_PS = mean_f_coll_st/f_coll; // normalization ratio used to adjust the PS conditional collapsed fraction
 	fprintf(LOG, "end f_coll normalization if, clock=%06.2f\n", (double)clock()/CLOCKS_PER_SEC);
 	fflush(LOG);
@@ -960,11 +930,7 @@ int main(int argc, char ** argv){
     } // END OF LOOP THROUGH FILTER RADII
 
       // find the neutral fraction
-    global_xH = 0;
-    for (ct=0; ct<HII_TOT_NUM_PIXELS; ct++){
-      global_xH += xH[ct];
-    }
-    global_xH /= (float)HII_TOT_NUM_PIXELS;
+    global_xH = box_sum(xH, 0) / (float)HII_TOT_NUM_PIXELS;
 
 
     // update the N_rec field
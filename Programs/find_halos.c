@@ -1,6 +1,8 @@
 #include "../Parameter_files/INIT_PARAMS.H"
 #include "../Parameter_files/ANAL_PARAMS.H"
 #include "filter.c"
+#include "halo_helper_progs.c"
+#include "halo_catalog_helper_progs.c"
 
 FILE *LOG;
 
@@ -12,11 +14,13 @@ FILE *LOG;
   Virialized halos are defined according to the linear critical overdensity.
   FIND_HALOS outputs a list of virialized halos, <halos_N_LMpc>, where
   N^3 is the spacial resolution and L is the comoving length of the box.
-  The columns in <halos_N_LMpc> contains each halo's:
+  <halos_N_LMpc> is a binary halo catalog (see halo_catalog_helper_progs.c),
+  whose records contain each halo's:
   mass (in M_sun)
   x location (in box size, [0 to 1) )
   y location (in box size, [0 to 1) )
   z location (in box size, [0 to 1) )
+  id (the order in which the halos were found)
 
   NOTE: Relevant parameters are taken from INIT_PARAMS.H and ANAL_PARAMS.H
 
@@ -25,223 +29,121 @@ FILE *LOG;
 */
 
 
+typedef struct{
+  int x, y, z;
+  float delta_m;
+} halo_candidate;
+
+
 /*
-  Funtion OVERLAP_HALO checks if the would be halo with radius R
-  and centered on (x,y,z) overlaps with a preesisting halo
+  Function FIND_HALO_CANDIDATES scans the (real space, filtered) box in parallel, and returns in
+  <*candidates> all of the pixels with delta_m > delta_crit which are not flagged in <excluded>
+  and, if <list> is not NULL, would not overlap with a halo in <list> (with radius R_overlap pixels).
+  The threads scan contiguous slabs in thread order, so the candidates come out in the same
+  order as the serial scan through the box.  Since <excluded> and <list> only grow as halos are
+  accepted, a pixel which is not a candidate here could not become a halo later in the scan,
+  and the halos can be accepted by going through the candidates serially.
+  Returns the number of candidates, or -1 on a memory allocation error.
 */
-int overlap_halo(char * in_halo, float R, int x, int y, int z){
-  int x_curr, y_curr, z_curr, x_min, x_max, y_min, y_max, z_min, z_max, R_index;
-  float Rsq_curr_index, xsq, xplussq, xminsq, ysq, yplussq, yminsq, zsq, zplussq, zminsq;
-  int x_index, y_index, z_index;
-
-    fprintf(LOG, "begin overlap halo (%i, %i, %i), clock=%.2f\n", x,y,z,(double)clock()/CLOCKS_PER_SEC);
-    fflush(LOG);
+long long find_halo_candidates(fftwf_complex *box, float growth_factor, float delta_crit, char *excluded,
+			       halo_cell_list *list, float R_overlap, halo_candidate **candidates){
+  int x, y, z, thread_num, num_th, error;
+  float delta_m;
+  long long *th_num, *th_max, num_candidates, ct;
+  halo_candidate **th_candidates, *tmp;
+
+  num_th = omp_get_max_threads();
+  th_candidates = (halo_candidate **) calloc(num_th, sizeof(halo_candidate *));
+  th_num = (long long *) calloc(num_th, sizeof(long long));
+  th_max = (long long *) calloc(num_th, sizeof(long long));
+  if (!th_candidates || !th_num || !th_max){
+    free(th_candidates); free(th_num); free(th_max);
+    return -1;
+  }
 
-  // scale R to a effective overlap size, using R_OVERLAP_FACTOR
-  R *= R_OVERLAP_FACTOR;
-
-  // convert R to index units
-  R_index = ceil(R/BOX_LEN*DIM);
-  Rsq_curr_index = pow(R/BOX_LEN*DIM, 2); // convert to index
-
-  // set parameter range
-  x_min = x-R_index;
-  x_max = x+R_index;
-  y_min = y-R_index;
-  y_max = y+R_index;
-  z_min = z-R_index;
-  z_max = z+R_index;
-
-  //    printf("min %i, %i, %i\n", x_min, y_min, z_min);
-  //printf("max %i, %i, %i\n", x_max, y_max, z_max);
-  for (x_curr=x_min; x_curr<=x_max; x_curr++){
-    for (y_curr=y_min; y_curr<=y_max; y_curr++){
-      for (z_curr=z_min; z_curr<=z_max; z_curr++){
-	x_index = x_curr;
-	y_index = y_curr;
-	z_index = z_curr;
-	// adjust if we are outside of the box
-	if (x_index<0) {x_index += DIM;}
-	else if (x_index>=DIM) {x_index -= DIM;}
-	if (y_index<0) {y_index += DIM;}
-	else if (y_index>=DIM) {y_index -= DIM;}
-	if (z_index<0) {z_index += DIM;}
-	else if (z_index>=DIM) {z_index -= DIM;}
-
-	// remember to check all reflections
-	xsq = pow(x-x_index, 2);
-	ysq = pow(y-y_index, 2);
-	zsq = pow(z-z_index, 2);
-	xplussq = pow(x-x_index+DIM, 2);
-	yplussq = pow(y-y_index+DIM, 2);
-	zplussq = pow(z-z_index+DIM, 2);
-	xminsq = pow(x-x_index-DIM, 2);
-	yminsq = pow(y-y_index-DIM, 2);
-	zminsq = pow(z-z_index-DIM, 2);
-	if ( in_halo[R_INDEX(x_index, y_index, z_index)] && 
-	     ( (Rsq_curr_index > (xsq + ysq + zsq)) || // AND pixel is within this halo
-	       (Rsq_curr_index > (xsq + ysq + zplussq)) || 
-	       (Rsq_curr_index > (xsq + ysq + zminsq)) || 
-			   
-	       (Rsq_curr_index > (xsq + yplussq + zsq)) || 
-	       (Rsq_curr_index > (xsq + yplussq + zplussq)) || 
-	       (Rsq_curr_index > (xsq + yplussq + zminsq)) || 
-
-	       (Rsq_curr_index > (xsq + yminsq + zsq)) || 
-	       (Rsq_curr_index > (xsq + yminsq + zplussq)) || 
-	       (Rsq_curr_index > (xsq + yminsq + zminsq)) || 
-
-
-	       (Rsq_curr_index > (xplussq + ysq + zsq)) || 
-	       (Rsq_curr_index > (xplussq + ysq + zplussq)) || 
-	       (Rsq_curr_index > (xplussq + ysq + zminsq)) || 
-
-	       (Rsq_curr_index > (xplussq + yplussq + zsq)) || 
-	       (Rsq_curr_index > (xplussq + yplussq + zplussq)) || 
-	       (Rsq_curr_index > (xplussq + yplussq + zminsq)) || 
-
-	       (Rsq_curr_index > (xplussq + yminsq + zsq)) || 
-	       (Rsq_curr_index > (xplussq + yminsq + zplussq)) || 
-	       (Rsq_curr_index > (xplussq + yminsq + zminsq)) || 
-
-
-	       (Rsq_curr_index > (xminsq + ysq + zsq)) || 
-	       (Rsq_curr_index > (xminsq + ysq + zplussq)) || 
-	       (Rsq_curr_index > (xminsq + ysq + zminsq)) || 
-
-	       (Rsq_curr_index > (xminsq + yplussq + zsq)) || 
-	       (Rsq_curr_index > (xminsq + yplussq + zplussq)) || 
-	       (Rsq_curr_index > (xminsq + yplussq + zminsq)) || 
-
-	       (Rsq_curr_index > (xminsq + yminsq + zsq)) || 
-	       (Rsq_curr_index > (xminsq + yminsq + zplussq)) || 
-	       (Rsq_curr_index > (xminsq + yminsq + zminsq))
-	       ) ){
-	    
-	  // this pixel already belongs to a halo, and would want to become part of this halo as well
-	  return 1;
+  // make sure the threads only read the halo stencil
+  if (list)
+    halo_stencil_ct(pow(R_overlap, 2));
+
+  error = 0;
+#pragma omp parallel shared(box, growth_factor, delta_crit, excluded, list, R_overlap, th_candidates, th_num, th_max) private(x, y, z, delta_m, thread_num, tmp) reduction(+:error) num_threads(num_th)
+{
+  thread_num = omp_get_thread_num();
+
+#pragma omp for schedule(static)
+  for (x=0; x<DIM; x++){
+    for (y=0; y<DIM; y++){
+      for (z=0; z<DIM; z++){
+	delta_m = *((float *)box + R_FFT_INDEX(x,y,z)) * growth_factor / VOLUME;       // don't forget the factor of 1/VOLUME!
+	if ( (delta_m > delta_crit) && !excluded[R_INDEX(x,y,z)] &&
+	     (!list || !halo_overlaps_cell_list(list, R_overlap, x,y,z)) ){
+	  if (th_num[thread_num] == th_max[thread_num]){
+	    th_max[thread_num] = th_max[thread_num] ? 2*th_max[thread_num] : 1024;
+	    tmp = (halo_candidate *) realloc(th_candidates[thread_num], sizeof(halo_candidate)*th_max[thread_num]);
+	    if (!tmp){
+	      error++;
+	      th_max[thread_num] = th_num[thread_num];
+	      continue;
+	    }
+	    th_candidates[thread_num] = tmp;
+	  }
+	  th_candidates[thread_num][th_num[thread_num]].x = x;
+	  th_candidates[thread_num][th_num[thread_num]].y = y;
+	  th_candidates[thread_num][th_num[thread_num]].z = z;
+	  th_candidates[thread_num][th_num[thread_num]].delta_m = delta_m;
+	  th_num[thread_num]++;
 	}
       }
     }
   }
-
-  return 0;
 }
 
-
-/*
-  Funtion UPDATE_IN_HALO takes in a box <in_halo> and flags all points
-  which fall within radius R of (x,y,z).
-*/
-void update_in_halo(char * in_halo, float R, int x, int y, int z){
-  int x_curr, y_curr, z_curr, x_min, x_max, y_min, y_max, z_min, z_max, R_index;
-  float Rsq_curr_index, xsq, xplussq, xminsq, ysq, yplussq, yminsq, zsq, zplussq, zminsq;
-  int x_index, y_index, z_index;
-
-    fprintf(LOG, "begin update halo (%i, %i, %i), clock=%.2f\n", x,y,z,(double)clock()/CLOCKS_PER_SEC);
-    fflush(LOG);
-
-  // convert R to index units
-  R_index = ceil(R/BOX_LEN*DIM);
-  Rsq_curr_index = pow(R/BOX_LEN*DIM, 2); // convert to index
-
-  // set parameter range
-  x_min = x-R_index;
-  x_max = x+R_index;
-  y_min = y-R_index;
-  y_max = y+R_index;
-  z_min = z-R_index;
-  z_max = z+R_index;
-
-  //printf("min %i, %i, %i\n", x_min, y_min, z_min);
-  //printf("max %i, %i, %i\n", x_max, y_max, z_max);
-  for (x_curr=x_min; x_curr<=x_max; x_curr++){
-    for (y_curr=y_min; y_curr<=y_max; y_curr++){
-      for (z_curr=z_min; z_curr<=z_max; z_curr++){
-	x_index = x_curr;
-	y_index = y_curr;
-	z_index = z_curr;
-	// adjust if we are outside of the box
-	if (x_index<0) {x_index += DIM;}
-	else if (x_index>=DIM) {x_index -= DIM;}
-	if (y_index<0) {y_index += DIM;}
-	else if (y_index>=DIM) {y_index -= DIM;}
-	if (z_index<0) {z_index += DIM;}
-	else if (z_index>=DIM) {z_index -= DIM;}
-
-	// now check
-	if (!in_halo[R_INDEX(x_index, y_index, z_index)]){ // untaken pixel (not part of other halo)
-	  // remember to check all reflections
-	  xsq = pow(x-x_index, 2);
-	  ysq = pow(y-y_index, 2);
-	  zsq = pow(z-z_index, 2);
-	  xplussq = pow(x-x_index+DIM, 2);
-	  yplussq = pow(y-y_index+DIM, 2);
-	  zplussq = pow(z-z_index+DIM, 2);
-	  xminsq = pow(x-x_index-DIM, 2);
-	  yminsq = pow(y-y_index-DIM, 2);
-	  zminsq = pow(z-z_index-DIM, 2);
-	  if ( (Rsq_curr_index > (xsq + ysq + zsq)) || 
-	       (Rsq_curr_index > (xsq + ysq + zplussq)) || 
-	       (Rsq_curr_index > (xsq + ysq + zminsq)) || 
-
-	       (Rsq_curr_index > (xsq + yplussq + zsq)) || 
-	       (Rsq_curr_index > (xsq + yplussq + zplussq)) || 
-	       (Rsq_curr_index > (xsq + yplussq + zminsq)) || 
-
-	       (Rsq_curr_index > (xsq + yminsq + zsq)) || 
-	       (Rsq_curr_index > (xsq + yminsq + zplussq)) || 
-	       (Rsq_curr_index > (xsq + yminsq + zminsq)) || 
-
-
-	       (Rsq_curr_index > (xplussq + ysq + zsq)) || 
-	       (Rsq_curr_index > (xplussq + ysq + zplussq)) || 
-	       (Rsq_curr_index > (xplussq + ysq + zminsq)) || 
-
-	       (Rsq_curr_index > (xplussq + yplussq + zsq)) || 
-	       (Rsq_curr_index > (xplussq + yplussq + zplussq)) || 
-	       (Rsq_curr_index > (xplussq + yplussq + zminsq)) || 
-
-	       (Rsq_curr_index > (xplussq + yminsq + zsq)) || 
-	       (Rsq_curr_index > (xplussq + yminsq + zplussq)) || 
-	       (Rsq_curr_index > (xplussq + yminsq + zminsq)) || 
-
-
-	       (Rsq_curr_index > (xminsq + ysq + zsq)) || 
-	       (Rsq_curr_index > (xminsq + ysq + zplussq)) || 
-	       (Rsq_curr_index > (xminsq + ysq + zminsq)) || 
-
-	       (Rsq_curr_index > (xminsq + yplussq + zsq)) || 
-	       (Rsq_curr_index > (xminsq + yplussq + zplussq)) || 
-	       (Rsq_curr_index > (xminsq + yplussq + zminsq)) || 
-
-	       (Rsq_curr_index > (xminsq + yminsq + zsq)) || 
-	       (Rsq_curr_index > (xminsq + yminsq + zplussq)) || 
-	       (Rsq_curr_index > (xminsq + yminsq + zminsq))
-	     ){
-	    
-	    // we are within the sphere defined by R, so change flag in in_halo array
-	    in_halo[R_INDEX(x_index, y_index, z_index)] = 1;
-	    //	    printf("%i, %i, %i\n", x_index, y_index, z_index);
-	  }
-	}
+  // stitch the thread lists together, in thread order
+  num_candidates = 0;
+  for (thread_num=0; thread_num<num_th; thread_num++)
+    num_candidates += th_num[thread_num];
+  *candidates = NULL;
+  if (!error && (num_candidates > 0)){
+    if (!(*candidates = (halo_candidate *) malloc(sizeof(halo_candidate)*num_candidates)))
+      error = 1;
+    else{
+      ct = 0;
+      for (thread_num=0; thread_num<num_th; thread_num++){
+	if (th_num[thread_num] > 0)
+	  memcpy(*candidates + ct, th_candidates[thread_num], sizeof(halo_candidate)*th_num[thread_num]);
+	ct += th_num[thread_num];
       }
     }
   }
-}
 
+  for (thread_num=0; thread_num<num_th; thread_num++)
+    free(th_candidates[thread_num]);
+  free(th_candidates); free(th_num); free(th_max);
+
+  if (error){
+    fprintf(stderr, "find_halos.c: Error allocating memory for the halo candidates\n");
+    return -1;
+  }
+  return num_candidates;
+}
 
 
 int main(int argc, char ** argv){
-  fftwf_complex *box;
+  fftwf_complex *box, *deltak;
   fftwf_plan plan;
-  FILE *IN, *OUT, *F;
+  FILE *IN, *F;
+  halo_catalog halo_cat, forbidden_cat;
+  halo_record halo, *halo_chunk;
+  long long num_read, halo_ct;
   float growth_factor, R, delta_m, dm, dlnm, M, Delta_R, delta_crit, REDSHIFT;
   double fgrtm, dfgrtm;
   unsigned long long ct;
   char filename[80], *in_halo, *forbidden;
-  int x,y,z,dn, n;
-  float R_temp, x_temp, y_temp, z_temp, dummy, M_MIN;
+  halo_cell_list halo_list;
+  halo_candidate *candidates;
+  long long num_candidates, cand_ct;
+  int x,y,z,dn, n, status = 0;
+  float R_temp, M_MIN;
 
   /************  BEGIN INITIALIZATION ****************************/
   if (argc != 2){
@@ -289,6 +191,14 @@ int main(int argc, char ** argv){
   // initialize
   memset(in_halo, 0, sizeof(char)*TOT_NUM_PIXELS);
 
+  // the centers and radii of the halos found so far, for the overlap checks (see halo_helper_progs.c)
+  if (init_halo_cell_list(&halo_list, DIM) != 0){
+    fprintf(stderr, "find_halos.c: Error allocating memory for the halo cell list\nAborting...\n");
+    fftwf_free(box);
+    free(in_halo);
+    return -1;
+  }
+
   if (OPTIMIZE){
     forbidden = (char *) malloc(sizeof(char)*TOT_NUM_PIXELS);
     if (!forbidden){
@@ -309,6 +219,27 @@ int main(int argc, char ** argv){
     return -1;
   }
 
+  // if it fits in the memory budget, keep a pristine copy of the k-space box in memory,
+  // so we only have to read it in once
+  deltak = NULL;
+  if ( (sizeof(fftwf_complex)*2.0*KSPACE_NUM_PIXELS + sizeof(char)*(OPTIMIZE ? 2.0 : 1.0)*TOT_NUM_PIXELS) <= (HALO_FINDER_MEM_BUDGET*1073741824.0) ){
+    deltak = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex)*KSPACE_NUM_PIXELS);
+    if (deltak && (mod_fread(deltak, sizeof(fftwf_complex)*KSPACE_NUM_PIXELS, 1, IN)!=1)){
+      fprintf(stderr, "find_halos.c: Read error occured!\n");
+      fftwf_free(box); fftwf_free(deltak);
+      fclose(IN);
+      free(in_halo);
+      return -1;
+    }
+  }
+  if (deltak)
+    fprintf(LOG, "Keeping the k-space box in memory\n");
+  else
+    fprintf(LOG, "The k-space box does not fit in the memory budget; it will be re-read for every filter radius\n");
+
+  // the inverse FFT is always done on the working box, so we only need one plan
+  plan = fftwf_plan_dft_c2r_3d(DIM, DIM, DIM, (fftwf_complex *)box, (float *)box, FFTW_ESTIMATE);
+
   // remove conflicting files
   sprintf(filename, "../Output_files/FgtrM_files/hist_halos_z%.2f_%i_%.0fMpc_b%.3f_c%.3f", REDSHIFT, DIM, BOX_LEN, SHETH_b, SHETH_c);
   system(filename);
@@ -317,10 +248,11 @@ int main(int argc, char ** argv){
 
   // open the output files
   sprintf(filename, "../Output_files/Halo_lists/halos_z%.2f_%i_%.0fMpc", REDSHIFT, DIM, BOX_LEN);
-  OUT = fopen(filename, "w");
-  if (!OUT){
+  if (open_halo_catalog_write(&halo_cat, filename, HALO_CATALOG_ID, REDSHIFT) != 0){
     fprintf(stderr, "Unable to open file %s for writting!\n", filename);
     fftwf_free(box);
+    if (deltak) fftwf_free(deltak);
+    fftwf_destroy_plan(plan);
     free(in_halo);
     fclose(IN);
     return -1;
@@ -352,36 +284,34 @@ int main(int argc, char ** argv){
       continue;
     }
 
-    fprintf(LOG, "begin read, clock=%.2f\n", (double)clock()/CLOCKS_PER_SEC);
-    fflush(LOG);
-    // read in the box
-    rewind(IN);
-    if (mod_fread(box, sizeof(fftwf_complex)*KSPACE_NUM_PIXELS, 1, IN)!=1){
-      fprintf(stderr, "find_halos.c: Read error occured!\n");
-      fftwf_free(box);
-      fclose(IN);
-      fclose(OUT);
-      free(in_halo);
-      return -1;
-    }
-    fprintf(LOG, "end read, clock=%.2f\n", (double)clock()/CLOCKS_PER_SEC);
-    fflush(LOG);
-
-    // now filter the box on scale R
+    // filter the pristine k-space box into the working box,
+    // or read it in again and filter it in place if we couldn't keep it
     // 0 = top hat in real space, 1 = top hat in k space
     fprintf(LOG, "begin filter, clock=%.2f\n", (double)clock()/CLOCKS_PER_SEC);
     fflush(LOG);
-    filter(box, HALO_FILTER, R);
+    if (deltak){
+      filter_box(box, deltak, HALO_FILTER, R);
+    }
+    else{
+      rewind(IN);
+      if (mod_fread(box, sizeof(fftwf_complex)*KSPACE_NUM_PIXELS, 1, IN)!=1){
+	fprintf(stderr, "find_halos.c: Read error occured!\n");
+	fftwf_free(box);
+	fftwf_destroy_plan(plan);
+	fclose(IN);
+	close_halo_catalog(&halo_cat);
+	free(in_halo);
+	return -1;
+      }
+      filter(box, HALO_FILTER, R);
+    }
     fprintf(LOG, "end filter, clock=%.2f\n", (double)clock()/CLOCKS_PER_SEC);
     fflush(LOG);
 
     // do the FFT to get delta_m box
     fprintf(LOG, "begin fft, clock=%.2f\n", (double)clock()/CLOCKS_PER_SEC);
     fflush(LOG);
-    plan = fftwf_plan_dft_c2r_3d(DIM, DIM, DIM, (fftwf_complex *)box, (float *)box, FFTW_ESTIMATE);
     fftwf_execute(plan);
-    fftwf_destroy_plan(plan);
-    fftwf_cleanup();
     fprintf(LOG, "end fft, clock=%.2f\n", (double)clock()/CLOCKS_PER_SEC);
     fflush(LOG);
 
@@ -394,51 +324,119 @@ int main(int argc, char ** argv){
       memset(forbidden, 0, sizeof(char)*TOT_NUM_PIXELS);
       // now go through the list of existing halos and paint on the no-go region onto <forbidden>
       sprintf(filename, "../Output_files/Halo_lists/halos_z%.2f_%i_%.0fMpc", REDSHIFT, DIM, BOX_LEN);
-      F = fopen(filename, "r");
-	fscanf(F, "%e %f %f %f", &dummy, &x_temp, &y_temp, &z_temp);
-      while (!feof(F)){
-	R_temp = MtoR(dummy);
-	update_in_halo(forbidden, R_temp+R_OVERLAP_FACTOR*R, rint(x_temp*DIM), rint(y_temp*DIM), rint(z_temp*DIM));
-	fscanf(F, "%e %f %f %f", &dummy, &x_temp, &y_temp, &z_temp);
+      halo_chunk = (halo_record *) malloc(sizeof(halo_record)*HALO_CATALOG_CHUNK);
+      if (!halo_chunk || (flush_halo_catalog(&halo_cat) != 0) || (open_halo_catalog_read(&forbidden_cat, filename) != 0)){
+	fprintf(stderr, "find_halos.c: Unable to read back the halo catalog %s\nAborting...\n", filename);
+	fftwf_free(box); if (deltak) fftwf_free(deltak);
+	fftwf_destroy_plan(plan);
+	fclose(IN); close_halo_catalog(&halo_cat);
+	free(in_halo); free(forbidden); free_halo_cell_list(&halo_list); free(halo_chunk);
+	return -1;
       }
-      fclose(F);
+      while ((num_read = read_halo_records(&forbidden_cat, halo_chunk, HALO_CATALOG_CHUNK)) > 0){
+	for (halo_ct=0; halo_ct<num_read; halo_ct++){
+	  R_temp = MtoR(halo_chunk[halo_ct].mass);
+	  paint_halo_sphere(forbidden, DIM, (R_temp+R_OVERLAP_FACTOR*R)/BOX_LEN*DIM, rint(halo_chunk[halo_ct].x*DIM), rint(halo_chunk[halo_ct].y*DIM), rint(halo_chunk[halo_ct].z*DIM));
+	}
+      }
+      close_halo_catalog(&forbidden_cat);
+      free(halo_chunk);
       fprintf(LOG, "end initialization of forbidden, clock=%.2f\n", (double)clock()/CLOCKS_PER_SEC);
       fflush(LOG);
     }
     /****************  END OPTIMIZATION  *******************************/
 
     // now lets scroll through the box, flagging all pixels with delta_m > delta_crit
+    // the candidates are found in parallel, and then accepted (or not) serially, in the order of the scan
+    if (OPTIMIZE && (M > OPTIMIZE_MIN_MASS))
+      num_candidates = find_halo_candidates(box, growth_factor, delta_crit, forbidden, NULL, 0, &candidates);
+    else
+      num_candidates = find_halo_candidates(box, growth_factor, delta_crit, in_halo, &halo_list, (R_OVERLAP_FACTOR*R)/BOX_LEN*DIM, &candidates);
+    if (num_candidates < 0){
+      fprintf(stderr, "find_halos.c: Aborting...\n");
+      fftwf_free(box); if (deltak) fftwf_free(deltak);
+      fftwf_destroy_plan(plan);
+      fclose(IN); close_halo_catalog(&halo_cat);
+      free(in_halo); free_halo_cell_list(&halo_list);
+      if (OPTIMIZE) free(forbidden);
+      return -1;
+    }
+    fprintf(LOG, "found %lli halo candidates, clock=%.2f\n", num_candidates, (double)clock()/CLOCKS_PER_SEC);
+    fflush(LOG);
+
     dn=0;
-    for (x=0; x<DIM; x++){
-      for (y=0; y<DIM; y++){
-	for (z=0; z<DIM; z++){
-	  delta_m = *((float *)box + R_FFT_INDEX(x,y,z)) * growth_factor / VOLUME;       // don't forget the factor of 1/VOLUME!
-	  // if not within a larger halo, and radii don't overlap print out stats, and update in_halo box
-	  /*********  BEGIN OPTIMIZATION **********/
-	  if (OPTIMIZE && (M > OPTIMIZE_MIN_MASS)){
-	    if ( (delta_m > delta_crit) && !forbidden[R_INDEX(x,y,z)]){
-	    fprintf(stderr, "Found halo #%i, delta_m = %.3f at (x,y,z) = (%i,%i,%i)\n", n+1, delta_m, x,y,z);
-	    fprintf(OUT, "%e\t%f\t%f\t%f\n", M, x/(DIM+0.0), y/(DIM+0.0), z/(DIM+0.0));
-	    fflush(NULL);
-	    update_in_halo(in_halo, R, x,y,z); // flag the pixels contained within this halo
-	    update_in_halo(forbidden, (1+R_OVERLAP_FACTOR)*R, x,y,z); // flag the pixels contained within this halo
-	    dn++; // keep track of the number of halos
-	    n++;
-	    }
+    for (cand_ct=0; cand_ct<num_candidates; cand_ct++){
+      x = candidates[cand_ct].x;
+      y = candidates[cand_ct].y;
+      z = candidates[cand_ct].z;
+      delta_m = candidates[cand_ct].delta_m;
+      // if not within a larger halo, and radii don't overlap print out stats, and update in_halo box
+      /*********  BEGIN OPTIMIZATION **********/
+      if (OPTIMIZE && (M > OPTIMIZE_MIN_MASS)){
+	if (!forbidden[R_INDEX(x,y,z)]){
+	  fprintf(stderr, "Found halo #%i, delta_m = %.3f at (x,y,z) = (%i,%i,%i)\n", n+1, delta_m, x,y,z);
+	  halo.mass = M; halo.x = x/(DIM+0.0); halo.y = y/(DIM+0.0); halo.z = z/(DIM+0.0); halo.id = n;
+	  if (write_halo_records(&halo_cat, &halo, 1) != 0){
+	    fprintf(stderr, "find_halos.c: Write error occured while writting the halo catalog\nAborting...\n");
+	    fftwf_free(box); if (deltak) fftwf_free(deltak);
+	    fftwf_destroy_plan(plan);
+	    fclose(IN); close_halo_catalog(&halo_cat);
+	    free(in_halo); free(forbidden); free_halo_cell_list(&halo_list); free(candidates);
+	    return -1;
 	  }
-	  /*********  END OPTIMIZATION **********/
-
-	  else if ((delta_m > delta_crit) && !in_halo[R_INDEX(x,y,z)] && !overlap_halo(in_halo, R, x,y,z)){ // we found us a "new" halo!
-	    fprintf(stderr, "Found halo #%i, delta_m = %.3f at (x,y,z) = (%i,%i,%i)\n", n+1, delta_m, x,y,z);
-	    fprintf(OUT, "%e\t%f\t%f\t%f\n", M, x/(DIM+0.0), y/(DIM+0.0), z/(DIM+0.0));
-	    fflush(NULL);
-	    update_in_halo(in_halo, R, x,y,z); // flag the pixels contained within this halo
-	    dn++; // keep track of the number of halos
-	    n++;
+	  fflush(NULL);
+	  paint_halo_sphere(in_halo, DIM, R/BOX_LEN*DIM, x,y,z); // flag the pixels contained within this halo
+	  paint_halo_sphere(forbidden, DIM, (1+R_OVERLAP_FACTOR)*R/BOX_LEN*DIM, x,y,z); // flag the pixels contained within this halo
+	  if (add_halo_to_cell_list(&halo_list, R/BOX_LEN*DIM, x,y,z) != 0){
+	    fprintf(stderr, "find_halos.c: Error allocating memory for the halo cell list\nAborting...\n");
+	    fftwf_free(box); if (deltak) fftwf_free(deltak);
+	    fftwf_destroy_plan(plan);
+	    fclose(IN); close_halo_catalog(&halo_cat);
+	    free(in_halo); free(forbidden); free_halo_cell_list(&halo_list); free(candidates);
+	    return -1;
 	  }
+	  dn++; // keep track of the number of halos
+	  n++;
+	}
+      }
+      /*********  END OPTIMIZATION **********/
+
+      else if (!in_halo[R_INDEX(x,y,z)] && !halo_overlaps_cell_list(&halo_list, (R_OVERLAP_FACTOR*R)/BOX_LEN*DIM, x,y,z)){ // we found us a "new" halo!
+	fprintf(stderr, "Found halo #%i, delta_m = %.3f at (x,y,z) = (%i,%i,%i)\n", n+1, delta_m, x,y,z);
+	halo.mass = M; halo.x = x/(DIM+0.0); halo.y = y/(DIM+0.0); halo.z = z/(DIM+0.0); halo.id = n;
+	if (write_halo_records(&halo_cat, &halo, 1) != 0){
+	  fprintf(stderr, "find_halos.c: Write error occured while writting the halo catalog\nAborting...\n");
+	  fftwf_free(box); if (deltak) fftwf_free(deltak);
+	  fftwf_destroy_plan(plan);
+	  fclose(IN); close_halo_catalog(&halo_cat);
+	  free(in_halo); free_halo_cell_list(&halo_list); free(candidates);
+	  if (OPTIMIZE) free(forbidden);
+	  return -1;
+	}
+	fflush(NULL);
+	paint_halo_sphere(in_halo, DIM, R/BOX_LEN*DIM, x,y,z); // flag the pixels contained within this halo
+	if (add_halo_to_cell_list(&halo_list, R/BOX_LEN*DIM, x,y,z) != 0){
+	  fprintf(stderr, "find_halos.c: Error allocating memory for the halo cell list\nAborting...\n");
+	  fftwf_free(box); if (deltak) fftwf_free(deltak);
+	  fftwf_destroy_plan(plan);
+	  fclose(IN); close_halo_catalog(&halo_cat);
+	  free(in_halo); free_halo_cell_list(&halo_list); free(candidates);
+	  return -1;
 	}
+	dn++; // keep track of the number of halos
+	n++;
       }
     }
+    free(candidates);
+    if (flush_halo_catalog(&halo_cat) != 0){
+      fprintf(stderr, "find_halos.c: Write error occured while writting the halo catalog\nAborting...\n");
+      fftwf_free(box); if (deltak) fftwf_free(deltak);
+      fftwf_destroy_plan(plan);
+      fclose(IN); close_halo_catalog(&halo_cat);
+      free(in_halo); free_halo_cell_list(&halo_list);
+      if (OPTIMIZE) free(forbidden);
+      return -1;
+    }
 
     if (dn > 0){
       // now lets print out the mass functions (FgrtR)
@@ -464,10 +462,16 @@ int main(int argc, char ** argv){
 
 
   // deallocate 
-  fclose(OUT);
+  if (close_halo_catalog(&halo_cat) != 0){
+    fprintf(stderr, "find_halos.c: Write error occured while writting the halo catalog\nAborting...\n");
+    status = -1;
+  }
   fclose(IN);
   fclose(LOG);
+  fftwf_destroy_plan(plan);
+  fftwf_cleanup();
   fftwf_free(box);
+  if (deltak) fftwf_free(deltak);
 
   /*
   // print in_halo box
@@ -481,9 +485,11 @@ int main(int argc, char ** argv){
   */
 
   free(in_halo);
+  free_halo_cell_list(&halo_list);
+  free_halo_stencil();
 
   if (OPTIMIZE)
     free(forbidden);
 
-  return 0;
+  return status;
 }
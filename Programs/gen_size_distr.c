@@ -1,11 +1,15 @@
 #include "../Parameter_files/INIT_PARAMS.H"
 #include "../Parameter_files/ANAL_PARAMS.H"
 
-#define NUM_TRIALS (unsigned long long) 1e7 // num of times we will perform the test
+#define NUM_TRIALS (unsigned long long) 1e7 // maximum num of times we will perform the test
+#define TRIAL_BATCH (unsigned long long) 1e5 // num of trials between convergence checks
+#define TARGET_REL_ERR (float) 0.02 // stop once the (Poisson) relative error of every bin above CONVERGENCE_FLOOR is below this
+#define CONVERGENCE_FLOOR (float) 0.05 // bins with R*dP/dR below this fraction of the peak are not required to converge
 #define dr (float)(1.0/(HII_DIM*5.0))
-#define SIZE_BINSTEP (float) 2*BOX_LEN/(HII_DIM+0.0) // single step in histogram construction
+#define SIZE_BINSTEP (float) (2*BOX_LEN/(HII_DIM+0.0)) // single step in histogram construction
 #define MAX_MAX (float) 1000.0 // truncate distributions after this value
 #define VOXEL_NF_CUTOFF (float) 0.5 // value demarkating "neutral" and "ionized" voxels
+#define NUM_SIZE_BINS (int) (MAX_MAX/SIZE_BINSTEP + 1) // histogram bins; larger distances are only counted in the normalization
 /*
 
   USAGE: gen_size_distr <REDSHIFT> <REGION> <IN_BUBBLE BOX filename>
@@ -17,16 +21,117 @@
      0 = genarate size distributions of ionized bubbles
      1 = genarate size distributions of neutral regions
 
+  The trials are run in parallel, in batches of TRIAL_BATCH, until every significant bin of the
+  distribution has converged to TARGET_REL_ERR (or NUM_TRIALS trials were made).  Each trial
+  draws its random numbers from its own counter-based stream, so the distribution does not
+  depend on the number of threads.
+
 */
 
 
+/*
+  Counter-based random numbers: the stream of trial <trial> is keyed by (SIZE_RANDOM_SEED, trial),
+  and the n-th number of the stream is a hash (splitmix64 finalizer) of the key and n.
+*/
+typedef struct{
+  unsigned long long key, ctr;
+} trial_rng;
+
+unsigned long long mix64(unsigned long long z){
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+void trial_rng_set(trial_rng *r, unsigned long long seed, unsigned long long trial){
+  r->key = mix64(mix64(seed) + trial*0x9e3779b97f4a7c15ULL);
+  r->ctr = 0;
+}
+
+// uniform in [0,1)
+double trial_rng_uniform(trial_rng *r){
+  r->ctr++;
+  return (mix64(r->key + r->ctr*0x9e3779b97f4a7c15ULL) >> 11) * (1.0/9007199254740992.0);
+}
+
+
+/*
+  Function SIZE_TRIAL randomly chooses a pixel in the desired phase, and a random direction,
+  and returns the distance (in Mpc) to the first phase transition along that direction.
+  *num_wraps counts the rays which wrapped around the box back to their first pixel (these are
+  re-drawn).
+*/
+float size_trial(char *in_bubble, int REGION_FLAG, unsigned long long trial, int *num_wraps){
+  trial_rng r;
+  float r_mag, r_x, r_y, r_z;
+  int x_0,y_0,z_0, x_curr, y_curr,z_curr, wrap;
+
+  trial_rng_set(&r, SIZE_RANDOM_SEED, trial);
+  while (1){
+    // find appropriate pixel
+    x_0 = trial_rng_uniform (&r)*HII_DIM;
+    y_0 = trial_rng_uniform (&r)*HII_DIM;
+    z_0 = trial_rng_uniform (&r)*HII_DIM;
+    if ( ((REGION_FLAG==0) && !in_bubble[HII_R_INDEX(x_0, y_0, z_0)] ) ||
+	 ((REGION_FLAG==1) && in_bubble[HII_R_INDEX(x_0, y_0, z_0)] ) ){
+      // we are not in the desired phase, try again
+      continue;
+    }
+
+    // construct unit directional vector
+    r_x = trial_rng_uniform (&r)-0.5;
+    r_y = trial_rng_uniform (&r)-0.5;
+    r_z = trial_rng_uniform (&r)-0.5;
+    r_mag = sqrt(r_x*r_x + r_y*r_y + r_z*r_z);
+    r_x /= r_mag; r_y /= r_mag; r_z /= r_mag;
+    wrap = 0;     // flag if we wrapped around
+    r_mag = 0;
+    // now follow the directional vector until we reach a phase transition
+    while (1){
+      r_mag += dr;
+      x_curr = (r_mag * r_x) * HII_DIM  + x_0+0.5;
+      y_curr = (r_mag * r_y) * HII_DIM  + y_0+0.5;
+      z_curr = (r_mag * r_z) * HII_DIM  + z_0+0.5;
+
+      // check if we stepped out of the box
+      while (x_curr >= HII_DIM){ x_curr -= HII_DIM; wrap=1;}
+      while (x_curr < 0){ x_curr += HII_DIM; wrap=1;}
+      while (y_curr >= HII_DIM){ y_curr -= HII_DIM; wrap=1;}
+      while (y_curr < 0){ y_curr += HII_DIM; wrap=1;}
+      while (z_curr >= HII_DIM){ z_curr -= HII_DIM; wrap=1;}
+      while (z_curr < 0){ z_curr += HII_DIM; wrap=1;}
+
+      // check if we crossed a boundary
+      if ( in_bubble[HII_R_INDEX(x_0, y_0, z_0)] != in_bubble[HII_R_INDEX(x_curr, y_curr, z_curr)] ) // got it!
+	return r_mag*BOX_LEN;
+      else if (wrap && (x_0==x_curr) && (y_0==y_curr) && (z_0==z_curr)){ // went around and back to first pixel
+	// try again
+	(*num_wraps)++;
+	break;
+      }
+    } // end while
+  }
+}
+
+
+void free_histograms(unsigned long long *hist, unsigned long long **th_hist, int num_th){
+  int thread_num;
+
+  if (th_hist){
+    for (thread_num=0; thread_num<num_th; thread_num++)
+      free(th_hist[thread_num]);
+    free(th_hist);
+  }
+  free(hist);
+}
+
+
 int main (int argc, char ** argv){
   char *in_bubble, filename[100];
   FILE *F, *LOG;
-  float REDSHIFT, r_mag, r_x, r_y, r_z, bin_floor, R, MAX, dpdR, P, *dist, nf, xH;
-  int REGION_FLAG, x_0,y_0,z_0, x_curr, y_curr,z_curr, wrap,j,k;
-  unsigned long long i, bin_ct;
-  gsl_rng * r;
+  float REDSHIFT, R, dpdR, P, dist, nf, xH, peak, rel_err, max_rel_err;
+  int REGION_FLAG, j,k, bin, max_bin, num_th, thread_num, num_wraps;
+  unsigned long long i, batch_start, batch_end, num_trials, *hist, **th_hist;
 
   /***************   BEGIN INITIALIZATION   **************************/
 
@@ -41,17 +146,22 @@ int main (int argc, char ** argv){
     fprintf(stderr, "USAGE: gen_size_distr <REDSHIFT> <REGION> <IN_BUBBLE BOX filename>\nAborting...\n");
     return -1;
   }
-  // allocate
-  dist = (float *) malloc(sizeof(float)*NUM_TRIALS);
-  if (!dist){
+  // allocate the histograms (one per thread, and the total)
+  num_th = omp_get_max_threads();
+  hist = (unsigned long long *) calloc(NUM_SIZE_BINS+1, sizeof(unsigned long long));
+  th_hist = (unsigned long long **) calloc(num_th, sizeof(unsigned long long *));
+  if (!hist || !th_hist){
     fprintf(stderr, "gen_size_distr: Unable to allocate enough memory\nAborting\n");
+    free(hist); free(th_hist);
     return -1;
   }
-
-  // seed the random number generator
-  //  gaus_seed(SIZE_RANDOM_SEED);
-  r = gsl_rng_alloc(gsl_rng_mt19937);
-  gsl_rng_set(r, SIZE_RANDOM_SEED);
+  for (thread_num=0; thread_num<num_th; thread_num++){
+    if (!(th_hist[thread_num] = (unsigned long long *) calloc(NUM_SIZE_BINS+1, sizeof(unsigned long long)))){
+      fprintf(stderr, "gen_size_distr: Unable to allocate enough memory\nAborting\n");
+      free_histograms(hist, th_hist, num_th);
+      return -1;
+    }
+  }
 
 
   // read in the bubble box
@@ -59,13 +169,13 @@ int main (int argc, char ** argv){
   in_bubble = (char *) malloc(sizeof(char)*HII_TOT_NUM_PIXELS);
   if (!in_bubble){
     fprintf(stderr, "gen_size_distr: Error allocating memory for in_bubble box\nAborting...\n");
-    gsl_rng_free (r); return -1;
+    free_histograms(hist, th_hist, num_th); return -1;
   }
   F = fopen(argv[3], "rb");
   if (!F){
     fprintf(stderr, "gen_size_distr: Error opening file %s for reading\nAborting...\n", argv[3]);
     free(in_bubble);
-    gsl_rng_free (r); return -1;
+    free_histograms(hist, th_hist, num_th); return -1;
   }
   fprintf(stderr, "Reading in xH box\n");
   nf = 0;
@@ -75,7 +185,7 @@ int main (int argc, char ** argv){
         if (fread(&xH, sizeof(float), 1, F)!=1){
           fprintf(stderr, "delta_T: Read error occured while reading neutral_fraction box.\n");
 	  fclose(F); free(in_bubble);
-	  gsl_rng_free (r); return -1;
+	  free_histograms(hist, th_hist, num_th); return -1;
         }
 
 	nf += xH;
@@ -92,6 +202,7 @@ int main (int argc, char ** argv){
   // check if the ionization field is fully neutral or ionized. if so calling this function is retarded
   if ((nf<FRACT_FLOAT_ERR) || (nf>(1-FRACT_FLOAT_ERR))){
     fprintf(stderr, "gen_size_distr: The ionization field is only a single phase.  Aborting gen_size_distr.\n");
+    free(in_bubble); free_histograms(hist, th_hist, num_th);
     return 0;
   }
 
@@ -101,7 +212,7 @@ int main (int argc, char ** argv){
   if (!LOG){
     fprintf(stderr, "gen_size_distr: Error opening log file\nAborting...\n");
     free(in_bubble);
-    gsl_rng_free (r); return -1;
+    free_histograms(hist, th_hist, num_th); return -1;
   }
 
   // open output file
@@ -122,94 +233,81 @@ int main (int argc, char ** argv){
     fprintf(stderr, "gen_size_distr: Error opening output file\nAborting...\n");
     free(in_bubble);
     fclose(LOG);
-    gsl_rng_free (r); return -1;
+    free_histograms(hist, th_hist, num_th); return -1;
   }
-  MAX = 0;
   /***************   END INITIALIZATION   **************************/
 
 
-  // go through the trials
-  for (i=0; i<NUM_TRIALS; i++){
+  // go through the trials, in batches, until the distribution has converged
+  num_trials = 0;
+  num_wraps = 0;
+  max_bin = 0;
+  do{
+    batch_start = num_trials;
+    batch_end = batch_start + TRIAL_BATCH;
+    if (batch_end > NUM_TRIALS)
+      batch_end = NUM_TRIALS;
 
-    // find appropriate pixel
-    x_0 = gsl_rng_uniform (r)*HII_DIM;
-    y_0 = gsl_rng_uniform (r)*HII_DIM;
-    z_0 = gsl_rng_uniform (r)*HII_DIM;
-    if ( ((REGION_FLAG==0) && !in_bubble[HII_R_INDEX(x_0, y_0, z_0)] ) ||
-	 ((REGION_FLAG==1) && in_bubble[HII_R_INDEX(x_0, y_0, z_0)] ) ){
-      // we are not in the desired phase, try again
-      i--;
-      continue;
+#pragma omp parallel shared(in_bubble, REGION_FLAG, th_hist, batch_start, batch_end) private(i, dist, bin, thread_num) reduction(+:num_wraps) reduction(max:max_bin) num_threads(num_th)
+    {
+      thread_num = omp_get_thread_num();
+#pragma omp for schedule(dynamic, 1024)
+      for (i=batch_start; i<batch_end; i++){
+	dist = size_trial(in_bubble, REGION_FLAG, i, &num_wraps);
+	if (dist < MAX_MAX){
+	  bin = dist/SIZE_BINSTEP;
+	  if (bin > max_bin)
+	    max_bin = bin;
+	}
+	else{
+	  bin = NUM_SIZE_BINS; // only counted in the normalization
+	  max_bin = NUM_SIZE_BINS-1;
+	}
+	th_hist[thread_num][bin]++;
+      }
     }
+    num_trials = batch_end;
 
-
-    // construct unit directional vector
-    r_x = gsl_rng_uniform (r)-0.5;
-    r_y = gsl_rng_uniform (r)-0.5;
-    r_z = gsl_rng_uniform (r)-0.5;
-    r_mag = sqrt(r_x*r_x + r_y*r_y + r_z*r_z);
-    r_x /= r_mag; r_y /= r_mag; r_z /= r_mag;
-    //    fprintf(stderr, "Found %llu at (%i, %i, %i), going in direction (%.3f, %.3f, %.3f)\n", i, x_0, y_0, z_0, r_x, r_y, r_z);
-    //fprintf(LOG, "Found %llu at (%i, %i, %i), going in direction (%.3f, %.3f, %.3f)\n", i, x_0, y_0, z_0, r_x, r_y, r_z);
-    wrap = 0;     // flag if we wrapped around
-    r_mag = 0;
-    // now follow the directional vector until we reach a phase transition
-    while (1){
-      r_mag += dr;
-      x_curr = (r_mag * r_x) * HII_DIM  + x_0+0.5;
-      y_curr = (r_mag * r_y) * HII_DIM  + y_0+0.5;
-      z_curr = (r_mag * r_z) * HII_DIM  + z_0+0.5;
-
-      // check if we stepped out of the box
-      while (x_curr >= HII_DIM){ x_curr -= HII_DIM; wrap=1;}
-      while (x_curr < 0){ x_curr += HII_DIM; wrap=1;}
-      while (y_curr >= HII_DIM){ y_curr -= HII_DIM; wrap=1;}
-      while (y_curr < 0){ y_curr += HII_DIM; wrap=1;}
-      while (z_curr >= HII_DIM){ z_curr -= HII_DIM; wrap=1;}
-      while (z_curr < 0){ z_curr += HII_DIM; wrap=1;}
-
-      // check if we crossed a boundary
-      if ( in_bubble[HII_R_INDEX(x_0, y_0, z_0)] != in_bubble[HII_R_INDEX(x_curr, y_curr, z_curr)] ){ // got it!
-	//	fprintf(stderr, "Got it at d=%.3f Mpc, (%i, %i, %i)\n", r_mag*BOX_LEN, x_curr, y_curr, z_curr);
-	//fprintf(LOG, "Got it at d=%.3f Mpc, (%i, %i, %i)\n", r_mag*BOX_LEN, x_curr, y_curr, z_curr);
-       	dist[i] = r_mag*BOX_LEN;
-	if (dist[i] > MAX)
-	  MAX = dist[i];
-	break;
-      }
-      else if (wrap && (x_0==x_curr) && (y_0==y_curr) && (z_0==z_curr)){ // went around and back to first pixel
-	// try again
-	fprintf(stderr, "We wrapped around to the start pixel\n");
-	fprintf(LOG, "We wrapped around to the start pixel\n");
-	i--;
-	break;
+    // sum the thread histograms, and check the relative error of the significant bins
+    for (bin=0; bin<=NUM_SIZE_BINS; bin++){
+      hist[bin] = 0;
+      for (thread_num=0; thread_num<num_th; thread_num++)
+	hist[bin] += th_hist[thread_num][bin];
+    }
+    peak = 0;
+    for (bin=0; bin<=max_bin; bin++){
+      if ((bin+0.5)*hist[bin] > peak)
+	peak = (bin+0.5)*hist[bin];
+    }
+    max_rel_err = 0;
+    for (bin=0; bin<=max_bin; bin++){
+      if ( ((bin+0.5)*hist[bin] >= CONVERGENCE_FLOOR*peak) && (hist[bin] > 0) ){
+	rel_err = 1.0/sqrt((double)hist[bin]);
+	if (rel_err > max_rel_err)
+	  max_rel_err = rel_err;
       }
-    } // end while
-  } // end for
-  fprintf(stderr, "\nDone with Monte-Carlo\n\nNow printing histogram\n");
-  fprintf(LOG, "\nDone with Monte-Carlo\n\nNow printing histogram\n");
+    }
+    fprintf(LOG, "%llu trials, maximum relative error of the distribution = %e\n", num_trials, max_rel_err);
+    fflush(LOG);
+  } while ((num_trials < NUM_TRIALS) && (max_rel_err > TARGET_REL_ERR));
+
+  if (num_wraps > 0){
+    fprintf(stderr, "We wrapped around to the start pixel %i times\n", num_wraps);
+    fprintf(LOG, "We wrapped around to the start pixel %i times\n", num_wraps);
+  }
+  fprintf(stderr, "\nDone with Monte-Carlo after %llu trials (maximum relative error %e)\n\nNow printing histogram\n", num_trials, max_rel_err);
+  fprintf(LOG, "\nDone with Monte-Carlo after %llu trials (maximum relative error %e)\n\nNow printing histogram\n", num_trials, max_rel_err);
 
 
-  // print out the histogram
-  // do more efficientl if we need super long trials
-  bin_floor = 0;
+  // print out the histogram, up to the bin after the largest distance found
   P=0;
-  if (MAX > MAX_MAX){ MAX = MAX_MAX;}
-  while (bin_floor < (MAX+SIZE_BINSTEP)){ // go through each bin
-    // cycle through all the entries counting the ones that fall in the bin
-    bin_ct = 0;
-    for (i=0; i<NUM_TRIALS; i++){
-      if ( (dist[i] >= bin_floor) && (dist[i] < (bin_floor+SIZE_BINSTEP)) ){ bin_ct++;}
-    }
-
+  for (bin=0; (bin<=max_bin+1) && (bin<NUM_SIZE_BINS); bin++){
     // now print our results: mean value of bin followed by num of files that fall in bin
-    R =  bin_floor+0.5*SIZE_BINSTEP;
-    dpdR = (float)bin_ct/(float)NUM_TRIALS;
+    R =  (bin+0.5)*SIZE_BINSTEP;
+    dpdR = (float)hist[bin]/(float)num_trials;
     dpdR /= SIZE_BINSTEP;
-    //    printf("%f\t%f\t%f\t%u\n", dpdR, (float)bin_ct/(float)NUM_TRIALS/SIZE_BINSTEP, SIZE_BINSTEP, bin_ct);
     fprintf(F, "%f\t%e\n", R, R*dpdR );
     P+=dpdR;
-    bin_floor += SIZE_BINSTEP;
   }
   fprintf(stderr, "Done %f!\n", P*SIZE_BINSTEP);
   fprintf(LOG, "Done!\n");
@@ -217,9 +315,8 @@ int main (int argc, char ** argv){
 
   // deallocate
   free(in_bubble);
-  free(dist);
   fclose(LOG);
   fclose(F);
 
-  gsl_rng_free (r); return 0;
+  free_histograms(hist, th_hist, num_th); return 0;
 }
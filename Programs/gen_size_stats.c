@@ -0,0 +1,184 @@
+#include "../Parameter_files/INIT_PARAMS.H"
+#include "../Parameter_files/ANAL_PARAMS.H"
+#include "size_helper_progs.c"
+
+#define VOXEL_NF_CUTOFF (float) 0.5 // value demarkating "neutral" and "ionized" voxels
+/*
+
+  USAGE: gen_size_stats <REDSHIFT> <REGION> <xH BOX filename>
+
+  PROGRAM GEN_SIZE_STATS is a deterministic (noise-free) alternative to gen_size_distr.
+  It computes two exact size statistics of the ionized or neutral regions:
+
+     1) the distribution of chord lengths (mean free paths) through the regions along every
+        line of sight parallel to the box axes, written to
+        ../Output_files/Size_distributions/<ionized/neutral>_mfp_...
+        columns: R (Mpc), R dP/dR along x, y, z, and along all three axes,
+        where P is the fraction of chords
+
+     2) the Euclidean distance from every voxel in the region to the nearest voxel
+        of the other phase, whose distribution is written to
+        ../Output_files/Size_distributions/<ionized/neutral>_edt_...
+        columns: R (Mpc), R dP/dR  where P is the fraction of voxels in the region
+
+  Both are computed in time linear in the number of voxels, in parallel.
+
+  <REGION> is an integer:
+     0 = genarate size distributions of ionized bubbles
+     1 = genarate size distributions of neutral regions
+
+*/
+
+
+int main (int argc, char ** argv){
+  char *in_phase=NULL, filename[300], region_name[100];
+  FILE *F=NULL;
+  float REDSHIFT, xH, *dist_sq=NULL, *buffer=NULL, nf, cell_size;
+  double num_chords[4], mean_chord[4], dpdR[4];
+  int REGION_FLAG, i,j,k, axis, len, bin, max_bin, status=-1;
+  unsigned long long ct, *hist=NULL, *edt_hist=NULL, num_in_phase;
+
+  /***************   BEGIN INITIALIZATION   **************************/
+
+  // check usage
+  if (argc != 4){
+    fprintf(stderr, "USAGE: gen_size_stats <REDSHIFT> <REGION> <xH BOX filename>\nAborting...\n");
+    return -1;
+  }
+  REDSHIFT = atof(argv[1]);
+  REGION_FLAG = atoi(argv[2]);
+  if ((REGION_FLAG != 1) && (REGION_FLAG != 0)){
+    fprintf(stderr, "USAGE: gen_size_stats <REDSHIFT> <REGION> <xH BOX filename>\nAborting...\n");
+    return -1;
+  }
+  cell_size = BOX_LEN/(HII_DIM+0.0);
+
+  // allocate
+  in_phase = (char *) malloc(sizeof(char)*HII_TOT_NUM_PIXELS);
+  dist_sq = (float *) malloc(sizeof(float)*HII_TOT_NUM_PIXELS);
+  buffer = (float *) malloc(sizeof(float)*HII_DIM);
+  hist = (unsigned long long *) calloc(3*(HII_DIM+1), sizeof(unsigned long long));
+  // squared distances are at most 3*(HII_DIM/2)^2, i.e. distances below HII_DIM cells
+  edt_hist = (unsigned long long *) calloc(HII_DIM+1, sizeof(unsigned long long));
+  if (!in_phase || !dist_sq || !buffer || !hist || !edt_hist){
+    fprintf(stderr, "gen_size_stats: Error allocating memory\nAborting...\n");
+    goto CLEANUP;
+  }
+
+  // read in the xH box, and flag the voxels in the region of interest
+  F = fopen(argv[3], "rb");
+  if (!F){
+    fprintf(stderr, "gen_size_stats: Error opening file %s for reading\nAborting...\n", argv[3]);
+    goto CLEANUP;
+  }
+  fprintf(stderr, "Reading in xH box\n");
+  nf = 0;
+  num_in_phase = 0;
+  for (i=0; i<HII_DIM; i++){
+    for (j=0; j<HII_DIM; j++){
+      if (fread(buffer, sizeof(float), HII_DIM, F)!=HII_DIM){
+	fprintf(stderr, "gen_size_stats: Read error occured while reading neutral_fraction box.\nAborting...\n");
+	goto CLEANUP;
+      }
+      for (k=0; k<HII_DIM; k++){
+	xH = buffer[k];
+	nf += xH;
+	in_phase[HII_R_INDEX(i,j,k)] = REGION_FLAG ? (xH >= VOXEL_NF_CUTOFF) : (xH < VOXEL_NF_CUTOFF);
+	num_in_phase += in_phase[HII_R_INDEX(i,j,k)];
+      }
+    }
+  }
+  fclose(F);
+  F = NULL;
+  nf /= (double)HII_TOT_NUM_PIXELS;
+
+  // check if the ionization field is fully neutral or ionized
+  if ((num_in_phase == 0) || (num_in_phase == HII_TOT_NUM_PIXELS)){
+    fprintf(stderr, "gen_size_stats: The ionization field is only a single phase.  Aborting gen_size_stats.\n");
+    status = 0;
+    goto CLEANUP;
+  }
+  /***************   END INITIALIZATION   **************************/
+
+
+  // 1) chord lengths along the axes
+  fprintf(stderr, "Computing chord length distributions\n");
+  if (run_length_distribution(in_phase, hist) != 0)
+    goto CLEANUP;
+
+  sprintf(region_name, "%s%s", (REGION_FLAG ? "neutral" : "ionized"), (USE_HALO_FIELD ? "" : "_no_halos"));
+  sprintf(filename, "../Output_files/Size_distributions/%s_mfp_nf%f_z%06.2f_%i_%.0fMpc", region_name, nf, REDSHIFT, HII_DIM, BOX_LEN);
+  F = fopen(filename, "w");
+  if (!F){
+    fprintf(stderr, "gen_size_stats: Error opening output file %s\nAborting...\n", filename);
+    goto CLEANUP;
+  }
+  for (axis=0; axis<4; axis++){
+    num_chords[axis] = mean_chord[axis] = 0;
+  }
+  for (axis=0; axis<3; axis++){
+    for (len=1; len<HII_DIM; len++){
+      num_chords[axis] += hist[axis*(HII_DIM+1) + len];
+      mean_chord[axis] += len*cell_size*hist[axis*(HII_DIM+1) + len];
+    }
+    num_chords[3] += num_chords[axis];
+    mean_chord[3] += mean_chord[axis];
+  }
+  fprintf(F, "# R (Mpc)\tR dP/dR (x)\tR dP/dR (y)\tR dP/dR (z)\tR dP/dR (all)\n");
+  for (len=1; len<HII_DIM; len++){
+    dpdR[3] = 0;
+    for (axis=0; axis<3; axis++){
+      dpdR[axis] = num_chords[axis]>0 ? hist[axis*(HII_DIM+1) + len] / num_chords[axis] / cell_size : 0;
+      dpdR[3] += hist[axis*(HII_DIM+1) + len];
+    }
+    dpdR[3] /= num_chords[3]*cell_size;
+    fprintf(F, "%f\t%e\t%e\t%e\t%e\n", len*cell_size, len*cell_size*dpdR[0], len*cell_size*dpdR[1], len*cell_size*dpdR[2], len*cell_size*dpdR[3]);
+  }
+  fclose(F);
+  F = NULL;
+  for (axis=0; axis<4; axis++)
+    mean_chord[axis] = num_chords[axis]>0 ? mean_chord[axis]/num_chords[axis] : 0;
+  fprintf(stderr, "Mean chord length (Mpc): x = %f, y = %f, z = %f, all = %f\n", mean_chord[0], mean_chord[1], mean_chord[2], mean_chord[3]);
+  if (hist[HII_DIM] + hist[2*HII_DIM+1] + hist[3*HII_DIM+2] > 0)
+    fprintf(stderr, "%llu lines of sight are entirely %s, and are not included in the chord distribution\n",
+	    hist[HII_DIM] + hist[2*HII_DIM+1] + hist[3*HII_DIM+2], (REGION_FLAG ? "neutral" : "ionized"));
+
+
+  // 2) distance to the other phase
+  fprintf(stderr, "Computing the distance transform\n");
+  if (distance_transform(in_phase, dist_sq) != 0)
+    goto CLEANUP;
+  max_bin = 0;
+  for (ct=0; ct<HII_TOT_NUM_PIXELS; ct++){
+    if (in_phase[ct]){
+      bin = sqrt(dist_sq[ct]); // bins of one cell
+      if (bin > HII_DIM) bin = HII_DIM;
+      edt_hist[bin]++;
+      if (bin > max_bin) max_bin = bin;
+    }
+  }
+  sprintf(filename, "../Output_files/Size_distributions/%s_edt_nf%f_z%06.2f_%i_%.0fMpc", region_name, nf, REDSHIFT, HII_DIM, BOX_LEN);
+  F = fopen(filename, "w");
+  if (!F){
+    fprintf(stderr, "gen_size_stats: Error opening output file %s\nAborting...\n", filename);
+    goto CLEANUP;
+  }
+  fprintf(F, "# R (Mpc)\tR dP/dR\n");
+  for (bin=1; bin<=max_bin; bin++){ // in-phase voxels are at least one cell away from the other phase
+    dpdR[0] = edt_hist[bin] / (double)num_in_phase / cell_size;
+    fprintf(F, "%f\t%e\n", (bin+0.5)*cell_size, (bin+0.5)*cell_size*dpdR[0]);
+  }
+  fclose(F);
+  F = NULL;
+  fprintf(stderr, "Done!\n");
+  status = 0;
+
+ CLEANUP:
+  if (F) fclose(F);
+  free(in_phase);
+  free(dist_sq);
+  free(buffer);
+  free(hist);
+  free(edt_hist);
+  return status;
+}
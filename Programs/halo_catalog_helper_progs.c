@@ -0,0 +1,300 @@
+#ifndef _HALO_CATALOG_HELPERS_
+#define _HALO_CATALOG_HELPERS_
+
+#include "../Parameter_files/INIT_PARAMS.H"
+#include "../Parameter_files/ANAL_PARAMS.H"
+
+/*
+  Binary halo catalogs, written by find_halos and update_halo_pos, and read by update_halo_pos,
+  find_HII_bubbles (USE_HALO_FIELD) and by find_halos itself (OPTIMIZE).
+
+  File layout (native byte order):
+     halo_catalog_header
+     num_halos fixed-width records, each containing (in this order):
+        mass (float, in M_sun)
+        x, y, z (float, in units of the box size, [0 to 1) )
+        vx, vy, vz (float, only if the HALO_CATALOG_VELOCITY flag is set)
+        id (unsigned long long, only if the HALO_CATALOG_ID flag is set)
+
+  Catalogs are read and written in chunks of halo_record structs through a halo_catalog stream:
+
+     halo_catalog cat;
+     halo_record halos[HALO_CATALOG_CHUNK];
+     long long n;
+     open_halo_catalog_read(&cat, filename);
+     while ((n = read_halo_records(&cat, halos, HALO_CATALOG_CHUNK)) > 0){ ... }
+     close_halo_catalog(&cat);
+
+  The number of halos in the header is filled-in when a catalog is closed, but readers only
+  rely on the file size, so a catalog can be read while it is still being written
+  (after a call to flush_halo_catalog).
+*/
+
+#define HALO_CATALOG_MAGIC "21cmHALO"
+#define HALO_CATALOG_VERSION (int) 1
+#define HALO_CATALOG_VELOCITY (int) 1 // flag: the records contain the halo velocities
+#define HALO_CATALOG_ID (int) 2 // flag: the records contain the halo IDs
+#define HALO_CATALOG_CHUNK (int) 65536 // number of records buffered / read at a time
+
+typedef struct{
+  char magic[8];
+  int version;
+  int flags;
+  int record_size; // bytes per record on disk
+  int dim; // resolution of the box on which the halos were found
+  float box_len; // in Mpc
+  float redshift;
+  unsigned long long num_halos; // 0 while the catalog is still being written
+} halo_catalog_header;
+
+typedef struct{
+  float mass;
+  float x, y, z;
+  float vx, vy, vz;
+  unsigned long long id;
+} halo_record;
+
+typedef struct{
+  FILE *F;
+  halo_catalog_header header;
+  int writing;
+  unsigned long long num_total; // number of records in the file (when reading)
+  unsigned long long num_done; // number of records read / written so far
+  int num_buffered;
+  char *buffer; // HALO_CATALOG_CHUNK packed records
+} halo_catalog;
+
+
+int halo_record_size(int flags){
+  return 4*sizeof(float) + ((flags & HALO_CATALOG_VELOCITY) ? 3*sizeof(float) : 0) + ((flags & HALO_CATALOG_ID) ? sizeof(unsigned long long) : 0);
+}
+
+
+/*
+  Function OPEN_HALO_CATALOG_WRITE creates a new catalog (overwriting any old file).
+  Returns 0 on success, -1 on an error.
+*/
+int open_halo_catalog_write(halo_catalog *cat, const char *filename, int flags, float redshift){
+  memset(cat, 0, sizeof(halo_catalog));
+  memcpy(cat->header.magic, HALO_CATALOG_MAGIC, 8);
+  cat->header.version = HALO_CATALOG_VERSION;
+  cat->header.flags = flags;
+  cat->header.record_size = halo_record_size(flags);
+  cat->header.dim = DIM;
+  cat->header.box_len = BOX_LEN;
+  cat->header.redshift = redshift;
+  cat->header.num_halos = 0;
+  cat->writing = 1;
+
+  if (!(cat->buffer = (char *) malloc((size_t)cat->header.record_size*HALO_CATALOG_CHUNK))){
+    fprintf(stderr, "halo_catalog_helper_progs.c: Error allocating memory for the halo catalog buffer\n");
+    return -1;
+  }
+  if (!(cat->F = fopen(filename, "wb"))){
+    fprintf(stderr, "halo_catalog_helper_progs.c: Unable to open halo catalog %s for writting\n", filename);
+    free(cat->buffer); cat->buffer = NULL;
+    return -1;
+  }
+  if (fwrite(&cat->header, sizeof(halo_catalog_header), 1, cat->F) != 1){
+    fprintf(stderr, "halo_catalog_helper_progs.c: Write error occured while writting halo catalog %s\n", filename);
+    fclose(cat->F); cat->F = NULL;
+    free(cat->buffer); cat->buffer = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+
+/*
+  Function OPEN_HALO_CATALOG_READ opens an existing catalog and checks its header.
+  Returns 0 on success, -1 on an error.
+*/
+int open_halo_catalog_read(halo_catalog *cat, const char *filename){
+  long long file_size;
+
+  memset(cat, 0, sizeof(halo_catalog));
+  if (!(cat->F = fopen(filename, "rb"))){
+    fprintf(stderr, "halo_catalog_helper_progs.c: Unable to open halo catalog %s\n", filename);
+    return -1;
+  }
+  if ( (fread(&cat->header, sizeof(halo_catalog_header), 1, cat->F) != 1) ||
+       memcmp(cat->header.magic, HALO_CATALOG_MAGIC, 8) ||
+       (cat->header.version != HALO_CATALOG_VERSION) ||
+       (cat->header.record_size != halo_record_size(cat->header.flags)) ){
+    fprintf(stderr, "halo_catalog_helper_progs.c: %s is not a (version %i) halo catalog\n", filename, HALO_CATALOG_VERSION);
+    fclose(cat->F); cat->F = NULL;
+    return -1;
+  }
+  if ((cat->header.dim != DIM) || (fabs(cat->header.box_len - BOX_LEN) > 1e-3*BOX_LEN))
+    fprintf(stderr, "halo_catalog_helper_progs.c: Warning, the halos in %s were found on a %i^3, %.0f Mpc box\n", filename, cat->header.dim, cat->header.box_len);
+
+  // the number of records follows from the size of the file
+  fseeko(cat->F, 0, SEEK_END);
+  file_size = ftello(cat->F);
+  fseeko(cat->F, sizeof(halo_catalog_header), SEEK_SET);
+  cat->num_total = (file_size - (long long)sizeof(halo_catalog_header)) / cat->header.record_size;
+  if ((cat->header.num_halos > 0) && (cat->header.num_halos != cat->num_total))
+    fprintf(stderr, "halo_catalog_helper_progs.c: Warning, halo catalog %s is truncated (%llu of %llu halos)\n", filename, cat->num_total, cat->header.num_halos);
+
+  if (!(cat->buffer = (char *) malloc((size_t)cat->header.record_size*HALO_CATALOG_CHUNK))){
+    fprintf(stderr, "halo_catalog_helper_progs.c: Error allocating memory for the halo catalog buffer\n");
+    fclose(cat->F); cat->F = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+
+/*
+  Function FLUSH_HALO_CATALOG writes out the buffered records.
+  Returns 0 on success, -1 on a write error.
+*/
+int flush_halo_catalog(halo_catalog *cat){
+  if (!cat->writing)
+    return 0;
+  if ( (cat->num_buffered > 0) &&
+       (fwrite(cat->buffer, cat->header.record_size, cat->num_buffered, cat->F) != cat->num_buffered) ){
+    fprintf(stderr, "halo_catalog_helper_progs.c: Write error occured while writting halo catalog\n");
+    return -1;
+  }
+  cat->num_buffered = 0;
+  fflush(cat->F);
+  return 0;
+}
+
+
+/*
+  Function WRITE_HALO_RECORDS appends n halos to the catalog.
+  Returns 0 on success, -1 on a write error.
+*/
+int write_halo_records(halo_catalog *cat, const halo_record *halos, unsigned long long n){
+  unsigned long long ct;
+  char *rec;
+
+  for (ct=0; ct<n; ct++){
+    if ((cat->num_buffered == HALO_CATALOG_CHUNK) && (flush_halo_catalog(cat) != 0))
+      return -1;
+    rec = cat->buffer + (size_t)cat->num_buffered*cat->header.record_size;
+    memcpy(rec, &halos[ct].mass, sizeof(float)); rec += sizeof(float);
+    memcpy(rec, &halos[ct].x, sizeof(float)); rec += sizeof(float);
+    memcpy(rec, &halos[ct].y, sizeof(float)); rec += sizeof(float);
+    memcpy(rec, &halos[ct].z, sizeof(float)); rec += sizeof(float);
+    if (cat->header.flags & HALO_CATALOG_VELOCITY){
+      memcpy(rec, &halos[ct].vx, sizeof(float)); rec += sizeof(float);
+      memcpy(rec, &halos[ct].vy, sizeof(float)); rec += sizeof(float);
+      memcpy(rec, &halos[ct].vz, sizeof(float)); rec += sizeof(float);
+    }
+    if (cat->header.flags & HALO_CATALOG_ID)
+      memcpy(rec, &halos[ct].id, sizeof(unsigned long long));
+
+    cat->num_buffered++;
+    cat->num_done++;
+  }
+  return 0;
+}
+
+
+/*
+  Function READ_HALO_RECORDS reads (up to) the next max_n halos of the catalog into <halos>.
+  Fields which are not in the catalog are set to 0 (velocities) or the halo's index in the
+  catalog (id).  Returns the number of halos read (0 at the end of the catalog), or -1 on a read error.
+*/
+long long read_halo_records(halo_catalog *cat, halo_record *halos, unsigned long long max_n){
+  unsigned long long n, ct, chunk, num_read;
+  char *rec;
+
+  n = cat->num_total - cat->num_done;
+  if (n > max_n)
+    n = max_n;
+
+  for (num_read=0; num_read<n; num_read+=chunk){
+    chunk = n - num_read;
+    if (chunk > HALO_CATALOG_CHUNK)
+      chunk = HALO_CATALOG_CHUNK;
+    if (fread(cat->buffer, cat->header.record_size, chunk, cat->F) != chunk){
+      fprintf(stderr, "halo_catalog_helper_progs.c: Read error occured while reading halo catalog\n");
+      return -1;
+    }
+    for (ct=0; ct<chunk; ct++){
+      rec = cat->buffer + (size_t)ct*cat->header.record_size;
+      memcpy(&halos[num_read+ct].mass, rec, sizeof(float)); rec += sizeof(float);
+      memcpy(&halos[num_read+ct].x, rec, sizeof(float)); rec += sizeof(float);
+      memcpy(&halos[num_read+ct].y, rec, sizeof(float)); rec += sizeof(float);
+      memcpy(&halos[num_read+ct].z, rec, sizeof(float)); rec += sizeof(float);
+      if (cat->header.flags & HALO_CATALOG_VELOCITY){
+	memcpy(&halos[num_read+ct].vx, rec, sizeof(float)); rec += sizeof(float);
+	memcpy(&halos[num_read+ct].vy, rec, sizeof(float)); rec += sizeof(float);
+	memcpy(&halos[num_read+ct].vz, rec, sizeof(float)); rec += sizeof(float);
+      }
+      else
+	halos[num_read+ct].vx = halos[num_read+ct].vy = halos[num_read+ct].vz = 0;
+      if (cat->header.flags & HALO_CATALOG_ID)
+	memcpy(&halos[num_read+ct].id, rec, sizeof(unsigned long long));
+      else
+	halos[num_read+ct].id = cat->num_done + num_read + ct;
+    }
+  }
+  cat->num_done += n;
+  return n;
+}
+
+
+/*
+  Function CLOSE_HALO_CATALOG flushes a catalog which is being written and fills-in the
+  number of halos in its header, and frees the stream.
+  Returns 0 on success, -1 on a write error.
+*/
+int close_halo_catalog(halo_catalog *cat){
+  int status = 0;
+
+  if (!cat->F)
+    return 0;
+  if (cat->writing){
+    if (flush_halo_catalog(cat) != 0)
+      status = -1;
+    cat->header.num_halos = cat->num_done;
+    fseeko(cat->F, 0, SEEK_SET);
+    if (fwrite(&cat->header, sizeof(halo_catalog_header), 1, cat->F) != 1){
+      fprintf(stderr, "halo_catalog_helper_progs.c: Write error occured while writting halo catalog header\n");
+      status = -1;
+    }
+  }
+  if (fclose(cat->F) && cat->writing){
+    fprintf(stderr, "halo_catalog_helper_progs.c: Write error occured while writting halo catalog\n");
+    status = -1;
+  }
+  cat->F = NULL;
+  free(cat->buffer);
+  cat->buffer = NULL;
+  return status;
+}
+
+
+/*
+  Function READ_HALO_CATALOG reads a whole catalog into a newly allocated array <*halos>.
+  The header is returned in <header> (if not NULL).
+  Returns the number of halos, or -1 on an error.
+*/
+long long read_halo_catalog(const char *filename, halo_record **halos, halo_catalog_header *header){
+  halo_catalog cat;
+  long long n;
+
+  *halos = NULL;
+  if (open_halo_catalog_read(&cat, filename) != 0)
+    return -1;
+  if (header)
+    *header = cat.header;
+  if (!(*halos = (halo_record *) malloc(sizeof(halo_record)*(cat.num_total+1)))){
+    fprintf(stderr, "halo_catalog_helper_progs.c: Error allocating memory for %llu halos\n", cat.num_total);
+    close_halo_catalog(&cat);
+    return -1;
+  }
+  n = read_halo_records(&cat, *halos, cat.num_total);
+  close_halo_catalog(&cat);
+  if (n < 0){
+    free(*halos); *halos = NULL;
+  }
+  return n;
+}
+
+#endif
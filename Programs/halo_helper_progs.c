@@ -0,0 +1,374 @@
+#ifndef _HALO_HELPERS_
+#define _HALO_HELPERS_
+
+#include "../Parameter_files/INIT_PARAMS.H"
+#include "../Parameter_files/ANAL_PARAMS.H"
+
+/*
+  Halo exclusion engine used by find_halos.c.
+
+  Halos are spheres of pixels on a periodic box of side <dim> (radii are in pixel units).
+  A pixel at offset (dx,dy,dz) from a halo center (minimum image) belongs to the halo
+  if dx^2 + dy^2 + dz^2 < R^2.
+
+  - Painting a halo onto a flag box uses a precomputed stencil of offsets sorted by their
+    distance from the center, so that the offsets of a sphere of radius R are simply the
+    first cum_ct[ceil(R^2)] entries of the stencil (no distance tests, no periodic images).
+  - Overlap checks against already accepted halos go through a cell list of the halo
+    centers and radii, so only the few neighbouring halos have to be looked at.
+
+  Both give exactly the same pixels as testing every pixel against the 27 periodic images.
+*/
+
+#define HALO_STENCIL_MAX_R (int) 64 // beyond this radius (in pixels) we just scan the bounding cube
+#define HALO_CELL_SIZE (int) 8 // side (in pixels) of the cells of the halo cell list
+
+
+/***************  SPHERICAL STENCILS  ***************/
+
+typedef struct{
+  int R_max; // the stencil contains all offsets with dx^2 + dy^2 + dz^2 <= R_max^2
+  unsigned long long num_offsets;
+  int *offsets; // (dx,dy,dz) triplets, sorted by distance from the center
+  unsigned long long *cum_ct; // cum_ct[m] = number of offsets with dx^2 + dy^2 + dz^2 < m, m = 0..R_max^2+1
+} halo_stencil;
+
+halo_stencil HALO_STENCIL = {-1, 0, NULL, NULL};
+
+
+void free_halo_stencil(){
+  free(HALO_STENCIL.offsets); free(HALO_STENCIL.cum_ct);
+  HALO_STENCIL.offsets = NULL; HALO_STENCIL.cum_ct = NULL;
+  HALO_STENCIL.num_offsets = 0;
+  HALO_STENCIL.R_max = -1;
+}
+
+
+/*
+  Function INIT_HALO_STENCIL makes sure that the stencil covers radii up to R_max pixels
+  (capped at HALO_STENCIL_MAX_R).  The stencil only grows, so this is a no-op most of the time.
+  Not thread safe; call it before any parallel region that uses the stencil.
+  Returns 0 on success, -1 on a memory allocation error.
+*/
+int init_halo_stencil(int R_max){
+  int dx, dy, dz, d2, R_max_sq;
+  unsigned long long *fill_ct, ct;
+
+  if (R_max > HALO_STENCIL_MAX_R)
+    R_max = HALO_STENCIL_MAX_R;
+  if (R_max <= HALO_STENCIL.R_max)
+    return 0;
+
+  free_halo_stencil();
+  R_max_sq = R_max*R_max;
+
+  // count the offsets in each distance shell (counting sort)
+  HALO_STENCIL.cum_ct = (unsigned long long *) calloc(R_max_sq+2, sizeof(unsigned long long));
+  fill_ct = (unsigned long long *) calloc(R_max_sq+1, sizeof(unsigned long long));
+  if (!HALO_STENCIL.cum_ct || !fill_ct){
+    fprintf(stderr, "halo_helper_progs.c: Error allocating memory for the halo stencil\n");
+    free(fill_ct); free_halo_stencil();
+    return -1;
+  }
+  for (dx=-R_max; dx<=R_max; dx++){
+    for (dy=-R_max; dy<=R_max; dy++){
+      for (dz=-R_max; dz<=R_max; dz++){
+	d2 = dx*dx + dy*dy + dz*dz;
+	if (d2 <= R_max_sq)
+	  HALO_STENCIL.cum_ct[d2+1]++;
+      }
+    }
+  }
+  for (d2=1; d2<=(R_max_sq+1); d2++)
+    HALO_STENCIL.cum_ct[d2] += HALO_STENCIL.cum_ct[d2-1];
+  HALO_STENCIL.num_offsets = HALO_STENCIL.cum_ct[R_max_sq+1];
+
+  HALO_STENCIL.offsets = (int *) malloc(sizeof(int)*3*HALO_STENCIL.num_offsets);
+  if (!HALO_STENCIL.offsets){
+    fprintf(stderr, "halo_helper_progs.c: Error allocating memory for the halo stencil\n");
+    free(fill_ct); free_halo_stencil();
+    return -1;
+  }
+  for (dx=-R_max; dx<=R_max; dx++){
+    for (dy=-R_max; dy<=R_max; dy++){
+      for (dz=-R_max; dz<=R_max; dz++){
+	d2 = dx*dx + dy*dy + dz*dz;
+	if (d2 <= R_max_sq){
+	  ct = HALO_STENCIL.cum_ct[d2] + fill_ct[d2]++;
+	  HALO_STENCIL.offsets[3*ct] = dx;
+	  HALO_STENCIL.offsets[3*ct+1] = dy;
+	  HALO_STENCIL.offsets[3*ct+2] = dz;
+	}
+      }
+    }
+  }
+  free(fill_ct);
+  HALO_STENCIL.R_max = R_max;
+  return 0;
+}
+
+
+/*
+  Returns the number of (leading) stencil offsets which are inside a sphere with
+  the squared radius Rsq (in pixels), or -1 if the sphere is too large for the stencil.
+*/
+long long halo_stencil_ct(float Rsq){
+  int m;
+
+  if (Rsq <= 0)
+    return 0;
+  // the distances are integers, so d2 < Rsq <=> d2 < ceil(Rsq)
+  m = ceil(Rsq);
+  if ( (init_halo_stencil(ceil(sqrt(Rsq))) != 0) || (m > HALO_STENCIL.R_max*HALO_STENCIL.R_max+1) )
+    return -1;
+  return HALO_STENCIL.cum_ct[m];
+}
+
+
+// periodic wrap of a pixel coordinate
+int halo_wrap(int x, int dim){
+  x %= dim;
+  if (x < 0) x += dim;
+  return x;
+}
+
+// periodic minimum image of a pixel offset
+int halo_min_image(int dx, int dim){
+  dx = halo_wrap(dx, dim);
+  if (2*dx > dim) dx -= dim;
+  return dx;
+}
+
+
+/*
+  Function PAINT_HALO_SPHERE flags all pixels of the (dim^3, unpadded) box <in_halo>
+  which fall within R pixels of (x,y,z).
+*/
+void paint_halo_sphere(char *in_halo, int dim, float R, int x, int y, int z){
+  long long n, ct;
+  int dx, dy, dz, R_index;
+  float Rsq;
+  int *offset;
+
+  Rsq = pow(R, 2);
+  n = halo_stencil_ct(Rsq);
+  if (n >= 0){
+    for (ct=0; ct<n; ct++){
+      offset = HALO_STENCIL.offsets + 3*ct;
+      in_halo[ halo_wrap(z+offset[2], dim) + dim*( halo_wrap(y+offset[1], dim) + dim*(unsigned long long)halo_wrap(x+offset[0], dim) ) ] = 1;
+    }
+    return;
+  }
+
+  // sphere larger than the stencil; go through the bounding cube
+  R_index = ceil(R);
+  for (dx=-R_index; dx<=R_index; dx++){
+    for (dy=-R_index; dy<=R_index; dy++){
+      for (dz=-R_index; dz<=R_index; dz++){
+	if (Rsq > (float)(dx*dx + dy*dy + dz*dz))
+	  in_halo[ halo_wrap(z+dz, dim) + dim*( halo_wrap(y+dy, dim) + dim*(unsigned long long)halo_wrap(x+dx, dim) ) ] = 1;
+      }
+    }
+  }
+}
+
+
+/*
+  Returns 1 if the pixel offset (dx,dy,dz) from a halo center (any periodic image) is inside
+  a sphere with squared radius Rsq.
+*/
+int halo_offset_inside(int dx, int dy, int dz, int dim, float Rsq){
+  dx = halo_min_image(dx, dim);
+  dy = halo_min_image(dy, dim);
+  dz = halo_min_image(dz, dim);
+  return (Rsq > (float)(dx*dx + dy*dy + dz*dz));
+}
+
+
+/*
+  Returns 1 if any pixel is shared by the sphere with squared radius Rsq_a centered on the pixel
+  offset (dx,dy,dz) and the sphere with squared radius Rsq_b centered on the origin.
+*/
+int halo_spheres_share_pixel(int dx, int dy, int dz, int dim, float Rsq_a, float Rsq_b){
+  long long n, ct;
+  int ox, oy, oz, R_index;
+  int *offset;
+
+  n = halo_stencil_ct(Rsq_a);
+  if (n >= 0){
+    for (ct=0; ct<n; ct++){
+      offset = HALO_STENCIL.offsets + 3*ct;
+      if (halo_offset_inside(dx+offset[0], dy+offset[1], dz+offset[2], dim, Rsq_b))
+	return 1;
+    }
+    return 0;
+  }
+
+  R_index = ceil(sqrt(Rsq_a));
+  for (ox=-R_index; ox<=R_index; ox++){
+    for (oy=-R_index; oy<=R_index; oy++){
+      for (oz=-R_index; oz<=R_index; oz++){
+	if ( (Rsq_a > (float)(ox*ox + oy*oy + oz*oz)) &&
+	     halo_offset_inside(dx+ox, dy+oy, dz+oz, dim, Rsq_b) )
+	  return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+
+/***************  HALO CELL LIST  ***************/
+
+typedef struct{
+  int dim; // pixels per side of the box
+  int NUM_CELLS; // cells per side; pixel x is in cell x*NUM_CELLS/dim
+  int *head; // first halo in each cell (-1 if empty)
+  int num_halos, max_halos;
+  int *next, *x, *y, *z; // linked list of the halos in each cell, and their centers
+  float *R, *Rsq; // halo radii (in pixels) and their squares
+  float R_max; // the largest radius in the list
+} halo_cell_list;
+
+
+// cell index of the pixel coordinate x
+int halo_cell(int x, halo_cell_list *list){
+  return (int)(((long long)x*list->NUM_CELLS)/list->dim);
+}
+
+
+/*
+  Function INIT_HALO_CELL_LIST sets up an empty cell list for a periodic box of side <dim> pixels.
+  Returns 0 on success, -1 on a memory allocation error.
+*/
+int init_halo_cell_list(halo_cell_list *list, int dim){
+  int ct;
+
+  list->dim = dim;
+  list->NUM_CELLS = dim/HALO_CELL_SIZE;
+  if (list->NUM_CELLS < 1)
+    list->NUM_CELLS = 1;
+  list->num_halos = list->max_halos = 0;
+  list->next = list->x = list->y = list->z = NULL;
+  list->R = list->Rsq = NULL;
+  list->R_max = 0;
+  list->head = (int *) malloc(sizeof(int)*list->NUM_CELLS*list->NUM_CELLS*list->NUM_CELLS);
+  if (!list->head){
+    fprintf(stderr, "halo_helper_progs.c: Error allocating memory for the halo cell list\n");
+    return -1;
+  }
+  for (ct=0; ct<(list->NUM_CELLS*list->NUM_CELLS*list->NUM_CELLS); ct++)
+    list->head[ct] = -1;
+  return 0;
+}
+
+
+void free_halo_cell_list(halo_cell_list *list){
+  free(list->head); free(list->next);
+  free(list->x); free(list->y); free(list->z);
+  free(list->R); free(list->Rsq);
+}
+
+
+/*
+  Function ADD_HALO_TO_CELL_LIST adds a halo of radius R pixels centered on (x,y,z).
+  Returns 0 on success, -1 on a memory allocation error.
+*/
+int add_halo_to_cell_list(halo_cell_list *list, float R, int x, int y, int z){
+  int cell, new_max;
+  void *p[6];
+
+  if (list->num_halos == list->max_halos){
+    new_max = list->max_halos ? 2*list->max_halos : 1024;
+    p[0] = realloc(list->next, sizeof(int)*new_max);
+    if (p[0]) list->next = (int *) p[0];
+    p[1] = realloc(list->x, sizeof(int)*new_max);
+    if (p[1]) list->x = (int *) p[1];
+    p[2] = realloc(list->y, sizeof(int)*new_max);
+    if (p[2]) list->y = (int *) p[2];
+    p[3] = realloc(list->z, sizeof(int)*new_max);
+    if (p[3]) list->z = (int *) p[3];
+    p[4] = realloc(list->R, sizeof(float)*new_max);
+    if (p[4]) list->R = (float *) p[4];
+    p[5] = realloc(list->Rsq, sizeof(float)*new_max);
+    if (p[5]) list->Rsq = (float *) p[5];
+    if (!p[0] || !p[1] || !p[2] || !p[3] || !p[4] || !p[5]){
+      fprintf(stderr, "halo_helper_progs.c: Error allocating memory for the halo cell list\n");
+      return -1;
+    }
+    list->max_halos = new_max;
+  }
+
+  cell = halo_cell(z, list) + list->NUM_CELLS*( halo_cell(y, list) + list->NUM_CELLS*halo_cell(x, list) );
+  list->x[list->num_halos] = x;
+  list->y[list->num_halos] = y;
+  list->z[list->num_halos] = z;
+  list->R[list->num_halos] = R;
+  list->Rsq[list->num_halos] = pow(R, 2);
+  list->next[list->num_halos] = list->head[cell];
+  list->head[cell] = list->num_halos;
+  list->num_halos++;
+  if (R > list->R_max)
+    list->R_max = R;
+  return 0;
+}
+
+
+/*
+  Function HALO_OVERLAPS_CELL_LIST returns 1 if a would be halo with radius R pixels centered
+  on (x,y,z) shares at least one pixel with a halo in the list, and 0 otherwise.
+*/
+int halo_overlaps_cell_list(halo_cell_list *list, float R, int x, int y, int z){
+  int cx, cy, cz, cx_min, cy_min, cz_min, cx_max, cy_max, cz_max, cell_range, i, j, k, halo;
+  int dx, dy, dz;
+  float Rsq, d;
+
+  if ((list->num_halos == 0) || (R <= 0))
+    return 0;
+  Rsq = pow(R, 2);
+
+  // only cells within R + R_max of the center can hold an overlapping halo
+  cell_range = ceil((R + list->R_max)*list->NUM_CELLS/(float)list->dim) + 1;
+  if ((2*cell_range+1) >= list->NUM_CELLS){ // every cell, each once
+    cx_min = cy_min = cz_min = 0;
+    cx_max = cy_max = cz_max = list->NUM_CELLS-1;
+  }
+  else{
+    cx_min = halo_cell(x, list) - cell_range; cx_max = halo_cell(x, list) + cell_range;
+    cy_min = halo_cell(y, list) - cell_range; cy_max = halo_cell(y, list) + cell_range;
+    cz_min = halo_cell(z, list) - cell_range; cz_max = halo_cell(z, list) + cell_range;
+  }
+
+  for (i=cx_min; i<=cx_max; i++){
+    cx = halo_wrap(i, list->NUM_CELLS);
+    for (j=cy_min; j<=cy_max; j++){
+      cy = halo_wrap(j, list->NUM_CELLS);
+      for (k=cz_min; k<=cz_max; k++){
+	cz = halo_wrap(k, list->NUM_CELLS);
+
+	for (halo=list->head[cz + list->NUM_CELLS*(cy + list->NUM_CELLS*cx)]; halo>=0; halo=list->next[halo]){
+	  dx = halo_min_image(x - list->x[halo], list->dim);
+	  dy = halo_min_image(y - list->y[halo], list->dim);
+	  dz = halo_min_image(z - list->z[halo], list->dim);
+
+	  // the center pixel is inside the other halo
+	  if (list->Rsq[halo] > (float)(dx*dx + dy*dy + dz*dz))
+	    return 1;
+
+	  // disjoint spheres can not share a pixel (small margin for the float comparisons)
+	  d = sqrt(dx*dx + dy*dy + dz*dz);
+	  if (d >= (R + list->R[halo] + 1e-3))
+	    continue;
+
+	  // close call, compare the pixels
+	  if (halo_spheres_share_pixel(dx, dy, dz, list->dim, Rsq, list->Rsq[halo]))
+	    return 1;
+	}
+      }
+    }
+  }
+
+  return 0;
+}
+
+#endif
@@ -3,6 +3,8 @@
 #include "../Parameter_files/HEAT_PARAMS.H"
 #include "../Parameter_files/SOURCES.H"
 #include "bubble_helper_progs.c"
+#include "reduction_helper_progs.c"
+#include "fcoll_helper_progs.c"
 #include "elec_interp.c"
 
 #define NSPEC_MAX (int) 23
@@ -35,6 +37,43 @@ gsl_spline *FcollLowLya_zpp_spline[NUM_FILTER_STEPS_FOR_Ts];
 int i; //TEST
 FILE *LOG;
 
+/* Integration workspaces of the frequency integrals, one per thread, and the nodes and weights
+   in ln(nu/nu_min) of the fixed-node quadrature (if FREQ_INT_FIXED_NODES > 0) */
+gsl_integration_workspace **NU_INT_WORKSPACES = NULL;
+int NU_INT_NUM_WORKSPACES = 0;
+double *FREQ_INT_NODES = NULL, *FREQ_INT_WEIGHTS = NULL;
+
+/* The tabulated nu_tau_one; see init_nu_tau_one_table() below */
+#define NU_TAU_ONE_KEY_LEN (int) 32
+typedef struct{
+  double key[NU_TAU_ONE_KEY_LEN]; // parameters the table depends on
+  int N_zp, N_R, N_xe, N_Q;
+  double zp_min, zp_max, xe_max; // the filling factor axis is [0,1]
+  double *zpp; // [N_zp][N_R] redshifts of the filter shells
+  float *log_nu; // [N_zp][N_R][N_xe][N_Q] ln(nu_tau_one)
+  // log10 of the collapsed fraction used by the tabulated optical depths
+  int N_fcoll;
+  double fcoll_zmin, fcoll_dz, *log_fcoll;
+} nu_tau_one_table;
+nu_tau_one_table NU_TAU_ONE_TBL;
+
+/* The filter shells at every z' step of the run; see init_zpp_shell_table() below */
+#define ZPP_SHELL_KEY_LEN (int) 16
+typedef struct{
+  double key[ZPP_SHELL_KEY_LEN]; // parameters the table depends on
+  int N_zp, N_R;
+  float *zp; // [N_zp] the z' steps
+  double *zp_growth; // [N_zp][3] dicke(z'), ddicke_dz(z') and dtdz(z')
+  double *zpp_edge; // [N_zp][N_R] far edges of the shells
+  double *zpp_growth, *zpp_hubble, *zpp_dtdz; // [N_zp][N_R] dicke, hubble and dtdz at the shell centers
+} zpp_shell_table;
+zpp_shell_table ZPP_SHELL_TBL;
+
+/* The shells at the current z' step (set_zpp_shells), as used in evolveInt: the shell centers, widths,
+   growth factors, dfcoll/dz'' factors for the new parametrization and the X-ray and Lya redshift factors */
+double zpp_shell[NUM_FILTER_STEPS_FOR_Ts], dzpp_shell[NUM_FILTER_STEPS_FOR_Ts], growth_zpp_shell[NUM_FILTER_STEPS_FOR_Ts],
+  dfcoll_zpp_shell[NUM_FILTER_STEPS_FOR_Ts], xray_zpp_shell[NUM_FILTER_STEPS_FOR_Ts], lya_zpp_shell[NUM_FILTER_STEPS_FOR_Ts];
+
 /* initialization routine */
 int init_heat();
 
@@ -56,6 +95,14 @@ void evolveInt(float zp, float curr_delNL0[], double freq_int_heat[],
 	       int COMPUTE_Ts, double y[], double deriv[], int arr_num);
 		   //float Mturn, float ALPHA_STAR, float F_STAR10, float T_AST);
 
+/* The two halves of evolveInt: adding the contribution of one filter shell to the z'' integrals
+   zpp_sums[4] (X-ray heating, X-ray ionization, Lya from X-rays, direct stellar Lya), and
+   evolving with the summed integrals */
+void add_zpp_shell(float zp, int zpp_ct, float curr_delNL0, double freq_int_heat,
+		   double freq_int_ion, double freq_int_lya, int COMPUTE_Ts, int arr_num, double zpp_sums[]);
+void evolve_zpp_sums(float zp, float curr_delNL0, double zpp_sums[], int COMPUTE_Ts,
+		     double y[], double deriv[]);
+
 float dfcoll_dz(float z, float Tmin, float del_bias, float sig_bias);
 
 /* Compton heating rate */
@@ -74,9 +121,29 @@ double species_weighted_x_ray_cross_section(double nu, double x_e);
  in the IGM with mean electron fraction x_e */
 double nu_tau_one(double zp, double zpp, double x_e, double HI_filling_factor_zp); 
 
+/* Tabulates nu_tau_one over the z' range of the run (read from the cache if possible),
+   and returns it interpolated for the filter shell R_ct at z'' = zpp */
+int init_nu_tau_one_table();
+double nu_tau_one_lookup(double zp, double zpp, int R_ct, double x_e, double HI_filling_factor_zp);
+void free_nu_tau_one_table();
+
+/* Tabulates the filter shells at every z' step from zp_max down to zp_min (read from the cache if
+   possible), and sets zpp_edge and the *_zpp_shell arrays, and the z' growth factors, for step zp_ct */
+int init_zpp_shell_table(float zp_max, float zp_min);
+void set_zpp_shells(int zp_ct, float zp);
+void free_zpp_shell_table();
+
+/* name of a cache file in ../Boxes/Ts_evolution/, from a hash of its key */
+void cache_filename(char *filename, const char *name, double *key, int key_len);
+
  /* Main integral driver for the frequency integral in the evolution equations */
 double integrate_over_nu(double zp, double local_x_e, double lower_int_limit, int FLAG);
 
+/* The same integral for all of the x_int_XHII values at once, with the fixed-node quadrature */
+void integrate_over_nu_fixed(double zp, double lower_int_limit, int FLAG, double result[]);
+int init_nu_integration();
+void free_nu_integration();
+
 /* Returns the maximum redshift at which a Lyn transition contributes to Lya 
    flux at z */
 float zmax(float z, int n);
@@ -122,7 +189,11 @@ int init_heat()
   if (spectral_emissivity(0,1,2,0) < 0)
     return -6;
 
-  initialize_interp_arrays();
+  if (initialize_interp_arrays() < 0)
+    return -8;
+
+  if (init_nu_integration() < 0)
+    return -7;
 
   return 0;
 }
@@ -136,6 +207,10 @@ void destruct_heat()
   T_RECFAST(100.0,2);
   xion_RECFAST(100.0,2);
   spectral_emissivity(0.0, 2, 2,0);
+  free_nu_tau_one_table();
+  free_zpp_shell_table();
+  free_nu_integration();
+  free_interp_arrays();
 }
 
 
@@ -377,69 +452,62 @@ double spec_emis_avg(double z, sources s, double nu_norm)
 void evolveInt(float zp, float curr_delNL0[], double freq_int_heat[], 
 	       double freq_int_ion[], double freq_int_lya[], 
 	       int COMPUTE_Ts, double y[], double deriv[], int arr_num){//, float M_TURN, float ALPHA_STAR, float F_STAR10, float T_AST){
-  double  dfdzp, dadia_dzp, dcomp_dzp, dxheat_dt, ddz, dxion_source_dt, dxion_sink_dt;
-  double zpp, dzpp, nu_temp;
-  int zpp_ct,ithread;
-  double T, x_e, dTdzp, dx_edzp, dfcoll, dfcollLya, zpp_integrand;
-  double dxe_dzp, n_b, dspec_dzp, dxheat_dzp, dxlya_dt, dstarlya_dt;
-  // New in v1.4
-  float growth_zpp,fcoll,fcollLya;
+  double zpp_sums[4];
+  int zpp_ct;
 
-  x_e = y[0];
-  T = y[1];
-  n_b = N_b0 * pow(1+zp, 3) * (1+curr_delNL0[0]*growth_factor_zp);
+  // First, let's do the trapazoidal integration over zpp
+  zpp_sums[0] = zpp_sums[1] = zpp_sums[2] = zpp_sums[3] = 0;
+  if (!NO_LIGHT){
+    for (zpp_ct = 0; zpp_ct < NUM_FILTER_STEPS_FOR_Ts; zpp_ct++)
+      add_zpp_shell(zp, zpp_ct, curr_delNL0[zpp_ct], freq_int_heat[zpp_ct], freq_int_ion[zpp_ct],
+		    freq_int_lya[zpp_ct], COMPUTE_Ts, arr_num, zpp_sums);
+  }
 
+  evolve_zpp_sums(zp, curr_delNL0[0], zpp_sums, COMPUTE_Ts, y, deriv);
+}
 
-  // First, let's do the trapazoidal integration over zpp
-  ithread = omp_get_thread_num();
+/* Adds the contribution of the filter shell zpp_ct, with (z=0) density curr_delNL0, to the z'' integrals of evolveInt */
+void add_zpp_shell(float zp, int zpp_ct, float curr_delNL0, double freq_int_heat,
+		   double freq_int_ion, double freq_int_lya, int COMPUTE_Ts, int arr_num, double zpp_sums[]){
+  double zpp, dzpp, dfcoll, dfcollLya, zpp_integrand;
+  // New in v1.4
+  float growth_zpp,fcoll,fcollLya;
 
-  dxheat_dt = 0;
-  dxion_source_dt = 0;
-  dxlya_dt = 0;
-  dstarlya_dt = 0;
-  if (!NO_LIGHT){
-  for (zpp_ct = 0; zpp_ct < NUM_FILTER_STEPS_FOR_Ts; zpp_ct++){
-    // set redshift of half annulus; dz'' is negative since we flipped limits of integral
-    if (zpp_ct==0){
-      zpp = (zpp_edge[0]+zp)*0.5;
-      dzpp = zp - zpp_edge[0];
-    }
-    else{
-      zpp = (zpp_edge[zpp_ct]+zpp_edge[zpp_ct-1])*0.5;
-      dzpp = zpp_edge[zpp_ct-1] - zpp_edge[zpp_ct];
-    }
+  // the redshift of the half annulus, its width and growth factor are set for this z' by set_zpp_shells()
+  zpp = zpp_shell[zpp_ct];
+  dzpp = dzpp_shell[zpp_ct];
 	//New in v1.4
-    if (HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY) {
-	  growth_zpp = dicke(zpp);
+  if (HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY) {
+	  growth_zpp = growth_zpp_shell[zpp_ct];
 	  // Interpolate Fcoll -------------------------------------------------------------------------------------
-	  if (curr_delNL0[zpp_ct]*growth_zpp < 1.5){
-        if (curr_delNL0[zpp_ct]*growth_zpp < -1.) {
+	  if (curr_delNL0*growth_zpp < 1.5){
+      if (curr_delNL0*growth_zpp < -1.) {
 		  fcoll = 0;
-      fcollLya = 0;
-        }
-        else {
-          fcoll = gsl_spline_eval(FcollLow_zpp_spline[zpp_ct], log10(curr_delNL0[zpp_ct]*growth_zpp+1.), FcollLow_zpp_spline_acc[zpp_ct]);
-          fcoll= pow(10., fcoll);
-          fcollLya = gsl_spline_eval(FcollLowLya_zpp_spline[zpp_ct], log10(curr_delNL0[zpp_ct]*growth_zpp+1.), FcollLowLya_zpp_spline_acc[zpp_ct]);
-          fcollLya = pow(10., fcollLya);
-        }
+    fcollLya = 0;
+      }
+      else {
+        fcoll = gsl_spline_eval(FcollLow_zpp_spline[zpp_ct], log10(curr_delNL0*growth_zpp+1.), FcollLow_zpp_spline_acc[zpp_ct]);
+        fcoll= pow(10., fcoll);
+        fcollLya = gsl_spline_eval(FcollLowLya_zpp_spline[zpp_ct], log10(curr_delNL0*growth_zpp+1.), FcollLowLya_zpp_spline_acc[zpp_ct]);
+        fcollLya = pow(10., fcollLya);
+      }
+    }
+    else {
+      if (curr_delNL0*growth_zpp < 0.99*Deltac) {
+        // Usage of 0.99*Deltac arises due to the fact that close to the critical density, the collapsed fraction becomes a little unstable
+        // However, such densities should always be collapsed, so just set f_coll to unity. 
+        // Additionally, the fraction of points in this regime relative to the entire simulation volume is extremely small.
+        splint(Overdense_high_table-1,Fcollz_SFR_high_table[arr_num + zpp_ct]-1,second_derivs_Fcoll_zpp[zpp_ct]-1,NSFR_high,curr_delNL0*growth_zpp,&(fcoll));
+        splint(Overdense_high_table-1,FcollzLya_SFR_high_table[arr_num + zpp_ct]-1,second_derivs_FcollLya_zpp[zpp_ct]-1,NSFR_high,curr_delNL0*growth_zpp,&(fcollLya));
       }
       else {
-        if (curr_delNL0[zpp_ct]*growth_zpp < 0.99*Deltac) {
-          // Usage of 0.99*Deltac arises due to the fact that close to the critical density, the collapsed fraction becomes a little unstable
-          // However, such densities should always be collapsed, so just set f_coll to unity. 
-          // Additionally, the fraction of points in this regime relative to the entire simulation volume is extremely small.
-          splint(Overdense_high_table-1,Fcollz_SFR_high_table[arr_num + zpp_ct]-1,second_derivs_Fcoll_zpp[zpp_ct]-1,NSFR_high,curr_delNL0[zpp_ct]*growth_zpp,&(fcoll));
-          splint(Overdense_high_table-1,FcollzLya_SFR_high_table[arr_num + zpp_ct]-1,second_derivs_FcollLya_zpp[zpp_ct]-1,NSFR_high,curr_delNL0[zpp_ct]*growth_zpp,&(fcollLya));
-        }
-        else {
-          fcoll = 1.;
-          fcollLya = 1.;
-        }
+        fcoll = 1.;
+        fcollLya = 1.;
       }
-      //printf("delta = %.4f, fcoll1 = %.4e, fcoll2 = %.4e\n",Overdensity,fcoll1,fcoll2);
-      if (fcoll > 1.) fcoll = 1.;
-      if (fcollLya > 1.) fcollLya = 1.;
+    }
+    //printf("delta = %.4f, fcoll1 = %.4e, fcoll2 = %.4e\n",Overdensity,fcoll1,fcoll2);
+    if (fcoll > 1.) fcoll = 1.;
+    if (fcollLya > 1.) fcollLya = 1.;
 	  // Find Fcoll end ----------------------------------------------------------------------------------
 
 	  /* Instead of dfcoll/dz we compute fcoll/(T_AST*H(z)^-1)*(dt/dz), 
@@ -448,25 +516,40 @@ void evolveInt(float zp, float curr_delNL0[], double freq_int_heat[],
 		If turn the new parametrization on, this is a free parameter.
 		*/
 	  //dfcoll = ST_over_PS[zpp_ct]*(double)fcoll*hubble(zpp)/T_AST*dtdz(zpp)*dzpp;
-	  dfcoll = ST_over_PS[zpp_ct]*(double)fcoll*hubble(zpp)/T_AST*fabs(dtdz(zpp))*fabs(dzpp);
-    dfcollLya = ST_over_PS_Lya[zpp_ct]*(double)fcollLya*hubble(zpp)/T_AST*fabs(dtdz(zpp))*fabs(dzpp);
+	  dfcoll = ST_over_PS[zpp_ct]*(double)fcoll*dfcoll_zpp_shell[zpp_ct]; // hubble(zpp)/T_AST*fabs(dtdz(zpp))*fabs(dzpp)
+  dfcollLya = ST_over_PS_Lya[zpp_ct]*(double)fcollLya*dfcoll_zpp_shell[zpp_ct];
 	}
 	else {
-      dfcoll = dfcoll_dz(zpp, sigma_Tmin[zpp_ct], curr_delNL0[zpp_ct], sigma_atR[zpp_ct]);
-      dfcoll *= ST_over_PS[zpp_ct] * dzpp; // this is now a positive quantity
-	  //dfcoll = ST_over_PS[zpp_ct]*sigmaparam_FgtrM_bias(zpp, sigma_Tmin[zpp_ct], curr_delNL0[zpp_ct], sigma_atR[zpp_ct])*hubble(zpp)/0.7*fabs(dtdz(zpp));//TEST
+    dfcoll = dfcoll_dz(zpp, sigma_Tmin[zpp_ct], curr_delNL0, sigma_atR[zpp_ct]);
+    dfcoll *= ST_over_PS[zpp_ct] * dzpp; // this is now a positive quantity
+	  //dfcoll = ST_over_PS[zpp_ct]*sigmaparam_FgtrM_bias(zpp, sigma_Tmin[zpp_ct], curr_delNL0, sigma_atR[zpp_ct])*hubble(zpp)/0.7*fabs(dtdz(zpp));//TEST
 	}
-    zpp_integrand = dfcoll * (1+curr_delNL0[zpp_ct]*dicke(zpp)) * pow(1+zpp, -X_RAY_SPEC_INDEX);
-
-    dxheat_dt += zpp_integrand * freq_int_heat[zpp_ct];
-    dxion_source_dt += zpp_integrand * freq_int_ion[zpp_ct];
-    if (COMPUTE_Ts){
-      dxlya_dt += zpp_integrand * freq_int_lya[zpp_ct];
-      dstarlya_dt += dfcollLya * (1+curr_delNL0[zpp_ct]*dicke(zpp)) * pow(1+zp,2)*(1+zpp)
-                     * sum_lyn[zpp_ct];
-    }
+  zpp_integrand = dfcoll * (1+curr_delNL0*growth_zpp_shell[zpp_ct]) * xray_zpp_shell[zpp_ct];
+
+  zpp_sums[0] += zpp_integrand * freq_int_heat;
+  zpp_sums[1] += zpp_integrand * freq_int_ion;
+  if (COMPUTE_Ts){
+    zpp_sums[2] += zpp_integrand * freq_int_lya;
+    zpp_sums[3] += dfcollLya * (1+curr_delNL0*growth_zpp_shell[zpp_ct]) * lya_zpp_shell[zpp_ct]
+                   * sum_lyn[zpp_ct];
   }
+}
+
+/* Evolves the cell with (z=0) density curr_delNL0, given its z'' integrals */
+void evolve_zpp_sums(float zp, float curr_delNL0, double zpp_sums[], int COMPUTE_Ts,
+		     double y[], double deriv[]){
+  double dadia_dzp, dcomp_dzp, dxheat_dt, dxion_source_dt, dxion_sink_dt;
+  double T, x_e, dxe_dzp, n_b, dspec_dzp, dxheat_dzp, dxlya_dt, dstarlya_dt;
 
+  x_e = y[0];
+  T = y[1];
+  n_b = N_b0 * pow(1+zp, 3) * (1+curr_delNL0*growth_factor_zp);
+
+  dxheat_dt = zpp_sums[0];
+  dxion_source_dt = zpp_sums[1];
+  dxlya_dt = zpp_sums[2];
+  dstarlya_dt = zpp_sums[3];
+  if (!NO_LIGHT){
   // add prefactors
   dxheat_dt *= const_zp_prefactor;
   dxion_source_dt *= const_zp_prefactor;
@@ -506,10 +589,10 @@ void evolveInt(float zp, float curr_delNL0[], double freq_int_heat[],
   /*** Next, let's get the temperature components ***/
   // first, adiabatic term
   dadia_dzp = 3/(1.0+zp);
-  if (fabs(curr_delNL0[0]) > FRACT_FLOAT_ERR) // add adiabatic heating/cooling from structure formation
-    dadia_dzp += dgrowth_factor_dzp/(1.0/curr_delNL0[0]+growth_factor_zp);
+  if (fabs(curr_delNL0) > FRACT_FLOAT_ERR) // add adiabatic heating/cooling from structure formation
+    dadia_dzp += dgrowth_factor_dzp/(1.0/curr_delNL0+growth_factor_zp);
   dadia_dzp *= (2.0/3.0)*T;
-  //  printf("dTstructure/dz=%e, total Adiabatic heat/dzp (structure + expansion) at zp=%.3f = %e\n", dgrowth_factor_dzp/(1.0/curr_delNL0[0]+growth_factor_zp), zp, dadia_dzp);
+  //  printf("dTstructure/dz=%e, total Adiabatic heat/dzp (structure + expansion) at zp=%.3f = %e\n", dgrowth_factor_dzp/(1.0/curr_delNL0+growth_factor_zp), zp, dadia_dzp);
 
   // next heating due to the changing species
   dspec_dzp = - dxe_dzp * T / (1+x_e);
@@ -608,8 +691,14 @@ double integrate_over_nu(double zp, double local_x_e, double lower_int_limit, in
        double result, error;
        double rel_tol  = 0.01; //<- relative tolerance
        gsl_function F;
-       gsl_integration_workspace * w 
-	 = gsl_integration_workspace_alloc (1000);
+       gsl_integration_workspace * w;
+       int thread = omp_get_thread_num();
+
+       // use this thread's workspace if there is one
+       if (thread < NU_INT_NUM_WORKSPACES)
+	 w = NU_INT_WORKSPACES[thread];
+       else
+	 w = gsl_integration_workspace_alloc (1000);
 
        if (DEBUG_ON){
 	 printf("integrate over nu, parameters: %f, %f, %e, %i, thread# %i\n", zp, local_x_e, lower_int_limit, FLAG, omp_get_thread_num());
@@ -634,7 +723,8 @@ double integrate_over_nu(double zp, double local_x_e, double lower_int_limit, in
 
        gsl_integration_qag (&F, lower_int_limit, 100*lower_int_limit, 
 			    0, rel_tol, 1000, GSL_INTEG_GAUSS61, w, &result, &error); 
-       gsl_integration_workspace_free (w);
+       if (thread >= NU_INT_NUM_WORKSPACES)
+	 gsl_integration_workspace_free (w);
 
 
        // if it is the Lya integral, add prefactor
@@ -649,6 +739,108 @@ double integrate_over_nu(double zp, double local_x_e, double lower_int_limit, in
 }
 
 
+/*
+  Fixed-node version of integrate_over_nu.  The integrands fall off roughly as a power of nu,
+  i.e. exponentially in ln(nu), so the integral over [lower_int_limit, 100*lower_int_limit]
+  is done with FREQ_INT_FIXED_NODES Gauss-Legendre nodes in ln(nu).  The nodes only depend on
+  the lower limit, so all of the x_int_XHII values are done at once, and result[] holds the
+  integral for each of them.
+*/
+void integrate_over_nu_fixed(double zp, double lower_int_limit, int FLAG, double result[]){
+  double nu, x_e, weight;
+  int node_ct, x_e_ct;
+
+  for (x_e_ct=0; x_e_ct<x_int_NXHII; x_e_ct++)
+    result[x_e_ct] = 0;
+
+  for (node_ct=0; node_ct<FREQ_INT_FIXED_NODES; node_ct++){
+    nu = lower_int_limit * exp(FREQ_INT_NODES[node_ct]);
+    weight = FREQ_INT_WEIGHTS[node_ct] * nu; // dnu = nu dln(nu)
+    for (x_e_ct=0; x_e_ct<x_int_NXHII; x_e_ct++){
+      x_e = x_int_XHII[x_e_ct];
+      if (FLAG==0)
+	result[x_e_ct] += weight * integrand_in_nu_heat_integral(nu, &x_e);
+      else if (FLAG==1)
+	result[x_e_ct] += weight * integrand_in_nu_ion_integral(nu, &x_e);
+      else
+	result[x_e_ct] += weight * integrand_in_nu_lya_integral(nu, &x_e);
+    }
+  }
+
+  // if it is the Lya integral, add prefactor
+  if (FLAG == 2){
+    for (x_e_ct=0; x_e_ct<x_int_NXHII; x_e_ct++)
+      result[x_e_ct] *= C / FOURPI / Ly_alpha_HZ / hubble(zp);
+  }
+}
+
+
+/*
+  Allocates the per-thread integration workspaces, and sets up the Gauss-Legendre nodes
+  and weights on [0, ln(100)] used by integrate_over_nu_fixed
+*/
+int init_nu_integration(){
+  double x, p0, p1, p2, dp, L = log(100.0);
+  int n = FREQ_INT_FIXED_NODES, ct, j, iter;
+
+  free_nu_integration();
+  NU_INT_WORKSPACES = (gsl_integration_workspace **) calloc(omp_get_max_threads(), sizeof(gsl_integration_workspace *));
+  if (!NU_INT_WORKSPACES){
+    fprintf(stderr, "Unable to allocate memory for the integration workspaces!\n");
+    return -1;
+  }
+  for (NU_INT_NUM_WORKSPACES=0; NU_INT_NUM_WORKSPACES<omp_get_max_threads(); NU_INT_NUM_WORKSPACES++){
+    if (!(NU_INT_WORKSPACES[NU_INT_NUM_WORKSPACES] = gsl_integration_workspace_alloc (1000))){
+      fprintf(stderr, "Unable to allocate memory for the integration workspaces!\n");
+      free_nu_integration();
+      return -1;
+    }
+  }
+
+  if (n <= 0)
+    return 0;
+  FREQ_INT_NODES = (double *) malloc(sizeof(double)*n);
+  FREQ_INT_WEIGHTS = (double *) malloc(sizeof(double)*n);
+  if (!FREQ_INT_NODES || !FREQ_INT_WEIGHTS){
+    fprintf(stderr, "Unable to allocate memory for the frequency integration nodes!\n");
+    free_nu_integration();
+    return -1;
+  }
+  for (ct=0; ct<n; ct++){
+    // Newton iteration for the root of the Legendre polynomial P_n
+    x = cos(PI*(ct+0.75)/(n+0.5));
+    for (iter=0; iter<100; iter++){
+      p0 = 1;
+      p1 = x;
+      for (j=2; j<=n; j++){
+	p2 = ((2*j-1)*x*p1 - (j-1)*p0)/j;
+	p0 = p1;
+	p1 = p2;
+      }
+      dp = n*(x*p1 - p0)/(x*x-1);
+      x -= p1/dp;
+      if (fabs(p1/dp) < 1e-15)
+	break;
+    }
+    FREQ_INT_NODES[ct] = 0.5*L*(1+x);
+    FREQ_INT_WEIGHTS[ct] = L/((1-x*x)*dp*dp);
+  }
+  return 0;
+}
+
+void free_nu_integration(){
+  int ct;
+  for (ct=0; ct<NU_INT_NUM_WORKSPACES; ct++)
+    gsl_integration_workspace_free (NU_INT_WORKSPACES[ct]);
+  free(NU_INT_WORKSPACES);
+  free(FREQ_INT_NODES);
+  free(FREQ_INT_WEIGHTS);
+  NU_INT_WORKSPACES = NULL;
+  NU_INT_NUM_WORKSPACES = 0;
+  FREQ_INT_NODES = FREQ_INT_WEIGHTS = NULL;
+}
+
+
 
 /*
   The total weighted HI + HeI + HeII  cross-section in pcm^-2
@@ -673,10 +865,12 @@ double species_weighted_x_ray_cross_section(double nu, double x_e){
   The filling factor of neutral IGM at zp is HI_filling_factor_zp.
 */
 typedef struct{
-  double nu_0, x_e, ion_eff;
+  double nu_0, x_e, ion_eff, x_e_ave;
+  nu_tau_one_table *fcoll_tbl; // if set, fcoll is interpolated from the table (thread safe)
   // New in v1.4
   //double nu_0, x_e, ion_eff,M_TURN,ALPHA_STAR,F_STAR10;
 } tauX_params;
+double nu_tau_one_tbl_fcoll(nu_tau_one_table *t, double z);
 double tauX_integrand(double zhat, void *params){
   double n, drpropdz, nuhat, HI_filling_factor_zhat, sigma_tilde, fcoll;
   tauX_params *p = (tauX_params *) params;
@@ -686,7 +880,10 @@ double tauX_integrand(double zhat, void *params){
   n = N_b0 * pow(1+zhat, 3);
   nuhat = p->nu_0 * (1+zhat);
   // New in v1.4
-  if (HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY) {
+  if (p->fcoll_tbl) {
+    fcoll = nu_tau_one_tbl_fcoll(p->fcoll_tbl, zhat);
+  }
+  else if (HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY) {
     //fcoll = FgtrM(zhat, M_MIN); // TEST
 	FgtrM_st_SFR_z(zhat,&(Splined_Fcollz_mean));
 	fcoll = Splined_Fcollz_mean;
@@ -697,7 +894,7 @@ double tauX_integrand(double zhat, void *params){
   if (fcoll < 1e-20)
     HI_filling_factor_zhat = 1;
   else    
-    HI_filling_factor_zhat = 1 - p->ion_eff * fcoll/(1.0 - x_e_ave); //simplification to use the <x_e> value at zp and not zhat.  should'nt matter much since the evolution in x_e_ave is slower than fcoll.  in principle should make an array to store past values of x_e_ave..
+    HI_filling_factor_zhat = 1 - p->ion_eff * fcoll/(1.0 - p->x_e_ave); //simplification to use the <x_e> value at zp and not zhat.  should'nt matter much since the evolution in x_e_ave is slower than fcoll.  in principle should make an array to store past values of x_e_ave..
   if (HI_filling_factor_zhat < 1e-4) HI_filling_factor_zhat = 1e-4; //set a floor for post-reionization stability
 
   sigma_tilde = species_weighted_x_ray_cross_section(nuhat, p->x_e);
@@ -721,6 +918,8 @@ double tauX(double nu, double x_e, double zp, double zpp, double HI_filling_fact
        F.function = &tauX_integrand;
        p.nu_0 = nu/(1+zp);
        p.x_e = x_e;
+       p.x_e_ave = x_e_ave;
+       p.fcoll_tbl = NULL;
        // effective efficiency for the PS (not ST) mass function; quicker to compute...
        if (HI_filling_factor_zp > FRACT_FLOAT_ERR){
          // New in v1.4
@@ -766,13 +965,14 @@ double nu_tau_one_helper(double nu, void * params){
   nu_tau_one_params *p = (nu_tau_one_params *) params;
   return tauX(nu, p->x_e, p->zp, p->zpp, p->HI_filling_factor_zp) - 1;
 }
+#define NU_TAU_ONE_SOLVER_TOL (double) (0.02) // relative tolerance of the nu_tau_one() root solve
 double nu_tau_one(double zp, double zpp, double x_e, double HI_filling_factor_zp){
   int status, iter, max_iter;
   const gsl_root_fsolver_type * T; 
   gsl_root_fsolver * s;
   gsl_function F;
   double x_lo, x_hi, r=0;
-  double relative_error = 0.02;
+  double relative_error = NU_TAU_ONE_SOLVER_TOL;
   nu_tau_one_params p;
 
   if (DEBUG_ON){
@@ -839,6 +1039,700 @@ double nu_tau_one(double zp, double zpp, double x_e, double HI_filling_factor_zp
 }
 
 
+/*
+  Tabulated nu_tau_one.
+
+  nu_tau_one depends on the mean electron fraction x_e and on the HI filling factor at zp only
+  through the cross-section and through HI_filling_factor(zhat) = 1 - (1-Q) fcoll(zhat)/fcoll(zp),
+  where Q = HI_filling_factor_zp (the <x_e> in tauX cancels).  So for a given cosmology and
+  collapsed fraction model it is a smooth function of (zp, zpp, x_e, Q), which is tabulated
+  on a fixed z' range, at the z'' of each filter shell of Ts.c, and interpolated
+  (linearly in ln(1+z'), x_e and Q, in ln(nu)).
+
+  The collapsed fraction in the tabulated optical depths is itself interpolated from a fine
+  grid in z, which makes the tabulation thread safe and saves a sigma_z0 integral per
+  integrand evaluation.  The table is written to ../Boxes/Ts_evolution/ under a hash of its key,
+  and re-used by later runs with the same key.  The z' range does not depend on the redshift of
+  the run, so that all of the runs of a z-scroll share one table.
+*/
+#define NU_TAU_ONE_FCOLL_DZ (double) (0.01) // redshift spacing of the fcoll grid
+#define NU_TAU_ONE_ROOT_TOL (double) (1e-3) // relative tolerance of the tabulated roots
+#define NU_TAU_ONE_N_CHECK (int) (400) // number of points per axis checked after tabulating
+#define NU_TAU_ONE_N_DIRECT (int) (20) // number of points compared with nu_tau_one()
+#define NU_TAU_ONE_TABLE_VERSION (double) (2)
+
+typedef struct{
+  tauX_params tau;
+  double zp, zpp;
+  gsl_integration_workspace *w;
+} nu_tau_one_tbl_params;
+
+double nu_tau_one_tbl_fcoll(nu_tau_one_table *t, double z){
+  double x;
+  int i;
+
+  x = (z - t->fcoll_zmin)/t->fcoll_dz;
+  if (x < 0) x = 0;
+  i = (int) x;
+  if (i > t->N_fcoll-2) i = t->N_fcoll-2;
+  x -= i;
+  if (x > 1) x = 1;
+  return pow(10, (1-x)*t->log_fcoll[i] + x*t->log_fcoll[i+1]);
+}
+
+// z'' of the center of each filter shell at zp, as in Ts.c
+void nu_tau_one_tbl_shells(int N_R, double zp, double zpp[]){
+  double edge, prev_edge, prev_R;
+  int R_ct;
+
+  for (R_ct=0; R_ct<N_R; R_ct++){
+    if (R_ct==0){
+      prev_edge = zp;
+      prev_R = 0;
+    }
+    else{
+      prev_R = R_values[R_ct-1];
+    }
+    edge = prev_edge - (R_values[R_ct] - prev_R)*CMperMPC / drdz(prev_edge);
+    zpp[R_ct] = (edge+prev_edge)*0.5;
+    prev_edge = edge;
+  }
+}
+
+double nu_tau_one_tbl_helper(double nu, void * params){
+  nu_tau_one_tbl_params *p = (nu_tau_one_tbl_params *) params;
+  gsl_function F;
+  double result, error;
+
+  p->tau.nu_0 = nu/(1+p->zp);
+  F.function = &tauX_integrand;
+  F.params = &(p->tau);
+  gsl_integration_qag (&F, p->zpp, p->zp, 0, 0.005,
+		       1000, GSL_INTEG_GAUSS61, p->w, &result, &error); 
+  return result - 1;
+}
+
+/* nu_tau_one with the tabulated fcoll, using the caller's workspace and solver */
+double nu_tau_one_tbl_solve(nu_tau_one_table *t, double zp, double zpp, double x_e, double Q,
+			    gsl_integration_workspace *w, gsl_root_fsolver *s){
+  nu_tau_one_tbl_params p;
+  gsl_function F;
+  double fcoll_zp, x_lo, x_hi, r=0;
+  int status, iter;
+
+  fcoll_zp = nu_tau_one_tbl_fcoll(t, zp);
+  p.tau.x_e = x_e;
+  p.tau.x_e_ave = 0;
+  p.tau.ion_eff = (fcoll_zp < 1e-20) ? 0 : (1.0 - Q) / fcoll_zp;
+  p.tau.fcoll_tbl = t;
+  p.zp = zp;
+  p.zpp = zpp;
+  p.w = w;
+
+  //check if lower bound has null
+  if (nu_tau_one_tbl_helper(HeI_NUIONIZATION, &p) < 0)
+    return HeI_NUIONIZATION;
+
+  F.function = &nu_tau_one_tbl_helper;  
+  F.params = &p;
+  gsl_root_fsolver_set (s, &F, HeI_NUIONIZATION, 1e6 * NU_over_EV);
+  iter = 0;
+  do{
+    iter++;
+    status = gsl_root_fsolver_iterate (s);
+    r = gsl_root_fsolver_root (s);
+    x_lo = gsl_root_fsolver_x_lower (s);
+    x_hi = gsl_root_fsolver_x_upper (s);
+    status = gsl_root_test_interval (x_lo, x_hi, 0, NU_TAU_ONE_ROOT_TOL);
+  }
+  while (status == GSL_CONTINUE && iter < 100);
+
+  return r;
+}
+
+// interpolates the table; the caller checks that the arguments are in range
+double nu_tau_one_tbl_interp(nu_tau_one_table *t, double zp, int R_ct, double x_e, double Q){
+  double u[3], val;
+  int n[3], N[3], i, corner, idx[3];
+  unsigned long long ct;
+
+  N[0] = t->N_zp; N[1] = t->N_xe; N[2] = t->N_Q;
+  u[0] = log((1+zp)/(1+t->zp_min)) / log((1+t->zp_max)/(1+t->zp_min)) * (N[0]-1);
+  u[1] = x_e / t->xe_max * (N[1]-1);
+  u[2] = Q * (N[2]-1);
+  for (i=0; i<3; i++){
+    if (u[i] < 0) u[i] = 0;
+    if (u[i] > N[i]-1) u[i] = N[i]-1;
+    n[i] = (int) u[i];
+    if (n[i] > N[i]-2) n[i] = N[i]-2;
+    u[i] -= n[i];
+  }
+
+  val = 0;
+  for (corner=0; corner<8; corner++){
+    for (i=0; i<3; i++)
+      idx[i] = n[i] + ((corner >> i) & 1);
+    ct = (((unsigned long long)idx[0]*t->N_R + R_ct)*t->N_xe + idx[1])*t->N_Q + idx[2];
+    val += ((corner & 1) ? u[0] : 1-u[0]) * ((corner & 2) ? u[1] : 1-u[1]) * ((corner & 4) ? u[2] : 1-u[2])
+      * t->log_nu[ct];
+  }
+  return exp(val);
+}
+
+double nu_tau_one_tbl_zp(nu_tau_one_table *t, double iz){
+  return (1+t->zp_min) * pow((1+t->zp_max)/(1+t->zp_min), iz/(t->N_zp-1.0)) - 1;
+}
+
+void free_nu_tau_one_table(){
+  free(NU_TAU_ONE_TBL.zpp);
+  free(NU_TAU_ONE_TBL.log_nu);
+  free(NU_TAU_ONE_TBL.log_fcoll);
+  NU_TAU_ONE_TBL.zpp = NULL;
+  NU_TAU_ONE_TBL.log_nu = NULL;
+  NU_TAU_ONE_TBL.log_fcoll = NULL;
+}
+
+/* Fills in the table at its current resolution */
+int build_nu_tau_one_table(nu_tau_one_table *t){
+  unsigned long long ct, num_pts;
+  int iz, status=0;
+
+  free(t->zpp);
+  free(t->log_nu);
+  num_pts = (unsigned long long)t->N_zp*t->N_R*t->N_xe*t->N_Q;
+  t->zpp = (double *) malloc(sizeof(double)*t->N_zp*t->N_R);
+  t->log_nu = (float *) malloc(sizeof(float)*num_pts);
+  if (!t->zpp || !t->log_nu){
+    fprintf(stderr, "Ts.c: Unable to allocate memory for the nu_tau_one table!\n");
+    return -1;
+  }
+  for (iz=0; iz<t->N_zp; iz++)
+    nu_tau_one_tbl_shells(t->N_R, nu_tau_one_tbl_zp(t, iz), t->zpp + iz*t->N_R);
+
+#pragma omp parallel shared(t, num_pts, status) private(ct)
+  {
+    gsl_integration_workspace * w = gsl_integration_workspace_alloc (1000);
+    gsl_root_fsolver * s = gsl_root_fsolver_alloc (gsl_root_fsolver_brent);
+    int iz, R_ct, x_e_ct, Q_ct;
+
+    if (!w || !s)
+      status = -1;
+#pragma omp for schedule(dynamic, 16)
+    for (ct=0; ct<num_pts; ct++){
+      if (!w || !s)
+	continue;
+      Q_ct = ct % t->N_Q;
+      x_e_ct = (ct / t->N_Q) % t->N_xe;
+      R_ct = (ct / t->N_Q / t->N_xe) % t->N_R;
+      iz = ct / t->N_Q / t->N_xe / t->N_R;
+      t->log_nu[ct] = log(nu_tau_one_tbl_solve(t, nu_tau_one_tbl_zp(t, iz), t->zpp[iz*t->N_R + R_ct],
+					       x_e_ct*t->xe_max/(t->N_xe-1.0), Q_ct/(t->N_Q-1.0), w, s));
+    }
+    if (w) gsl_integration_workspace_free (w);
+    if (s) gsl_root_fsolver_free (s);
+  } // end omp parallel
+
+  if (status < 0)
+    fprintf(stderr, "Ts.c: Unable to allocate memory for the nu_tau_one table!\n");
+  return status;
+}
+
+/*
+  Returns in err[] the largest relative interpolation error half way between the grid points
+  along z', x_e and Q, over a sample of grid cells.  Only frequencies above NU_X_THRESH
+  matter for the frequency integrals, so the error is that of fmax(nu_tau_one, NU_X_THRESH).
+*/
+int check_nu_tau_one_table(nu_tau_one_table *t, double err[]){
+  double *cell_err;
+  int ct, status=0;
+
+  cell_err = (double *) malloc(sizeof(double)*3*NU_TAU_ONE_N_CHECK);
+  if (!cell_err){
+    fprintf(stderr, "Ts.c: Unable to allocate memory for the nu_tau_one table!\n");
+    return -1;
+  }
+
+#pragma omp parallel shared(t, cell_err, status)
+  {
+    gsl_integration_workspace * w = gsl_integration_workspace_alloc (1000);
+    gsl_root_fsolver * s = gsl_root_fsolver_alloc (gsl_root_fsolver_brent);
+    double pos[3], zp, zpp[NUM_FILTER_STEPS_FOR_Ts], x_e, Q, nu, nu_interp;
+    int N[3], R_ct, sample, axis, i;
+    unsigned long long ct, num_cells;
+
+    if (!w || !s)
+      status = -1;
+#pragma omp for schedule(dynamic)
+    for (sample=0; sample<3*NU_TAU_ONE_N_CHECK; sample++){
+      cell_err[sample] = 0;
+      if (!w || !s)
+	continue;
+      // pick a cell, and the midpoint of one of its edges
+      axis = sample % 3;
+      N[0] = t->N_zp; N[1] = t->N_xe; N[2] = t->N_Q;
+      N[axis]--;
+      num_cells = (unsigned long long)N[0]*N[1]*N[2]*t->N_R;
+      ct = ((unsigned long long)(sample/3) * 2654435761ULL) % num_cells;
+      for (i=2; i>=0; i--){
+	pos[i] = ct % N[i];
+	ct /= N[i];
+      }
+      R_ct = ct;
+      pos[axis] += 0.5;
+
+      zp = nu_tau_one_tbl_zp(t, pos[0]);
+      x_e = pos[1]*t->xe_max/(t->N_xe-1.0);
+      Q = pos[2]/(t->N_Q-1.0);
+      nu_tau_one_tbl_shells(t->N_R, zp, zpp);
+      nu = nu_tau_one_tbl_solve(t, zp, zpp[R_ct], x_e, Q, w, s);
+      nu_interp = nu_tau_one_tbl_interp(t, zp, R_ct, x_e, Q);
+      cell_err[sample] = fabs(fmax(nu_interp, NU_X_THRESH)/fmax(nu, NU_X_THRESH) - 1);
+    }
+    if (w) gsl_integration_workspace_free (w);
+    if (s) gsl_root_fsolver_free (s);
+  } // end omp parallel
+
+  err[0] = err[1] = err[2] = 0;
+  for (ct=0; ct<3*NU_TAU_ONE_N_CHECK; ct++)
+    err[ct%3] = fmax(err[ct%3], cell_err[ct]);
+  free(cell_err);
+  if (status < 0)
+    fprintf(stderr, "Ts.c: Unable to allocate memory for the nu_tau_one table!\n");
+  return status;
+}
+
+void cache_filename(char *filename, const char *name, double *key, int key_len){
+  unsigned long long hash = 14695981039346656037ULL;
+  unsigned char *bytes = (unsigned char *) key;
+  int i;
+
+  for (i=0; i<sizeof(double)*key_len; i++){
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  sprintf(filename, "../Boxes/Ts_evolution/%s_%016llx", name, hash);
+}
+
+void nu_tau_one_table_filename(nu_tau_one_table *t, char *filename){
+  cache_filename(filename, "nu_tau_one_table", t->key, NU_TAU_ONE_KEY_LEN);
+}
+
+int read_nu_tau_one_table(nu_tau_one_table *t, char *filename){
+  double key[NU_TAU_ONE_KEY_LEN], range[3];
+  int dims[5];
+  unsigned long long num_pts;
+  FILE *F;
+
+  if (!(F = fopen(filename, "rb")))
+    return -1;
+  if ( (fread(key, sizeof(double), NU_TAU_ONE_KEY_LEN, F) != NU_TAU_ONE_KEY_LEN) ||
+       memcmp(key, t->key, sizeof(key)) ||
+       (fread(dims, sizeof(int), 5, F) != 5) || (fread(range, sizeof(double), 3, F) != 3) ||
+       (dims[0] < 2) || (dims[1] != t->N_R) || (dims[2] < 2) || (dims[3] < 2) || (dims[4] != t->N_fcoll) ){
+    fclose(F);
+    return -1;
+  }
+  t->N_zp = dims[0]; t->N_xe = dims[2]; t->N_Q = dims[3];
+  num_pts = (unsigned long long)t->N_zp*t->N_R*t->N_xe*t->N_Q;
+  t->zpp = (double *) malloc(sizeof(double)*t->N_zp*t->N_R);
+  t->log_nu = (float *) malloc(sizeof(float)*num_pts);
+  if (!t->zpp || !t->log_nu ||
+      (fread(t->zpp, sizeof(double), t->N_zp*t->N_R, F) != t->N_zp*t->N_R) ||
+      (fread(t->log_nu, sizeof(float), num_pts, F) != num_pts) ){
+    fclose(F);
+    free(t->zpp); free(t->log_nu);
+    t->zpp = NULL; t->log_nu = NULL;
+    return -1;
+  }
+  fclose(F);
+  return 0;
+}
+
+// written to a temporary file first, so that a concurrent run never reads a partial table
+int write_nu_tau_one_table(nu_tau_one_table *t, char *filename){
+  double range[3] = {t->zp_min, t->zp_max, t->xe_max};
+  int dims[5] = {t->N_zp, t->N_R, t->N_xe, t->N_Q, t->N_fcoll};
+  unsigned long long num_pts = (unsigned long long)t->N_zp*t->N_R*t->N_xe*t->N_Q;
+  char tmpname[300];
+  FILE *F;
+
+  sprintf(tmpname, "%s.%i.tmp", filename, (int) getpid());
+  if (!(F = fopen(tmpname, "wb")))
+    return -1;
+  if ( (fwrite(t->key, sizeof(double), NU_TAU_ONE_KEY_LEN, F) != NU_TAU_ONE_KEY_LEN) ||
+       (fwrite(dims, sizeof(int), 5, F) != 5) || (fwrite(range, sizeof(double), 3, F) != 3) ||
+       (fwrite(t->zpp, sizeof(double), t->N_zp*t->N_R, F) != t->N_zp*t->N_R) ||
+       (fwrite(t->log_nu, sizeof(float), num_pts, F) != num_pts) ){
+    fclose(F);
+    remove(tmpname);
+    return -1;
+  }
+  if (fclose(F) || rename(tmpname, filename)){
+    remove(tmpname);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+  Sets up NU_TAU_ONE_TBL for NU_TAU_ONE_TABLE_ZP_MIN <= z' <= Z_HEAT_MAX, reading it from the cache
+  if it is there.  Must be called after the filter scales (R_values) and the collapsed fraction are
+  set up.  Returns -1 if the table can't be made; nu_tau_one_lookup then uses nu_tau_one.
+*/
+int init_nu_tau_one_table(){
+  nu_tau_one_table *t = &NU_TAU_ONE_TBL;
+  float zp_min = NU_TAU_ONE_TABLE_ZP_MIN, zp_max = Z_HEAT_MAX;
+  double zpp_max[NUM_FILTER_STEPS_FOR_Ts], err[3], z, max_dev, nu;
+  float Splined_Fcollz_mean;
+  char filename[300];
+  int ct, refine, k;
+  time_t start_time, curr_time;
+
+  free_nu_tau_one_table();
+  if (zp_max <= zp_min*(1+FRACT_FLOAT_ERR))
+    return -1;
+  time(&start_time);
+
+  t->N_R = NUM_FILTER_STEPS_FOR_Ts;
+  t->N_zp = NU_TAU_ONE_TABLE_N_ZP;
+  t->N_xe = NU_TAU_ONE_TABLE_N_XE;
+  t->N_Q = NU_TAU_ONE_TABLE_N_Q;
+  t->zp_min = zp_min;
+  t->zp_max = zp_max;
+  t->xe_max = NU_TAU_ONE_TABLE_XE_MAX;
+
+  // everything nu_tau_one depends on
+  for (k=0; k<NU_TAU_ONE_KEY_LEN; k++)
+    t->key[k] = 0;
+  k = 0;
+  t->key[k++] = NU_TAU_ONE_TABLE_VERSION;
+  t->key[k++] = SIGMA8; t->key[k++] = hlittle; t->key[k++] = OMm; t->key[k++] = OMl; t->key[k++] = OMb;
+  t->key[k++] = POWER_INDEX; t->key[k++] = POWER_SPECTRUM; t->key[k++] = P_CUTOFF; t->key[k++] = M_WDM;
+  t->key[k++] = Y_He; t->key[k++] = SHETH_a; t->key[k++] = SHETH_p; t->key[k++] = SHETH_A;
+  t->key[k++] = HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY; t->key[k++] = M_MIN;
+  if (HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY){
+    t->key[k++] = M_TURN; t->key[k++] = ALPHA_STAR; t->key[k++] = ALPHA_ESC;
+    t->key[k++] = F_STAR10; t->key[k++] = F_ESC10;
+  }
+  else
+    k += 5;
+  t->key[k++] = zp_min; t->key[k++] = zp_max;
+  t->key[k++] = t->N_R; t->key[k++] = R_values[0]; t->key[k++] = R_values[t->N_R-1];
+  t->key[k++] = t->N_zp; t->key[k++] = t->N_xe; t->key[k++] = t->N_Q; t->key[k++] = t->xe_max;
+  t->key[k++] = NU_TAU_ONE_TABLE_TOL;
+
+  // tabulate the collapsed fraction, from zp_min to the furthest filter shell
+  nu_tau_one_tbl_shells(t->N_R, zp_max, zpp_max);
+  t->fcoll_zmin = zp_min;
+  t->N_fcoll = (zpp_max[t->N_R-1] - zp_min)/NU_TAU_ONE_FCOLL_DZ + 2;
+  t->fcoll_dz = (zpp_max[t->N_R-1] - zp_min)/(t->N_fcoll-1.0);
+  if (!(t->log_fcoll = (double *) malloc(sizeof(double)*t->N_fcoll))){
+    fprintf(stderr, "Ts.c: Unable to allocate memory for the nu_tau_one table!\n");
+    return -1;
+  }
+  for (ct=0; ct<t->N_fcoll; ct++){
+    z = fmin(t->fcoll_zmin + ct*t->fcoll_dz, zpp_max[t->N_R-1]);
+    if (HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY){
+      FgtrM_st_SFR_z(z,&(Splined_Fcollz_mean));
+      t->log_fcoll[ct] = log10(fmax(Splined_Fcollz_mean, 1e-40));
+    }
+    else
+      t->log_fcoll[ct] = log10(fmax(FgtrM(z, M_MIN), 1e-40));
+  }
+
+  nu_tau_one_table_filename(t, filename);
+  if (read_nu_tau_one_table(t, filename) == 0){
+    fprintf(stderr, "Read the nu_tau_one table from %s\n", filename);
+    fprintf(LOG, "Read the nu_tau_one table from %s\n", filename);
+    return 0;
+  }
+
+  fprintf(stderr, "Tabulating nu_tau_one for %g <= z' <= %g, in %s\n", zp_min, zp_max, filename);
+  fprintf(LOG, "Tabulating nu_tau_one for %g <= z' <= %g, in %s\n", zp_min, zp_max, filename);
+  refine = 0;
+  while (1){
+    if ( (build_nu_tau_one_table(t) < 0) || (check_nu_tau_one_table(t, err) < 0) ){
+      free_nu_tau_one_table();
+      return -1;
+    }
+    fprintf(stderr, "nu_tau_one table with %i x %i x %i x %i points: max interpolation error in z', x_e, Q = %.2e, %.2e, %.2e\n",
+	    t->N_zp, t->N_R, t->N_xe, t->N_Q, err[0], err[1], err[2]);
+    fprintf(LOG, "nu_tau_one table with %i x %i x %i x %i points: max interpolation error in z', x_e, Q = %.2e, %.2e, %.2e\n",
+	    t->N_zp, t->N_R, t->N_xe, t->N_Q, err[0], err[1], err[2]);
+    if ( fmax(err[0], fmax(err[1], err[2])) <= NU_TAU_ONE_TABLE_TOL )
+      break;
+    if (refine == NU_TAU_ONE_TABLE_MAX_REFINE){
+      fprintf(stderr, "Ts.c: WARNING: the nu_tau_one table did not reach the tolerance of %.2e\n", NU_TAU_ONE_TABLE_TOL);
+      fprintf(LOG, "Ts.c: WARNING: the nu_tau_one table did not reach the tolerance of %.2e\n", NU_TAU_ONE_TABLE_TOL);
+      break;
+    }
+    refine++;
+    // double the resolution of the axes that are off
+    if (err[0] > NU_TAU_ONE_TABLE_TOL) t->N_zp = 2*t->N_zp-1;
+    if (err[1] > NU_TAU_ONE_TABLE_TOL) t->N_xe = 2*t->N_xe-1;
+    if (err[2] > NU_TAU_ONE_TABLE_TOL) t->N_Q = 2*t->N_Q-1;
+  }
+
+  // and compare a few points with the root solver used without the table
+  max_dev = 0;
+  for (ct=0; ct<NU_TAU_ONE_N_DIRECT; ct++){
+    k = (ct * 2654435761ULL) % ((unsigned long long)t->N_zp*t->N_R*t->N_xe*t->N_Q);
+    z = nu_tau_one_tbl_zp(t, k / (t->N_R*t->N_xe*t->N_Q));
+    nu = nu_tau_one(z, t->zpp[k / (t->N_xe*t->N_Q)], (k / t->N_Q % t->N_xe)*t->xe_max/(t->N_xe-1.0),
+		    fmax(k % t->N_Q / (t->N_Q-1.0), 2*FRACT_FLOAT_ERR));
+    max_dev = fmax(max_dev, fabs(fmax(exp(t->log_nu[k]), NU_X_THRESH)/fmax(nu, NU_X_THRESH) - 1));
+  }
+  time(&curr_time);
+  fprintf(stderr, "Max deviation of the nu_tau_one table from the root solver (accurate to %.0e) = %.2e.  It took %06.2f min\n",
+	  NU_TAU_ONE_SOLVER_TOL, max_dev, difftime(curr_time, start_time)/60.0);
+  fprintf(LOG, "Max deviation of the nu_tau_one table from the root solver (accurate to %.0e) = %.2e.  It took %06.2f min\n",
+	  NU_TAU_ONE_SOLVER_TOL, max_dev, difftime(curr_time, start_time)/60.0);
+
+  if (write_nu_tau_one_table(t, filename) < 0){
+    fprintf(stderr, "Ts.c: WARNING: Unable to write the nu_tau_one table to %s\n", filename);
+    fprintf(LOG, "Ts.c: WARNING: Unable to write the nu_tau_one table to %s\n", filename);
+  }
+  return 0;
+}
+
+/*
+  nu_tau_one from the table, for the filter shell R_ct at z'' = zpp.  Falls back to nu_tau_one
+  outside the table and in the post-reionization regime, where tauX uses the last ionizing
+  efficiency (PS_ION_EFF), which is kept up to date here as tauX would.
+*/
+double nu_tau_one_lookup(double zp, double zpp, int R_ct, double x_e, double HI_filling_factor_zp){
+  nu_tau_one_table *t = &NU_TAU_ONE_TBL;
+
+  if ( !t->log_nu || (HI_filling_factor_zp <= FRACT_FLOAT_ERR) || (x_e < 0) || (x_e > t->xe_max) ||
+       (zp < t->zp_min*(1-FRACT_FLOAT_ERR)) || (zp > t->zp_max*(1+FRACT_FLOAT_ERR)) )
+    return nu_tau_one(zp, zpp, x_e, HI_filling_factor_zp);
+
+  if (nu_tau_one_tbl_fcoll(t, zp) > 1e-20)
+    PS_ION_EFF = (1.0 - HI_filling_factor_zp) / nu_tau_one_tbl_fcoll(t, zp) * (1.0 - x_e_ave);
+  return nu_tau_one_tbl_interp(t, zp, R_ct, x_e, HI_filling_factor_zp);
+}
+
+
+
+/*
+  The filter shells of Ts.c only depend on z', and the z' steps of a run are fixed by its
+  redshift, ZPRIME_STEP_FACTOR and Z_HEAT_MAX, so their edges and the growth factors, Hubble
+  rates and dt/dz at their centers are tabulated once for all of the steps instead of at each
+  step (and, for the centers, in each cell).  The table is written to ../Boxes/Ts_evolution/
+  under a hash of its key, and re-used by later runs with the same z' steps, e.g. in z-scrolls
+  with the same final redshift.
+*/
+#define ZPP_SHELL_TABLE_VERSION (double) (1)
+
+// the far edges of the shells at zp, as computed in Ts.c
+void zpp_shell_edges(float zp, double zpp_edge_zp[]){
+  float prev_zpp, prev_R;
+  int R_ct;
+
+  for (R_ct=0; R_ct<NUM_FILTER_STEPS_FOR_Ts; R_ct++){
+    if (R_ct==0){
+      prev_zpp = zp;
+      prev_R = 0;
+    }
+    else{
+      prev_zpp = zpp_edge_zp[R_ct-1];
+      prev_R = R_values[R_ct-1];
+    }
+    zpp_edge_zp[R_ct] = prev_zpp - (R_values[R_ct] - prev_R)*CMperMPC / drdz(prev_zpp); // cell size
+  }
+}
+
+// row zp_ct of the table, at z' = zp
+void zpp_shell_row(zpp_shell_table *t, int zp_ct, float zp){
+  double *edge = t->zpp_edge + zp_ct*t->N_R, zpp;
+  int R_ct;
+
+  t->zp[zp_ct] = zp;
+  t->zp_growth[3*zp_ct] = dicke(zp);
+  t->zp_growth[3*zp_ct+1] = ddicke_dz(zp);
+  t->zp_growth[3*zp_ct+2] = dtdz(zp);
+  zpp_shell_edges(zp, edge);
+  for (R_ct=0; R_ct<t->N_R; R_ct++){
+    // the center of the shell, as in evolveInt
+    zpp = (R_ct==0) ? (edge[0]+zp)*0.5 : (edge[R_ct]+edge[R_ct-1])*0.5;
+    t->zpp_growth[zp_ct*t->N_R + R_ct] = dicke(zpp);
+    t->zpp_hubble[zp_ct*t->N_R + R_ct] = hubble(zpp);
+    t->zpp_dtdz[zp_ct*t->N_R + R_ct] = dtdz(zpp);
+  }
+}
+
+void free_zpp_shell_table(){
+  zpp_shell_table *t = &ZPP_SHELL_TBL;
+
+  free(t->zp); free(t->zp_growth); free(t->zpp_edge);
+  free(t->zpp_growth); free(t->zpp_hubble); free(t->zpp_dtdz);
+  t->zp = NULL; t->zp_growth = NULL; t->zpp_edge = NULL;
+  t->zpp_growth = NULL; t->zpp_hubble = NULL; t->zpp_dtdz = NULL;
+  t->N_zp = 0;
+}
+
+int alloc_zpp_shell_table(zpp_shell_table *t){
+  t->zp = (float *) malloc(sizeof(float)*t->N_zp);
+  t->zp_growth = (double *) malloc(sizeof(double)*3*t->N_zp);
+  t->zpp_edge = (double *) malloc(sizeof(double)*t->N_zp*t->N_R);
+  t->zpp_growth = (double *) malloc(sizeof(double)*t->N_zp*t->N_R);
+  t->zpp_hubble = (double *) malloc(sizeof(double)*t->N_zp*t->N_R);
+  t->zpp_dtdz = (double *) malloc(sizeof(double)*t->N_zp*t->N_R);
+  if (!t->zp || !t->zp_growth || !t->zpp_edge || !t->zpp_growth || !t->zpp_hubble || !t->zpp_dtdz){
+    free_zpp_shell_table();
+    return -1;
+  }
+  return 0;
+}
+
+int read_zpp_shell_table(zpp_shell_table *t, char *filename){
+  double key[ZPP_SHELL_KEY_LEN];
+  unsigned long long num_pts = (unsigned long long)t->N_zp*t->N_R;
+  FILE *F;
+
+  if (!(F = fopen(filename, "rb")))
+    return -1;
+  if ( (fread(key, sizeof(double), ZPP_SHELL_KEY_LEN, F) != ZPP_SHELL_KEY_LEN) ||
+       memcmp(key, t->key, sizeof(key)) || (alloc_zpp_shell_table(t) < 0) ){
+    fclose(F);
+    return -1;
+  }
+  if ( (fread(t->zp, sizeof(float), t->N_zp, F) != t->N_zp) ||
+       (fread(t->zp_growth, sizeof(double), 3*t->N_zp, F) != 3*t->N_zp) ||
+       (fread(t->zpp_edge, sizeof(double), num_pts, F) != num_pts) ||
+       (fread(t->zpp_growth, sizeof(double), num_pts, F) != num_pts) ||
+       (fread(t->zpp_hubble, sizeof(double), num_pts, F) != num_pts) ||
+       (fread(t->zpp_dtdz, sizeof(double), num_pts, F) != num_pts) ){
+    fclose(F);
+    free_zpp_shell_table();
+    return -1;
+  }
+  fclose(F);
+  return 0;
+}
+
+// written to a temporary file first, so that a concurrent run never reads a partial table
+int write_zpp_shell_table(zpp_shell_table *t, char *filename){
+  unsigned long long num_pts = (unsigned long long)t->N_zp*t->N_R;
+  char tmpname[300];
+  FILE *F;
+
+  sprintf(tmpname, "%s.%i.tmp", filename, (int) getpid());
+  if (!(F = fopen(tmpname, "wb")))
+    return -1;
+  if ( (fwrite(t->key, sizeof(double), ZPP_SHELL_KEY_LEN, F) != ZPP_SHELL_KEY_LEN) ||
+       (fwrite(t->zp, sizeof(float), t->N_zp, F) != t->N_zp) ||
+       (fwrite(t->zp_growth, sizeof(double), 3*t->N_zp, F) != 3*t->N_zp) ||
+       (fwrite(t->zpp_edge, sizeof(double), num_pts, F) != num_pts) ||
+       (fwrite(t->zpp_growth, sizeof(double), num_pts, F) != num_pts) ||
+       (fwrite(t->zpp_hubble, sizeof(double), num_pts, F) != num_pts) ||
+       (fwrite(t->zpp_dtdz, sizeof(double), num_pts, F) != num_pts) ){
+    fclose(F);
+    remove(tmpname);
+    return -1;
+  }
+  if (fclose(F) || rename(tmpname, filename)){
+    remove(tmpname);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+  Sets up ZPP_SHELL_TBL for the z' steps of Ts.c, starting at zp_max and continuing while z' > zp_min.
+  Must be called after the filter scales (R_values) are set up.  Returns -1 if the table can't
+  be made; set_zpp_shells then computes the shells at each step.
+*/
+int init_zpp_shell_table(float zp_max, float zp_min){
+  zpp_shell_table *t = &ZPP_SHELL_TBL;
+  char filename[300];
+  float zp;
+  int zp_ct, k;
+
+  free_zpp_shell_table();
+  t->N_R = NUM_FILTER_STEPS_FOR_Ts;
+  t->N_zp = 0;
+  for (zp = zp_max; zp > zp_min; zp = ((1+zp) / ZPRIME_STEP_FACTOR - 1))
+    t->N_zp++;
+  if (t->N_zp == 0)
+    return -1;
+
+  // everything the shells depend on
+  for (k=0; k<ZPP_SHELL_KEY_LEN; k++)
+    t->key[k] = 0;
+  k = 0;
+  t->key[k++] = ZPP_SHELL_TABLE_VERSION;
+  t->key[k++] = hlittle; t->key[k++] = OMm; t->key[k++] = OMl; t->key[k++] = OMb; t->key[k++] = OMr;
+  t->key[k++] = zp_max; t->key[k++] = zp_min; t->key[k++] = ZPRIME_STEP_FACTOR; t->key[k++] = t->N_zp;
+  t->key[k++] = t->N_R; t->key[k++] = R_values[0]; t->key[k++] = R_values[t->N_R-1];
+
+  cache_filename(filename, "zpp_shell_table", t->key, ZPP_SHELL_KEY_LEN);
+  if (read_zpp_shell_table(t, filename) == 0){
+    fprintf(stderr, "Read the z'' shell table from %s\n", filename);
+    fprintf(LOG, "Read the z'' shell table from %s\n", filename);
+    return 0;
+  }
+
+  if (alloc_zpp_shell_table(t) < 0){
+    fprintf(stderr, "Ts.c: Unable to allocate memory for the z'' shell table!\n");
+    return -1;
+  }
+  zp = zp_max;
+  for (zp_ct=0; zp_ct<t->N_zp; zp_ct++){
+    zpp_shell_row(t, zp_ct, zp);
+    zp = ((1+zp) / ZPRIME_STEP_FACTOR - 1);
+  }
+  if (write_zpp_shell_table(t, filename) < 0){
+    fprintf(stderr, "Ts.c: WARNING: Unable to write the z'' shell table to %s\n", filename);
+    fprintf(LOG, "Ts.c: WARNING: Unable to write the z'' shell table to %s\n", filename);
+  }
+  return 0;
+}
+
+/*
+  Sets zpp_edge, the *_zpp_shell arrays, growth_factor_zp, dgrowth_factor_dzp and dt_dzp for
+  the z' step zp_ct (at zp), from the table if it has this step.
+*/
+void set_zpp_shells(int zp_ct, float zp){
+  zpp_shell_table *t = &ZPP_SHELL_TBL;
+  zpp_shell_table row;
+  float row_zp;
+  double row_zp_growth[3], row_growth[NUM_FILTER_STEPS_FOR_Ts], row_hubble[NUM_FILTER_STEPS_FOR_Ts],
+    row_dtdz[NUM_FILTER_STEPS_FOR_Ts];
+  int R_ct;
+
+  if ( !t->zp || (zp_ct < 0) || (zp_ct >= t->N_zp) || (t->zp[zp_ct] != zp) ){ // not tabulated
+    row.N_R = NUM_FILTER_STEPS_FOR_Ts;
+    row.zp = &row_zp; row.zp_growth = row_zp_growth; row.zpp_edge = zpp_edge;
+    row.zpp_growth = row_growth; row.zpp_hubble = row_hubble; row.zpp_dtdz = row_dtdz;
+    zpp_shell_row(&row, 0, zp);
+    t = &row;
+    zp_ct = 0;
+  }
+  else
+    memcpy(zpp_edge, t->zpp_edge + zp_ct*t->N_R, sizeof(double)*t->N_R);
+
+  growth_factor_zp = t->zp_growth[3*zp_ct];
+  dgrowth_factor_dzp = t->zp_growth[3*zp_ct+1];
+  dt_dzp = t->zp_growth[3*zp_ct+2];
+  for (R_ct=0; R_ct<NUM_FILTER_STEPS_FOR_Ts; R_ct++){
+    // set redshift of half annulus; dz'' is negative since we flipped limits of integral
+    if (R_ct==0){
+      zpp_shell[0] = (zpp_edge[0]+zp)*0.5;
+      dzpp_shell[0] = zp - zpp_edge[0];
+    }
+    else{
+      zpp_shell[R_ct] = (zpp_edge[R_ct]+zpp_edge[R_ct-1])*0.5;
+      dzpp_shell[R_ct] = zpp_edge[R_ct-1] - zpp_edge[R_ct];
+    }
+    growth_zpp_shell[R_ct] = t->zpp_growth[zp_ct*t->N_R + R_ct];
+    if (HALO_MASS_DEPENDENT_IONIZING_EFFICIENCY)
+      dfcoll_zpp_shell[R_ct] = t->zpp_hubble[zp_ct*t->N_R + R_ct]/T_AST*fabs(t->zpp_dtdz[zp_ct*t->N_R + R_ct])*fabs(dzpp_shell[R_ct]);
+    xray_zpp_shell[R_ct] = pow(1+zpp_shell[R_ct], -X_RAY_SPEC_INDEX);
+    lya_zpp_shell[R_ct] = pow(1+zp,2)*(1+zpp_shell[R_ct]);
+  }
+}
+
 /*
   Redshift derivative of the conditional collapsed fraction
  */
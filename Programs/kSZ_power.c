@@ -5,6 +5,12 @@ This program calculates the kSZ from reionization boxes.  The script that execut
 format:
 
 FORMAT: kSZ_power <list of density boxes> <list of xH boxes> <list of velocity boxes> <ouput filename>
+                  [-los <x|y|z> <list of velocity boxes> <output filename>] ...
+
+The first velocity list is the z component (the line of sight is taken along k, see below).  Each
+optional -los block adds a kSZ map with the line of sight along another axis of the same boxes,
+with the velocity component along that axis; all of the maps are made while the density and xH
+boxes are read once.
 
 old version: kSZ_power <filename_that_lists_reionization_data_files. <number_of_files_to_read_in $output_file_name>
 
@@ -22,7 +28,7 @@ and each $base_file_name comes with three files:
           base_file_name.ion = ionization field (ones and zeros)
 
 Each of these files is $data_grid_size^3 floats in row major order and the los direction is taken to be 
-in k where float_number = i*GRIDHII_DIM*GRIDHII_DIM + j*GRIDHII_DIM +k.  Note that floats are wasteful, but
+in k where float_number = i*GRIDHII_DIM*GRIDHII_DIM + j*GRIDHII_DIM +k (or along i or j for the -los x/y maps).  Note that floats are wasteful, but
 you cannot convert everything to float blindly because fftwf by default wants float format. I can help 
 if you would rather do floats.
 
@@ -53,30 +59,41 @@ ASCII: .dat file is ASCII
 #include "fftCMB.c"
 
 #define PARALLEL_APPROX (int) 0 // use parallel light ray approximation
-
-void projectArray(float *Tcmb, float *Tcmb_3d, float *dtau_3d);
-int readInArrays(float*, float*, FILE*, FILE*, FILE*);
-void printTField(float *Tcmb);
-void printStatistics(float *K, float *Pk, int *Count);
+#define MAX_KSZ_MAPS (int) 3 // one per line-of-sight axis
+
+// a kSZ map, made with the line of sight along one of the box axes
+typedef struct{
+  int los; // line-of-sight axis: 0=i (x), 1=j (y), 2=k (z)
+  FILE *v_filelist; // velocity component along the line of sight
+  char outfile[400];
+  float *Tcmb; // the 2D kSZ (tau) field
+  float *Tcmb_3D; // v*xi*(1+delta) of the current box
+  double *taue_arry; // optical depth along each sightline
+  double mean_taue_curr_z;
+} kSZ_map;
+
+void projectArray(kSZ_map *map, float *dtau_3d);
+int readInArrays(kSZ_map *maps, int num_maps, float *dtau_3d, FILE *delta_filelist, FILE *xH_filelist);
+void printTField(float *Tcmb, char *outfile);
+void printStatistics(float *K, float *Pk, int *Count, char *outfile);
 unsigned long long position(int i, int j, int ti, int tj);
+unsigned long long los_index(int los, int i, int j, int k);
 void subtract_avg(float *Tcmb);
 double hubbleZ(float z);
 double confDist(float z);
+void free_maps(kSZ_map *maps, int num_maps);
 
 float START_REDSHIFT = -1; //lowest redshift
 
 float REDSHIFT;
 double currZ;
-double mean_taue_curr_z = 0;
 FILE *LOG;
-char OUTFILE[400];
-double *taue_arry;
 void doFFT(float *R, fftwf_complex *Rf, long Nf, int dim);
 void makePk(float *K, float *Pk, int *Count, fftwf_complex *Rf);
 void initialize(float **K,float **Pk, int **count, int flag);
   long N, Nf;
   fftwf_complex *Tcmbf = NULL;
-  float *Tcmb, *Tcmb_3D, *dtau_3D;
+  float *dtau_3D;
   float *Cl = NULL,*L = NULL;
   int *Count = NULL;
 
@@ -84,25 +101,39 @@ void initialize(float **K,float **Pk, int **count, int flag);
 int main(int argc, char *argv[])
 {
   unsigned short seed[3] = {-11, 444, 3};//random number 
-  unsigned long long i, ct;
-  char filename[400];
+  unsigned long long i;
+  char filename[900];
   void doInverseFFT(fftwf_complex *Rf, float *R, long Nf, int dim);
-  FILE *IN, *delta_filelist, *v_filelist, *xH_filelist;
+  FILE *delta_filelist, *xH_filelist;
+  kSZ_map maps[MAX_KSZ_MAPS];
+  int num_maps, map_ct, arg_ct, los;
 
 
-  if (argc != 5){
+  if ((argc < 5) || ((argc-5)%4 != 0) || ((argc-5)/4 >= MAX_KSZ_MAPS)){
     fprintf(stderr, "kSZ_power: FORMAT: kSZ_power <list of density boxes> \
-          <list of xH boxes> <list of velocity boxes> <ouput filename>\nAborting\n");
+          <list of xH boxes> <list of velocity boxes> <ouput filename> \
+          [-los <x|y|z> <list of velocity boxes> <output filename>] ...\nAborting\n");
     return -1;
   }
-  strcpy(OUTFILE, argv[4]);
+  num_maps = 1 + (argc-5)/4;
+  memset(maps, 0, sizeof(maps));
+  maps[0].los = 2;
+  strcpy(maps[0].outfile, argv[4]);
+  for (map_ct=1; map_ct<num_maps; map_ct++){
+    arg_ct = 5 + 4*(map_ct-1);
+    los = argv[arg_ct+1][0] - 'x';
+    if (strcmp(argv[arg_ct], "-los") || (los < 0) || (los > 2) || (argv[arg_ct+1][1] != '\0')){
+      fprintf(stderr, "kSZ_power: ERROR: expected -los <x|y|z>, got %s %s.\nAborting\n", argv[arg_ct], argv[arg_ct+1]);
+      return -1;
+    }
+    maps[map_ct].los = los;
+    strcpy(maps[map_ct].outfile, argv[arg_ct+3]);
+  }
   seed48(seed);//initialize random number seed
   //size of arrays for 2Dfft
   N = HII_DIM*HII_DIM;
   Nf = (HII_DIM/2 +1)*HII_DIM;
 
-  taue_arry = (double *) malloc(sizeof(double)*HII_DIM*HII_DIM);
-
   /****  OPEN FILES  ****/
   if (!(LOG=fopen("../Log_files/kSZ_power_LOG", "w"))){
     fprintf(stderr, "kSZ_power: WARNING: unable to open LOG file at \
@@ -118,10 +149,13 @@ int main(int argc, char *argv[])
     fprintf(LOG, "kSZ_power: ERROR: unable to open xHI filelist %s.\n", argv[2]);
     fclose(LOG); fclose(delta_filelist); return -1;
   }
-  if (!(v_filelist=fopen(argv[3], "r"))){
-    fprintf(stderr, "kSZ_power: ERROR: unable to open xHI filelist %s.\n", argv[3]);
-    fprintf(LOG, "kSZ_power: ERROR: unable to open xHI filelist %s.\n", argv[3]);
-    fclose(LOG); fclose(delta_filelist); fclose(xH_filelist); return -1;
+  for (map_ct=0; map_ct<num_maps; map_ct++){
+    strcpy(filename, map_ct ? argv[5 + 4*(map_ct-1) + 2] : argv[3]);
+    if (!(maps[map_ct].v_filelist=fopen(filename, "r"))){
+      fprintf(stderr, "kSZ_power: ERROR: unable to open velocity filelist %s.\n", filename);
+      fprintf(LOG, "kSZ_power: ERROR: unable to open velocity filelist %s.\n", filename);
+      fclose(LOG); fclose(delta_filelist); fclose(xH_filelist); free_maps(maps, num_maps); return -1;
+    }
   }
   fprintf(stderr, "kSZ_power: Opened filelist files\n");
   fprintf(LOG, "kSZ_power: Opened filelist files\n");
@@ -129,17 +163,24 @@ int main(int argc, char *argv[])
   /****  ALLOCATE MEMORY  ****/
   //allocates 2 and 3 temperature field and initializes 2D 
   dtau_3D = (float*)  fftwf_malloc(sizeof(float) * HII_TOT_NUM_PIXELS);
-  Tcmb = (float*) fftwf_malloc(sizeof(float) * N);
-  Tcmb_3D = (float*)  fftwf_malloc(sizeof(float) * N*HII_DIM);
-  if (!dtau_3D || !Tcmb || !Tcmb_3D){ // sloppy and memory bleeding.. i know. but how often do you get allocation errors?
+  //fourier conjugate
+  Tcmbf = (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex) * Nf);
+  for (map_ct=0; map_ct<num_maps; map_ct++){
+    maps[map_ct].Tcmb = (float*) fftwf_malloc(sizeof(float) * N);
+    maps[map_ct].Tcmb_3D = (float*)  fftwf_malloc(sizeof(float) * N*HII_DIM);
+    maps[map_ct].taue_arry = (double *) malloc(sizeof(double)*N);
+    if (!maps[map_ct].Tcmb || !maps[map_ct].Tcmb_3D || !maps[map_ct].taue_arry)
+      dtau_3D = NULL; // flag the error below
+  }
+  if (!dtau_3D || !Tcmbf){
     fprintf(stderr, "kSZ_power: ERROR allocating memory.\nAborting\n");
     fprintf(LOG, "kSZ_power: ERROR allocating memory.\nAborting\n");
-    fclose(LOG); fclose(delta_filelist); fclose(xH_filelist); fclose(v_filelist); return -1;
+    fclose(LOG); fclose(delta_filelist); fclose(xH_filelist); free_maps(maps, num_maps); return -1;
+  }
+  for (map_ct=0; map_ct<num_maps; map_ct++){
+    for(i = 0; i< N; i++)
+      maps[map_ct].Tcmb[i] = 0.;
   }
-  for(i = 0; i< N; i++)
-    Tcmb[i] = 0.;
-  //fourier conjugate
-  Tcmbf = (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex) * Nf);
   initialize(&L, &Cl, &Count, 0);
 
 
@@ -152,8 +193,8 @@ int main(int argc, char *argv[])
     fprintf(LOG, "Working on the next set of boxes...\n");
 
     //read in boxes
-    if (readInArrays(Tcmb_3D, dtau_3D, delta_filelist, xH_filelist, v_filelist) < 0 ){
-      fclose(LOG); fclose(delta_filelist); fclose(xH_filelist); fclose(v_filelist);
+    if (readInArrays(maps, num_maps, dtau_3D, delta_filelist, xH_filelist) < 0 ){
+      fclose(LOG); fclose(delta_filelist); fclose(xH_filelist); free_maps(maps, num_maps);
       return -1;	
     }
 
@@ -161,52 +202,71 @@ int main(int argc, char *argv[])
     fprintf(LOG, "Initialized the arrays, now doing the projection\n");
 
     //calculates kSZ (or tau signal)
-    projectArray(Tcmb, Tcmb_3D, dtau_3D); 
-    /*
-    //print power spectrum
-    doFFT(Tcmb, Tcmbf, Nf, 2);
-    makePk(L, Cl, Count, Tcmbf); //calculates power spectrum
-    printStatistics(L, Cl, Count); //prints power spectrum
-    initialize(&L, &Cl, &Count, 3);
-    */
+    for (map_ct=0; map_ct<num_maps; map_ct++)
+      projectArray(&maps[map_ct], dtau_3D);
   }
   fprintf(stderr, "Done with all boxes\n Now doing FFT and printing the power spectrum\n");
   fprintf(LOG, "Done with all boxes\n Now doing FFT and printing the power spectrum\n");
-  fclose(delta_filelist); fclose(xH_filelist); fclose(v_filelist);
-  sprintf(filename, "cp %s_z%f.pk %s.pk", OUTFILE, REDSHIFT, OUTFILE);
-  fprintf(stderr, "Copying the last power spectrum file: %s\n", filename);
-  fprintf(LOG, "Copying the last power spectrum file: %s\n", filename);
-  system(filename);
-  fftwf_free(Tcmb_3D); //frees grid
+  fclose(delta_filelist); fclose(xH_filelist);
   fftwf_free(dtau_3D);
-  printTField(Tcmb); //prints the kSZ (tau) field
+  for (map_ct=0; map_ct<num_maps; map_ct++){
+    sprintf(filename, "cp %s_z%f.pk %s.pk", maps[map_ct].outfile, REDSHIFT, maps[map_ct].outfile);
+    fprintf(stderr, "Copying the last power spectrum file: %s\n", filename);
+    fprintf(LOG, "Copying the last power spectrum file: %s\n", filename);
+    system(filename);
+    printTField(maps[map_ct].Tcmb, maps[map_ct].outfile); //prints the kSZ (tau) field
+  }
 
 
   //frees all the rest of the gllocated memory
   initialize(&L, &Cl, &Count, 1);
+  free_maps(maps, num_maps);
   fftwf_free(Tcmbf);
-  fftwf_free(Tcmb);
+  destroyFFTPlans();
   fclose(LOG);
-  free(taue_arry);
 
   return 0;
 }
 
 
+void free_maps(kSZ_map *maps, int num_maps)
+{
+  int map_ct;
+  for (map_ct=0; map_ct<num_maps; map_ct++){
+    if (maps[map_ct].v_filelist) fclose(maps[map_ct].v_filelist);
+    if (maps[map_ct].Tcmb) fftwf_free(maps[map_ct].Tcmb);
+    if (maps[map_ct].Tcmb_3D) fftwf_free(maps[map_ct].Tcmb_3D);
+    free(maps[map_ct].taue_arry);
+    maps[map_ct].v_filelist = NULL;
+    maps[map_ct].Tcmb = maps[map_ct].Tcmb_3D = NULL;
+    maps[map_ct].taue_arry = NULL;
+  }
+}
+
+
 /********************************************************************
 Calculates 2D kSZ field
+The sky pixels are independent, so each slice along the line of sight
+is done in parallel over the pixels.
 *******************************************************************/
-void projectArray(float *Tcmb, float *Tcmb_3d, float *dtau_3d)
+void projectArray(kSZ_map *map, float *dtau_3d)
 {
   int i, j, k, ii, jj;
-  double A, dz, inc;
+  double A, dz;
   int tx, ty;
-  double taue, DA_zstart = confDist(START_REDSHIFT);
+  double DA_zstart = confDist(START_REDSHIFT);
   double DA_zstartcurrbox = confDist(REDSHIFT);
   double dR = (BOX_LEN / (double) HII_DIM); // comoving length of single cell in cMpc
-  double last_slice_taue = 0;
+  double *inc, *slice_z;
   unsigned long long ct;
 
+  inc = (double *) malloc(sizeof(double)*HII_DIM);
+  slice_z = (double *) malloc(sizeof(double)*HII_DIM);
+  if (!inc || !slice_z){
+    fprintf(stderr, "kSZ_power: ERROR allocating memory.\nAborting\n");
+    fprintf(LOG, "kSZ_power: ERROR allocating memory.\nAborting\n");
+    exit(1);
+  }
 
   //this coeficinet is used to calculate kSZ
   A = N_b0*SIGMAT*BOX_LEN*CMperMPC/(double)HII_DIM; // N*sigma*dR (comoving units)
@@ -216,62 +276,68 @@ void projectArray(float *Tcmb, float *Tcmb_3d, float *dtau_3d)
   tx = (int )(HII_DIM*drand48());   //Put in your favorite random # generator if you like such as ran1(&idum) in numerical recipes
   ty = (int )(HII_DIM*drand48());
 
-
+  // the redshift of, and the ratio of the angular diameter distances to, each slice
   currZ = REDSHIFT;
-  taue = mean_taue_curr_z; //optical depth to thompson scattering along this k sightline
   for(k = 0; k < HII_DIM; k++){
-    inc = (k*dR + DA_zstartcurrbox) / DA_zstart; //ratio of the angular diameter distances	  
+    inc[k] = (k*dR + DA_zstartcurrbox) / DA_zstart; //ratio of the angular diameter distances	  
     dz = - dR * CMperMPC / drdz(currZ);
     currZ += dz;
+    slice_z[k] = currZ;
+  }
 
+  for(k = 0; k < HII_DIM; k++){
+    currZ = slice_z[k];
+
+#pragma omp parallel for shared(map, dtau_3d, inc, slice_z, k, tx, ty, A) private(i, j, ii, jj) schedule(static)
     for(i = 0; i < HII_DIM; i++){
-      //      fprintf(stderr, "%i ", i);
       for(j = 0; j < HII_DIM; j++){ 
 
 	if (PARALLEL_APPROX){
 	  ii = i; jj = j; //assumes rays are parallel
 	}
 	else{
-	  ii = ((int) ((i+.5)*inc)) % HII_DIM; //does not
-	  jj = ((int) ((j+.5)*inc)) % HII_DIM;
+	  ii = ((int) ((i+.5)*inc[k])) % HII_DIM; //does not
+	  jj = ((int) ((j+.5)*inc[k])) % HII_DIM;
 	}
 
 	  //adding missing conversion factors for length units
-	taue_arry[position(i,j,0,0)] += dtau_3d[HII_R_INDEX(ii,jj,k)] * (1+currZ) * (1+currZ);
+	map->taue_arry[position(i,j,0,0)] += dtau_3d[los_index(map->los,ii,jj,k)] * (1+slice_z[k]) * (1+slice_z[k]);
 	    
-	  Tcmb[position(i,j, tx, ty)] 
-	    += A*(1+currZ)*Tcmb_3d[HII_R_INDEX(ii,jj,k)] * exp(-taue_arry[position(i,j,0,0)]);
-	  if ((i==0)&&(j==0)&&(k<110) && (100<k)){
-	    fprintf(stderr, "taue along sightline is %e\n", taue_arry[position(i,j,0,0)]);
-	    fprintf(LOG, "taue along sightline is %e\n", taue_arry[position(i,j,0,0)]);
-	  }
+	  map->Tcmb[position(i,j, tx, ty)] 
+	    += A*(1+slice_z[k])*map->Tcmb_3D[los_index(map->los,ii,jj,k)] * exp(-map->taue_arry[position(i,j,0,0)]);
 	  /**** AM: I took out one factor of (1+z) since the velocity is in comoving units **/
 	}
 
     }// done with all x,y
+    if ((k<110) && (100<k)){
+      fprintf(stderr, "taue along sightline is %e\n", map->taue_arry[position(0,0,0,0)]);
+      fprintf(LOG, "taue along sightline is %e\n", map->taue_arry[position(0,0,0,0)]);
+    }
 
     if (k%50 ==0){
       //print power spectrum
-      doFFT(Tcmb, Tcmbf, Nf, 2);
+      doFFT(map->Tcmb, Tcmbf, Nf, 2);
       makePk(L, Cl, Count, Tcmbf); //calculates power spectrum
-      printStatistics(L, Cl, Count); //prints power spectrum
+      printStatistics(L, Cl, Count, map->outfile); //prints power spectrum
       initialize(&L, &Cl, &Count, 3);
     }
   } // end look through box
 
-  mean_taue_curr_z =0;
+  map->mean_taue_curr_z =0;
   for (ct=0; ct<HII_DIM*HII_DIM; ct++)
-    mean_taue_curr_z += taue_arry[ct];
-  mean_taue_curr_z /=  pow(HII_DIM, 2); // updates the mean taue for next box
+    map->mean_taue_curr_z += map->taue_arry[ct];
+  map->mean_taue_curr_z /=  pow(HII_DIM, 2); // updates the mean taue for next box
 
   //#ifdef TAU_POWER  //removes mean--kSZ naturally has zero mean, so only relevant for tau
-   subtract_avg(Tcmb);  
+   subtract_avg(map->Tcmb);  
 //#endif
 
 
   //prints out starting and ending redshift
-  fprintf(stderr, "zstart =%f zend = %f, <taue(zend)>=%f\n", REDSHIFT, currZ, mean_taue_curr_z);
-  fprintf(LOG, "zstart =%f zend = %f, <taue(zend)>=%f\n", REDSHIFT, currZ, mean_taue_curr_z);
+  fprintf(stderr, "zstart =%f zend = %f, <taue(zend)>=%f\n", REDSHIFT, currZ, map->mean_taue_curr_z);
+  fprintf(LOG, "zstart =%f zend = %f, <taue(zend)>=%f\n", REDSHIFT, currZ, map->mean_taue_curr_z);
+  free(inc);
+  free(slice_z);
 }
 
 /************************************************************************
@@ -282,53 +348,70 @@ unsigned long long position(int i, int j, int ti, int tj)
     return ((i+ti)%HII_DIM)*HII_DIM + (j +tj)%HII_DIM; 
 }
 
+/************************************************************************
+Returns the index in the box of sky pixel (i,j) and line-of-sight cell k,
+for a line of sight along axis los (the sky axes are the other two, in order)
+***********************************************************************/
+unsigned long long los_index(int los, int i, int j, int k)
+{
+    if (los == 0)
+      return HII_R_INDEX(k,i,j);
+    if (los == 1)
+      return HII_R_INDEX(i,k,j);
+    return HII_R_INDEX(i,j,k);
+}
+
 
 /********************************************************************
-Reads in necessary arrays to calculate kSZ/tau power spectrum.
+Opens the next box listed in filelist; the name is returned in filename.
 **********************************************************************/
-int readInArrays(float *Tcmb_3d, float *dtau_3d, 
-		 FILE *delta_filelist, FILE *xH_filelist, FILE *v_filelist)
+FILE *openNextBox(FILE *filelist, char *filename, char *field)
 {
-  unsigned long long i, ct;
-    int x,y,z;
-    float v, delta, xi;
-    FILE *delta_IN, *xH_IN, *v_IN;
-    char filename[200], *token;
-
-    //density field in overdensity
-    if (fscanf(delta_filelist, "%s\n", filename) <= 0){
-      fprintf(stderr, "kSZ_power: ERROR: early termination in delta filelist\n.");
-      fprintf(LOG, "kSZ_power: ERROR: early termination in delta filelist\n.");
-      return -1;
+    FILE *F;
+    if (fscanf(filelist, "%s\n", filename) <= 0){
+      fprintf(stderr, "kSZ_power: ERROR: early termination in %s filelist\n.", field);
+      fprintf(LOG, "kSZ_power: ERROR: early termination in %s filelist\n.", field);
+      return NULL;
     }
-    if( !(delta_IN = fopen(filename, "rb"))){
+    if( !(F = fopen(filename, "rb"))){
 	fprintf(stderr, "Could not read in %s.\n", filename);
 	fprintf(LOG, "Could not read in %s.\n", filename);
-	return -1;
+	return NULL;
     }
+    return F;
+}
+
+
+/********************************************************************
+Reads in necessary arrays to calculate kSZ/tau power spectrum.
+The density, xH and velocity boxes are streamed together, a slab
+(of constant i) at a time, and turned into the optical depth box
+and the momentum box of each map.
+**********************************************************************/
+int readInArrays(kSZ_map *maps, int num_maps, float *dtau_3d,
+		 FILE *delta_filelist, FILE *xH_filelist)
+{
+  unsigned long long ct, slab_start, num_low_delta, num_low_xi, num_high_xi;
+    int x, map_ct, status = -1;
+    float delta, xi, *delta_slab=NULL, *xi_slab=NULL, *v_slab=NULL;
+    FILE *delta_IN=NULL, *xH_IN=NULL, *v_IN[MAX_KSZ_MAPS];
+    char filename[200], *token;
+
+    for (map_ct=0; map_ct<MAX_KSZ_MAPS; map_ct++)
+      v_IN[map_ct] = NULL;
+
+    //density field in overdensity
+    if (!(delta_IN = openNextBox(delta_filelist, filename, "delta")))
+      goto CLEANUP;
 
     //neutral fraction field
-    if (fscanf(xH_filelist, "%s\n", filename) <= 0){
-      fprintf(stderr, "kSZ_power: ERROR: early termination in delta filelist\n.");
-      fprintf(LOG, "kSZ_power: ERROR: early termination in delta filelist\n.");
-      return -1;
-    }
-    if( !(xH_IN = fopen(filename, "rb"))){
-	fprintf(stderr, "Could not read in %s.\n", filename);
-	fprintf(LOG, "Could not read in %s.\n", filename);
-	fclose (delta_IN); return -1;
-    }
+    if (!(xH_IN = openNextBox(xH_filelist, filename, "xH")))
+      goto CLEANUP;
 
-    //velocity field
-    if (fscanf(v_filelist, "%s\n", filename) <= 0){
-      fprintf(stderr, "kSZ_power: ERROR: early termination in delta filelist\n.");
-      fprintf(LOG, "kSZ_power: ERROR: early termination in delta filelist\n.");
-      return -1;
-    }
-    if( !(v_IN = fopen(filename, "rb"))){
-	fprintf(stderr, "Could not read in %s.\n", filename);
-	fprintf(LOG, "Could not read in %s.\n", filename);
-	fclose(delta_IN); fclose(xH_IN); return -1;
+    //velocity fields; the redshift is read from the name of the first one
+    for (map_ct=num_maps-1; map_ct>=0; map_ct--){
+      if (!(v_IN[map_ct] = openNextBox(maps[map_ct].v_filelist, filename, "velocity")))
+	goto CLEANUP;
     }
 
     // get start redshift
@@ -342,9 +425,11 @@ int readInArrays(float *Tcmb_3d, float *dtau_3d,
       fprintf(stderr, "Starting redshift: %f\n", START_REDSHIFT);
       fprintf(LOG, "Starting redshift: %f\n", START_REDSHIFT);
       REDSHIFT = START_REDSHIFT;
-      mean_taue_curr_z = tau_e(0, START_REDSHIFT, NULL, NULL, 0);
-      for (ct=0; ct< HII_DIM*HII_DIM; ct++)
-	taue_arry[ct] = mean_taue_curr_z;
+      for (map_ct=0; map_ct<num_maps; map_ct++){
+	maps[map_ct].mean_taue_curr_z = tau_e(0, START_REDSHIFT, NULL, NULL, 0);
+	for (ct=0; ct< HII_DIM*HII_DIM; ct++)
+	  maps[map_ct].taue_arry[ct] = maps[map_ct].mean_taue_curr_z;
+      }
     }
     else{ // get the starting one from this current box
       token = strtok(filename, "_");
@@ -357,64 +442,94 @@ int readInArrays(float *Tcmb_3d, float *dtau_3d,
       fprintf(LOG, "Starting redshift of new box: %f\n", REDSHIFT);
     }
 
+    delta_slab = (float *) malloc(sizeof(float)*HII_D*HII_D);
+    xi_slab = (float *) malloc(sizeof(float)*HII_D*HII_D);
+    v_slab = (float *) malloc(sizeof(float)*HII_D*HII_D);
+    if (!delta_slab || !xi_slab || !v_slab){
+      fprintf(stderr, "kSZ_power: ERROR allocating memory.\n");
+      fprintf(LOG, "kSZ_power: ERROR allocating memory.\n");
+      goto CLEANUP;
+    }
+
     // now load the arrays
-    for(i = 0; i < HII_TOT_NUM_PIXELS; i++){  
-      if (fread(&delta, sizeof(float), 1, delta_IN) != 1){
+    num_low_delta = num_low_xi = num_high_xi = 0;
+    for(x = 0; x < HII_DIM; x++){
+      slab_start = HII_R_INDEX(x,0,0);
+      if (fread(delta_slab, sizeof(float), HII_D*HII_D, delta_IN) != HII_D*HII_D){
 	fprintf(stderr, "kSZ_power: ERROR: reading from delta box\n.");
 	fprintf(LOG, "kSZ_power: ERROR: reading from delta box\n.");
-	fclose(delta_IN); fclose(xH_IN); fclose(v_IN); return -1;
+	goto CLEANUP;
       }
-      if (fread(&v, sizeof(float), 1, v_IN)	 != 1){
-	fprintf(stderr, "kSZ_power: ERROR: reading from velocity box\n.");
-	fprintf(LOG, "kSZ_power: ERROR: reading from velocity box\n.");
-	fclose(delta_IN); fclose(xH_IN); fclose(v_IN); return -1;
-      }
-
-      if (fread(&xi, sizeof(float), 1, xH_IN) != 1) {
+      if (fread(xi_slab, sizeof(float), HII_D*HII_D, xH_IN) != HII_D*HII_D) {
 	fprintf(stderr, "kSZ_power: ERROR: reading from xH box\n.");
 	fprintf(LOG, "kSZ_power: ERROR: reading from xH box\n.");
-	fclose(delta_IN); fclose(xH_IN); fclose(v_IN); return -1;
+	goto CLEANUP;
       }
-	xi = 1.0-xi; // input is neutral fraction not ionized
-	v *= CMperMPC/C; //in units of C
-	//*****AM:  my velocity fields are in comoving units
-	//*****will convert to proper units in the projection
+
+#pragma omp parallel for shared(delta_slab, xi_slab, dtau_3d, slab_start) private(ct, delta, xi) reduction(+:num_low_delta, num_low_xi, num_high_xi) schedule(static)
+      for(ct = 0; ct < HII_D*HII_D; ct++){
+	xi = 1.0-xi_slab[ct]; // input is neutral fraction not ionized
+	delta = delta_slab[ct];
 	// check for wierd rounding errors
 	if (delta < -1){
-	  fprintf(stderr, "kSZ_power: flagged delta=%e < -1 at index=%llu\nChanging to -1+FRACT_FLOAT_ERR\n", delta, i);
-	  fprintf(LOG, "kSZ_power: flagged delta=%e < -1 at index=%llu\nChanging to -1+FRACT_FLOAT_ERR\n", delta, i);
+	  num_low_delta++;
 	  delta = -1 + FRACT_FLOAT_ERR;
 	}
 	if (xi < 0){
-	  fprintf(stderr, "kSZ_power: flagged xi=%e < 0 at index=%llu\nChanging to 0\n", xi, i);
-	  fprintf(LOG, "kSZ_power: flagged xi=%e < 0 at index=%llu\nChanging to 0\n", xi, i);
+	  num_low_xi++;
 	  xi = 0;
 	}
 	if (xi > 1){
-	  fprintf(stderr, "kSZ_power: flagged xi=%e > 1 at index=%llu\n.Changing to 1\n", xi, i);
-	  fprintf(LOG, "kSZ_power: flagged xi=%e > 1 at index=%llu\n.Changing to 1\n", xi, i);
+	  num_high_xi++;
 	  xi = 1;
 	}
-
-	Tcmb_3d[i] = v*xi*(1.0+delta);
-
+	// keep the electron density, for the momentum boxes
+	xi_slab[ct] = xi*(1.0+delta);
 
 	// and the e^dtau array, i.e.  optical depth contribution of the current cell
-	dtau_3d[i] =  N_b0*(1.0+delta)*xi*SIGMAT*CMperMPC*BOX_LEN/(double)HII_DIM;
+	dtau_3d[slab_start+ct] =  N_b0*(1.0+delta)*xi*SIGMAT*CMperMPC*BOX_LEN/(double)HII_DIM;
 	//AM: NOTE THAT it is missing a factor of (1+z)^2 from proper to comoving conversions
-    }
-
+      }
 
-    fclose(delta_IN); fclose(v_IN); fclose(xH_IN);
+      for (map_ct=0; map_ct<num_maps; map_ct++){
+	if (fread(v_slab, sizeof(float), HII_D*HII_D, v_IN[map_ct]) != HII_D*HII_D){
+	  fprintf(stderr, "kSZ_power: ERROR: reading from velocity box\n.");
+	  fprintf(LOG, "kSZ_power: ERROR: reading from velocity box\n.");
+	  goto CLEANUP;
+	}
+#pragma omp parallel for shared(maps, map_ct, v_slab, xi_slab, slab_start) private(ct) schedule(static)
+	for(ct = 0; ct < HII_D*HII_D; ct++){
+	  // v *= CMperMPC/C, in units of C
+	  //*****AM:  my velocity fields are in comoving units
+	  //*****will convert to proper units in the projection
+	  maps[map_ct].Tcmb_3D[slab_start+ct] = v_slab[ct]*CMperMPC/C * xi_slab[ct];
+	}
+      }
+    }
+    if (num_low_delta + num_low_xi + num_high_xi > 0){
+      fprintf(stderr, "kSZ_power: flagged %llu cells with delta < -1 (changed to -1+FRACT_FLOAT_ERR), %llu with xi < 0 (changed to 0) and %llu with xi > 1 (changed to 1)\n",
+	      num_low_delta, num_low_xi, num_high_xi);
+      fprintf(LOG, "kSZ_power: flagged %llu cells with delta < -1 (changed to -1+FRACT_FLOAT_ERR), %llu with xi < 0 (changed to 0) and %llu with xi > 1 (changed to 1)\n",
+	      num_low_delta, num_low_xi, num_high_xi);
+    }
+    status = 0;
+
+ CLEANUP:
+    if (delta_IN) fclose(delta_IN);
+    if (xH_IN) fclose(xH_IN);
+    for (map_ct=0; map_ct<num_maps; map_ct++)
+      if (v_IN[map_ct]) fclose(v_IN[map_ct]);
+    free(delta_slab); free(xi_slab); free(v_slab);
+    return status;
 }
 
 
 //Prints dT_kSZ/tau field
-void printTField(float *Tcmb)
+void printTField(float *Tcmb, char *outfile_name)
 {
-    char filename[400];
+    char filename[500];
     FILE *outfile;
-    sprintf(filename, "%s.dat", OUTFILE);
+    sprintf(filename, "%s.dat", outfile_name);
     outfile = fopen(filename, "wb");
     /*
     int i,j;
@@ -432,15 +547,15 @@ void printTField(float *Tcmb)
 
 
 //prints angular power spectrum
-void printStatistics(float *K, float *Pk, int *Count) 
+void printStatistics(float *K, float *Pk, int *Count, char *outfile_name) 
 {
     int i;
     FILE *outfile;
     float coef, x;
-    char filename[400];
+    char filename[500];
    
 
-    sprintf(filename, "%s_z%f.pk", OUTFILE, currZ);
+    sprintf(filename, "%s_z%f.pk", outfile_name, currZ);
 
     if((outfile = fopen(filename, "w")) == NULL)
     {
@@ -0,0 +1,144 @@
+#include "../Parameter_files/INIT_PARAMS.H"
+#include "../Parameter_files/ANAL_PARAMS.H"
+#include "size_helper_progs.c"
+
+#define VOXEL_NF_CUTOFF (float) 0.5 // value demarkating "neutral" and "ionized" voxels
+/*
+
+  USAGE: label_HII_regions <REDSHIFT> <REGION> <xH BOX filename>
+
+  PROGRAM LABEL_HII_REGIONS identifies the individual (face-connected, with periodic boundaries)
+  ionized or neutral regions of an xH box.  It writes:
+
+     the list of regions, sorted by label, to
+     ../Output_files/Size_distributions/<ionized/neutral>_regions_...
+     columns: label, volume (cells), volume (Mpc^3), centroid x, y, z (Mpc)
+
+     the label box (unsigned int, 0 outside of the regions, 1..N inside) to
+     ../Boxes/<ionized/neutral>_region_labels_...
+
+  <REGION> is an integer:
+     0 = label ionized regions
+     1 = label neutral regions
+
+*/
+
+
+int main (int argc, char ** argv){
+  char *in_phase=NULL, filename[300], region_name[100];
+  FILE *F=NULL;
+  float REDSHIFT, *buffer=NULL, *centroid=NULL, nf, cell_size;
+  int REGION_FLAG, i,j,k, status=-1;
+  unsigned int *label=NULL;
+  unsigned long long *volume=NULL, num_in_phase, largest;
+  long long num_regions, r;
+
+  /***************   BEGIN INITIALIZATION   **************************/
+
+  // check usage
+  if (argc != 4){
+    fprintf(stderr, "USAGE: label_HII_regions <REDSHIFT> <REGION> <xH BOX filename>\nAborting...\n");
+    return -1;
+  }
+  REDSHIFT = atof(argv[1]);
+  REGION_FLAG = atoi(argv[2]);
+  if ((REGION_FLAG != 1) && (REGION_FLAG != 0)){
+    fprintf(stderr, "USAGE: label_HII_regions <REDSHIFT> <REGION> <xH BOX filename>\nAborting...\n");
+    return -1;
+  }
+  cell_size = BOX_LEN/(HII_DIM+0.0);
+
+  // allocate
+  in_phase = (char *) malloc(sizeof(char)*HII_TOT_NUM_PIXELS);
+  label = (unsigned int *) malloc(sizeof(unsigned int)*HII_TOT_NUM_PIXELS);
+  buffer = (float *) malloc(sizeof(float)*HII_DIM);
+  if (!in_phase || !label || !buffer){
+    fprintf(stderr, "label_HII_regions: Error allocating memory\nAborting...\n");
+    goto CLEANUP;
+  }
+
+  // read in the xH box, and flag the voxels in the phase of interest
+  F = fopen(argv[3], "rb");
+  if (!F){
+    fprintf(stderr, "label_HII_regions: Error opening file %s for reading\nAborting...\n", argv[3]);
+    goto CLEANUP;
+  }
+  fprintf(stderr, "Reading in xH box\n");
+  nf = 0;
+  num_in_phase = 0;
+  for (i=0; i<HII_DIM; i++){
+    for (j=0; j<HII_DIM; j++){
+      if (fread(buffer, sizeof(float), HII_DIM, F)!=HII_DIM){
+	fprintf(stderr, "label_HII_regions: Read error occured while reading neutral_fraction box.\nAborting...\n");
+	goto CLEANUP;
+      }
+      for (k=0; k<HII_DIM; k++){
+	nf += buffer[k];
+	in_phase[HII_R_INDEX(i,j,k)] = REGION_FLAG ? (buffer[k] >= VOXEL_NF_CUTOFF) : (buffer[k] < VOXEL_NF_CUTOFF);
+	num_in_phase += in_phase[HII_R_INDEX(i,j,k)];
+      }
+    }
+  }
+  fclose(F);
+  F = NULL;
+  nf /= (double)HII_TOT_NUM_PIXELS;
+  /***************   END INITIALIZATION   **************************/
+
+
+  // label the regions
+  fprintf(stderr, "Labeling regions\n");
+  if ((num_regions = label_regions(in_phase, label)) < 0)
+    goto CLEANUP;
+  volume = (unsigned long long *) malloc(sizeof(unsigned long long)*(num_regions+1));
+  centroid = (float *) malloc(sizeof(float)*3*(num_regions+1));
+  if (!volume || !centroid){
+    fprintf(stderr, "label_HII_regions: Error allocating memory for %lli regions\nAborting...\n", num_regions);
+    goto CLEANUP;
+  }
+  if (region_properties(label, num_regions, volume, centroid) != 0)
+    goto CLEANUP;
+
+  largest = 0;
+  for (r=0; r<num_regions; r++){
+    if (volume[r] > largest)
+      largest = volume[r];
+  }
+  fprintf(stderr, "Found %lli %s regions; the largest one contains %e of the %s volume\n", num_regions, (REGION_FLAG ? "neutral" : "ionized"),
+	  num_in_phase>0 ? largest/(double)num_in_phase : 0, (REGION_FLAG ? "neutral" : "ionized"));
+
+  // print out the region list
+  sprintf(region_name, "%s%s", (REGION_FLAG ? "neutral" : "ionized"), (USE_HALO_FIELD ? "" : "_no_halos"));
+  sprintf(filename, "../Output_files/Size_distributions/%s_regions_nf%f_z%06.2f_%i_%.0fMpc", region_name, nf, REDSHIFT, HII_DIM, BOX_LEN);
+  F = fopen(filename, "w");
+  if (!F){
+    fprintf(stderr, "label_HII_regions: Error opening output file %s\nAborting...\n", filename);
+    goto CLEANUP;
+  }
+  fprintf(F, "# label\tvolume (cells)\tvolume (Mpc^3)\tx (Mpc)\ty (Mpc)\tz (Mpc)\n");
+  for (r=0; r<num_regions; r++)
+    fprintf(F, "%lli\t%llu\t%e\t%f\t%f\t%f\n", r+1, volume[r], volume[r]*pow(cell_size, 3),
+	    centroid[3*r]*cell_size, centroid[3*r+1]*cell_size, centroid[3*r+2]*cell_size);
+  fclose(F);
+  F = NULL;
+
+  // and the label box
+  sprintf(filename, "../Boxes/%s_region_labels_nf%f_z%06.2f_%i_%.0fMpc", region_name, nf, REDSHIFT, HII_DIM, BOX_LEN);
+  F = fopen(filename, "wb");
+  if (!F || (mod_fwrite(label, sizeof(unsigned int)*HII_TOT_NUM_PIXELS, 1, F)!=1)){
+    fprintf(stderr, "label_HII_regions: Write error occured while writting the label box %s\nAborting...\n", filename);
+    goto CLEANUP;
+  }
+  fclose(F);
+  F = NULL;
+  fprintf(stderr, "Done!\n");
+  status = 0;
+
+ CLEANUP:
+  if (F) fclose(F);
+  free(in_phase);
+  free(label);
+  free(buffer);
+  free(volume);
+  free(centroid);
+  return status;
+}
@@ -0,0 +1,385 @@
+#ifndef _POWER_SPEC_HELPERS_
+#define _POWER_SPEC_HELPERS_
+
+#include "../Parameter_files/INIT_PARAMS.H"
+#include "../Parameter_files/ANAL_PARAMS.H"
+
+/*
+  Shared power spectrum estimator, used by delta_T.c, delta_ps.c, print_power_spec_ICs.c and fftCMB.c.
+
+  A k-space box (as produced by an r2c FFTW transform, i.e. only the n_z <= dim/2 half is stored)
+  is swept once in parallel.  Each thread fills its own histograms, which are reduced in thread order
+  at the end, so the result does not depend on the scheduling.  One sweep fills the spherically
+  averaged bins and, optionally, the cylindrical (k_perp, k_par) bins and the Legendre multipoles
+  (P0, P2, P4) in the spherical bins, and can be applied to the auto-power of one box or to the
+  cross-power of two boxes.  The line of sight of the cylindrical bins and the multipoles is the
+  third (n_z) axis by default, or the axis set in los_axis.
+
+  Usage:
+     ps_bins k_bins;
+     ps_estimator ps;
+     set_log_ps_bins(&k_bins, DELTA_K, 1.5, DELTA_K*HII_DIM);
+     init_ps_estimator(&ps, k_bins, 3, 1.0/(2.0*PI*PI*VOLUME));
+     accumulate_power_spec(&ps, deldel_T, NULL, HII_DIM, 3, BOX_LEN);
+     ... use ps.k_ave[ct], ps.p_box[ct], ps.in_bin_ct[ct] ...
+     free_ps_estimator(&ps);
+
+  The bin sums are not normalized by the number of modes; this is left to the caller.
+  The same per-mode weighting (k^k_power * norm) is used by all of the estimators.
+*/
+
+#define NUM_PS_MULTIPOLES (int) 3 // ell = 0, 2, 4
+
+typedef struct{
+  int NUM_BINS;
+  float *k_edges; // NUM_BINS+1 edges; bin ct covers k_edges[ct] <= k < k_edges[ct+1]
+} ps_bins;
+
+typedef struct{
+  ps_bins k_bins; // spherically averaged bins
+  ps_bins k_perp_bins, k_par_bins; // cylindrical bins (k_perp_bins.NUM_BINS = 0 if not used)
+  float k_power; // every mode is weighted by k^k_power (e.g. 3 for the dimensionless power)
+  double norm; // multiplies |delta_k|^2 (e.g. 1/VOLUME)
+  int hermitian_weights; // if 1, modes with 0 < n_z < dim/2 are counted twice, for their conjugate twin
+  int los_axis; // the line of sight: 0, 1 or 2 for the first, second or third index of the box
+  double (*model)(double); // optional model power spectrum averaged over the same modes (NULL if not used)
+
+  // bin sums
+  double *k_ave, *p_box, *p_model;
+  unsigned long long *in_bin_ct;
+  double *p_cyl; // [k_perp bin * k_par_bins.NUM_BINS + k_par bin]
+  unsigned long long *in_cyl_ct;
+  double *p_ell; // (2 ell + 1) L_ell(mu) weighted sums, [ell/2 * k_bins.NUM_BINS + k bin] (NULL if not used)
+} ps_estimator;
+
+
+/*
+  Function SET_LOG_PS_BINS sets logarithmic bins: the first bin is [0, <k_first_bin_ceil>), and
+  every following bin is a factor of <k_factor> wider, up to the last bin ceiling below <k_max>.
+  This is the binning historically used by delta_T.c, delta_ps.c and print_power_spec_ICs.c, and the
+  edges are computed in the same (float) arithmetic.
+  Returns the number of bins, or -1 on a memory allocation error.
+*/
+int set_log_ps_bins(ps_bins *bins, float k_first_bin_ceil, float k_factor, float k_max){
+  float k_ceil;
+  int ct;
+
+  // ghetto counting (lookup how to do logs of arbitrary bases in c...)
+  bins->NUM_BINS = 0;
+  k_ceil = k_first_bin_ceil;
+  while (k_ceil < k_max){
+    bins->NUM_BINS++;
+    k_ceil*=k_factor;
+  }
+
+  if (!(bins->k_edges = (float *) malloc(sizeof(float)*(bins->NUM_BINS+1)))){
+    fprintf(stderr, "power_spec_helper_progs.c: Error allocating memory for bin edges\n");
+    bins->NUM_BINS = 0;
+    return -1;
+  }
+  bins->k_edges[0] = 0;
+  k_ceil = k_first_bin_ceil;
+  for (ct=1; ct<=bins->NUM_BINS; ct++){
+    bins->k_edges[ct] = k_ceil;
+    k_ceil*=k_factor;
+  }
+  return bins->NUM_BINS;
+}
+
+
+/*
+  Function SET_LINEAR_PS_BINS sets <NUM_BINS> linear bins of width <dk>, starting at <k_min>.
+  Returns the number of bins, or -1 on a memory allocation error.
+*/
+int set_linear_ps_bins(ps_bins *bins, float k_min, float dk, int NUM_BINS){
+  int ct;
+
+  bins->NUM_BINS = NUM_BINS;
+  if (!(bins->k_edges = (float *) malloc(sizeof(float)*(bins->NUM_BINS+1)))){
+    fprintf(stderr, "power_spec_helper_progs.c: Error allocating memory for bin edges\n");
+    bins->NUM_BINS = 0;
+    return -1;
+  }
+  for (ct=0; ct<=bins->NUM_BINS; ct++){
+    bins->k_edges[ct] = k_min + ct*dk;
+  }
+  return bins->NUM_BINS;
+}
+
+
+void free_ps_bins(ps_bins *bins){
+  free(bins->k_edges);
+  bins->k_edges = NULL;
+  bins->NUM_BINS = 0;
+}
+
+
+/* returns the bin containing k, or -1 if k lies outside of the bins */
+int find_ps_bin(ps_bins *bins, float k){
+  int lo, hi, mid;
+
+  if ((bins->NUM_BINS < 1) || (k < bins->k_edges[0]) || (k >= bins->k_edges[bins->NUM_BINS]))
+    return -1;
+
+  // bisect the edges
+  lo = 0;
+  hi = bins->NUM_BINS;
+  while (hi-lo > 1){
+    mid = (lo+hi)/2;
+    if (k < bins->k_edges[mid])
+      hi = mid;
+    else
+      lo = mid;
+  }
+  return lo;
+}
+
+
+/* zeroes the bin sums of the estimator */
+void reset_ps_estimator(ps_estimator *ps){
+  int ct;
+
+  for (ct=0; ct<ps->k_bins.NUM_BINS; ct++){
+    ps->k_ave[ct] = ps->p_box[ct] = ps->p_model[ct] = 0;
+    ps->in_bin_ct[ct] = 0;
+  }
+  for (ct=0; ct<(ps->k_perp_bins.NUM_BINS*ps->k_par_bins.NUM_BINS); ct++){
+    ps->p_cyl[ct] = 0;
+    ps->in_cyl_ct[ct] = 0;
+  }
+  if (ps->p_ell){
+    for (ct=0; ct<(NUM_PS_MULTIPOLES*ps->k_bins.NUM_BINS); ct++){
+      ps->p_ell[ct] = 0;
+    }
+  }
+}
+
+
+/*
+  Function INIT_PS_ESTIMATOR sets up an estimator using the spherical bins <k_bins> (which the
+  estimator takes ownership of).  Each mode contributes k^<k_power> * <norm> * |delta_k|^2.
+  Cylindrical binning, hermitian weights and the model power are off by default.
+  Returns 0 on success, -1 on a memory allocation error.
+*/
+int init_ps_estimator(ps_estimator *ps, ps_bins k_bins, float k_power, double norm){
+  ps->k_bins = k_bins;
+  ps->k_perp_bins.NUM_BINS = ps->k_par_bins.NUM_BINS = 0;
+  ps->k_perp_bins.k_edges = ps->k_par_bins.k_edges = NULL;
+  ps->k_power = k_power;
+  ps->norm = norm;
+  ps->hermitian_weights = 0;
+  ps->los_axis = 2;
+  ps->model = NULL;
+  ps->p_cyl = NULL;
+  ps->in_cyl_ct = NULL;
+  ps->p_ell = NULL;
+
+  ps->k_ave = (double *) malloc(sizeof(double)*k_bins.NUM_BINS);
+  ps->p_box = (double *) malloc(sizeof(double)*k_bins.NUM_BINS);
+  ps->p_model = (double *) malloc(sizeof(double)*k_bins.NUM_BINS);
+  ps->in_bin_ct = (unsigned long long *) malloc(sizeof(unsigned long long)*k_bins.NUM_BINS);
+  if (!ps->k_ave || !ps->p_box || !ps->p_model || !ps->in_bin_ct){
+    fprintf(stderr, "power_spec_helper_progs.c: Error allocating memory for the power spectrum\n");
+    free(ps->k_ave); free(ps->p_box); free(ps->p_model); free(ps->in_bin_ct);
+    return -1;
+  }
+  reset_ps_estimator(ps);
+  return 0;
+}
+
+
+/*
+  Function ADD_CYLINDRICAL_PS_BINS additionally bins every mode in (k_perp, |k_par|), with the
+  line of sight along ps->los_axis.  The estimator takes ownership of the bins.
+  Returns 0 on success, -1 on a memory allocation error.
+*/
+int add_cylindrical_ps_bins(ps_estimator *ps, ps_bins k_perp_bins, ps_bins k_par_bins){
+  unsigned long long num_cyl = (unsigned long long)k_perp_bins.NUM_BINS*k_par_bins.NUM_BINS;
+
+  ps->p_cyl = (double *) malloc(sizeof(double)*num_cyl);
+  ps->in_cyl_ct = (unsigned long long *) malloc(sizeof(unsigned long long)*num_cyl);
+  if (!ps->p_cyl || !ps->in_cyl_ct){
+    fprintf(stderr, "power_spec_helper_progs.c: Error allocating memory for the cylindrical power spectrum\n");
+    free(ps->p_cyl); free(ps->in_cyl_ct);
+    ps->p_cyl = NULL; ps->in_cyl_ct = NULL;
+    return -1;
+  }
+  ps->k_perp_bins = k_perp_bins;
+  ps->k_par_bins = k_par_bins;
+  reset_ps_estimator(ps);
+  return 0;
+}
+
+
+/*
+  Function ADD_PS_MULTIPOLES additionally accumulates the Legendre multipoles ell = 0, 2, 4 of the
+  power spectrum in the spherical bins, with mu = k_par/k and the line of sight along ps->los_axis:
+  P_ell(k) = (2 ell + 1) < P(k, mu) L_ell(mu) >, i.e. p_ell[ell/2 * NUM_BINS + ct] / in_bin_ct[ct].
+  Returns 0 on success, -1 on a memory allocation error.
+*/
+int add_ps_multipoles(ps_estimator *ps){
+  if (!(ps->p_ell = (double *) malloc(sizeof(double)*NUM_PS_MULTIPOLES*ps->k_bins.NUM_BINS))){
+    fprintf(stderr, "power_spec_helper_progs.c: Error allocating memory for the power spectrum multipoles\n");
+    return -1;
+  }
+  reset_ps_estimator(ps);
+  return 0;
+}
+
+
+void free_ps_estimator(ps_estimator *ps){
+  free(ps->k_ave); free(ps->p_box); free(ps->p_model); free(ps->in_bin_ct);
+  free(ps->p_ell);
+  if (ps->k_perp_bins.NUM_BINS > 0){
+    free(ps->p_cyl); free(ps->in_cyl_ct);
+  }
+  free_ps_bins(&ps->k_bins);
+  free_ps_bins(&ps->k_perp_bins);
+  free_ps_bins(&ps->k_par_bins);
+}
+
+
+/*
+  Function ACCUMULATE_POWER_SPEC adds the modes of the k-space box <box> to the bin sums of <ps>.
+  If <box2> is not NULL, the cross-power Re(box*conj(box2)) is accumulated instead of |box|^2.
+  <dim> is the number of cells along a side of the (real space) box, <ndim> is 2 or 3, and
+  <box_len> is its side length in Mpc.  The boxes are indexed as r2c FFTW outputs, i.e.
+  C_INDEX / HII_C_INDEX for ndim=3.
+  Returns 0 on success, -1 on a memory allocation error (in which case the bin sums are unchanged).
+*/
+int accumulate_power_spec(ps_estimator *ps, fftwf_complex *box, fftwf_complex *box2, int dim, int ndim, float box_len){
+  int n_x, n_y, n_z, ny_max, middle, thread_num, num_th, ct, perp_ct, par_ct, NUM_BINS, NUM_CYL;
+  float k_x, k_y, k_z, k_mag, k_par, k_perp;
+  double delta_k;
+  double p, w, mu_sq;
+  unsigned long long index, th_ct;
+  double *th_k_ave, *th_p_box, *th_p_model, *th_p_cyl, *th_p_ell;
+  unsigned long long *th_in_bin_ct, *th_in_cyl_ct;
+
+  num_th = omp_get_max_threads();
+  middle = dim/2;
+  delta_k = TWOPI/box_len;
+  ny_max = (ndim == 3) ? dim : 1;
+  NUM_BINS = ps->k_bins.NUM_BINS;
+  NUM_CYL = ps->k_perp_bins.NUM_BINS*ps->k_par_bins.NUM_BINS;
+
+  // per-thread histograms
+  th_k_ave = (double *) calloc((unsigned long long)num_th*NUM_BINS, sizeof(double));
+  th_p_box = (double *) calloc((unsigned long long)num_th*NUM_BINS, sizeof(double));
+  th_p_model = (double *) calloc((unsigned long long)num_th*NUM_BINS, sizeof(double));
+  th_in_bin_ct = (unsigned long long *) calloc((unsigned long long)num_th*NUM_BINS, sizeof(unsigned long long));
+  th_p_cyl = (double *) calloc((unsigned long long)num_th*NUM_CYL+1, sizeof(double));
+  th_in_cyl_ct = (unsigned long long *) calloc((unsigned long long)num_th*NUM_CYL+1, sizeof(unsigned long long));
+  th_p_ell = (double *) calloc((unsigned long long)num_th*NUM_PS_MULTIPOLES*NUM_BINS+1, sizeof(double));
+  if (!th_k_ave || !th_p_box || !th_p_model || !th_in_bin_ct || !th_p_cyl || !th_in_cyl_ct || !th_p_ell){
+    fprintf(stderr, "power_spec_helper_progs.c: Error allocating memory for the thread histograms\n");
+    free(th_k_ave); free(th_p_box); free(th_p_model); free(th_in_bin_ct);
+    free(th_p_cyl); free(th_in_cyl_ct); free(th_p_ell);
+    return -1;
+  }
+
+#pragma omp parallel shared(ps, box, box2, dim, ndim, middle, delta_k, ny_max, NUM_BINS, NUM_CYL, th_k_ave, th_p_box, th_p_model, th_in_bin_ct, th_p_cyl, th_in_cyl_ct, th_p_ell) private(n_x, n_y, n_z, k_x, k_y, k_z, k_mag, k_par, k_perp, index, p, w, mu_sq, ct, perp_ct, par_ct, thread_num) num_threads(num_th)
+{
+  thread_num = omp_get_thread_num();
+
+#pragma omp for
+  for (n_x=0; n_x<dim; n_x++){
+    if (n_x>middle)
+      k_x =(n_x-dim) * delta_k;  // wrap around for FFT convention
+    else
+      k_x = n_x * delta_k;
+
+    for (n_y=0; n_y<ny_max; n_y++){
+      if (n_y>middle)
+	k_y =(n_y-dim) * delta_k;
+      else
+	k_y = n_y * delta_k; // (n_y is always 0 for a 2D box)
+
+      for (n_z=0; n_z<=middle; n_z++){
+	k_z = n_z * delta_k;
+	k_mag = sqrt(k_x*k_x + k_y*k_y + k_z*k_z);
+	switch(ps->los_axis){
+	case 0:
+	  k_par = fabs(k_x); k_perp = sqrt(k_y*k_y + k_z*k_z);
+	  break;
+	case 1:
+	  k_par = fabs(k_y); k_perp = sqrt(k_x*k_x + k_z*k_z);
+	  break;
+	default:
+	  k_par = k_z; k_perp = sqrt(k_x*k_x + k_y*k_y);
+	}
+	index = (unsigned long long)n_z + (middle+1llu)*((unsigned long long)n_y + (unsigned long long)ny_max*n_x);
+
+	if (box2)
+	  p = crealf(box[index]*conjf(box2[index]));
+	else
+	  p = pow(cabs(box[index]), 2);
+	p *= ps->norm;
+	if (ps->k_power != 0)
+	  p *= pow(k_mag, ps->k_power);
+
+	// the modes with 0 < n_z < dim/2 have a conjugate twin which is not stored
+	w = 1;
+	if (ps->hermitian_weights && (n_z > 0) && (n_z < middle))
+	  w = 2;
+
+	ct = find_ps_bin(&ps->k_bins, k_mag);
+	if (ct >= 0){
+	  th_ct = (unsigned long long)thread_num*NUM_BINS + ct;
+	  th_in_bin_ct[th_ct] += w;
+	  th_k_ave[th_ct] += w*k_mag;
+	  th_p_box[th_ct] += w*p;
+	  if (ps->model)
+	    th_p_model[th_ct] += w*ps->model(k_mag);
+
+	  if (ps->p_ell){
+	    // (2 ell + 1) L_ell(mu), for ell = 0, 2, 4
+	    mu_sq = (k_mag > 0) ? (k_par*k_par)/(k_mag*k_mag) : 0;
+	    th_ct = (unsigned long long)thread_num*NUM_PS_MULTIPOLES*NUM_BINS + ct;
+	    th_p_ell[th_ct] += w*p;
+	    th_p_ell[th_ct + NUM_BINS] += w*p * 5.0*(3.0*mu_sq - 1.0)/2.0;
+	    th_p_ell[th_ct + 2*NUM_BINS] += w*p * 9.0*(35.0*mu_sq*mu_sq - 30.0*mu_sq + 3.0)/8.0;
+	  }
+	}
+
+	if (NUM_CYL > 0){
+	  perp_ct = find_ps_bin(&ps->k_perp_bins, k_perp);
+	  par_ct = find_ps_bin(&ps->k_par_bins, k_par);
+	  if ((perp_ct >= 0) && (par_ct >= 0)){
+	    th_ct = (unsigned long long)thread_num*NUM_CYL + perp_ct*ps->k_par_bins.NUM_BINS + par_ct;
+	    th_in_cyl_ct[th_ct] += w;
+	    th_p_cyl[th_ct] += w*p;
+	  }
+	}
+      }
+    }
+  } // end looping through k box
+}
+
+  // reduce the thread histograms, always in the same order
+  for (thread_num=0; thread_num<num_th; thread_num++){
+    for (ct=0; ct<NUM_BINS; ct++){
+      th_ct = (unsigned long long)thread_num*NUM_BINS + ct;
+      ps->in_bin_ct[ct] += th_in_bin_ct[th_ct];
+      ps->k_ave[ct] += th_k_ave[th_ct];
+      ps->p_box[ct] += th_p_box[th_ct];
+      ps->p_model[ct] += th_p_model[th_ct];
+    }
+    if (ps->p_ell){
+      for (ct=0; ct<NUM_PS_MULTIPOLES*NUM_BINS; ct++){
+	ps->p_ell[ct] += th_p_ell[(unsigned long long)thread_num*NUM_PS_MULTIPOLES*NUM_BINS + ct];
+      }
+    }
+    for (ct=0; ct<NUM_CYL; ct++){
+      th_ct = (unsigned long long)thread_num*NUM_CYL + ct;
+      ps->in_cyl_ct[ct] += th_in_cyl_ct[th_ct];
+      ps->p_cyl[ct] += th_p_cyl[th_ct];
+    }
+  }
+
+  free(th_k_ave); free(th_p_box); free(th_p_model); free(th_in_bin_ct);
+  free(th_p_cyl); free(th_in_cyl_ct); free(th_p_ell);
+  return 0;
+}
+
+#endif
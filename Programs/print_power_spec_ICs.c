@@ -1,5 +1,6 @@
 #include "../Parameter_files/INIT_PARAMS.H"
 #include "../Parameter_files/ANAL_PARAMS.H"
+#include "power_spec_helper_progs.c"
 
 
 /*
@@ -22,11 +23,10 @@
 */
 int main(int argc, char ** argv){
   fftwf_complex *box;
-  unsigned long *in_bin_ct;
-  int n_x, n_y, n_z, NUM_BINS, ct;
-  float k_x, k_y, k_z, k_mag, k, p;
-  float k_floor, k_ceil, k_max, growth_factor, k_first_bin_ceil, k_factor;
-  double *p_true, *p_box, *k_ave;
+  int ct;
+  float k_max, growth_factor, k_first_bin_ceil, k_factor;
+  ps_bins k_bins;
+  ps_estimator ps;
   FILE *OUT, *IN;
   unsigned long long longct;
 
@@ -85,90 +85,32 @@ int main(int argc, char ** argv){
     return -1;
   }
 
-  // initialize arrays
-  // ghetto counting (lookup how to do logs of arbitrary bases in c...)
-  NUM_BINS = 0;
-  k_floor = 0;
-  k_ceil = k_first_bin_ceil;
-  while (k_ceil < k_max){
-    NUM_BINS++;
-    k_floor=k_ceil;
-    k_ceil*=k_factor;
-  }
-
-  p_true = (double *)malloc(sizeof(double)*NUM_BINS);
-  p_box =  (double *)malloc(sizeof(double)*NUM_BINS);
-  k_ave =  (double *)malloc(sizeof(double)*NUM_BINS);
-  in_bin_ct = (unsigned long *)malloc(sizeof(unsigned long)*NUM_BINS);
-  if (!p_true || !p_box || !in_bin_ct || !k_ave){ // a bit sloppy, but whatever..
+  // initialize the estimator (see power_spec_helper_progs.c)
+  if ( (set_log_ps_bins(&k_bins, k_first_bin_ceil, k_factor, k_max) < 0) ||
+       (init_ps_estimator(&ps, k_bins, 0, growth_factor*growth_factor/VOLUME) < 0) ){
     fprintf(stderr, "print_power_spec: Error allocating memory.\nAborting...\n");
     return -1;
   }
-
-  for (ct=0; ct<NUM_BINS; ct++){
-    p_true[ct] = p_box[ct] = k_ave[ct] = 0;
-    in_bin_ct[ct] = 0;
-  }
+  // note the 1/VOLUME factor, which turns this into a power density in k-space
+  ps.model = power_in_k; // the input power spectrum, averaged over the same modes
   /************  END INITIALIZATION ******************/
 
 
   // now construct the power spectrum file
-  for (n_x=0; n_x<DIM; n_x++){
-    // convert index to numerical value for this component of the k-mode: k = (2*pi/L) * n
-    if (n_x>MIDDLE)
-      k_x =(n_x-DIM) * DELTA_K;  // wrap around for FFT convention
-    else
-      k_x = n_x * DELTA_K;
-
-    for (n_y=0; n_y<DIM; n_y++){
-      if (n_y>MIDDLE)
-	k_y =(n_y-DIM) * DELTA_K;
-      else
-	k_y = n_y * DELTA_K;
-
-      // since physical space field is real, only half contains independent modes
-      for (n_z=0; n_z<=floor(DIM/2); n_z++){ 
-	k_z = n_z * DELTA_K;
-	
-	k_mag = sqrt(k_x*k_x + k_y*k_y + k_z*k_z);
-	p = power_in_k(k_mag)*growth_factor*growth_factor;
-
-
-	// now go through the k bins and update
-	ct = 0;
-	k_floor = 0;
-	k_ceil = k_first_bin_ceil;
-	while (k_ceil < k_max){
-	  // check if we fal in this bin
-	  if ((k_mag>=k_floor) && (k_mag < k_ceil)){
-	    in_bin_ct[ct]++;
-	    p_true[ct] += p;
-	    p_box[ct] += pow(cabs(box[C_INDEX(n_x, n_y, n_z)])*growth_factor, 2)/VOLUME;
-	    // note the 1/VOLUME factor, which turns this into a power density in k-space
-
-	    k_ave[ct] += k_mag;
-	    break;
-	  }
-
-	  ct++;
-	  k_floor=k_ceil;
-	  k_ceil*=k_factor;
-	}
-      }
-    }
-  } // end looping through k box
+  if (accumulate_power_spec(&ps, box, NULL, DIM, 3, BOX_LEN) < 0){
+    fprintf(stderr, "print_power_spec: Error allocating memory.\nAborting...\n");
+    fclose(OUT); free_ps_estimator(&ps); fftwf_free(box);
+    return -1;
+  }
 
   // now lets print out the k bins
-  for (ct=1; ct<NUM_BINS; ct++){
-    fprintf(OUT, "%e\t%e\t%e\n", k_ave[ct]/(in_bin_ct[ct]+0.0), p_true[ct]/(in_bin_ct[ct]+0.0), p_box[ct]/(in_bin_ct[ct]+0.0)/sqrt(in_bin_ct[ct]+0.0));
+  for (ct=1; ct<ps.k_bins.NUM_BINS; ct++){
+    fprintf(OUT, "%e\t%e\t%e\n", ps.k_ave[ct]/(ps.in_bin_ct[ct]+0.0), ps.p_model[ct]*growth_factor*growth_factor/(ps.in_bin_ct[ct]+0.0), ps.p_box[ct]/(ps.in_bin_ct[ct]+0.0)/sqrt(ps.in_bin_ct[ct]+0.0));
   }
 
 
   // deallocate memory
   fclose(OUT);
-  free(p_true);
-  free(p_box);
-  free(k_ave);
-  free(in_bin_ct);
+  free_ps_estimator(&ps);
   fftwf_free(box);
 }
@@ -0,0 +1,139 @@
+#ifndef _REDUCTION_HELPERS_
+#define _REDUCTION_HELPERS_
+
+#include "../Parameter_files/INIT_PARAMS.H"
+
+/*
+  Deterministic sums over the cells of a box, used for the global averages of Ts.c,
+  find_HII_bubbles.c and delta_T.c.
+
+  Each row of the box (the HII_DIM cells with the same first two indices) has its own slot of up
+  to ROW_SUMS_MAX sums, which fills one 64 byte cache line, so threads working on different rows
+  never write to the same cache line.  A row must be summed by a single thread, in cell order; with
+  an OpenMP loop over the cells of the box this is the case with schedule(static, HII_DIM), and with
+  a loop over rows it always is.  The row slots are then added pairwise, in row order.  The result
+  therefore does not depend on the number of threads or on the scheduling, and its rounding error
+  only grows with the log of the number of rows.
+
+  Usage:
+     row_sums rs;
+     init_row_sums(&rs, 2);
+  #pragma omp parallel for schedule(static, HII_DIM)
+     for (ct=0; ct<HII_TOT_NUM_PIXELS; ct++){
+       ROW_SUM_ADD(&rs, ct, 0, a[ct]);
+       ROW_SUM_ADD(&rs, ct, 1, b[ct]);
+     }
+     total_row_sums(&rs, totals);
+     free_row_sums(&rs);
+*/
+
+#define ROW_SUMS_MAX (int) 8
+#define PAIRWISE_SUM_BLOCK (int) 8 // sums of fewer terms than this are done in order
+
+typedef struct{
+  double s[ROW_SUMS_MAX];
+} row_sum_slot;
+
+typedef struct{
+  int num_sums;
+  unsigned long long num_rows;
+  row_sum_slot *rows;
+} row_sums;
+
+/* adds val to sum n of the row of cell (an unpadded index, as box_ct in Ts.c) */
+#define ROW_SUM_ADD(rs, cell, n, val) ((rs)->rows[(cell)/HII_DIM].s[(n)] += (val))
+
+
+/* pairwise sum of the n doubles x[0], x[stride], ... x[(n-1)*stride] */
+double pairwise_sum(double *x, unsigned long long n, int stride){
+  unsigned long long ct, half;
+  double sum;
+
+  if (n < PAIRWISE_SUM_BLOCK){
+    sum = 0;
+    for (ct=0; ct<n; ct++)
+      sum += x[ct*stride];
+    return sum;
+  }
+  half = n/2;
+  return pairwise_sum(x, half, stride) + pairwise_sum(x + half*stride, n-half, stride);
+}
+
+
+void zero_row_sums(row_sums *rs){
+  unsigned long long row;
+  int n;
+
+#pragma omp parallel for shared(rs) private(row, n)
+  for (row=0; row<rs->num_rows; row++)
+    for (n=0; n<ROW_SUMS_MAX; n++)
+      rs->rows[row].s[n] = 0;
+}
+
+/* allocates and zeros the slots of num_sums (<= ROW_SUMS_MAX) sums.  Returns -1 on an error */
+int init_row_sums(row_sums *rs, int num_sums){
+  void *rows;
+
+  rs->rows = NULL;
+  rs->num_rows = 0;
+  rs->num_sums = num_sums;
+  if (num_sums > ROW_SUMS_MAX){
+    fprintf(stderr, "init_row_sums: at most %i sums per row, not %i\n", ROW_SUMS_MAX, num_sums);
+    return -1;
+  }
+  if (posix_memalign(&rows, sizeof(row_sum_slot), sizeof(row_sum_slot)*HII_DIM*HII_DIM)){
+    fprintf(stderr, "init_row_sums: Error allocating memory\n");
+    return -1;
+  }
+  rs->rows = (row_sum_slot *) rows;
+  rs->num_rows = (unsigned long long)HII_DIM*HII_DIM;
+  zero_row_sums(rs);
+  return 0;
+}
+
+void free_row_sums(row_sums *rs){
+  free(rs->rows);
+  rs->rows = NULL;
+  rs->num_rows = 0;
+}
+
+/* totals[n] is sum n over the whole box */
+void total_row_sums(row_sums *rs, double totals[]){
+  int n;
+  for (n=0; n<rs->num_sums; n++)
+    totals[n] = pairwise_sum(&(rs->rows[0].s[n]), rs->num_rows, ROW_SUMS_MAX);
+}
+
+
+/*
+  Function BOX_SUM returns the sum of the float box <box> (in the padded layout of an in-place FFT
+  if padded), in parallel and in the same deterministic order as the row sums above.
+  If there is no memory for the row totals, the rows are summed serially, in order.
+*/
+double box_sum(float *box, int padded){
+  unsigned long long row, row_start;
+  double *row_total, row_sum, sum;
+  int k;
+
+  row_total = (double *) malloc(sizeof(double)*HII_DIM*HII_DIM);
+  sum = 0;
+#pragma omp parallel for if(row_total) shared(box, padded, row_total, sum) private(row, row_start, row_sum, k)
+  for (row=0; row<(unsigned long long)HII_DIM*HII_DIM; row++){
+    row_start = padded ? HII_R_FFT_INDEX(row/HII_DIM, row%HII_DIM, 0) : row*HII_DIM;
+    row_sum = 0;
+    for (k=0; k<HII_DIM; k++)
+      row_sum += box[row_start+k];
+    if (row_total)
+      row_total[row] = row_sum;
+    else
+      sum += row_sum;
+  }
+
+  if (row_total){
+    sum = pairwise_sum(row_total, (unsigned long long)HII_DIM*HII_DIM, 1);
+    free(row_total);
+  }
+  return sum;
+}
+
+#endif
@@ -0,0 +1,261 @@
+#ifndef _RSD_HELPERS_
+#define _RSD_HELPERS_
+
+#include "../Parameter_files/INIT_PARAMS.H"
+#include "../Parameter_files/ANAL_PARAMS.H"
+#include "reduction_helper_progs.c"
+
+/*
+  Sub-cell redshift space distortions (Jensen et al. 2013), used by delta_T.c when SUBCELL_RSD is set.
+
+  The box is partitioned into line-of-sight skewers along the third (k) index.  The re-gridding
+  only ever moves signal along a skewer, so every (i,j) skewer is independent of all others and
+  each thread can process its own skewers, using its own scratch line-of-sight buffer, without
+  any write conflicts.
+*/
+
+/*
+  Function SUBCELL_RSD_SKEWER re-grids a single line-of-sight skewer.
+  <dT_los> is the HII_DIM long brightness temperature skewer (not padded), <xH_los> the
+  neutral fraction skewer and <v_los> the velocity gradient skewer (stride 1, HII_DIM long).
+  <x_pos> and <x_pos_offset> are the normalised and physical sub-cell central positions,
+  <H> is the hubble parameter at the redshift of the box.
+  The re-gridded skewer is returned in <dT_RSD_los>.
+*/
+void subcell_RSD_skewer(const float *dT_los, const float *xH_los, const float *v_los,
+			const float *x_pos, const float *x_pos_offset, float H, float *dT_RSD_los){
+  int k, ii;
+  float d1_low, d1_high, d2_low, d2_high, subcell_width, x_val1, x_val2, subcell_displacement;
+  float RSD_pos_new, RSD_pos_new_boundary_low,RSD_pos_new_boundary_high, fraction_within, fraction_outside, cell_distance;
+
+  x_val1 = 0.;
+  x_val2 = 1.;
+  subcell_width = (BOX_LEN/(float)HII_DIM)/(float)N_RSD_STEPS;
+
+  for(k=0;k<HII_DIM;k++) {
+    dT_RSD_los[k] = 0.0;
+  }
+
+  for (k=0; k<HII_DIM; k++){
+
+    if((fabs(dT_los[k]) >= FRACT_FLOAT_ERR) && (xH_los[k] >= FRACT_FLOAT_ERR)) {
+
+      // Displacements (converted from velocity) for the original cell centres straddling half of the sub-cells (cell before)
+      if(k==0) {
+	d1_low = v_los[HII_DIM-1]/H;
+	d2_low = v_los[k]/H;
+      }
+      else {
+	d1_low = v_los[k-1]/H;
+	d2_low = v_los[k]/H;
+      }
+      // Displacements (converted from velocity) for the original cell centres straddling half of the sub-cells (cell after)
+      if(k==(HII_DIM-1)) {
+	d1_high = v_los[k]/H;
+	d2_high = v_los[0]/H;
+      }
+      else {
+	d1_high = v_los[k]/H;
+	d2_high = v_los[k+1]/H;
+      }
+
+      for(ii=0;ii<N_RSD_STEPS;ii++) {
+
+	// linearly interpolate the displacements to determine the corresponding displacements of the sub-cells
+	// Checking of 0.5 is for determining if we are left or right of the mid-point of the original cell (for the linear interpolation of the displacement)
+	// to use the appropriate cell
+	if(x_pos[ii] <= 0.5) {
+	  subcell_displacement = d1_low + ( (x_pos[ii] + 0.5 ) - x_val1)*( d2_low - d1_low )/( x_val2 - x_val1 );
+	}
+	else {
+	  subcell_displacement = d1_high + ( (x_pos[ii] - 0.5 ) - x_val1)*( d2_high - d1_high )/( x_val2 - x_val1 );
+	}
+
+	// The new centre of the sub-cell post R.S.D displacement. Normalised to units of cell width for determining it's displacement
+	RSD_pos_new = (x_pos_offset[ii] + subcell_displacement)/( BOX_LEN/(float)HII_DIM );
+	// The sub-cell boundaries of the sub-cell, for determining the fractional contribution of the sub-cell to neighbouring cells when
+	// the sub-cell straddles two cell positions
+	RSD_pos_new_boundary_low = RSD_pos_new - (subcell_width/2.)/( BOX_LEN/(float)HII_DIM );
+	RSD_pos_new_boundary_high = RSD_pos_new + (subcell_width/2.)/( BOX_LEN/(float)HII_DIM );
+
+	if(RSD_pos_new_boundary_low >= 0.0 && RSD_pos_new_boundary_high < 1.0) {
+	  // sub-cell has remained in the original cell (just add it back to the original cell)
+	  dT_RSD_los[k] += dT_los[k]/(float)N_RSD_STEPS;
+	}
+	else if(RSD_pos_new_boundary_low < 0.0 && RSD_pos_new_boundary_high < 0.0) {
+	  // sub-cell has moved completely into a new cell (toward the observer)
+
+	  // determine how far the sub-cell has moved in units of original cell boundary
+	  cell_distance = ceil(fabs(RSD_pos_new_boundary_low))-1.;
+
+	  // Determine the location of the sub-cell relative to the original cell binning
+	  if(fabs(RSD_pos_new_boundary_high) > cell_distance) {
+	    // sub-cell is entirely contained within the new cell (just add it to the new cell)
+	    // check if the new cell position is at the edge of the box. If so, periodic boundary conditions
+	    if(k<((int)cell_distance+1)) {
+	      dT_RSD_los[k-((int)cell_distance+1) + HII_DIM] += dT_los[k]/(float)N_RSD_STEPS;
+	    }
+	    else {
+	      dT_RSD_los[k-((int)cell_distance+1)] += dT_los[k]/(float)N_RSD_STEPS;
+	    }
+	  }
+	  else {
+	    // sub-cell is partially contained within the cell
+
+	    // Determine the fraction of the sub-cell which is in either of the two original cells
+	    fraction_outside = (fabs(RSD_pos_new_boundary_low) - cell_distance)/(subcell_width/( BOX_LEN/(float)HII_DIM ));
+	    fraction_within = 1. - fraction_outside;
+
+	    // Check if the first part of the sub-cell is at the box edge
+	    if(k<(((int)cell_distance))) {
+	      dT_RSD_los[k-((int)cell_distance) + HII_DIM] += fraction_within*dT_los[k]/(float)N_RSD_STEPS;
+	    }
+	    else {
+	      dT_RSD_los[k-((int)cell_distance)] += fraction_within*dT_los[k]/(float)N_RSD_STEPS;
+	    }
+	    // Check if the second part of the sub-cell is at the box edge
+	    if(k<(((int)cell_distance + 1))) {
+	      dT_RSD_los[k-((int)cell_distance+1) + HII_DIM] += fraction_outside*dT_los[k]/(float)N_RSD_STEPS;
+	    }
+	    else {
+	      dT_RSD_los[k-((int)cell_distance+1)] += fraction_outside*dT_los[k]/(float)N_RSD_STEPS;
+	    }
+	  }
+	}
+	else if(RSD_pos_new_boundary_low < 0.0 && (RSD_pos_new_boundary_high > 0.0 && RSD_pos_new_boundary_high < 1.0)) {
+	  // sub-cell has moved partially into a new cell (toward the observer)
+
+	  // Determine the fraction of the sub-cell which is in either of the two original cells
+	  fraction_within = RSD_pos_new_boundary_high/(subcell_width/( BOX_LEN/(float)HII_DIM ));
+	  fraction_outside = 1. - fraction_within;
+
+	  // Check the periodic boundaries conditions and move the fraction of each sub-cell to the appropriate new cell
+	  if(k==0) {
+	    dT_RSD_los[HII_DIM-1] += fraction_outside*dT_los[k]/(float)N_RSD_STEPS;
+	    dT_RSD_los[k] += fraction_within*dT_los[k]/(float)N_RSD_STEPS;
+	  }
+	  else {
+	    dT_RSD_los[k-1] += fraction_outside*dT_los[k]/(float)N_RSD_STEPS;
+	    dT_RSD_los[k] += fraction_within*dT_los[k]/(float)N_RSD_STEPS;
+	  }
+	}
+	else if((RSD_pos_new_boundary_low >= 0.0 && RSD_pos_new_boundary_low < 1.0) && (RSD_pos_new_boundary_high >= 1.0)) {
+	  // sub-cell has moved partially into a new cell (away from the observer)
+
+	  // Determine the fraction of the sub-cell which is in either of the two original cells
+	  fraction_outside = (RSD_pos_new_boundary_high - 1.)/(subcell_width/( BOX_LEN/(float)HII_DIM ));
+	  fraction_within = 1. - fraction_outside;
+
+	  // Check the periodic boundaries conditions and move the fraction of each sub-cell to the appropriate new cell
+	  if(k==(HII_DIM-1)) {
+	    dT_RSD_los[k] += fraction_within*dT_los[k]/(float)N_RSD_STEPS;
+	    dT_RSD_los[0] += fraction_outside*dT_los[k]/(float)N_RSD_STEPS;
+	  }
+	  else {
+	    dT_RSD_los[k] += fraction_within*dT_los[k]/(float)N_RSD_STEPS;
+	    dT_RSD_los[k+1] += fraction_outside*dT_los[k]/(float)N_RSD_STEPS;
+	  }
+	}
+	else {
+	  // sub-cell has moved completely into a new cell (away from the observer)
+
+	  // determine how far the sub-cell has moved in units of original cell boundary
+	  cell_distance = floor(fabs(RSD_pos_new_boundary_high));
+
+	  if(RSD_pos_new_boundary_low >= cell_distance) {
+	    // sub-cell is entirely contained within the new cell (just add it to the new cell)
+
+	    // check if the new cell position is at the edge of the box. If so, periodic boundary conditions
+	    if(k>(HII_DIM - 1 - (int)cell_distance)) {
+	      dT_RSD_los[k+(int)cell_distance - HII_DIM] += dT_los[k]/(float)N_RSD_STEPS;
+	    }
+	    else {
+	      dT_RSD_los[k+(int)cell_distance] += dT_los[k]/(float)N_RSD_STEPS;
+	    }
+	  }
+	  else {
+	    // sub-cell is partially contained within the cell
+
+	    // Determine the fraction of the sub-cell which is in either of the two original cells
+	    fraction_outside = (RSD_pos_new_boundary_high - cell_distance)/(subcell_width/( BOX_LEN/(float)HII_DIM ));
+	    fraction_within = 1. - fraction_outside;
+
+	    // Check if the first part of the sub-cell is at the box edge
+	    if(k>(HII_DIM - 1 - ((int)cell_distance-1))) {
+	      dT_RSD_los[k+(int)cell_distance-1 - HII_DIM] += fraction_within*dT_los[k]/(float)N_RSD_STEPS;
+	    }
+	    else {
+	      dT_RSD_los[k+(int)cell_distance-1] += fraction_within*dT_los[k]/(float)N_RSD_STEPS;
+	    }
+	    // Check if the second part of the sub-cell is at the box edge
+	    if(k>(HII_DIM - 1 - ((int)cell_distance))) {
+	      dT_RSD_los[k+(int)cell_distance - HII_DIM] += fraction_outside*dT_los[k]/(float)N_RSD_STEPS;
+	    }
+	    else {
+	      dT_RSD_los[k+(int)cell_distance] += fraction_outside*dT_los[k]/(float)N_RSD_STEPS;
+	    }
+	  }
+	}
+      }
+    }
+  }
+}
+
+
+/*
+  Function SUBCELL_RSD_REMAP applies the sub-cell redshift space distortions to the whole
+  <delta_T> box (unpadded), in place.  <xH> is the unpadded neutral fraction box and <v> the
+  FFT padded line-of-sight velocity gradient box.  The skewers are distributed over <num_th>
+  threads, each with a private line-of-sight buffer.
+
+  The sum of the re-gridded box (used for the box average, see box_sum()) is stored in <sum>.
+  Returns 0 on success, -1 on a memory allocation error (in which case the box is unchanged).
+*/
+int subcell_RSD_remap(float *delta_T, float *xH, float *v, float H, int num_th, double *sum){
+  float x_pos_offset[N_RSD_STEPS], x_pos[N_RSD_STEPS], subcell_width;
+  float *th_dT_RSD_los, *dT_RSD_los;
+  unsigned long long skewer;
+  int i, j, k, ii;
+
+  subcell_width = (BOX_LEN/(float)HII_DIM)/(float)N_RSD_STEPS;
+
+  // normalised units of cell length. 0 equals beginning of cell, 1 equals end of cell
+  // These are the sub-cell central positions (x_pos_offset), and the corresponding normalised value (x_pos) between 0 and 1
+  for(ii=0;ii<N_RSD_STEPS;ii++) {
+    x_pos_offset[ii] = subcell_width*(float)ii + subcell_width/2.;
+    x_pos[ii] = x_pos_offset[ii]/( BOX_LEN/(float)HII_DIM );
+  }
+
+  // per-thread line-of-sight buffers
+  if (!(th_dT_RSD_los = (float *) malloc(sizeof(float)*HII_DIM*num_th))){
+    fprintf(stderr, "rsd_helper_progs.c: Error allocating memory for the line-of-sight buffers\n");
+    return -1;
+  }
+
+#pragma omp parallel shared(delta_T, xH, v, H, x_pos, x_pos_offset, th_dT_RSD_los) private(skewer, i, j, k, dT_RSD_los) num_threads(num_th)
+{
+  dT_RSD_los = th_dT_RSD_los + (unsigned long long)omp_get_thread_num()*HII_DIM;
+
+#pragma omp for schedule(static)
+  for (skewer=0; skewer<HII_D*HII_D; skewer++){
+    i = skewer/HII_D;
+    j = skewer%HII_D;
+
+    // the unpadded boxes are contiguous along the line of sight, while the velocity box
+    // carries the FFT padding (which is also stride 1 along k)
+    subcell_RSD_skewer(delta_T + HII_R_INDEX(i,j,0), xH + HII_R_INDEX(i,j,0), v + HII_R_FFT_INDEX(i,j,0),
+		       x_pos, x_pos_offset, H, dT_RSD_los);
+
+    for(k=0;k<HII_DIM;k++) {
+      delta_T[HII_R_INDEX(i,j,k)] = dT_RSD_los[k];
+    }
+  }
+
+}
+
+  free(th_dT_RSD_los);
+  *sum = box_sum(delta_T, 0);
+  return 0;
+}
+
+#endif
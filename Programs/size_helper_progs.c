@@ -0,0 +1,372 @@
+#ifndef _SIZE_HELPERS_
+#define _SIZE_HELPERS_
+
+#include "../Parameter_files/INIT_PARAMS.H"
+#include "../Parameter_files/ANAL_PARAMS.H"
+
+/*
+  Deterministic size statistics of one phase of an HII_DIM^3 ionization box.
+  The phase is given by the char box <in_phase> (1 for the cells in the phase of interest,
+  0 otherwise), and the box is periodic.
+*/
+
+#define SIZE_EDT_INF (double) 1e20 // squared distance of cells which do not see the other phase
+
+
+/*
+  Function RUN_LENGTH_DISTRIBUTION counts the runs of consecutive in-phase cells along all of
+  the lines of sight parallel to the three axes (i.e. the exact distribution of chord lengths,
+  or mean free paths, through the phase).
+  hist[axis*(HII_DIM+1) + len] is the number of runs of length len (in cells, 1 <= len < HII_DIM)
+  along axis (0=x, 1=y, 2=z); hist[axis*(HII_DIM+1) + HII_DIM] is the number of lines which are
+  entirely in phase.  <hist> is overwritten.
+  Returns 0 on success, -1 on an error.
+*/
+int run_length_distribution(char *in_phase, unsigned long long *hist){
+  unsigned long long line_ct, start, stride, **th_hist;
+  int num_th, thread_num, axis, a, b, t, t0, s, len, error=0;
+
+  num_th = omp_get_max_threads();
+  if (!(th_hist = (unsigned long long **) calloc(num_th, sizeof(unsigned long long *)))){
+    fprintf(stderr, "size_helper_progs.c: Error allocating memory for run length histograms\n");
+    return -1;
+  }
+  for (thread_num=0; thread_num<num_th; thread_num++){
+    if (!(th_hist[thread_num] = (unsigned long long *) calloc(3*(HII_DIM+1), sizeof(unsigned long long))))
+      error = 1;
+  }
+  if (error){
+    fprintf(stderr, "size_helper_progs.c: Error allocating memory for run length histograms\n");
+    for (thread_num=0; thread_num<num_th; thread_num++)
+      free(th_hist[thread_num]);
+    free(th_hist);
+    return -1;
+  }
+
+#pragma omp parallel shared(in_phase, th_hist) private(line_ct, start, stride, thread_num, axis, a, b, t, t0, s, len) num_threads(num_th)
+  {
+    thread_num = omp_get_thread_num();
+#pragma omp for schedule(static)
+    for (line_ct=0; line_ct<3*HII_D*HII_D; line_ct++){
+      axis = line_ct / (HII_D*HII_D);
+      a = (line_ct / HII_D) % HII_D;
+      b = line_ct % HII_D;
+      // first cell of the line, and the stride along it
+      start = (axis==0) ? HII_R_INDEX(0,a,b) : ((axis==1) ? HII_R_INDEX(a,0,b) : HII_R_INDEX(a,b,0));
+      stride = (axis==0) ? HII_D*HII_D : ((axis==1) ? HII_D : 1);
+
+      // start from a cell which is not in phase, so that runs which wrap around are counted once
+      t0 = 0;
+      while ((t0 < HII_DIM) && in_phase[start + t0*stride])
+	t0++;
+      if (t0 == HII_DIM){
+	th_hist[thread_num][axis*(HII_DIM+1) + HII_DIM]++;
+	continue;
+      }
+      len = 0;
+      for (s=1; s<=HII_DIM; s++){
+	t = (t0+s) % HII_DIM;
+	if (in_phase[start + t*stride])
+	  len++;
+	else{
+	  if (len > 0)
+	    th_hist[thread_num][axis*(HII_DIM+1) + len]++;
+	  len = 0;
+	}
+      }
+    }
+  }
+
+  // (integer counts, so the result does not depend on the number of threads)
+  for (t=0; t<3*(HII_DIM+1); t++){
+    hist[t] = 0;
+    for (thread_num=0; thread_num<num_th; thread_num++)
+      hist[t] += th_hist[thread_num][t];
+  }
+  for (thread_num=0; thread_num<num_th; thread_num++)
+    free(th_hist[thread_num]);
+  free(th_hist);
+  return 0;
+}
+
+
+/*
+  Function EDT_1D_PERIODIC computes the 1D squared distance transform of the periodic line f[0..n-1],
+  d[q] = min_p ( (q-p)^2 + f[p] ),  with the lower envelope of parabolas of
+  Felzenszwalb & Huttenlocher (2012).  Periodicity is handled by running over three copies of
+  the line (every cell has its nearest source within n/2 of it).
+  g, z (3n+1) and v (3n) are work arrays.
+*/
+void edt_1d_periodic(double *f, int n, double *d, double *g, int *v, double *z){
+  int q, k, N = 3*n;
+  double s;
+
+  for (q=0; q<N; q++)
+    g[q] = f[q % n];
+
+  k = 0;
+  v[0] = 0;
+  z[0] = -SIZE_EDT_INF;
+  z[1] = SIZE_EDT_INF;
+  for (q=1; q<N; q++){
+    // z[0] = -SIZE_EDT_INF is below any intersection, so k stays >= 0
+    s = ((g[q] + (double)q*q) - (g[v[k]] + (double)v[k]*v[k])) / (2.0*(q - v[k]));
+    while (s <= z[k]){
+      k--;
+      s = ((g[q] + (double)q*q) - (g[v[k]] + (double)v[k]*v[k])) / (2.0*(q - v[k]));
+    }
+    k++;
+    v[k] = q;
+    z[k] = s;
+    z[k+1] = SIZE_EDT_INF;
+  }
+
+  // evaluate on the middle copy
+  k = 0;
+  for (q=n; q<2*n; q++){
+    while (z[k+1] < q)
+      k++;
+    d[q-n] = (double)(q-v[k])*(q-v[k]) + g[v[k]];
+    if (d[q-n] > SIZE_EDT_INF)
+      d[q-n] = SIZE_EDT_INF;
+  }
+}
+
+
+/*
+  Function DISTANCE_TRANSFORM computes the exact Euclidean distance transform of the phase:
+  dist_sq[HII_R_INDEX(x,y,z)] is the squared distance (in cells) from the cell to the nearest cell
+  which is not in the phase (0 for the cells outside of the phase, SIZE_EDT_INF if there are none).
+  The transform is separable, and each of the three passes is a set of independent lines.
+  Returns 0 on success, -1 on an error.
+*/
+int distance_transform(char *in_phase, float *dist_sq){
+  unsigned long long ct, line_ct, start, stride;
+  double *f, *d, *g, *z;
+  int *v, axis, a, b, t, error=0;
+
+  for (ct=0; ct<HII_TOT_NUM_PIXELS; ct++)
+    dist_sq[ct] = in_phase[ct] ? SIZE_EDT_INF : 0;
+
+  for (axis=2; axis>=0; axis--){
+#pragma omp parallel shared(in_phase, dist_sq, axis) private(line_ct, start, stride, f, d, g, z, v, a, b, t) reduction(+:error)
+    {
+      f = (double *) malloc(sizeof(double)*HII_DIM);
+      d = (double *) malloc(sizeof(double)*HII_DIM);
+      g = (double *) malloc(sizeof(double)*3*HII_DIM);
+      z = (double *) malloc(sizeof(double)*(3*HII_DIM+1));
+      v = (int *) malloc(sizeof(int)*3*HII_DIM);
+      if (!f || !d || !g || !z || !v)
+	error++;
+
+      // every thread has to reach the worksharing loop, even without its work arrays
+#pragma omp for schedule(static)
+      for (line_ct=0; line_ct<HII_D*HII_D; line_ct++){
+	if (!f || !d || !g || !z || !v)
+	  continue;
+	a = line_ct / HII_D;
+	b = line_ct % HII_D;
+	start = (axis==0) ? HII_R_INDEX(0,a,b) : ((axis==1) ? HII_R_INDEX(a,0,b) : HII_R_INDEX(a,b,0));
+	stride = (axis==0) ? HII_D*HII_D : ((axis==1) ? HII_D : 1);
+
+	for (t=0; t<HII_DIM; t++)
+	  f[t] = dist_sq[start + t*stride];
+	edt_1d_periodic(f, HII_DIM, d, g, v, z);
+	for (t=0; t<HII_DIM; t++)
+	  dist_sq[start + t*stride] = d[t];
+      }
+      free(f); free(d); free(g); free(z); free(v);
+    }
+    if (error){
+      fprintf(stderr, "size_helper_progs.c: Error allocating memory for the distance transform\n");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+/*
+  Connected-component labeling of the phase (regions of face-connected in-phase cells, with
+  periodic boundaries), with a union-find forest.  The box is split into slabs along x, which are
+  labeled in parallel, and the faces between slabs are merged afterwards.  Sets are always linked
+  under their smallest cell index, so the labels do not depend on the number of threads.
+*/
+
+unsigned int region_root(unsigned int *parent, unsigned int c){
+  while (parent[c] != c){
+    parent[c] = parent[parent[c]]; // path halving
+    c = parent[c];
+  }
+  return c;
+}
+
+void region_union(unsigned int *parent, unsigned int a, unsigned int b){
+  a = region_root(parent, a);
+  b = region_root(parent, b);
+  if (a < b)
+    parent[b] = a;
+  else if (b < a)
+    parent[a] = b;
+}
+
+
+/*
+  Function LABEL_REGIONS labels the connected regions of the phase: label[HII_R_INDEX(x,y,z)] is
+  0 outside of the phase, and 1..N in the N regions, numbered in the order of their first cell.
+  Returns N, or -1 on an error.
+*/
+long long label_regions(char *in_phase, unsigned int *label){
+  unsigned int *parent, c;
+  unsigned long long ct, *slab_roots;
+  long long num_regions;
+  int num_slabs, slab, x, y, z, x_start, x_end;
+
+  if (HII_TOT_NUM_PIXELS >= 4294967295ULL){
+    fprintf(stderr, "size_helper_progs.c: The box is too large for 32 bit region labels\n");
+    return -1;
+  }
+  num_slabs = omp_get_max_threads();
+  if (num_slabs > HII_DIM)
+    num_slabs = HII_DIM;
+  parent = (unsigned int *) malloc(sizeof(unsigned int)*HII_TOT_NUM_PIXELS);
+  slab_roots = (unsigned long long *) calloc(num_slabs+1, sizeof(unsigned long long));
+  if (!parent || !slab_roots){
+    fprintf(stderr, "size_helper_progs.c: Error allocating memory for region labeling\n");
+    free(parent); free(slab_roots);
+    return -1;
+  }
+
+  // label each slab on its own (unions only involve cells of the slab)
+#pragma omp parallel for shared(in_phase, parent, num_slabs) private(slab, x, y, z, x_start, x_end, c) schedule(static, 1) num_threads(num_slabs)
+  for (slab=0; slab<num_slabs; slab++){
+    x_start = (slab*HII_DIM) / num_slabs;
+    x_end = ((slab+1)*HII_DIM) / num_slabs;
+    for (x=x_start; x<x_end; x++){
+      for (y=0; y<HII_DIM; y++){
+	for (z=0; z<HII_DIM; z++){
+	  c = HII_R_INDEX(x,y,z);
+	  parent[c] = c;
+	  if (!in_phase[c])
+	    continue;
+	  if ((x > x_start) && in_phase[HII_R_INDEX(x-1,y,z)])
+	    region_union(parent, c, HII_R_INDEX(x-1,y,z));
+	  if ((y > 0) && in_phase[HII_R_INDEX(x,y-1,z)])
+	    region_union(parent, c, HII_R_INDEX(x,y-1,z));
+	  if ((z > 0) && in_phase[HII_R_INDEX(x,y,z-1)])
+	    region_union(parent, c, HII_R_INDEX(x,y,z-1));
+	}
+	// periodic boundary along z
+	if (in_phase[HII_R_INDEX(x,y,0)] && in_phase[HII_R_INDEX(x,y,HII_DIM-1)])
+	  region_union(parent, HII_R_INDEX(x,y,0), HII_R_INDEX(x,y,HII_DIM-1));
+      }
+      // periodic boundary along y
+      for (z=0; z<HII_DIM; z++){
+	if (in_phase[HII_R_INDEX(x,0,z)] && in_phase[HII_R_INDEX(x,HII_DIM-1,z)])
+	  region_union(parent, HII_R_INDEX(x,0,z), HII_R_INDEX(x,HII_DIM-1,z));
+      }
+    }
+  }
+
+  // merge the faces between the slabs (including the periodic boundary along x)
+  for (slab=0; slab<num_slabs; slab++){
+    x = (slab*HII_DIM) / num_slabs;
+    for (y=0; y<HII_DIM; y++){
+      for (z=0; z<HII_DIM; z++){
+	if (in_phase[HII_R_INDEX(x,y,z)] && in_phase[HII_R_INDEX((x+HII_DIM-1)%HII_DIM,y,z)])
+	  region_union(parent, HII_R_INDEX(x,y,z), HII_R_INDEX((x+HII_DIM-1)%HII_DIM,y,z));
+      }
+    }
+  }
+
+  // find the root of every cell (parent is not modified from here on), and count the roots of each slab
+#pragma omp parallel for shared(in_phase, parent, label, slab_roots, num_slabs) private(slab, ct, c) schedule(static, 1) num_threads(num_slabs)
+  for (slab=0; slab<num_slabs; slab++){
+    for (ct=((slab*HII_DIM)/num_slabs)*HII_D*HII_D; ct<(((slab+1)*HII_DIM)/num_slabs)*HII_D*HII_D; ct++){
+      if (!in_phase[ct])
+	continue;
+      for (c=ct; parent[c]!=c; c=parent[c]);
+      label[ct] = c;
+      if (c == ct)
+	slab_roots[slab+1]++;
+    }
+  }
+  for (slab=0; slab<num_slabs; slab++)
+    slab_roots[slab+1] += slab_roots[slab];
+  num_regions = slab_roots[num_slabs];
+
+  // number the roots in the order of their cell index, then relabel every cell with its root's number
+#pragma omp parallel for shared(in_phase, parent, label, slab_roots, num_slabs) private(slab, ct) schedule(static, 1) num_threads(num_slabs)
+  for (slab=0; slab<num_slabs; slab++){
+    for (ct=((slab*HII_DIM)/num_slabs)*HII_D*HII_D; ct<(((slab+1)*HII_DIM)/num_slabs)*HII_D*HII_D; ct++){
+      if (in_phase[ct] && (label[ct] == ct))
+	parent[ct] = ++slab_roots[slab];
+    }
+  }
+#pragma omp parallel for shared(in_phase, parent, label) private(ct) schedule(static)
+  for (ct=0; ct<HII_TOT_NUM_PIXELS; ct++)
+    label[ct] = in_phase[ct] ? parent[label[ct]] : 0;
+
+  free(parent);
+  free(slab_roots);
+  return num_regions;
+}
+
+
+/*
+  Function REGION_PROPERTIES computes the volume (in cells) and centroid (in cells, in [0, HII_DIM) )
+  of the num_regions regions of a label box (from label_regions); region r (1..num_regions) is
+  in volume[r-1] and centroid[3*(r-1) + axis].  The centroids are circular means along each axis,
+  so that regions which cross the boundary of the box are handled correctly.
+  Returns 0 on success, -1 on an error.
+*/
+int region_properties(unsigned int *label, long long num_regions, unsigned long long *volume, float *centroid){
+  double *sum, *cos_tbl, *sin_tbl, angle;
+  int x, y, z, i;
+  long long r;
+  unsigned int l;
+
+  sum = (double *) calloc(6*num_regions, sizeof(double));
+  cos_tbl = (double *) malloc(sizeof(double)*HII_DIM);
+  sin_tbl = (double *) malloc(sizeof(double)*HII_DIM);
+  if (!sum || !cos_tbl || !sin_tbl){
+    fprintf(stderr, "size_helper_progs.c: Error allocating memory for region properties\n");
+    free(sum); free(cos_tbl); free(sin_tbl);
+    return -1;
+  }
+  for (i=0; i<HII_DIM; i++){
+    cos_tbl[i] = cos(2*PI*i/(double)HII_DIM);
+    sin_tbl[i] = sin(2*PI*i/(double)HII_DIM);
+  }
+  for (r=0; r<num_regions; r++)
+    volume[r] = 0;
+
+  for (x=0; x<HII_DIM; x++){
+    for (y=0; y<HII_DIM; y++){
+      for (z=0; z<HII_DIM; z++){
+	if (!(l = label[HII_R_INDEX(x,y,z)]))
+	  continue;
+	l--;
+	volume[l]++;
+	sum[6*l+0] += cos_tbl[x];  sum[6*l+1] += sin_tbl[x];
+	sum[6*l+2] += cos_tbl[y];  sum[6*l+3] += sin_tbl[y];
+	sum[6*l+4] += cos_tbl[z];  sum[6*l+5] += sin_tbl[z];
+      }
+    }
+  }
+
+  for (r=0; r<num_regions; r++){
+    for (i=0; i<3; i++){
+      angle = atan2(sum[6*r+2*i+1], sum[6*r+2*i]);
+      if (angle < 0)
+	angle += 2*PI;
+      centroid[3*r+i] = angle/(2*PI)*HII_DIM;
+      if (centroid[3*r+i] >= HII_DIM)
+	centroid[3*r+i] = 0;
+    }
+  }
+  free(sum); free(cos_tbl); free(sin_tbl);
+  return 0;
+}
+
+#endif
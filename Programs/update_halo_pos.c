@@ -1,299 +1,261 @@
 #include "../Parameter_files/INIT_PARAMS.H"
 #include "../Parameter_files/ANAL_PARAMS.H"
+#include "halo_catalog_helper_progs.c"
 
 /********************************************************************
-USAGE:  update_halo_pos <REDSHIFT>
+USAGE:  update_halo_pos [-c <HALO CATALOG REDSHIFT>] <REDSHIFT> [<REDSHIFT> ...]
 
 Program UPDATE_HALO_POS reads in the linear velocity field, and uses
 it to update halo locations with a corresponding displacement field
-creating updated_halo_ in ../Output_files/Halo_lists/ directory
+creating updated_halo_ in ../Output_files/Halo_lists/ directory.
+Both catalogs are in the binary format of halo_catalog_helper_progs.c,
+and the halo IDs are carried over to the updated catalog.
+
+The whole halo catalog is loaded into memory and displaced in parallel;
+the velocities at the halo positions are taken from the cell containing
+the halo, or interpolated with cloud-in-cell if HALO_VELOCITY_CIC is set
+(see ANAL_PARAMS.H).
+
+Several redshifts can be given at once: the velocity boxes are then
+read only once, and only the growth factors differ between redshifts.
+The halo catalog found at each redshift (halos_z<REDSHIFT>) is displaced
+to that redshift, or, with the -c flag, the single catalog found at
+<HALO CATALOG REDSHIFT> is displaced to all of the redshifts.
 *********************************************************************/
 
-float max(float a, float b){
-  if (a > b) return a;
-  return b;
-}
-
-int main(int argc, char ** argv){
-  char filename[100];
-  FILE *F, *OUT;
-  float growth_factor, displacement_factor_2LPT, REDSHIFT, mass, xf, yf, zf, *vx, *vy, *vz, *vx_2LPT, *vy_2LPT, *vz_2LPT, z;
-  int i,j,k, xi, yi, zi, DI;
-  unsigned long long ct;
-  float dz = 1e-10;
-  time_t start_time, last_time;
-
-  /******************   BEGIN INITIALIZATION     ********************************/
-  // check arguments
-  if (argc != 2){
-    fprintf(stderr, "USAGE: update_halo_pos <redshift>\nAborting...\n");
-    return -1;
-  }
-  REDSHIFT = atof(argv[1]);
+#define NUM_VELOCITY_BOXES (int) (3*(1+(SECOND_ORDER_LPT_CORRECTIONS!=0))) // vx, vy, vz (, vx_2LPT, vy_2LPT, vz_2LPT)
 
-  // initialize power spectrum 
-  init_ps(0, 1e10);
-  growth_factor = dicke(REDSHIFT);
-  displacement_factor_2LPT = -(3.0/7.0) * growth_factor*growth_factor; // 2LPT eq. D8
+// cells (and their weights) from which the velocities at a halo position are gathered
+typedef struct{
+  int num;
+  unsigned long long index[8];
+  float weight[8];
+} velocity_weights;
 
-  fprintf(stderr, "gf = %.2e\ndf = %.2e\n", growth_factor, displacement_factor_2LPT);
 
-  fprintf(stderr, "Begin initialization velocity field\n");
-  start_time = time(NULL);
+/*
+  Function READ_VELOCITY_BOX reads the HII_DIM velocity box <filename> into <box>.
+  Returns 0 on success, -1 on an error.
+*/
+int read_velocity_box(char *filename, float *box){
+  FILE *F;
 
-  // allocate memory for the velocity boxes and read them in
-  vx = (float *) malloc(sizeof(float)*HII_TOT_NUM_PIXELS);
-  if (!vx){
-    fprintf(stderr, "update_halo_pos: Error allocating memory for velocity box\nAborting...\n");
-    return -1;
-  }
-  vy = (float *) malloc(sizeof(float)*HII_TOT_NUM_PIXELS);
-  if (!vy){
-    fprintf(stderr, "update_halo_pos: Error allocating memory for velocity box\nAborting...\n");
-    free(vx);
-    return -1;
-  }
-  vz = (float *) malloc(sizeof(float)*HII_TOT_NUM_PIXELS);
-  if (!vz){
-    fprintf(stderr, "update_halo_pos: Error allocating memory for velocity box\nAborting...\n");
-    free(vx); free(vy);
-    return -1;
-  }
-  sprintf(filename, "../Boxes/vxoverddot_%i_%.0fMpc", HII_DIM, BOX_LEN);
-  F=fopen(filename, "rb");
-  if (mod_fread(vx, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
-    fprintf(stderr, "update_halo_pos: Read error occured while reading velocity box.\n");
-    free(vx);  free(vy); free(vz);
-    return -1;
-  }
-  fclose(F);
-  last_time = time(NULL);
-  fprintf(stderr, "Read vx velocity field\nElapsed time: %ds\n", last_time - start_time);
-  sprintf(filename, "../Boxes/vyoverddot_%i_%.0fMpc", HII_DIM, BOX_LEN);
-  F=fopen(filename, "rb");
-  if (mod_fread(vy, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
-    fprintf(stderr, "update_halo_pos: Read error occured while reading velocity box.\n");
-    free(vx);  free(vy); free(vz);
+  if (!(F=fopen(filename, "rb"))){
+    fprintf(stderr, "update_halo_pos: Unable to open velocity box %s\n", filename);
     return -1;
   }
-  fclose(F);
-  fprintf(stderr, "Read vy velocity field\nElapsed time: %ds\n", time(NULL) - last_time);
-  last_time = time(NULL);
-  sprintf(filename, "../Boxes/vzoverddot_%i_%.0fMpc", HII_DIM, BOX_LEN);
-  F=fopen(filename, "rb");
-  if (mod_fread(vz, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
-    fprintf(stderr, "update_halo_pos: Read error occured while reading velocity box.\n");
-    free(vx);  free(vy); free(vz);
+  if (mod_fread(box, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
+    fprintf(stderr, "update_halo_pos: Read error occured while reading velocity box %s\n", filename);
+    fclose(F);
     return -1;
   }
   fclose(F);
-  fprintf(stderr, "Read vz velocity field\nElapsed time: %ds\n", time(NULL) - last_time);
-  last_time = time(NULL);
-  
-  fprintf(stderr, "Read velocity field\n");
-  // now add the missing factor of Ddot
-  for (ct=0; ct<HII_TOT_NUM_PIXELS; ct++){
-    vx[ct] *= growth_factor / BOX_LEN; // this is now comoving displacement in units of box size
-    vy[ct] *= growth_factor / BOX_LEN; // this is now comoving displacement in units of box size
-    vz[ct] *= growth_factor / BOX_LEN; // this is now comoving displacement in units of box size
-  }
-  // open file to write to
-  sprintf(filename, "../Output_files/Halo_lists/updated_halos_z%06.2f_%i_%.0fMpc", REDSHIFT, DIM, BOX_LEN);
-    OUT = fopen(filename, "w");
-  if (!OUT){
-    fprintf(stderr, "update_halo_pos: Error opening output file: %s\nAborting\n", filename);
-    free(vx);  free(vy); free(vz);
-    return -1;
+  return 0;
+}
+
+
+/*
+  Function SET_VELOCITY_WEIGHTS finds the cells from which the velocity at the position
+  (xf, yf, zf) (in units of the box size, [0,1) ) is gathered.
+  Velocities are sampled at the cell corners, i.e. cell i is at i/HII_DIM.
+*/
+void set_velocity_weights(float xf, float yf, float zf, velocity_weights *w){
+  int i, j, k, di, dj, dk;
+  float u, v, t;
+
+  if (!HALO_VELOCITY_CIC){
+    i = xf*HII_DIM;
+    j = yf*HII_DIM;
+    k = zf*HII_DIM;
+    if (i >= HII_DIM) i -= HII_DIM; // float round-off for positions just below 1
+    if (j >= HII_DIM) j -= HII_DIM;
+    if (k >= HII_DIM) k -= HII_DIM;
+    w->num = 1;
+    w->index[0] = HII_R_INDEX(i,j,k);
+    w->weight[0] = 1;
+    return;
   }
 
-/* ************************************************************************* *
- *                           BEGIN 2LPT PART                                 *
- * ************************************************************************* */
-// reference: reference: Scoccimarro R., 1998, MNRAS, 299, 1097-1118 Appendix D
-  if(SECOND_ORDER_LPT_CORRECTIONS){
-      
-    fprintf(stderr, "Begin initialization 2LPT velocity field\nTotal elapsed time: %ds\n", time(NULL) - start_time);
-    last_time = time(NULL);
-    // allocate memory for the velocity boxes and read them in
-    vx_2LPT = (float *) malloc(sizeof(float)*HII_TOT_NUM_PIXELS);
-    if (!vx_2LPT){
-      fprintf(stderr, "update_halo_pos: Error allocating memory for 2LPT velocity box\nAborting...\n");
-      free(vx);  free(vy); free(vz);
-      return -1;
-     }
-    vy_2LPT = (float *) malloc(sizeof(float)*HII_TOT_NUM_PIXELS);
-    if (!vy_2LPT){
-      fprintf(stderr, "update_halo_pos: Error allocating memory for 2LPT velocity box\nAborting...\n");
-      free(vx_2LPT);
-      free(vx);  free(vy); free(vz);
-      return -1;
-    }
-    vz_2LPT = (float *) malloc(sizeof(float)*HII_TOT_NUM_PIXELS);
-    if (!vz_2LPT){
-      fprintf(stderr, "update_halo_pos: Error allocating memory for 2LPT velocity box\nAborting...\n");
-      free(vx_2LPT); free(vy_2LPT);
-      free(vx);  free(vy); free(vz);
-      return -1;
+  u = xf*HII_DIM;  i = floor(u);  u -= i;
+  v = yf*HII_DIM;  j = floor(v);  v -= j;
+  t = zf*HII_DIM;  k = floor(t);  t -= k;
+  w->num = 0;
+  for (di=0; di<2; di++){
+    for (dj=0; dj<2; dj++){
+      for (dk=0; dk<2; dk++){
+	w->index[w->num] = HII_R_INDEX((i+di)%HII_DIM, (j+dj)%HII_DIM, (k+dk)%HII_DIM);
+	w->weight[w->num] = (di ? u : 1-u) * (dj ? v : 1-v) * (dk ? t : 1-t);
+	w->num++;
+      }
     }
+  }
+}
 
-    // read again velocities
 
-    sprintf(filename, "../Boxes/vxoverddot_2LPT_%i_%.0fMpc", HII_DIM, BOX_LEN);
-    F=fopen(filename, "rb");
-    if (mod_fread(vx_2LPT, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
-      fprintf(stderr, "update_halo_pos: Read error occured while reading velocity 2LPT box.\n");
-      free(vx);  free(vy); free(vz);
-      free(vx_2LPT);  free(vy_2LPT); free(vz_2LPT);
-      return -1;
-    }
-    fclose(F);
-    fprintf(stderr, "Read 2LPT vx velocity field\nElapsed time: %ds\n", time(NULL) - last_time);
-    last_time = time(NULL);
+float gather_velocity(float *box, velocity_weights *w){
+  float vel = 0;
+  int ct;
 
-    sprintf(filename, "../Boxes/vyoverddot_2LPT_%i_%.0fMpc", HII_DIM, BOX_LEN);
-    F=fopen(filename, "rb");
-    if (mod_fread(vy_2LPT, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
-      fprintf(stderr, "update_halo_pos: Read error occured while reading velocity 2LPT box.\n");
-      free(vx);  free(vy); free(vz);
-      free(vx_2LPT);  free(vy_2LPT); free(vz_2LPT);
-      return -1;
-    }
-    fclose(F);
-    fprintf(stderr, "Read 2LPT vy velocity field\nElapsed time: %ds\n", time(NULL) - last_time);
-    last_time = time(NULL);
+  for (ct=0; ct<w->num; ct++)
+    vel += w->weight[ct] * box[w->index[ct]];
+  return vel;
+}
 
-    sprintf(filename, "../Boxes/vzoverddot_2LPT_%i_%.0fMpc", HII_DIM, BOX_LEN);
-    F=fopen(filename, "rb");
-   if (mod_fread(vz_2LPT, sizeof(float)*HII_TOT_NUM_PIXELS, 1, F)!=1){
-      fprintf(stderr, "update_halo_pos: Read error occured while reading velocity box.\n");
-      free(vx);  free(vy); free(vz);
-      free(vx_2LPT);  free(vy_2LPT); free(vz_2LPT);
-      return -1;
-    }
-    fclose(F);
-    fprintf(stderr, "Read 2LPT vz velocity field\nElapsed time: %ds\n", time(NULL) - last_time);
-    last_time = time(NULL);
 
-    // now add the missing factor in eq. D9
-    for (ct=0; ct<HII_TOT_NUM_PIXELS; ct++){
-      vx_2LPT[ct] *= displacement_factor_2LPT / BOX_LEN; // this is now comoving displacement in units of box size
-      vy_2LPT[ct] *= displacement_factor_2LPT / BOX_LEN; // this is now comoving displacement in units of box size
-      vz_2LPT[ct] *= displacement_factor_2LPT / BOX_LEN; // this is now comoving displacement in units of box size
+/*
+  Function DISPLACE_HALOS moves the <num_halos> halos from their initial (Lagrangian) positions
+  in <halos> to their positions at some redshift, written into <updated_halos> (which can be <halos>).
+  vel[0..2] are the vx, vy, vz overddot boxes, and vel[3..5] their 2LPT counterparts (if used).
+  The displacement is  linear_factor*v - factor_2LPT*v_2LPT,  in units of the box size.
+*/
+void displace_halos(halo_record *halos, long long num_halos, float **vel,
+		    float linear_factor, float factor_2LPT, halo_record *updated_halos){
+  long long ct;
+  float pos[3];
+  velocity_weights w;
+  int axis;
+
+#pragma omp parallel for shared(halos, num_halos, vel, linear_factor, factor_2LPT, updated_halos) private(ct, pos, w, axis) schedule(static)
+  for (ct=0; ct<num_halos; ct++){
+    set_velocity_weights(halos[ct].x, halos[ct].y, halos[ct].z, &w);
+
+    pos[0] = halos[ct].x;
+    pos[1] = halos[ct].y;
+    pos[2] = halos[ct].z;
+    for (axis=0; axis<3; axis++){
+      // linear velocity displacement from z=INITIAL
+      pos[axis] += linear_factor * gather_velocity(vel[axis], &w);
+
+      // add second order corrections
+      if (SECOND_ORDER_LPT_CORRECTIONS)
+	pos[axis] -= factor_2LPT * gather_velocity(vel[3+axis], &w);
+
+      // check if we wrapped around; positions are kept in [0,1)
+      pos[axis] -= floor(pos[axis]);
+      if (pos[axis] >= 1) pos[axis] = 0; // float round-off of tiny negative values
     }
-    fprintf(stderr, "Read 2LPT velocity field\nTotal time: %ds\n", time(NULL) - start_time);
-  }
-
-/* ************************************************************************* *
- *                            END 2LPT PART                                  *
- * ************************************************************************* */
 
+    updated_halos[ct] = halos[ct];
+    updated_halos[ct].x = pos[0];
+    updated_halos[ct].y = pos[1];
+    updated_halos[ct].z = pos[2];
+  }
+}
 
 
-  /******************   END INITIALIZATION     ********************************/
+int main(int argc, char ** argv){
+  char filename[300], catalog_filename[300];
+  const char *axis_name[3] = {"vx", "vy", "vz"};
+  halo_catalog updated_cat;
+  halo_record *halos=NULL, *updated_halos=NULL;
+  float CATALOG_REDSHIFT, *REDSHIFT=NULL, *linear_factor=NULL, *factor_2LPT=NULL, *vel[6] = {NULL, NULL, NULL, NULL, NULL, NULL};
+  long long num_halos = 0, max_halos = 0;
+  int ct, z_ct, NUM_Z, first_z, use_catalog_redshift, status = -1;
+  time_t start_time, last_time;
 
-    float mean_correction = 0.0, mean_correction_2LPT = 0.0, mean_ratio = 0.0;
-    float max_correction = 1e-10, max_correction_2LPT = 1e-10, max_ratio = 1e-10;
-    int den = 0;
-
-  last_time = time(NULL);
-  // read in the halo list
-  sprintf(filename, "../Output_files/Halo_lists/halos_z%.2f_%i_%.0fMpc", REDSHIFT, DIM, BOX_LEN);
-  F = fopen(filename, "r");
-  if (!F){
-    fprintf(stderr, "update_halo_pos: Error opening input file: %s\nAborting\n", filename);
-    free(vx);  free(vy); free(vz);
+  /******************   BEGIN INITIALIZATION     ********************************/
+  // check arguments
+  use_catalog_redshift = (argc > 1) && !strcmp(argv[1], "-c");
+  first_z = use_catalog_redshift ? 3 : 1;
+  if (argc <= first_z){
+    fprintf(stderr, "USAGE: update_halo_pos [-c <halo catalog redshift>] <redshift> [<redshift> ...]\nAborting...\n");
     return -1;
   }
-  // now read in all halos above our threshold into the smoothed halo field
-  fprintf(stderr, "Updating halo positions\n");
-  fscanf(F, "%e %f %f %f", &mass, &xf, &yf, &zf);
-  while (!feof(F)){
-    i = xf*HII_DIM;
-    j = yf*HII_DIM;
-    k = zf*HII_DIM;
+  CATALOG_REDSHIFT = use_catalog_redshift ? atof(argv[2]) : 0;
+  NUM_Z = argc - first_z;
+  init_ps(0, 1e10); // initialize power spectrum
+  REDSHIFT = (float *) malloc(sizeof(float)*NUM_Z);
+  linear_factor = (float *) malloc(sizeof(float)*NUM_Z);
+  factor_2LPT = (float *) malloc(sizeof(float)*NUM_Z);
+  if (!REDSHIFT || !linear_factor || !factor_2LPT){
+    fprintf(stderr, "update_halo_pos: Error allocating memory for the redshift list\nAborting...\n");
+    goto CLEANUP;
+  }
 
-    // get new positions using linear velocity displacement from z=INITIAL
-    xf += vx[HII_R_INDEX(i,j,k)];
-    yf += vy[HII_R_INDEX(i,j,k)];
-    zf += vz[HII_R_INDEX(i,j,k)];
-
-    // 2LPT PART
-    // add second order corrections
-    if(SECOND_ORDER_LPT_CORRECTIONS){
-      xf -= vx_2LPT[HII_R_INDEX(i,j,k)];
-      yf -= vy_2LPT[HII_R_INDEX(i,j,k)];
-      zf -= vz_2LPT[HII_R_INDEX(i,j,k)];
-
-// DEBUG
-      //fprintf(stderr, "Displacements ratio: %.2e\t%.2e\n%.2e\t%.2e\n%.2e\t%.2e\n",  vx[HII_R_INDEX(i,j,k)], vx_2LPT[HII_R_INDEX(i,j,k)], vy[HII_R_INDEX(i,j,k)], vy_2LPT[HII_R_INDEX(i,j,k)], vz[HII_R_INDEX(i,j,k)], vz_2LPT[HII_R_INDEX(i,j,k)]);
-      if(fabs(mass - 1.72e10) < 0.1e10){
-        den += 3;
-        mean_correction += fabs(vx[HII_R_INDEX(i, j, k)]) + fabs(vy[HII_R_INDEX(i, j, k)]) + fabs(vz[HII_R_INDEX(i, j, k)]);
-        mean_correction_2LPT += fabs(vx_2LPT[HII_R_INDEX(i, j, k)]) + fabs(vy_2LPT[HII_R_INDEX(i, j, k)]) + fabs(vz_2LPT[HII_R_INDEX(i, j, k)]);
-        mean_ratio +=  fabs(vx_2LPT[HII_R_INDEX(i, j, k)]/vx[HII_R_INDEX(i, j, k)]) + fabs(vy_2LPT[HII_R_INDEX(i, j, k)]/vy[HII_R_INDEX(i, j, k)]) + fabs(vz_2LPT[HII_R_INDEX(i, j, k)]/vz[HII_R_INDEX(i, j, k)]); 
-
-        max_correction = max(max_correction,  fabs(vx[HII_R_INDEX(i, j, k)]));
-        max_correction = max(max_correction,  fabs(vy[HII_R_INDEX(i, j, k)]));
-        max_correction = max(max_correction,  fabs(vz[HII_R_INDEX(i, j, k)]));
-
-        max_correction_2LPT = max(max_correction_2LPT,  fabs(vx_2LPT[HII_R_INDEX(i, j, k)]));
-        max_correction_2LPT = max(max_correction_2LPT,  fabs(vy_2LPT[HII_R_INDEX(i, j, k)]));
-        max_correction_2LPT = max(max_correction_2LPT,  fabs(vz_2LPT[HII_R_INDEX(i, j, k)]));
-
-
-        max_ratio =  max(max_ratio, fabs(vx_2LPT[HII_R_INDEX(i, j, k)]/vx[HII_R_INDEX(i, j, k)])); 
-        max_ratio =  max(max_ratio, fabs(vy_2LPT[HII_R_INDEX(i, j, k)]/vy[HII_R_INDEX(i, j, k)])); 
-        max_ratio =  max(max_ratio, fabs(vz_2LPT[HII_R_INDEX(i, j, k)]/vz[HII_R_INDEX(i, j, k)])); 
-      }
-// END
+  // initialize the displacement coefficients at each redshift;
+  // the velocity boxes become comoving displacements in units of the box size (2LPT eqs. D8, D9)
+  for (z_ct=0; z_ct<NUM_Z; z_ct++){
+    REDSHIFT[z_ct] = atof(argv[first_z+z_ct]);
+    linear_factor[z_ct] = dicke(REDSHIFT[z_ct]);
+    factor_2LPT[z_ct] = -(3.0/7.0) * linear_factor[z_ct]*linear_factor[z_ct]; // 2LPT eq. D8
+    fprintf(stderr, "z = %.2f\tgf = %.2e\tdf = %.2e\n", REDSHIFT[z_ct], linear_factor[z_ct], factor_2LPT[z_ct]);
+    linear_factor[z_ct] /= BOX_LEN;
+    factor_2LPT[z_ct] /= BOX_LEN;
+  }
 
+  fprintf(stderr, "Begin initialization velocity field\n");
+  start_time = time(NULL);
 
+  // allocate memory for the velocity boxes and read them in (once, for all redshifts)
+  // reference for 2LPT: Scoccimarro R., 1998, MNRAS, 299, 1097-1118 Appendix D
+  for (ct=0; ct<NUM_VELOCITY_BOXES; ct++){
+    if (!(vel[ct] = (float *) malloc(sizeof(float)*HII_TOT_NUM_PIXELS))){
+      fprintf(stderr, "update_halo_pos: Error allocating memory for velocity box\nAborting...\n");
+      goto CLEANUP;
     }
-    // check if we wrapped around, not the casting to ensure < 1.00000
-    DI = 10000;
-    xf = roundf(xf*DI);
-    yf = roundf(yf*DI);
-    zf = roundf(zf*DI);
-    while (xf >= (float)DI){ xf -= DI;}
-    while (xf < 0){ xf += DI;}
-    while (yf >= (float)DI){ yf -= DI;}
-    while (yf < 0){ yf += DI;}
-    while (zf >= (float)DI){ zf -= DI;}
-    while (zf < 0){ zf += DI;}
-    xf = fabs(xf/(float)DI); // fabs gets rid of minus sign in -0.00000
-    yf = fabs(yf/(float)DI);
-    zf = fabs(zf/(float)DI);
-    /*
-    DI = 10000;
-    xi = xf*DI;
-    yi = yf*DI;
-    zi = zf*DI;
-    while (xi >= DI){ xi -= DI;}
-    while (xi < 0){ xi += DI;}
-    while (yi >= DI){ yi -= DI;}
-    while (yi < 0){ yi += DI;}
-    while (zi >= DI){ zi -= DI;}
-    while (zi < 0){ zi += DI;}
-    xf = ((float)xi) / ((float)DI);
-    yf = ((float)yi) / ((float)DI);
-    zf = ((float)zi) / ((float)DI);
-    */
-    // now write out the updated positions
-    fprintf(OUT, "%e\t%f\t%f\t%f\n", mass, xf, yf, zf);
-
-    fscanf(F, "%e %f %f %f", &mass, &xf, &yf, &zf);
+    if (ct < 3)
+      sprintf(filename, "../Boxes/%soverddot_%i_%.0fMpc", axis_name[ct], HII_DIM, BOX_LEN);
+    else
+      sprintf(filename, "../Boxes/%soverddot_2LPT_%i_%.0fMpc", axis_name[ct-3], HII_DIM, BOX_LEN);
+    last_time = time(NULL);
+    if (read_velocity_box(filename, vel[ct]) != 0)
+      goto CLEANUP;
+    fprintf(stderr, "Read %s%s velocity field\nElapsed time: %ds\n", axis_name[ct%3], (ct<3 ? "" : " 2LPT"), (int)(time(NULL) - last_time));
   }
-  fprintf(stderr, "Done in %ds\nTotal elapsed time: %ds\n", time(NULL) - last_time, time(NULL) - start_time);
 
-  mean_correction /= (float)den;
-  mean_correction_2LPT /= (float)den;
-  mean_ratio /= (float)den;
-  fprintf(stderr, "mc = %.2e\tmc2lpt = %.2e\tmr = %.2e\n maxc = %.2e\tmaxc2lpt = %.2e\tmaxr = %.2e\n", mean_correction, mean_correction_2LPT, mean_ratio, max_correction, max_correction_2LPT, max_ratio);
+  /******************   END INITIALIZATION     ********************************/
 
-  // deallocate
-  free(vx_2LPT);  free(vy_2LPT); free(vz_2LPT); 
-  free(vx);  free(vy); free(vz);  fclose(F); fclose(OUT);
+  catalog_filename[0] = '\0';
+  for (z_ct=0; z_ct<NUM_Z; z_ct++){
+    // read in the halo list, unless it is the one we already have in memory
+    sprintf(filename, "../Output_files/Halo_lists/halos_z%.2f_%i_%.0fMpc", (use_catalog_redshift ? CATALOG_REDSHIFT : REDSHIFT[z_ct]), DIM, BOX_LEN);
+    if (strcmp(filename, catalog_filename)){
+      last_time = time(NULL);
+      free(halos);
+      if ((num_halos = read_halo_catalog(filename, &halos, NULL)) < 0){
+	fprintf(stderr, "update_halo_pos: Error reading input file: %s\nAborting\n", filename);
+	goto CLEANUP;
+      }
+      strcpy(catalog_filename, filename);
+      if (num_halos > max_halos){
+	free(updated_halos);
+	max_halos = num_halos;
+	if (!(updated_halos = (halo_record *) malloc(sizeof(halo_record)*(max_halos+1)))){
+	  fprintf(stderr, "update_halo_pos: Error allocating memory for %lli halos\nAborting...\n", max_halos);
+	  goto CLEANUP;
+	}
+      }
+      fprintf(stderr, "Read %lli halos in %ds\nTotal elapsed time: %ds\n", num_halos, (int)(time(NULL) - last_time), (int)(time(NULL) - start_time));
+    }
 
+    fprintf(stderr, "Updating halo positions to z = %.2f\n", REDSHIFT[z_ct]);
+    last_time = time(NULL);
+    displace_halos(halos, num_halos, vel, linear_factor[z_ct], factor_2LPT[z_ct], updated_halos);
 
-  return 0;
+    // now write out the updated positions
+    sprintf(filename, "../Output_files/Halo_lists/updated_halos_z%06.2f_%i_%.0fMpc", REDSHIFT[z_ct], DIM, BOX_LEN);
+    if (open_halo_catalog_write(&updated_cat, filename, HALO_CATALOG_ID, REDSHIFT[z_ct]) != 0){
+      fprintf(stderr, "update_halo_pos: Error opening output file: %s\nAborting\n", filename);
+      goto CLEANUP;
+    }
+    // (not ||, the catalog is closed even after a write error)
+    if ((write_halo_records(&updated_cat, updated_halos, num_halos) != 0) | (close_halo_catalog(&updated_cat) != 0)){
+      fprintf(stderr, "update_halo_pos: Write error occured while writting output file: %s\nAborting\n", filename);
+      goto CLEANUP;
+    }
+    fprintf(stderr, "Done in %ds\nTotal elapsed time: %ds\n", (int)(time(NULL) - last_time), (int)(time(NULL) - start_time));
+  }
+  status = 0;
+
+  // deallocate
+ CLEANUP:
+  for (ct=0; ct<6; ct++)
+    free(vel[ct]);
+  free(halos);
+  free(updated_halos);
+  free(REDSHIFT);
+  free(linear_factor);
+  free(factor_2LPT);
+  free_ps();
+  return status;
 }